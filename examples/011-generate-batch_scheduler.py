@@ -0,0 +1,38 @@
+import threading
+
+import sdkit
+from sdkit.generate import BatchScheduler
+from sdkit.models import load_model
+
+context = sdkit.Context()
+
+# set the path to the model file on the disk (.ckpt or .safetensors file)
+context.model_paths["stable-diffusion"] = "D:\\path\\to\\512-base-ema.ckpt"
+load_model(context, "stable-diffusion")
+
+# compatible requests (same size, steps, sampler etc) are rendered together in one batch
+scheduler = BatchScheduler(context, max_batch_size=4, batch_window=0.1)
+
+
+def client_thread(prompt, seed):
+    images = scheduler.generate_images(prompt=prompt, seed=seed, width=512, height=512)
+    images[0].save(f"image_{seed}.jpg")  # images is a list of PIL.Image
+
+
+prompts = ["Photograph of an astronaut riding a horse", "A lighthouse on a cliff, oil painting", "A red fox in the snow"]
+clients = [threading.Thread(target=client_thread, args=(prompt, 42 + i)) for i, prompt in enumerate(prompts)]
+for client in clients:
+    client.start()
+
+
+
+def stop_when_done():
+    for client in clients:
+        client.join()
+    scheduler.stop()
+
+
+threading.Thread(target=stop_when_done).start()
+
+# the scheduler needs to run on the thread that loaded the model (i.e. this one)
+scheduler.run()
@@ -0,0 +1,38 @@
+import sdkit
+from sdkit.generate import CancelToken, GenerationCancelled, generate_images
+from sdkit.models import load_model
+
+context = sdkit.Context()
+
+# set the path to the model file on the disk (.ckpt or .safetensors file)
+context.model_paths["stable-diffusion"] = "D:\\path\\to\\512-base-ema.ckpt"
+load_model(context, "stable-diffusion")
+
+# optional: a tiny VAE for better previews (otherwise the previews are a cheap approximation at 1/8th the size)
+context.model_paths["taesd"] = "madebyollin/taesd"
+load_model(context, "taesd")
+
+token = CancelToken()  # call `token.cancel()` from any thread to stop at the next step
+
+
+def on_progress(event):
+    print(f"step {event.step}/{event.total_steps}, {event.elapsed:.1f} sec")
+    if event.preview:
+        event.preview[0].save(f"preview_{event.step}.jpg")
+
+
+try:
+    images = generate_images(
+        context,
+        prompt="Photograph of an astronaut riding a horse",
+        seed=42,
+        width=512,
+        height=512,
+        on_progress=on_progress,
+        preview_every=5,
+        preview_type="taesd",
+        cancel_token=token,
+    )
+    images[0].save("image.jpg")
+except GenerationCancelled:
+    print("cancelled")
@@ -0,0 +1,26 @@
+import sdkit
+from sdkit.generate import generate_images
+from sdkit.models import load_model
+from sdkit.utils import get_output_pipeline, log
+
+context = sdkit.Context()
+
+# set the path to the model file on the disk (.ckpt or .safetensors file)
+context.model_paths["stable-diffusion"] = "D:\\path\\to\\512-base-ema.ckpt"
+load_model(context, "stable-diffusion")
+
+# the images are encoded and saved on worker threads, while the next images are generated
+output_pipeline = get_output_pipeline()
+futures = []
+
+for seed in (42, 43, 44):
+    images = generate_images(context, prompt="Photograph of an astronaut riding a horse", seed=seed, num_outputs=2)
+
+    metadata = [{"prompt": "Photograph of an astronaut riding a horse", "seed": seed}] * len(images)
+    futures += output_pipeline.save_images(
+        images, dir_path=".", file_name=f"image_{seed}", output_format="PNG", metadata=metadata
+    )
+
+# wait for the images to be saved
+for f in futures:
+    log.info(f"Saved {f.result()}")
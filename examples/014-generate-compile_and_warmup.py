@@ -0,0 +1,22 @@
+import sdkit
+from sdkit.generate import generate_images, warmup
+from sdkit.models import load_model
+from sdkit.utils import log, save_images
+
+context = sdkit.Context()
+
+# set the path to the model file on the disk (.ckpt or .safetensors file)
+context.model_paths["stable-diffusion"] = "D:\\path\\to\\512-base-ema.ckpt"
+
+# compile the UNet and the VAE with torch.compile. the compiled kernels are saved in context.compiled_model_cache_dir,
+# so the next process that loads this model (on the same GPU and torch version) doesn't compile them again
+load_model(context, "stable-diffusion", compile_config={"shapes": [(512, 512, 1), (768, 768, 1)]})
+
+# compile and warm up the shapes, before the first request
+timings = warmup(context)
+log.info(f"Ready! Warmup times: {timings}")
+
+# generate the image, at the steady-state speed
+images = generate_images(context, prompt="Photograph of an astronaut riding a horse", seed=42, width=512, height=512)
+
+save_images(images, dir_path=".")
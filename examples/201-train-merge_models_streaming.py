@@ -0,0 +1,19 @@
+from sdkit.train import merge_models_add_difference, merge_models_streaming
+
+# weighted sum of any number of models, in a single pass (reads the tensors in chunks, instead of the full models)
+merge_models_streaming(
+    model_paths=["D:\\path\\to\\model_a.safetensors", "D:\\path\\to\\model_b.safetensors", "D:\\path\\to\\model_c.ckpt"],
+    weights=[0.5, 0.3, 0.2],
+    out_path="D:\\path\\to\\merged_model.safetensors",
+    use_fp16=True,
+    device="cuda:0",  # optional, merges the chunks on the GPU
+)
+
+# model_a + 0.8 * (model_b - model_c)
+merge_models_add_difference(
+    "D:\\path\\to\\model_a.safetensors",
+    "D:\\path\\to\\model_b.safetensors",
+    "D:\\path\\to\\model_c.safetensors",
+    alpha=0.8,
+    out_path="D:\\path\\to\\add_difference_model.safetensors",
+)
@@ -0,0 +1,14 @@
+from sdkit.generate import DevicePool
+
+# assuming the PC has two CUDA-compatible GPUs. requests are sent to the GPU with the fewest pending requests
+pool = DevicePool(["cuda:0", "cuda:1"])
+
+# the model is read from the disk only once, and then copied to the other GPU
+pool.load_model("stable-diffusion", "D:\\path\\to\\sd-v1-4.ckpt")
+
+futures = [pool.submit_generate(prompt="Photograph of an astronaut riding a horse", seed=42 + i) for i in range(8)]
+for i, future in enumerate(futures):
+    images = future.result()  # a list of PIL.Image
+    images[0].save(f"image_{i}.jpg")
+
+pool.stop()
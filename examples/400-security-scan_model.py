@@ -19,3 +19,11 @@ else:
         "Scan %s: [green]%d scanned, %d issue, %d infected.[/green]"
         % (model_path, scan_result.scanned_files, scan_result.issues_count, scan_result.infected_files)
     )
+
+# scan all the models in a directory, in parallel. the results are saved in an index file in that directory, so
+# the files that haven't changed aren't scanned again (by scan_models(), or by load_model())
+from sdkit.models import scan_models
+
+for path, scan_result in scan_models("D:\\path\\to\\models").items():
+    if scan_result.issues_count > 0 or scan_result.infected_files > 0:
+        log.warn(f":warning: [bold red]Potentially infected model: {path}[/bold red]")
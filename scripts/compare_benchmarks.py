@@ -1,29 +1,86 @@
+"""
+Compares two benchmark CSV files (e.g. of the stable and beta versions), and prints the regressions and improvements.
+
+Example:
+`python scripts/compare_benchmarks.py stable.csv beta.csv --threshold 5`
+
+The files are produced by `python -m sdkit bench`. Rows are matched by the benchmark point (model, image size, batch
+size, sampler etc). Older CSV files (without a `schema_version` column) are matched by the columns they share.
+
+Exits with status 1 if any metric regressed by more than the threshold (in percent), so it can be used in CI.
+"""
+
+import argparse
 import sys
 
-# import seaborn as sns
 import pandas
 
-stable = pandas.read_csv(sys.argv[1])
-beta = pandas.read_csv(sys.argv[2])
+from sdkit.benchmark import KEY_COLUMNS, METRIC_COLUMNS, get_new_failures
+
+parser = argparse.ArgumentParser()
+parser.add_argument("stable", help="The baseline benchmark CSV file")
+parser.add_argument("beta", help="The benchmark CSV file to check for regressions")
+parser.add_argument("--threshold", type=float, default=5, help="Ignore changes smaller than this percent. Default: 5")
+parser.add_argument(
+    "--metrics",
+    default="all",
+    help="Comma-separated list of metrics to compare. Default: all the metrics in both files",
+)
+args = parser.parse_args()
+
+stable = pandas.read_csv(args.stable)
+beta = pandas.read_csv(args.beta)
+
+keys = [c for c in KEY_COLUMNS if c in stable and c in beta]
+metrics = [m for m in METRIC_COLUMNS if m in stable and m in beta]
+if args.metrics != "all":
+    metrics = [m for m in args.metrics.split(",") if m in metrics]
+
+if "status" in stable and "status" in beta:
+    newly_failed = get_new_failures(stable.to_dict("records"), beta.to_dict("records"), keys)
+    stable = stable[stable["status"] == "ok"]
+    beta = beta[beta["status"] == "ok"]
+else:
+    newly_failed = []
+
+if not keys or not metrics:
+    print("The benchmark files don't have any common key or metric columns!")
+    sys.exit(2)
+
+combined = stable[keys + metrics].merge(beta[keys + metrics], on=keys, suffixes=(" stable", " beta"))
+if len(combined) == 0:
+    print("No common benchmark points to compare")
+    sys.exit(2)
+
+regressions, improvements = [], []
+for _, row in combined.iterrows():
+    point = ", ".join(f"{k}={row[k]}" for k in keys)
+    for metric in metrics:
+        old, new = row[f"{metric} stable"], row[f"{metric} beta"]
+        if pandas.isna(old) or pandas.isna(new) or old == 0:
+            continue
 
-del stable["vram_usage"], stable["ram_usage"]
-del beta["vram_usage"], beta["ram_usage"]
+        change = (new - old) / abs(old) * 100
+        if abs(change) < args.threshold:
+            continue
 
-del stable["render_test"], stable["vram_tp90"], stable["vram_spike_test"], stable["overall_status"]
-del beta["render_test"], beta["vram_tp90"], beta["vram_spike_test"], beta["overall_status"]
+        is_better = (change > 0) == METRIC_COLUMNS[metric]
+        entry = f"{point}: {metric} {old} -> {new} ({change:+.1f}%)"
+        (improvements if is_better else regressions).append(entry)
 
-bad = stable["max_vram (GB)"] < beta["max_vram (GB)"]  # & (stable['model_filename'] == 'sd-v1-4.ckpt')
-good = stable["max_vram (GB)"] > beta["max_vram (GB)"]  # & (stable['model_filename'] == 'sd-v1-4.ckpt')
+print(f"Compared {len(combined)} benchmark points, threshold: {args.threshold}%\n")
 
-print("bad results", bad)
-print("good results", good)
+print(f"Regressions ({len(regressions)}):")
+for entry in regressions:
+    print("  " + entry)
 
-# combined = pandas.concat([stable, beta], axis=0, ignore_index=False)
-# combined['version'] = (len(stable)*('v2.4',) + len(beta)*('v2.5',))
-# combined.reset_index(inplace=True)
+print(f"\nImprovements ({len(improvements)}):")
+for entry in improvements:
+    print("  " + entry)
 
-# combined['index'] = combined['model_filename'].apply(lambda x: x.replace('.ckpt', '').replace('.safetensors', '')) + ',' + combined['vram_usage_level'] + ',' + combined['image_size']
+if len(newly_failed) > 0:
+    print(f"\nNewly failed in {args.beta} ({len(newly_failed)}):")
+    for row in newly_failed:
+        print("  " + ", ".join(f"{k}={row[k]}" for k in keys) + f": {row.get('error')}")
 
-# sns.catplot(x='index', y='max_vram (GB)', hue='version', kind='bar', data=combined)
-# plt.xticks(rotation=90, fontsize=6)
-# plt.show()
+sys.exit(1 if regressions or len(newly_failed) > 0 else 0)
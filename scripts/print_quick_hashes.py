@@ -1,5 +1,6 @@
 """
 Utility script for calculating quick hashes for all the entries in the models db.
+Or for all the model files in a local directory (in parallel), with `--dir`.
 
 Usage:
 python print_quick_hashes.py --help
@@ -13,16 +14,28 @@ parser.add_argument(
     action="store_true",
     help="Only show entries if the calculated quick-hash doesn't match the stored quick-hash",
 )
+parser.add_argument(
+    "--dir",
+    type=str,
+    default=None,
+    help="Print the quick-hashes of the model files in this directory (and the models db entries they match)",
+)
 parser.set_defaults(diff_only=False)
 args = parser.parse_args()
 
 # setup
-from sdkit.models import get_models_db
-from sdkit.utils import hash_url_quick
+from sdkit.models import get_model_info_from_db, get_models_db
+from sdkit.utils import hash_files_quick, hash_url_quick
 
 models_db = get_models_db()
 hashes_found = {}
 
+if args.dir:
+    for path, quick_hash in hash_files_quick(args.dir).items():
+        model_info = get_model_info_from_db(quick_hash=quick_hash)
+        print(f"{path} = {quick_hash}" + (f" ({model_info.get('name')})" if model_info else ""))
+    exit()
+
 if args.diff_only:
     print("Printing quick-hashes for only those URLs that do not match the configured quick-hash")
 
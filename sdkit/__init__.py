@@ -1,3 +1,4 @@
+import os
 import sys
 from threading import local
 
@@ -50,6 +51,73 @@ class Context(local):
         self.vram_usage_level = "balanced"
 
         self.test_diffusers = True
+        self.attention_backend = "auto"
+        """
+        The attention implementation for the diffusers models: `"auto"` (picks the fastest of the ones below that fits
+        in memory, per image size and batch size, with a one-time calibration on CUDA), `"sdpa"`, `"xformers"`,
+        `"chunked"` or `"sliced"` (the least VRAM). Applied when the model is loaded.
+        """
+        self.vae_precision = "auto"
+        """
+        The precision of the VAE while decoding, in half precision: `"auto"` (decodes with an fp32 copy of the VAE, made
+        once, if the VAE overflows in fp16, e.g. SDXL's), `"fp32"` (always the fp32 copy) or `"fp16"` (e.g. for VAEs
+        fixed for fp16, like madebyollin's SDXL VAE). See `sdkit.generate.vae_engine`.
+        """
+        self.cuda_graphs = False
+        """
+        Replay the UNet from CUDA graphs (captured once per image size and batch size), to remove the Python and
+        kernel-launch overhead of each step. Useful for small batches on fast GPUs. Uses extra VRAM for the graphs.
+        Ignored for offloaded, TensorRT and compiled models, and for ControlNet. See `sdkit.generate.cuda_graphs`.
+        """
+        self.noise_rng = "device"
+        """
+        How the initial noise is made from the seeds: `"device"` (on the render device, same as earlier versions, but
+        the same seed gives different images on CUDA, MPS and CPU), `"cpu"` (on the CPU, so a seed gives the same image
+        on every device) or `"philox"` (a counter-based RNG that makes the whole batch on the device at once, and gives
+        the same image on every device). See `sdkit.generate.noise`.
+        """
+        self.lora_mode = "fused"
+        """
+        How LoRA models are applied: `"fused"` (merged into the model weights, fastest rendering, but changing an alpha
+        recomputes the layers of that LoRA) or `"runtime"` (a separate low-rank path in each layer, changing the alphas
+        is free, but each step is slightly slower). Use `"runtime"` if the alphas change on most requests.
+        """
+        self.model_residency_budget = {"vram": 0, "ram": 0}
+        """
+        The memory (in GB) for keeping previously-used Stable Diffusion models loaded, in addition to the current model.
+        Switching back to a model kept in VRAM is instant, and to a model kept in (pinned) RAM needs only a copy to the
+        GPU. Disabled by default (`0`). Not used with `vram_usage_level = "low"`. See `sdkit.models.prefetch_model()`.
+        """
+        self.model_residency_policy = "lru"
+        """
+        Which models to evict first, when the `model_residency_budget` is full: `"lru"` (least-recently used) or
+        `"lfu"` (least-frequently used).
+        """
+        self.converted_model_cache_dir = None
+        """
+        The directory for saving Stable Diffusion models (and ControlNets) after converting them to the diffusers
+        format (one copy per model, precision and diffusers version), so that loading them again doesn't need another
+        conversion. Each entry takes several GB, and entries aren't evicted. `None` (the default) disables this cache,
+        e.g. `os.path.join(os.path.expanduser("~"), ".cache", "sdkit", "converted_models")` enables it.
+        """
+        self.controlnet_residency = 0
+        """
+        How many unloaded ControlNet models to keep in RAM, so that loading them again (e.g. when switching between
+        sets of ControlNets) copies them to the GPU, instead of reading the file again. `0` (the default) disables
+        this, so unloading a ControlNet frees its memory. `sdkit.models.unload_parked_controlnets()` frees the parked
+        ones. Not used with `vram_usage_level="low"`.
+        """
+        self.compiled_model_cache_dir = os.path.join(os.path.expanduser("~"), ".cache", "sdkit", "compiled_models")
+        """
+        The directory for the kernels and autotuning results of models compiled with `torch.compile` (see the
+        `compile_config` argument of `load_model()`), per model, torch version and GPU. Set to `None` to use the
+        default (temporary) directories of torch.
+        """
+        self.prompt_cache_size = (64, 256)
+        """
+        The memory budget (in MB) for caching the prompt embeddings, as `(device, cpu)`. The most recently-used
+        embeddings are kept on the device, and older ones are moved to the CPU. Set to `(0, 0)` to disable the cache.
+        """
         self.enable_codeformer = False
         """
         Enable this to use CodeFormer.
@@ -1,12 +1,20 @@
 import argparse
 import os
+import sys
 from PIL import Image
 
 SUPPORTED_DEVICES = ("cpu", "mps", "cuda", "xpu", "directml", "mtia")
 
 
 def main():
-    parser = argparse.ArgumentParser(description="Generate images using sdkit.")
+    if len(sys.argv) > 1 and sys.argv[1] == "bench":
+        from sdkit.benchmark import main as run_benchmarks
+
+        return run_benchmarks(sys.argv[2:])
+
+    parser = argparse.ArgumentParser(
+        description="Generate images using sdkit. Use `python -m sdkit bench --help` to run the benchmarks."
+    )
     parser.add_argument("-m", "--model", required=True, help="Path to the Stable Diffusion model.")
     parser.add_argument(
         "--type",
@@ -0,0 +1,357 @@
+"""
+Measures the generation performance (speed, latency and memory usage) of sdkit, and saves the results as a CSV file.
+
+Run it with `python -m sdkit bench --models path/to/sd-v1-4.safetensors,path/to/sd_xl_base_1.0.safetensors`. Each
+combination of `--models`, `--sizes`, `--batch-sizes`, `--samplers`, `--vram-usage-levels` and `--accelerators`
+is a benchmark point, which is rendered `--warmup` times (not measured) and then `--repeats` times.
+
+Compare two result files (e.g. of the stable and beta versions) with `python scripts/compare_benchmarks.py`.
+
+Each row of the CSV has the columns in `KEY_COLUMNS` (the benchmark point), `METRIC_COLUMNS` (the measurements) and
+`INFO_COLUMNS` (the environment and status).
+"""
+
+import argparse
+import csv
+import os
+import platform
+import threading
+import time
+import traceback
+
+SCHEMA_VERSION = 1
+ACCELERATORS = ("none", "xformers", "tensorrt", "directml")
+
+KEY_COLUMNS = (
+    "model_filename",
+    "model_type",
+    "image_size",
+    "batch_size",
+    "sampler",
+    "vram_usage_level",
+    "accelerator",
+    "steps",
+)
+METRIC_COLUMNS = {  # name -> True if a higher value is better
+    "it/s": True,
+    "time_to_first_step (s)": False,
+    "latency_mean (s)": False,
+    "latency_p50 (s)": False,
+    "latency_p95 (s)": False,
+    "max_vram (GB)": False,
+    "max_ram (GB)": False,
+}
+INFO_COLUMNS = ("schema_version", "status", "error", "warmup", "repeats", "device", "torch_version", "platform")
+
+GB = 1024**3
+RSS_SAMPLE_INTERVAL = 0.01  # seconds, for the peak RAM
+
+
+def run_benchmarks(
+    models: list,
+    sizes=((512, 512),),
+    batch_sizes=(1,),
+    samplers=("euler_a",),
+    vram_usage_levels=("balanced",),
+    accelerators=("none",),
+    steps=20,
+    warmup=1,
+    repeats=3,
+    device=None,
+    prompt="Photograph of an astronaut riding a horse",
+    out_file=None,
+) -> list:
+    """
+    Runs every combination of the given arguments, and returns a list of result rows (dicts). Appends each row to
+    `out_file` (CSV) as soon as it is measured, if given.
+
+    * sizes: list of (width, height)
+    * accelerators: any of `ACCELERATORS`
+    """
+    rows = []
+    for model_path in models:
+        for vram_usage_level in vram_usage_levels:
+            for accelerator in accelerators:
+                points = [(s, b, sampler) for s in sizes for b in batch_sizes for sampler in samplers]
+                rows += _run_model_benchmarks(
+                    model_path, vram_usage_level, accelerator, points, steps, warmup, repeats, device, prompt, out_file
+                )
+
+    return rows
+
+
+def _run_model_benchmarks(
+    model_path, vram_usage_level, accelerator, points, steps, warmup, repeats, device, prompt, out
+):
+    "Loads the model once, and runs all the given (size, batch_size, sampler) points on it"
+    from sdkit import Context
+    from sdkit.models import load_model, unload_model
+    from sdkit.utils import log
+
+    context = Context()
+    context.test_diffusers = True
+    if accelerator == "directml" and not str(device).startswith("directml"):
+        device = "directml:0"
+    if device:
+        context.device = device
+    context.vram_usage_level = vram_usage_level
+
+    rows = []
+    model_type = None
+    try:
+        context.model_paths["stable-diffusion"] = model_path
+        if accelerator == "tensorrt":
+            max_batch = max(b for _, b, _ in points)
+            trt_build_config = {
+                "batch_size_range": (1, max_batch),
+                "dimensions_range": [(min(min(s) for s, _, _ in points), max(max(s) for s, _, _ in points))],
+            }
+            load_model(context, "stable-diffusion", convert_to_tensorrt=True, trt_build_config=trt_build_config)
+        else:
+            load_model(context, "stable-diffusion")
+
+        model_type = context.models["stable-diffusion"]["type"]
+        pipe = context.models["stable-diffusion"]["default"]
+        if accelerator == "none" and hasattr(pipe, "disable_xformers_memory_efficient_attention"):
+            pipe.disable_xformers_memory_efficient_attention()
+        elif accelerator == "xformers":
+            pipe.enable_xformers_memory_efficient_attention()  # fail if xformers isn't installed
+    except Exception as e:
+        log.error(traceback.format_exc())
+        rows = [_make_row(model_path, model_type, p, vram_usage_level, accelerator, steps, context) for p in points]
+        for row in rows:
+            row.update(status="load_failed", error=str(e).splitlines()[0] if str(e) else type(e).__name__)
+            _write_row(out, row)
+        return rows
+
+    for point in points:
+        row = _make_row(model_path, model_type, point, vram_usage_level, accelerator, steps, context)
+        row.update(warmup=warmup, repeats=repeats)
+        try:
+            row.update(measure(context, point, steps, warmup, repeats, prompt))
+            row["status"] = "ok"
+        except Exception as e:
+            log.error(traceback.format_exc())
+            row.update(status="failed", error=str(e).splitlines()[0] if str(e) else type(e).__name__)
+
+        log.info(f"Benchmark result: {row}")
+        rows.append(row)
+        _write_row(out, row)
+
+    unload_model(context, "stable-diffusion")
+    return rows
+
+
+def measure(context, point, steps, warmup, repeats, prompt) -> dict:
+    "Renders the point `warmup + repeats` times, and returns the metrics of the measured repeats"
+    import numpy as np
+
+    from sdkit.generate import generate_images
+    from sdkit.utils import memory_stats
+
+    (width, height), batch_size, sampler = point
+    device = context.torch_device
+
+    def render(step_times):
+        def callback(*args, **kwargs):
+            step_times.append(time.perf_counter())
+
+        generate_images(
+            context,
+            prompt=prompt,
+            seed=42,
+            width=width,
+            height=height,
+            num_outputs=batch_size,
+            num_inference_steps=steps,
+            sampler_name=sampler,
+            callback=callback,
+        )
+
+    for _ in range(warmup):
+        render([])
+
+    _reset_peak_memory(device)
+    latencies, first_step_times, its = [], [], []
+    with PeakRssSampler() as rss:
+        for _ in range(repeats):
+            step_times = []
+            _synchronize(device)
+            start = time.perf_counter()
+            render(step_times)
+            _synchronize(device)
+            end = time.perf_counter()
+
+            latencies.append(end - start)
+            if step_times:
+                first_step_times.append(step_times[0] - start)
+            if len(step_times) > 1:
+                its.append((len(step_times) - 1) / (step_times[-1] - step_times[0]))
+
+    vram_peak = memory_stats(device).get("allocated_bytes.all.peak", 0)
+
+    return {
+        "it/s": _round(np.mean(its)) if its else None,
+        "time_to_first_step (s)": _round(np.mean(first_step_times)) if first_step_times else None,
+        "latency_mean (s)": _round(np.mean(latencies)),
+        "latency_p50 (s)": _round(np.percentile(latencies, 50)),
+        "latency_p95 (s)": _round(np.percentile(latencies, 95)),
+        "max_vram (GB)": _round(vram_peak / GB),
+        "max_ram (GB)": _round(rss.peak / GB),
+    }
+
+
+class PeakRssSampler:
+    "Samples the RSS of this process on a background thread, to record its peak (`self.peak`, in bytes) in a `with`"
+
+    def __init__(self, interval=RSS_SAMPLE_INTERVAL):
+        import psutil
+
+        self.interval = interval
+        self.peak = 0
+        self._process = psutil.Process()
+        self._stopped = threading.Event()
+        self._thread = None
+
+    def __enter__(self):
+        self._sample()
+        self._thread = threading.Thread(target=self._run, daemon=True)
+        self._thread.start()
+        return self
+
+    def __exit__(self, exc_type, exc, tb):
+        self._stopped.set()
+        self._thread.join()
+        self._sample()
+        return False
+
+    def _run(self):
+        while not self._stopped.wait(self.interval):
+            self._sample()
+
+    def _sample(self):
+        self.peak = max(self.peak, self._process.memory_info().rss)
+
+
+def get_new_failures(stable_rows: list, beta_rows: list, keys=KEY_COLUMNS) -> list:
+    "Returns the rows that failed in `beta_rows`, except the benchmark points that had also failed in `stable_rows`"
+
+    def get_key(row):
+        return tuple(str(row.get(k)) for k in keys)
+
+    failed_before = {get_key(row) for row in stable_rows if row.get("status") != "ok"}
+    return [row for row in beta_rows if row.get("status") != "ok" and get_key(row) not in failed_before]
+
+
+def _make_row(model_path, model_type, point, vram_usage_level, accelerator, steps, context):
+    import torch
+
+    (width, height), batch_size, sampler = point
+    row = {c: None for c in KEY_COLUMNS + tuple(METRIC_COLUMNS) + INFO_COLUMNS}
+    row.update(
+        model_filename=os.path.basename(model_path),
+        model_type=model_type,
+        image_size=f"{width}x{height}",
+        batch_size=batch_size,
+        sampler=sampler,
+        vram_usage_level=vram_usage_level,
+        accelerator=accelerator,
+        steps=steps,
+        schema_version=SCHEMA_VERSION,
+        device=_get_device_name(context),
+        torch_version=torch.__version__,
+        platform=platform.platform(),
+    )
+    return row
+
+
+def _write_row(out_file, row):
+    if not out_file:
+        return
+
+    is_new = not os.path.exists(out_file) or os.path.getsize(out_file) == 0
+    with open(out_file, "a", newline="", encoding="utf-8") as f:
+        writer = csv.DictWriter(f, fieldnames=list(row.keys()))
+        if is_new:
+            writer.writeheader()
+        writer.writerow(row)
+
+
+def _get_device_name(context):
+    import torch
+
+    device = context.torch_device
+    if device.type == "cuda":
+        return torch.cuda.get_device_name(device)
+    return str(device)
+
+
+def _reset_peak_memory(device):
+    import torch
+
+    if device.type == "cuda":
+        torch.cuda.reset_peak_memory_stats(device)
+
+
+def _synchronize(device):
+    import torch
+
+    if device.type == "cuda":
+        torch.cuda.synchronize(device)
+    elif device.type == "mps":
+        torch.mps.synchronize()
+
+
+def _round(x):
+    return round(float(x), 4)
+
+
+def _parse_list(value):
+    return [v.strip() for v in value.split(",") if v.strip()]
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(prog="python -m sdkit bench", description="Benchmark the generation performance.")
+    parser.add_argument("--models", required=True, help="Comma-separated list of Stable Diffusion model paths.")
+    parser.add_argument("--sizes", default="512x512", help="Comma-separated list of WIDTHxHEIGHT (default: 512x512).")
+    parser.add_argument("--batch-sizes", default="1", help="Comma-separated list of batch sizes (default: 1).")
+    parser.add_argument("--samplers", default="euler_a", help="Comma-separated list of samplers (default: euler_a).")
+    parser.add_argument(
+        "--vram-usage-levels",
+        default="balanced",
+        help="Comma-separated list of: low, balanced, high (default: balanced).",
+    )
+    parser.add_argument(
+        "--accelerators", default="none", help=f"Comma-separated list of: {', '.join(ACCELERATORS)} (default: none)."
+    )
+    parser.add_argument("--steps", type=int, default=20, help="Number of inference steps (default: 20).")
+    parser.add_argument("--warmup", type=int, default=1, help="Unmeasured renders per point (default: 1).")
+    parser.add_argument("--repeats", type=int, default=3, help="Measured renders per point (default: 3).")
+    parser.add_argument("-d", "--device", default=None, help="Device to run on, e.g. cuda:0 (default: automatic).")
+    parser.add_argument("-o", "--output", default="benchmark.csv", help="The CSV file to append the results to.")
+
+    args = parser.parse_args(argv)
+
+    accelerators = _parse_list(args.accelerators)
+    for a in accelerators:
+        if a not in ACCELERATORS:
+            parser.error(f"Unknown accelerator: {a}. Supported: {ACCELERATORS}")
+
+    sizes = [tuple(int(x) for x in s.lower().split("x")) for s in _parse_list(args.sizes)]
+
+    rows = run_benchmarks(
+        models=_parse_list(args.models),
+        sizes=sizes,
+        batch_sizes=[int(b) for b in _parse_list(args.batch_sizes)],
+        samplers=_parse_list(args.samplers),
+        vram_usage_levels=_parse_list(args.vram_usage_levels),
+        accelerators=accelerators,
+        steps=args.steps,
+        warmup=args.warmup,
+        repeats=args.repeats,
+        device=args.device,
+        out_file=args.output,
+    )
+
+    failed = sum(1 for row in rows if row["status"] != "ok")
+    print(f"Saved {len(rows)} results to {args.output} ({failed} failed)")
@@ -1,5 +1,5 @@
 from sdkit import Context
-from sdkit.utils import base64_str_to_img, gc, log
+from sdkit.utils import base64_str_to_img, gc, images_to_tensor, log, tensor_to_images, trace
 
 import importlib
 
@@ -25,29 +25,103 @@ def _get_module(model_type):
     return importlib.import_module("." + module_name, base_package)
 
 
-def apply_filters(context: Context, filters, images, **kwargs):
+def apply_filters(context: Context, filters, images, output_type="pil", **kwargs):
     """
     * context: Context
     * filters: filter_type (string) or list of strings
     * images: str or PIL.Image or list of str/PIL.Image - image to filter. if a string is passed, it needs to be a base64-encoded image
+        Can also be a tensor of shape (B, 3, H, W) with values in [0, 1], e.g. from `generate_images(output_type="pt")`
+    * output_type: "pil" (list of PIL.Image) or "pt" (a tensor of shape (B, 3, H, W), if the images have the same size)
+
+    Filters that support batches (i.e. have an `apply_batch()` function) process all the images together, as a
+    tensor on the device (one batch per image size). The images are converted to PIL only for the filters that don't
+    support batches, and at the end. The filters run on the RGB channels, and the alpha channel of the input images
+    (if any) is resized to the size of the filtered image, and added back in the returned PIL images.
 
     returns: [PIL.Image] - list of filtered images
     """
-    images = images if isinstance(images, list) else [images]
+    import torch
+
+    alphas = None
+    if not isinstance(images, torch.Tensor):
+        images = images if isinstance(images, list) else [images]
+        images = [base64_str_to_img(image) if isinstance(image, str) else image for image in images]
+        alphas = [_get_alpha(image) for image in images]
     filters = filters if isinstance(filters, list) else [filters]
 
-    return [apply_filter_single_image(context, filters, image, **kwargs) for image in images]
+    with trace("apply_filters", context.torch_device):
+        for filter_type in filters:
+            log.info(f"Applying {filter_type}...")
+            gc(context)
+
+            module = get_filter_module(filter_type)
+            with trace(f"filter:{filter_type}"):
+                if hasattr(module, "apply_batch"):
+                    batches = _to_batches(context, images)
+                    if len(batches) == 1:
+                        images = module.apply_batch(context, batches[0][1], **kwargs)
+                    else:  # keep the order of the images
+                        images = [None] * len(images)
+                        for indices, batch in batches:
+                            filtered = tensor_to_images(module.apply_batch(context, batch, **kwargs))
+                            for i, image in zip(indices, filtered):
+                                images[i] = image
+                else:
+                    images = [module.apply(context, image, **kwargs) for image in _to_pil(images)]
+
+    if output_type == "pt":
+        batches = _to_batches(context, images)
+        if len(batches) > 1:
+            raise ValueError("Can't return the images as a tensor, since they have different sizes!")
+        return batches[0][1]
+
+    images = _to_pil(images)
+    if alphas and any(alpha is not None for alpha in alphas):
+        images = [_put_alpha(image, alpha) for image, alpha in zip(images, alphas)]
+    return images
 
 
 def apply_filter_single_image(context, filters, image, **kwargs):
-    image = base64_str_to_img(image) if isinstance(image, str) else image
+    return apply_filters(context, filters, image, **kwargs)[0]
+
+
+def _to_pil(images) -> list:
+    return tensor_to_images(images) if not isinstance(images, list) else images
+
+
+def _to_batches(context, images) -> list:
+    """
+    Returns the images as a list of (indices, (B, 3, H, W) tensor on the device), one per image size. `indices` are
+    the positions of the batch's images in `images`.
+    """
+    if not isinstance(images, list):
+        return [(list(range(len(images))), images.to(context.torch_device))]
+
+    sizes = {}  # size -> indices
+    for i, img in enumerate(images):
+        sizes.setdefault(img.size, []).append(i)
+
+    return [(idx, images_to_tensor([images[i] for i in idx], context.torch_device)) for idx in sizes.values()]
+
+
+def _get_alpha(image):
+    "Returns the alpha channel of the PIL image (as an 'L' image), or None if it doesn't have one"
+    if image.mode in ("RGBA", "LA", "PA") or (image.mode == "P" and "transparency" in image.info):
+        return image.convert("RGBA").getchannel("A")
+    return None
+
 
-    for filter_type in filters:
-        log.info(f"Applying {filter_type}...")
-        gc(context)
+def _put_alpha(image, alpha):
+    "Adds the alpha channel back to a filtered image, resized to its size (as `RealESRGANer.enhance()` does)"
+    if alpha is None:
+        return image
 
-        image = get_filter_module(filter_type).apply(context, image, **kwargs)
+    from PIL import Image
 
+    if alpha.size != image.size:
+        alpha = alpha.resize(image.size, Image.Resampling.LANCZOS)
+    image = image.convert("RGB")
+    image.putalpha(alpha)
     return image
 
 
@@ -5,54 +5,137 @@ from sdkit import Context
 from sdkit.models import load_model, unload_model
 from sdkit.utils import empty_cache
 
-from torchvision.transforms.functional import normalize
 from threading import Lock
 from PIL import Image
 import numpy as np
 
-from basicsr.utils import img2tensor, tensor2img
 from .face_restoration_helper import FaceRestoreHelper
 
-codeformer_temp_device_lock = Lock()  # workaround: codeformer currently can only start on one device at a time.
+FACE_BATCH_SIZE = 8  # faces restored together. Halved automatically if it runs out of memory.
+
+# facexlib's retinaface reads a module-level `device` while detecting faces (workaround for
+# https://github.com/xinntao/facexlib/pull/19/files), so face detection can only run on one device at a time.
+# Everything else (restoration and pasting) runs in parallel on different devices.
+face_detection_lock = Lock()
+
+_face_helpers = {}  # device -> (FaceRestoreHelper, Lock). The helpers are reused, since they load two models each.
+_face_helpers_lock = Lock()
+
+
+def get_face_helper(device):
+    "Returns the `FaceRestoreHelper` for this device, and the lock that needs to be held while using it"
+    key = str(device)
+    with _face_helpers_lock:
+        if key not in _face_helpers:
+            with face_detection_lock:
+                helper = FaceRestoreHelper(upscale_factor=1, use_parse=True, device=device)
+            _face_helpers[key] = (helper, Lock())
+
+        return _face_helpers[key]
+
+
+def unload_face_helper(device):
+    with _face_helpers_lock:
+        _face_helpers.pop(str(device), None)
 
 
 def inference(context: Context, image, upscale_bg, upscale_faces, upscale_factor, codeformer_fidelity, codeformer_net):
+    return inference_batch(
+        context, [image], upscale_bg, upscale_faces, upscale_factor, codeformer_fidelity, codeformer_net
+    )[0]
+
+
+def inference_batch(
+    context: Context, images, upscale_bg, upscale_faces, upscale_factor, codeformer_fidelity, codeformer_net
+):
+    """
+    Restores the faces in a list of images (BGR numpy arrays). The faces of all the images are restored together
+    in batches. Returns a list of RGB numpy arrays.
+    """
+    from facexlib.detection import retinaface
+
     device = context.torch_device
-    face_helper = FaceRestoreHelper(upscale_factor=upscale_factor, use_parse=True, device=device)
-    face_helper.clean_all()
-    face_helper.read_image(image)
-    face_helper.get_face_landmarks_5(resize=640, eye_dist_threshold=5)
-    face_helper.align_warp_face()
+    face_helper, face_helper_lock = get_face_helper(device)
 
     bg_upscaler = context.models["realesrgan"] if upscale_bg else None
     face_upscaler = context.models["realesrgan"] if upscale_faces else None
 
-    # face restoration for each cropped face
-    for idx, cropped_face in enumerate(face_helper.cropped_faces):
-        cropped_face_t = img2tensor(cropped_face / 255.0, bgr2rgb=True, float32=True)
-        normalize(cropped_face_t, (0.5, 0.5, 0.5), (0.5, 0.5, 0.5), inplace=True)
-        cropped_face_t = cropped_face_t.unsqueeze(0).to(device)
-
+    with face_helper_lock:
+        face_helper.set_upscale_factor(int(upscale_factor))
+
+        # detect and align the faces in all the images
+        states = []
+        for image in images:
+            face_helper.clean_all()
+            face_helper.read_image(image)
+            with face_detection_lock:
+                retinaface.device = device
+                face_helper.get_face_landmarks_5(resize=640, eye_dist_threshold=5)
+            face_helper.align_warp_face()
+
+            states.append(
+                (face_helper.input_img, face_helper.is_gray, face_helper.affine_matrices, face_helper.cropped_faces)
+            )
+
+        # face restoration for all the cropped faces
+        cropped_faces = [face for state in states for face in state[3]]
+        restored_faces = restore_faces(cropped_faces, codeformer_net, codeformer_fidelity, device)
+
+        # paste_back
+        results = []
+        for image, (input_img, is_gray, affine_matrices, faces) in zip(images, states):
+            face_helper.clean_all()
+            face_helper.input_img, face_helper.is_gray = input_img, is_gray
+            face_helper.affine_matrices = affine_matrices
+            for restored_face in restored_faces[: len(faces)]:
+                face_helper.add_restored_face(restored_face)
+            restored_faces = restored_faces[len(faces) :]
+
+            face_helper.get_inverse_affine(None)
+            bg_img = bg_upscaler.enhance(image, outscale=upscale_factor)[0] if bg_upscaler else None
+            restored_img = face_helper.paste_faces_to_input_image(upsample_img=bg_img, face_upsampler=face_upscaler)
+            results.append(cv2.cvtColor(restored_img, cv2.COLOR_BGR2RGB))
+
+        face_helper.clean_all()
+
+    return results
+
+
+def restore_faces(cropped_faces: list, codeformer_net, codeformer_fidelity, device) -> list:
+    "Runs CodeFormer on the cropped faces (BGR uint8 numpy arrays) in batches. Returns the restored faces (same format)"
+    if not cropped_faces:
+        return []
+
+    faces = torch.from_numpy(np.stack(cropped_faces)).to(device)
+    faces = faces.flip(-1).permute(0, 3, 1, 2).float() / 255.0  # BGR -> RGB
+    faces = (faces - 0.5) / 0.5
+
+    outputs = []
+    batch_size = FACE_BATCH_SIZE
+    i = 0
+    while i < len(faces):
+        batch = faces[i : i + batch_size]
         try:
             with torch.no_grad():
-                output = codeformer_net(cropped_face_t, w=codeformer_fidelity, adain=True)[0]
-                restored_face = tensor2img(output.squeeze(0), rgb2bgr=True, min_max=(-1, 1))
-            del output
-            empty_cache()
+                outputs.append(codeformer_net(batch, w=codeformer_fidelity, adain=True)[0])
+            i += len(batch)
         except RuntimeError as error:
-            print(f"Failed inference for CodeFormer: {error}")
-            restored_face = tensor2img(cropped_face_t, rgb2bgr=True, min_max=(-1, 1))
+            if batch_size > 1 and "out of memory" in str(error).lower():
+                batch_size //= 2
+                empty_cache()
+                continue
 
-        restored_face = restored_face.astype("uint8")
-        face_helper.add_restored_face(restored_face)
+            print(f"Failed inference for CodeFormer: {error}")
+            outputs.append(batch)  # the unrestored faces
+            i += len(batch)
 
-    # paste_back
-    face_helper.get_inverse_affine(None)
-    bg_img = bg_upscaler.enhance(image, outscale=upscale_factor)[0] if bg_upscaler else None
-    restored_img = face_helper.paste_faces_to_input_image(upsample_img=bg_img, face_upsampler=face_upscaler)
-    restored_img = cv2.cvtColor(restored_img, cv2.COLOR_BGR2RGB)
+    outputs = torch.cat(outputs)
+    outputs = ((outputs.clamp(-1, 1) + 1) / 2 * 255).round().to(torch.uint8)
+    outputs = outputs.permute(0, 2, 3, 1).flip(-1).cpu().numpy()  # RGB -> BGR
+    del faces
+    empty_cache()
 
-    return restored_img
+    return list(outputs)
 
 
 def apply(
@@ -64,6 +147,35 @@ def apply(
     codeformer_fidelity=0.5,
     **kwargs,
 ):
+    # Convert PIL Image to numpy array and ensure it's in BGR format for OpenCV
+    input_img = np.array(input_img)
+    input_img = cv2.cvtColor(input_img, cv2.COLOR_RGB2BGR)
+
+    args = (upscale_background, upscale_faces, upscale_factor, codeformer_fidelity)
+    return restore_images(context, [input_img], *args)[0]
+
+
+def apply_batch(
+    context: Context,
+    images,
+    upscale_background=False,
+    upscale_faces=False,
+    upscale_factor=1,
+    codeformer_fidelity=0.5,
+    **kwargs,
+):
+    "Restores the faces in a batch of images (a tensor of shape (B, 3, H, W) with values in [0, 1]) together"
+    from sdkit.utils import images_to_tensor
+
+    input_imgs = (images.clamp(0, 1) * 255).round().to(torch.uint8).permute(0, 2, 3, 1).cpu().numpy()
+    input_imgs = [np.ascontiguousarray(img[..., ::-1]) for img in input_imgs]  # RGB -> BGR
+
+    args = (upscale_background, upscale_faces, upscale_factor, codeformer_fidelity)
+    return images_to_tensor(restore_images(context, input_imgs, *args), images.device, images.dtype)
+
+
+def restore_images(context, input_imgs, upscale_background, upscale_faces, upscale_factor, codeformer_fidelity):
+    "Restores the faces in the given images (BGR numpy arrays), and returns a list of PIL images"
     if not context.enable_codeformer:
         raise Exception(
             "Please set `context.enable_codeformer` to True, to use CodeFormer. By enabling CodeFormer, "
@@ -73,40 +185,33 @@ def apply(
     if (upscale_background or upscale_faces) and "realesrgan" not in context.models:
         raise Exception("realesrgan not loaded in context.models! Required for upscaling in CodeFormer.")
 
-    device = context.torch_device
     codeformer_net = context.models["codeformer"]
 
-    # Convert PIL Image to numpy array and ensure it's in BGR format for OpenCV
-    input_img = np.array(input_img)
-    input_img = cv2.cvtColor(input_img, cv2.COLOR_RGB2BGR)
-
     # Run inference
-    with codeformer_temp_device_lock:  # Wait for any other devices to complete before starting.
-        # hack for a bug in facexlib: https://github.com/xinntao/facexlib/pull/19/files
-        from facexlib.detection import retinaface
+    results = inference_batch(
+        context, input_imgs, upscale_background, upscale_faces, upscale_factor, codeformer_fidelity, codeformer_net
+    )
 
-        retinaface.device = context.torch_device
-
-        result = inference(
-            context, input_img, upscale_background, upscale_faces, upscale_factor, codeformer_fidelity, codeformer_net
-        )
+    pil_images = []
+    for result in results:
+        pil_image = Image.fromarray(result)
 
-    pil_image = Image.fromarray(result)
+        # Convert result back to RGB for PIL, then create PIL Image
+        # result = cv2.cvtColor(result, cv2.COLOR_BGR2RGB) # uncommenting this line turns people blue, which is a very convenient way to check CodeFormer is being used
 
-    # Convert result back to RGB for PIL, then create PIL Image
-    # result = cv2.cvtColor(result, cv2.COLOR_BGR2RGB) # uncommenting this line turns people blue, which is a very convenient way to check CodeFormer is being used
+        # Only resize if rescaling_factor is not 1
+        if upscale_factor != 1:
+            # Get original image dimensions
+            original_width, original_height = pil_image.size
 
-    # Only resize if rescaling_factor is not 1
-    if upscale_factor != 1:
-        # Get original image dimensions
-        original_width, original_height = pil_image.size
+            # Calculate new dimensions
+            new_width = int(original_width / upscale_factor)
+            new_height = int(original_height / upscale_factor)
 
-        # Calculate new dimensions
-        new_width = int(original_width / upscale_factor)
-        new_height = int(original_height / upscale_factor)
+            # Resize the image, using the high-quality downsampling filter
+            pil_image = pil_image.resize((new_width, new_height), Image.ANTIALIAS)
 
-        # Resize the image, using the high-quality downsampling filter
-        pil_image = pil_image.resize((new_width, new_height), Image.ANTIALIAS)
+        pil_images.append(pil_image)
 
-    # Return the rescaled/unchanged image
-    return pil_image
+    # Return the rescaled/unchanged images
+    return pil_images
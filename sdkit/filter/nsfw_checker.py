@@ -4,9 +4,19 @@ from PIL import ImageFilter
 from sdkit import Context
 
 
+class NSFWContentDetected(Exception):
+    "Raised by the callback from `make_preview_check_callback()`, to stop rendering images that will be blurred anyway"
+
+
 def apply(context: Context, image, blur_radius: float = 75, **kwargs):
     safety_checker, feature_extractor = context.models["nsfw_checker"]
 
+    if safety_checker.device.type != "cpu":
+        from sdkit.utils import images_to_tensor, tensor_to_images
+
+        image = images_to_tensor([image], safety_checker.device)
+        return tensor_to_images(apply_batch(context, image, blur_radius=blur_radius))[0]
+
     images = [torch.Tensor([0])]  # just a dummy array, the real info is in `safety_checker_input``
 
     safety_checker_input = feature_extractor(image, return_tensors="pt").to("cpu")
@@ -16,3 +26,94 @@ def apply(context: Context, image, blur_radius: float = 75, **kwargs):
         image = image.filter(ImageFilter.GaussianBlur(blur_radius))
 
     return image
+
+
+def apply_batch(context: Context, images, blur_radius: float = 75, **kwargs):
+    "Checks a batch of images (a tensor of shape (B, 3, H, W) with values in [0, 1]) together"
+    from sdkit.utils import images_to_tensor, tensor_to_images
+
+    flagged = [i for i, is_nsfw in enumerate(is_nsfw_batch(context, images)) if is_nsfw]
+    if flagged:  # rare, so blur these on the CPU
+        blurred = [img.filter(ImageFilter.GaussianBlur(blur_radius)) for img in tensor_to_images(images[flagged])]
+        images = images.clone()
+        images[flagged] = images_to_tensor(blurred, images.device, images.dtype)
+
+    return images
+
+
+def is_nsfw_batch(context: Context, images) -> list:
+    """
+    Returns a list of bools (one per image) for a batch of images (a tensor of shape (B, 3, H, W) with values in
+    [0, 1]). If the safety checker was loaded with `run_on_device=True`, the images are resized and normalized on the
+    device, without a round-trip through the CPU.
+    """
+    safety_checker, feature_extractor = context.models["nsfw_checker"]
+
+    dummy_images = [torch.Tensor([0])] * images.shape[0]
+
+    with torch.no_grad():
+        if safety_checker.device.type == "cpu":
+            clip_input = feature_extractor(list(images.float().cpu()), do_rescale=False, return_tensors="pt")
+            clip_input = clip_input.pixel_values
+        else:
+            clip_input = _preprocess_on_device(images, feature_extractor, safety_checker.device, safety_checker.dtype)
+
+        _, has_nsfw_concept = safety_checker(images=dummy_images, clip_input=clip_input)
+
+    return [bool(x) for x in has_nsfw_concept]
+
+
+def check_preview(context: Context, latents, model_type="SD1") -> list:
+    """
+    Checks an intermediate result (the latents, as passed to the step callbacks) without decoding them with the VAE.
+    Less accurate than checking the final image, so use it only to catch the obvious cases early.
+    """
+    import torch.nn.functional as F
+
+    from sdkit.utils import latents_to_rgb_preview
+
+    preview = latents_to_rgb_preview(latents, model_type)
+    preview = F.interpolate(preview, scale_factor=4, mode="bilinear")  # the checker works at 224px anyway
+    return is_nsfw_batch(context, preview)
+
+
+def make_preview_check_callback(context: Context, check_at_step: int, callback=None):
+    """
+    Returns a callback for `generate_images()`, which checks the preview at `check_at_step`, and raises
+    `NSFWContentDetected` if all the images in the batch are NSFW (so the remaining steps aren't wasted).
+    Calls `callback` (if given) on every step.
+    """
+
+    def wrapper(latents, i, pipe):
+        if callback:
+            callback(latents, i, pipe)
+
+        if i == check_at_step:
+            model_type = context.models["stable-diffusion"]["type"] if "stable-diffusion" in context.models else "SD1"
+            if all(check_preview(context, latents, model_type)):
+                raise NSFWContentDetected(f"NSFW content detected at step {i}")
+
+    return wrapper
+
+
+def _preprocess_on_device(images, feature_extractor, device, dtype):
+    "Same as the CLIP feature extractor: resize the shortest side, center crop and normalize, but on the device"
+    import torch.nn.functional as F
+
+    size = feature_extractor.size
+    size = size.get("shortest_edge", size.get("height")) if isinstance(size, dict) else size
+    crop = feature_extractor.crop_size
+    crop_h, crop_w = (crop["height"], crop["width"]) if isinstance(crop, dict) else (crop, crop)
+
+    images = images.to(device, torch.float32)
+    h, w = images.shape[2:]
+    scale = size / min(h, w)
+    new_h, new_w = max(round(h * scale), crop_h), max(round(w * scale), crop_w)
+    images = F.interpolate(images, size=(new_h, new_w), mode="bicubic", antialias=True, align_corners=False)
+
+    top, left = (new_h - crop_h) // 2, (new_w - crop_w) // 2
+    images = images[:, :, top : top + crop_h, left : left + crop_w]
+
+    mean = torch.tensor(feature_extractor.image_mean, device=device).view(1, 3, 1, 1)
+    std = torch.tensor(feature_extractor.image_std, device=device).view(1, 3, 1, 1)
+    return ((images - mean) / std).to(dtype)
@@ -1,15 +1,168 @@
-import numpy as np
-from PIL import Image
-
 from sdkit import Context
 
 
 def apply(context: Context, image, scale=4, **kwargs):
-    image = image.convert("RGB")
-    image = np.array(image, dtype=np.uint8)[..., ::-1]
+    "Upscales a single PIL image, with the same tiling as `apply_batch()`"
+    from sdkit.filter import apply_filters
+
+    return apply_filters(context, "realesrgan", image, scale=scale, **kwargs)[0]
+
+
+TILE_SIZES = (1024, 768, 512, 384, 256, 192, 128, 64)
+DEFAULT_CPU_TILE_SIZE = 512
+
+
+def apply_batch(context: Context, images, scale=4, tile_size=None, tile_overlap=None, **kwargs):
+    """
+    Upscales a batch of images (a tensor of shape (B, 3, H, W) with values in [0, 1], on the device) together,
+    without converting them to numpy.
+
+    The images are split into overlapping tiles (of the same size), and the tiles of all the images are upscaled
+    in batches. Overlapping tiles are blended with a linear ramp, to avoid seams.
+
+    * tile_size: the size (in input pixels) of each tile. `None` uses the `tile` of the loaded model, and if that's 0,
+        picks the largest size that fits in the free VRAM.
+    * tile_overlap: the overlap (in input pixels) between neighbouring tiles. `None` uses twice the `tile_pad` of the
+        loaded model (RealESRGANer pads each tile by `tile_pad` on every side).
+    """
+    import torch
+    import torch.nn.functional as F
+
+    upsampler = context.models["realesrgan"]
+    model = upsampler.model
+    dtype = next(model.parameters()).dtype
+    images = images.to(upsampler.device, dtype)
+    model_scale = upsampler.scale
+
+    # as in RealESRGANer.pre_process(): pad the bottom and right edges with `pre_pad` pixels (against border
+    # artifacts), and to a multiple of `mod_scale` (the x1 and x2 models need sizes divisible by 4 and 2)
+    orig_height, orig_width = images.shape[-2:]
+    mod_scale = {1: 4, 2: 2}.get(model_scale)
+    pad_h = pad_w = upsampler.pre_pad
+    if mod_scale:
+        pad_h += -(orig_height + pad_h) % mod_scale
+        pad_w += -(orig_width + pad_w) % mod_scale
+    if pad_h or pad_w:
+        images = F.pad(images, (0, pad_w, 0, pad_h), mode="reflect")
+
+    batch, _, height, width = images.shape
+
+    # allocated before picking the tile size, so that the free memory doesn't include them
+    output = torch.zeros((batch, 3, height * model_scale, width * model_scale), device=images.device)
+    weights = torch.zeros((batch, 1, height * model_scale, width * model_scale), device=images.device)
+
+    mem_per_tile_pixel = get_mem_per_pixel(model, model_scale, images.element_size())
+    tile_size = (upsampler.tile or None) if tile_size is None else tile_size
+    tile_overlap = 2 * upsampler.tile_pad if tile_overlap is None else tile_overlap
+    if tile_size is None:
+        tile_size, tiles_per_batch = get_tile_size(upsampler.device, height, width, mem_per_tile_pixel)
+    else:
+        tiles_per_batch = None
+
+    tile_h, tile_w = min(tile_size, height), min(tile_size, width)
+    if mod_scale:
+        tile_h, tile_w = tile_h - tile_h % mod_scale, tile_w - tile_w % mod_scale
+    tile_overlap = min(tile_overlap, tile_h // 2, tile_w // 2)
+    ys = _get_tile_starts(height, tile_h, tile_overlap)
+    xs = _get_tile_starts(width, tile_w, tile_overlap)
+    positions = [(b, y, x) for b in range(batch) for y in ys for x in xs]
+
+    if tiles_per_batch is None:
+        tiles_per_batch = _get_tiles_per_batch(upsampler.device, tile_h * tile_w * mem_per_tile_pixel)
+
+    out_h, out_w = tile_h * model_scale, tile_w * model_scale
+
+    with torch.no_grad():
+        for i in range(0, len(positions), tiles_per_batch):
+            chunk = positions[i : i + tiles_per_batch]
+            tiles = torch.stack([images[b, :, y : y + tile_h, x : x + tile_w] for b, y, x in chunk])
+            tiles = model(tiles).float()
+
+            for tile, (b, y, x) in zip(tiles, chunk):
+                mask = _get_blend_mask(
+                    out_h, out_w, tile_overlap * model_scale, y, x, height - tile_h, width - tile_w, images.device
+                )
+                oy, ox = y * model_scale, x * model_scale
+                output[b, :, oy : oy + out_h, ox : ox + out_w] += tile * mask
+                weights[b, :, oy : oy + out_h, ox : ox + out_w] += mask
 
-    output, _ = context.models["realesrgan"].enhance(image, outscale=scale)
-    output = output[:, :, ::-1]
-    output = Image.fromarray(output)
+    output = (output / weights).clamp_(0, 1)
+    output = output[:, :, : orig_height * model_scale, : orig_width * model_scale]  # remove the padding
+    if scale != model_scale:
+        size = (int(orig_height * scale), int(orig_width * scale))
+        output = F.interpolate(output, size=size, mode="bicubic", antialias=True)
+        output = output.clamp_(0, 1)
 
     return output
+
+
+def get_mem_per_pixel(model, scale, element_size) -> int:
+    """
+    Returns the approx. peak memory (in bytes) that RRDBNet needs per input pixel. In its dense blocks, about 9 feature
+    maps are alive at once (the trunk and block inputs, the 4 growth maps and their concatenation), and the last
+    upsampling convolutions keep 2 feature maps at the output resolution. Plus 50% for the convolution workspaces.
+    e.g. 3072 values per pixel for RealESRGAN_x4plus.
+    """
+    conv_first = getattr(model, "conv_first", None)
+    num_feat = conv_first.out_channels if conv_first is not None else 64
+    unshuffle = {1: 16, 2: 4}.get(scale, 1)  # the x1 and x2 models run their blocks at a lower resolution
+
+    values = max(9 * num_feat / unshuffle, 2 * num_feat * scale**2) * 1.5
+    return int(values * element_size)
+
+
+def get_tile_size(device, height, width, mem_per_pixel) -> tuple:
+    """
+    Returns the largest tile size (and the number of tiles per batch) that fits in the free memory of the device.
+    Prefers a single tile for small images.
+    """
+    from sdkit.utils import get_available_memory, is_cpu_device
+
+    if is_cpu_device(device):
+        return DEFAULT_CPU_TILE_SIZE, 1
+
+    mem_free = get_available_memory(device) * 0.8  # leave some room for fragmentation
+    for tile_size in TILE_SIZES:
+        tile_pixels = min(tile_size, height) * min(tile_size, width)
+        if tile_pixels * mem_per_pixel <= mem_free:
+            return tile_size, max(1, int(mem_free // (tile_pixels * mem_per_pixel)))
+
+    return TILE_SIZES[-1], 1
+
+
+def _get_tiles_per_batch(device, mem_per_tile):
+    from sdkit.utils import get_available_memory, is_cpu_device
+
+    if is_cpu_device(device):
+        return 1
+    return max(1, int(get_available_memory(device) * 0.8 // mem_per_tile))
+
+
+def _get_tile_starts(size, tile, overlap):
+    "The start of each tile along one axis, so that the tiles overlap by at least `overlap` and end at `size`"
+    if tile >= size:
+        return [0]
+
+    stride = tile - overlap
+    starts = list(range(0, size - tile, stride))
+    starts.append(size - tile)
+    return starts
+
+
+def _get_blend_mask(h, w, overlap, y, x, max_y, max_x, device):
+    "A weight mask that ramps up linearly over `overlap` pixels on the sides that overlap with another tile"
+    import torch
+
+    def ramp(n, at_start, at_end):
+        r = torch.ones(n, device=device)
+        if overlap > 0:
+            edge = torch.linspace(0, 1, overlap + 2, device=device)[1:-1]
+            if not at_start:
+                r[:overlap] = edge
+            if not at_end:
+                r[-overlap:] = torch.minimum(r[-overlap:], edge.flip(0))
+        return r
+
+    ry = ramp(h, y == 0, y == max_y)
+    rx = ramp(w, x == 0, x == max_x)
+    return (ry[:, None] * rx[None, :]).unsqueeze(0)
@@ -1 +1,5 @@
 from .image_generator import generate_images
+from .batch_scheduler import BatchScheduler
+from .device_pool import DevicePool
+from .progress import CancelToken, GenerationCancelled, ProgressEvent
+from .warmup import warmup
@@ -0,0 +1,216 @@
+import inspect
+import threading
+import time
+from collections import deque
+from concurrent.futures import Future
+
+from sdkit import Context
+from sdkit.utils import log
+
+from .image_generator import generate_images
+from .progress import CancelToken, GenerationCancelled
+
+# the arguments that can differ between the requests in a batch. all the other arguments need to match exactly.
+PER_PROMPT_ARGS = ("prompt", "negative_prompt", "seed", "guidance_scale", "num_outputs")
+
+# requests with these arguments are rendered on their own (the pipelines take one image per batch)
+SOLO_ARGS = ("init_image", "init_image_mask", "control_image", "callback", "on_progress")
+
+# per-request arguments that don't affect the images (and don't prevent batching)
+REQUEST_ARGS = ("cancel_token",)
+
+DEFAULT_ARGS = {
+    name: param.default
+    for name, param in inspect.signature(generate_images).parameters.items()
+    if param.default is not inspect.Parameter.empty
+}
+
+
+class BatchScheduler:
+    """
+    Groups compatible `generate_images()` requests into a single batched call, to make better use of the GPU.
+
+    Requests are compatible if they only differ in `prompt`, `negative_prompt`, `seed` and `guidance_scale` (i.e. the
+    same size, steps, sampler, tiling, LoRA alpha etc). Requests with an initial image, mask, control image, callback
+    or `num_outputs > 1` are always rendered on their own, so every request gets the same images as when it's rendered
+    on its own (a solo request with several outputs draws its noise from a single generator, which a batch can't
+    reproduce).
+
+    Requests whose `cancel_token` is cancelled before they start are dropped (their future raises
+    `GenerationCancelled`). A running batch stops at the next step once all of its requests are cancelled.
+
+    Requests can be submitted from any thread. But `run()` needs to be called on the thread that loaded the models,
+    since `Context` is thread-local.
+
+    * context: the Context containing the loaded Stable Diffusion model.
+    * max_batch_size: the maximum number of images rendered in one batch.
+    * batch_window: the number of seconds to wait for compatible requests, after the first request of a batch
+      arrives. `0` means that only the requests that are already waiting will be grouped.
+
+    Example:
+        scheduler = BatchScheduler(context, max_batch_size=4)
+        threading.Thread(target=scheduler.run).start()  # or call `run()` on the thread that loaded the model
+        future = scheduler.submit(prompt="Photograph of an astronaut riding a horse", seed=42)
+        image = future.result()[0]
+    """
+
+    def __init__(self, context: Context, max_batch_size: int = 4, batch_window: float = 0.05):
+        self.context = context
+        self.max_batch_size = max(1, max_batch_size)
+        self.batch_window = batch_window
+
+        self._queue = deque()
+        self._cond = threading.Condition()
+        self._stopped = False
+
+    def submit(self, **kwargs) -> Future:
+        """
+        Queues a request. Accepts the same keyword arguments as `generate_images()` (except `context`).
+        Returns a `concurrent.futures.Future` which resolves to the list of generated images.
+        """
+        for name in PER_PROMPT_ARGS[:4]:
+            if isinstance(kwargs.get(name), list):
+                raise ValueError(f"{name} needs to be a single value for a scheduled request!")
+
+        request = _Request(kwargs)
+        with self._cond:
+            if self._stopped:
+                raise RuntimeError("The BatchScheduler has been stopped!")
+
+            self._queue.append(request)
+            self._cond.notify_all()
+
+        return request.future
+
+    def generate_images(self, **kwargs) -> list:
+        "Submits a request and waits for its images."
+        return self.submit(**kwargs).result()
+
+    @property
+    def pending_count(self) -> int:
+        "The number of images that haven't started rendering yet."
+        with self._cond:
+            return sum(r.num_outputs for r in self._queue)
+
+    def run(self):
+        "Renders the submitted requests until `stop()` is called. Needs to be called on the thread owning the context."
+        while True:
+            batch = self._next_batch(block=True)
+            if batch is None:
+                return
+
+            self._render(batch)
+
+    def run_pending(self):
+        "Renders the requests that have already been submitted, and returns after that."
+        while True:
+            batch = self._next_batch(block=False)
+            if batch is None:
+                return
+
+            self._render(batch)
+
+    def stop(self):
+        "Stops `run()` after the queued requests have been rendered. No new requests are accepted after this."
+        with self._cond:
+            self._stopped = True
+            self._cond.notify_all()
+
+    def _next_batch(self, block: bool):
+        with self._cond:
+            while block and not self._queue and not self._stopped:
+                self._cond.wait()
+
+            if not self._queue:
+                return None
+
+            first = self._queue[0]
+            if first.key is not None:
+                deadline = first.submitted_at + self.batch_window
+                while block and not self._stopped and self._count_compatible(first) < self.max_batch_size:
+                    remaining = deadline - time.monotonic()
+                    if remaining <= 0:
+                        break
+                    self._cond.wait(remaining)
+
+            return self._pop_compatible(first)
+
+    def _count_compatible(self, first) -> int:
+        return sum(r.num_outputs for r in self._queue if r.key == first.key)
+
+    def _pop_compatible(self, first) -> list:
+        self._queue.popleft()
+        batch = [first]
+        if first.key is None:
+            return batch
+
+        num_images = first.num_outputs
+        for request in list(self._queue):
+            if request.key != first.key or num_images + request.num_outputs > self.max_batch_size:
+                continue
+
+            self._queue.remove(request)
+            batch.append(request)
+            num_images += request.num_outputs
+
+        return batch
+
+    def _render(self, batch: list):
+        batch = [r for r in batch if r.future.set_running_or_notify_cancel()]
+        for request in [r for r in batch if r.cancel_token is not None and r.cancel_token.is_cancelled]:
+            request.future.set_exception(GenerationCancelled("The request was cancelled before it started"))
+            batch.remove(request)
+
+        if not batch:
+            return
+
+        try:
+            if len(batch) == 1 or not self.context.test_diffusers:
+                for request in batch:
+                    request.future.set_result(generate_images(self.context, **request.kwargs))
+                return
+
+            args = dict(batch[0].args)
+            args["prompt"], args["negative_prompt"], args["seed"], args["guidance_scale"] = [], [], [], []
+            for request in batch:
+                for i in range(request.num_outputs):
+                    args["prompt"].append(request.args["prompt"])
+                    args["negative_prompt"].append(request.args["negative_prompt"])
+                    args["seed"].append(request.args["seed"] + i)
+                    args["guidance_scale"].append(request.args["guidance_scale"])
+            args["num_outputs"] = 1
+            args["cancel_token"] = CancelToken.all_of([r.cancel_token for r in batch])
+
+            log.info(f"Rendering a batch of {len(batch)} requests ({len(args['prompt'])} images)")
+            images = generate_images(self.context, **args)
+
+            offset = 0
+            for request in batch:
+                request.future.set_result(images[offset : offset + request.num_outputs])
+                offset += request.num_outputs
+        except BaseException as e:
+            for request in batch:
+                if not request.future.done():
+                    request.future.set_exception(e)
+
+            if not isinstance(e, Exception):
+                raise
+
+
+class _Request:
+    def __init__(self, kwargs: dict):
+        self.kwargs = kwargs
+        self.args = {**DEFAULT_ARGS, **kwargs}
+        self.num_outputs = self.args["num_outputs"]
+        self.cancel_token = kwargs.get("cancel_token")
+        self.key = get_batch_key(self.args)
+        self.future = Future()
+        self.submitted_at = time.monotonic()
+
+
+def get_batch_key(args: dict):
+    "Returns a key that's the same for requests that can be rendered in the same batch, or None for solo requests."
+    if any(args.get(name) is not None for name in SOLO_ARGS) or args.get("num_outputs", 1) != 1:
+        return None
+
+    return repr(sorted((k, v) for k, v in args.items() if k not in PER_PROMPT_ARGS + REQUEST_ARGS))
@@ -0,0 +1,247 @@
+"""
+Runs the ControlNets of a request for each denoising step. `make_with_diffusers()` passes a `ControlNetEngine` to the
+ControlNet pipelines, in place of diffusers' `MultiControlNetModel` (also for a single ControlNet):
+* ControlNets that don't contribute to a step are skipped, i.e. a zero weight, or a step outside their
+    `control_start`..`control_end` range. If none of them contribute, the UNet runs without ControlNet residuals
+    (which also lets it replay from a CUDA graph).
+* ControlNets with the same architecture (config, dtype and device) run as one batched forward pass, with
+    `torch.func.vmap` over their weights. The weights of each group (of all the engine's ControlNets) are stacked once,
+    when the engine is made, and each ControlNet's tensors become views of the stacked ones, so they aren't kept twice.
+    In steps where only some of a group contribute, those run one at a time from their views, so the weights are never
+    moved during a request. They run one at a time if vmap doesn't support something in them.
+* The control image features (the output of `controlnet_cond_embedding`, which runs at the full image resolution)
+    are computed once per request, and are reused for later requests with the same control image (the most recent
+    `CONTROL_FEATURE_CACHE_SIZE` images of each ControlNet).
+
+Offloaded (`vram_usage_level="low"`) or patched (e.g. TensorRT) ControlNets run normally, one at a time.
+"""
+
+import hashlib
+import json
+import weakref
+from collections import OrderedDict
+from contextlib import contextmanager
+
+from diffusers.pipelines.controlnet.multicontrolnet import MultiControlNetModel
+
+from sdkit.utils import log, trace
+
+CONTROL_FEATURE_CACHE_SIZE = 4  # control images per ControlNet
+
+_feature_caches = weakref.WeakKeyDictionary()  # controlnet -> OrderedDict of (image key, shape..) -> features
+
+
+class ControlNetEngine(MultiControlNetModel):
+    def __init__(self, controlnets: list):
+        super().__init__(controlnets)
+        self.control_keys = [None] * len(controlnets)  # see set_control_keys()
+        self.use_batching = True
+        self._unbatchable = set()  # groups of ControlNets (indices) that couldn't run in vmap
+
+        for group in self._get_groups(range(len(self.nets))):
+            if len(group) > 1:
+                _stack_weights([self.nets[i] for i in group])
+
+    def set_control_keys(self, keys: list):
+        "Identifies the control image of each ControlNet (see `get_control_image_key()`), to reuse their features"
+        self.control_keys = list(keys)
+
+    def forward(
+        self,
+        sample,
+        timestep,
+        encoder_hidden_states,
+        controlnet_cond: list,
+        conditioning_scale: list,
+        class_labels=None,
+        timestep_cond=None,
+        attention_mask=None,
+        added_cond_kwargs=None,
+        cross_attention_kwargs=None,
+        guess_mode=False,
+        return_dict=True,
+    ):
+        # the same arguments (and return value) as MultiControlNetModel
+        active = [i for i, scale in enumerate(conditioning_scale) if float(scale) != 0]
+        if not active:
+            if guess_mode:  # the pipeline expects residuals
+                active = list(range(len(self.nets)))
+            else:
+                return None, None
+
+        args = (sample, timestep, encoder_hidden_states)
+        kwargs = {
+            "class_labels": class_labels,
+            "timestep_cond": timestep_cond,
+            "attention_mask": attention_mask,
+            "added_cond_kwargs": added_cond_kwargs,
+            "cross_attention_kwargs": cross_attention_kwargs,
+            "guess_mode": guess_mode,
+        }
+
+        outputs = []  # the (down, mid) residuals of each group, already scaled
+        with trace("controlnet", active=len(active)):
+            for group in self._get_groups(range(len(self.nets))):
+                members = [i for i in group if i in active]
+                if len(members) == len(group) > 1 and self.use_batching and group not in self._unbatchable:
+                    try:
+                        outputs.append(self._run_batched(group, args, kwargs, controlnet_cond, conditioning_scale))
+                        continue
+                    except Exception as e:
+                        log.warn(f"Could not run the ControlNets {group} as a batch, running them one at a time: {e}")
+                        self._unbatchable.add(group)
+
+                # e.g. a step where some of the group are outside their control range. They run from their views of
+                # the group's stacked weights, instead of stacking the subset
+                for i in members:
+                    outputs.append(self._run_single(i, args, kwargs, controlnet_cond[i], conditioning_scale[i]))
+
+        down, mid = outputs[0]
+        for d, m in outputs[1:]:
+            down = [a + b for a, b in zip(down, d)]
+            mid = mid + m
+        return down, mid
+
+    def _get_groups(self, indices) -> list:
+        "Groups the ControlNets that can run as one batch"
+        groups = OrderedDict()
+        for i in indices:
+            groups.setdefault(_get_architecture(self.nets[i]), []).append(i)
+        return [tuple(g) for g in groups.values()]
+
+    def _run_single(self, i, args, kwargs, cond, scale):
+        net = self.nets[i]
+        if not _can_patch(net):
+            return net(*args, controlnet_cond=cond, conditioning_scale=scale, return_dict=False, **kwargs)
+
+        with _use_features(net, self._get_features(i, cond)):
+            return net(*args, controlnet_cond=cond, conditioning_scale=scale, return_dict=False, **kwargs)
+
+    def _run_batched(self, group, args, kwargs, controlnet_cond, conditioning_scale):
+        import torch
+        from torch.func import functional_call, vmap
+
+        base = self.nets[group[0]]
+        weights = _stack_weights([self.nets[i] for i in group])
+        features = torch.stack([self._get_features(i, controlnet_cond[i]) for i in group])
+        call_kwargs = dict(kwargs, controlnet_cond=controlnet_cond[group[0]], conditioning_scale=1.0, return_dict=False)
+
+        def run(weights, features):
+            with _use_features(base, features):
+                return functional_call(base, weights, args, call_kwargs)
+
+        down, mid = vmap(run)(weights, features)
+
+        # the residuals are linear in the conditioning scale (also in guess mode)
+        scales = torch.tensor([float(conditioning_scale[i]) for i in group], dtype=mid.dtype, device=mid.device)
+        scales = scales.view(-1, *([1] * (mid.ndim - 1)))
+        return [(d * scales).sum(0) for d in down], (mid * scales).sum(0)
+
+    def _get_features(self, i, cond):
+        "Returns the output of the ControlNet's `controlnet_cond_embedding` for this control image tensor"
+        net = self.nets[i]
+        cache = _feature_caches.get(net)
+        if cache is None:
+            cache = _feature_caches[net] = OrderedDict()
+
+        image_key = self.control_keys[i] if i < len(self.control_keys) else None
+        if image_key is None:  # only reused for the same tensor, i.e. within a request
+            image_key = ("tensor", id(cond), cond._version)
+        key = (image_key, tuple(cond.shape), cond.dtype, cond.device)
+
+        entry = cache.get(key)
+        if entry is not None and (image_key[0] != "tensor" or entry[0]() is cond):
+            cache.move_to_end(key)
+            return entry[1]
+
+        embedding_input = cond
+        if net.config.get("controlnet_conditioning_channel_order") == "bgr":  # as in ControlNetModel.forward()
+            embedding_input = cond.flip(dims=[1])
+        features = net.controlnet_cond_embedding(embedding_input)
+
+        cache[key] = (weakref.ref(cond), features)
+        while len(cache) > CONTROL_FEATURE_CACHE_SIZE:
+            cache.popitem(last=False)
+        return features
+
+
+def get_control_image_key(image) -> str:
+    "A key for the pixels of a (resized) control image, to reuse its features in later requests"
+    return f"{image.mode}-{image.size}-{hashlib.sha1(image.tobytes()).hexdigest()}"
+
+
+def clear_control_features(controlnet=None):
+    "Drops the cached control image features of this ControlNet (or of all ControlNets)"
+    if controlnet is None:
+        _feature_caches.clear()
+    else:
+        _feature_caches.pop(controlnet, None)
+
+
+def _can_patch(net) -> bool:
+    "False for offloaded or patched ControlNets (e.g. TensorRT), which have to run as they are"
+    if hasattr(net, "_hf_hook") or "forward" in vars(net):
+        return False
+    embedding = getattr(net, "controlnet_cond_embedding", None)
+    return embedding is not None and "forward" not in vars(embedding)
+
+
+def _get_architecture(net):
+    "ControlNets with the same architecture can run as one batch"
+    if not _can_patch(net):
+        return ("unbatchable", id(net))
+
+    config = json.dumps(dict(net.config), sort_keys=True, default=str)
+    return (type(net), config, net.dtype, net.device)
+
+
+@contextmanager
+def _use_features(net, features):
+    "Makes the ControlNet use these control image features, instead of computing them from the control image"
+    embedding = net.controlnet_cond_embedding
+    embedding.forward = lambda cond: features
+    try:
+        yield
+    finally:
+        del embedding.forward
+
+
+def _stack_weights(nets: list) -> dict:
+    """
+    Returns the parameters and buffers of these ControlNets (of the same architecture), each stacked along a new first
+    dim. The first call stacks them, and points each ControlNet's tensors to its slice of the stacked tensors. Later
+    calls (with the same ControlNets) return views of the same memory, until the ControlNets' weights are replaced
+    (e.g. moved to another device).
+    """
+    import torch
+
+    per_net = [{**dict(net.named_parameters()), **dict(net.named_buffers())} for net in nets]
+    stacked = {}
+    for name in per_net[0]:
+        tensors = [t[name] for t in per_net]
+        view = _as_stacked(tensors)
+        if view is None:
+            view = torch.stack([t.detach() for t in tensors])
+            for i, t in enumerate(tensors):
+                t.data = view[i]  # frees the original tensor
+        stacked[name] = view
+    return stacked
+
+
+def _as_stacked(tensors: list):
+    "Returns a view of these tensors stacked along a new first dim, if they're consecutive in one storage (or None)"
+    first = tensors[0]
+    if not first.is_contiguous():
+        return None
+
+    storage_ptr = first.untyped_storage().data_ptr()
+    size = first.numel() * first.element_size()
+    for i, t in enumerate(tensors):
+        if t.untyped_storage().data_ptr() != storage_ptr or t.data_ptr() != first.data_ptr() + i * size:
+            return None
+        if t.shape != first.shape or t.dtype != first.dtype or not t.is_contiguous():
+            return None
+
+    shape = (len(tensors), *first.shape)
+    stride = (first.numel(), *first.stride())
+    return first.detach().as_strided(shape, stride, first.storage_offset())
@@ -0,0 +1,223 @@
+"""
+Replays the UNet's forward pass from CUDA graphs, to remove the Python and kernel-launch overhead of each step (which
+dominates at small batch sizes on fast GPUs). Enabled with `context.cuda_graphs`.
+
+A graph is captured for each shape bucket (the shapes and dtypes of the UNet's inputs), the first time the bucket is
+used. Later calls copy their inputs into the graph's static input buffers, replay it, and return a copy of the static
+output. The most recently-used `CUDA_GRAPH_CACHE_SIZE` graphs are kept per UNet, sharing one memory pool.
+
+The graphs are captured again if the UNet's weights are replaced, or its attention processors, the tiling patches or
+the runtime LoRA alphas change (see `cuda_graph_unet()`). The UNet runs normally (eagerly) for ControlNet residuals,
+when the UNet is offloaded or patched (e.g. TensorRT, DirectML), and if a capture fails.
+"""
+
+import inspect
+import threading
+import weakref
+from collections import OrderedDict
+from contextlib import contextmanager, nullcontext
+
+from sdkit import Context
+from sdkit.utils import log
+
+CUDA_GRAPH_CACHE_SIZE = 4  # graphs per UNet
+CUDA_GRAPH_WARMUP_RUNS = 2  # on a side stream, before capturing (also lets the attention backend calibrate)
+
+# inputs that come from a ControlNet, which isn't inside the graph
+EAGER_INPUTS = (
+    "down_block_additional_residuals",
+    "mid_block_additional_residual",
+    "down_intrablock_additional_residuals",
+)
+
+_runners = weakref.WeakKeyDictionary()  # unet -> CudaGraphRunner
+
+
+def cuda_graph_unet(context: Context, unet, state_key=None):
+    """
+    Returns a `with` block, inside which the calls to `unet` are replayed from CUDA graphs (if `context.cuda_graphs`
+    is enabled, and the UNet supports it).
+
+    * state_key: anything else that changes what the UNet computes, without changing its weights (e.g. the tiling
+        patches). The graphs are captured again when this changes.
+    """
+    if not context.cuda_graphs or not can_use_cuda_graphs(context, unet):
+        return nullcontext()
+
+    runner = _runners.get(unet)
+    if runner is None:
+        runner = _runners[unet] = CudaGraphRunner(unet)
+    runner.check_state(state_key)
+    return runner.installed()
+
+
+def can_use_cuda_graphs(context: Context, unet) -> bool:
+    if unet.device.type != "cuda" or getattr(context, "block_offloader", None) is not None:
+        return False
+    return not hasattr(unet, "_hf_hook") and "forward" not in vars(unet)  # offloaded, or a patched forward
+
+
+def release_cuda_graphs(unet):
+    "Frees the CUDA graphs (and their memory pool) of this UNet"
+    _runners.pop(unet, None)
+
+
+class CudaGraphRunner:
+    def __init__(self, unet):
+        self._unet = weakref.ref(unet)  # cached per UNet, so this shouldn't keep the UNet alive
+        self._arg_names = list(inspect.signature(type(unet).forward).parameters)[1:]
+        self._lock = threading.Lock()
+
+        self.graphs = OrderedDict()  # bucket -> _Graph, or None if this bucket couldn't be captured
+        self.pool = None
+        self.state = None
+
+    def check_state(self, state_key):
+        "Drops the graphs if the UNet has changed since they were captured"
+        unet = self._unet()
+        state = (
+            state_key,
+            tuple(t.data_ptr() for t in unet.parameters()),
+            tuple(t.data_ptr() for t in unet.buffers()),
+            tuple(id(p) for p in unet.attn_processors.values()),
+        )
+        if state == self.state:
+            return
+
+        if self.graphs:
+            log.info("The UNet has changed, its CUDA graphs will be captured again")
+        with self._lock:
+            self.graphs.clear()
+            self.pool = None
+            self.state = state
+
+    @contextmanager
+    def installed(self):
+        unet = self._unet()
+        unet.forward = self.forward
+        try:
+            yield
+        finally:
+            del unet.forward
+
+    def forward(self, *args, **kwargs):
+        import torch
+
+        unet = self._unet()
+        kwargs.update(zip(self._arg_names, args))
+        return_dict = kwargs.pop("return_dict", True)
+
+        timestep = kwargs.get("timestep")
+        if timestep is not None and not torch.is_tensor(timestep):  # a python number would be baked into the graph
+            dtype = torch.float32 if isinstance(timestep, float) else torch.int64
+            kwargs["timestep"] = torch.tensor(timestep, dtype=dtype, device=unet.device)
+        elif timestep is not None and timestep.device != unet.device:  # copies from the CPU can't be captured
+            kwargs["timestep"] = timestep.to(unet.device)
+
+        bucket = get_bucket(kwargs)
+        if bucket is None or torch.is_grad_enabled() or torch.cuda.is_current_stream_capturing():
+            return type(unet).forward(unet, **kwargs, return_dict=return_dict)
+
+        with self._lock:
+            if bucket in self.graphs:
+                self.graphs.move_to_end(bucket)
+                graph = self.graphs[bucket]
+                output = graph.replay(kwargs) if graph is not None else _run(unet, kwargs)
+            else:
+                graph, output = self._capture(unet, kwargs)
+                self.graphs[bucket] = graph
+                while len(self.graphs) > CUDA_GRAPH_CACHE_SIZE:
+                    self.graphs.popitem(last=False)
+
+        if return_dict:
+            from diffusers.models.unets.unet_2d_condition import UNet2DConditionOutput
+
+            return UNet2DConditionOutput(sample=output)
+        return (output,)
+
+    def _capture(self, unet, kwargs):
+        "Returns (the graph or None, the output of this call)"
+        import torch
+
+        device = unet.device
+        static_inputs = _map_tensors(kwargs, lambda t: t.clone())
+        try:
+            stream = torch.cuda.Stream(device)
+            stream.wait_stream(torch.cuda.current_stream(device))
+            with torch.cuda.stream(stream):
+                for _ in range(CUDA_GRAPH_WARMUP_RUNS):
+                    output = _run(unet, static_inputs)
+            torch.cuda.current_stream(device).wait_stream(stream)
+
+            if self.pool is None:
+                self.pool = torch.cuda.graph_pool_handle()
+            graph = torch.cuda.CUDAGraph()
+            with torch.cuda.graph(graph, pool=self.pool):
+                static_output = _run(unet, static_inputs)
+        except Exception as e:
+            log.warn(f"Could not capture a CUDA graph of the UNet, running it normally for this shape: {e}")
+            return None, _run(unet, kwargs)
+
+        log.info(f"Captured a CUDA graph of the UNet for {tuple(kwargs['sample'].shape)}")
+        return _Graph(graph, static_inputs, static_output), output
+
+
+class _Graph:
+    def __init__(self, graph, static_inputs: dict, static_output):
+        self.graph = graph
+        self.static_inputs = static_inputs
+        self.static_output = static_output
+
+    def replay(self, kwargs):
+        _copy_tensors(self.static_inputs, kwargs)
+        self.graph.replay()
+        return self.static_output.clone()  # the next replay overwrites the static output (and schedulers keep it)
+
+
+def get_bucket(kwargs: dict):
+    "Returns a hashable key of the shapes, dtypes and values of the inputs, or None if they can't be captured"
+    import torch
+
+    class Unsupported(Exception):
+        pass
+
+    def describe(value):
+        if torch.is_tensor(value):
+            return ("tensor", tuple(value.shape), value.dtype, value.device)
+        if isinstance(value, dict):
+            return tuple((k, describe(v)) for k, v in sorted(value.items()))
+        if value is None or isinstance(value, (bool, int, float, str)):
+            return value
+        raise Unsupported()
+
+    if any(kwargs.get(name) is not None for name in EAGER_INPUTS) or "sample" not in kwargs:
+        return None
+
+    try:
+        return describe(kwargs)
+    except Unsupported:
+        return None
+
+
+def _run(unet, kwargs):
+    return type(unet).forward(unet, **kwargs, return_dict=False)[0]
+
+
+def _map_tensors(value, fn):
+    import torch
+
+    if torch.is_tensor(value):
+        return fn(value)
+    if isinstance(value, dict):
+        return {k: _map_tensors(v, fn) for k, v in value.items()}
+    return value
+
+
+def _copy_tensors(static, value):
+    import torch
+
+    if torch.is_tensor(static):
+        static.copy_(value, non_blocking=True)
+    elif isinstance(static, dict):
+        for k, v in static.items():
+            _copy_tensors(v, value[k])
@@ -0,0 +1,156 @@
+import queue
+import threading
+from concurrent.futures import Future
+
+from sdkit import Context
+from sdkit.utils import log
+
+from .image_generator import generate_images
+
+
+class _Worker:
+    def __init__(self, device, configure):
+        self.device = device
+        self.pending = 0  # queued + running tasks
+        self._pending_lock = threading.Lock()
+        self._tasks = queue.Queue()
+
+        self.thread = threading.Thread(target=self._run, args=(configure,), name=f"sd-{device}", daemon=True)
+        self.thread.start()
+
+    def submit(self, fn, *args, **kwargs) -> Future:
+        future = Future()
+        with self._pending_lock:
+            self.pending += 1
+        self._tasks.put((future, fn, args, kwargs))
+        return future
+
+    def stop(self):
+        self._tasks.put(None)
+
+    def _run(self, configure):
+        self.context = Context()  # thread-local, so it's created (and only used) on this thread
+        self.context.device = self.device
+        if configure:
+            configure(self.context)
+
+        while True:
+            task = self._tasks.get()
+            if task is None:
+                return
+
+            future, fn, args, kwargs = task
+            if future.set_running_or_notify_cancel():
+                try:
+                    future.set_result(fn(self.context, *args, **kwargs))
+                except BaseException as e:
+                    future.set_exception(e)
+            with self._pending_lock:
+                self.pending -= 1
+
+
+class DevicePool:
+    """
+    Serves requests on several devices (e.g. GPUs) in parallel, with one `Context` per device. Each Context lives on
+    its own worker thread (since `Context` is thread-local), and requests are dispatched to the device with the
+    fewest pending requests.
+
+    The same models are loaded on all the devices. A Stable Diffusion model is loaded from the disk (and converted)
+    only once, on the first device. The other devices then copy it from a single copy in pinned RAM, in parallel.
+
+    * devices: the list of devices, e.g. `["cuda:0", "cuda:1"]`
+    * configure: an optional function that is called with each device's `Context` before anything is loaded,
+      e.g. to set `vram_usage_level` or `half_precision`.
+
+    Example:
+        pool = DevicePool(["cuda:0", "cuda:1"])
+        pool.load_model("stable-diffusion", "path/to/sd-v1-4.safetensors")
+        futures = [pool.submit_generate(prompt="Photograph of an astronaut riding a horse", seed=i) for i in range(8)]
+        images = [f.result()[0] for f in futures]
+    """
+
+    def __init__(self, devices: list, configure=None):
+        if not devices:
+            raise ValueError("DevicePool needs at least one device!")
+
+        self._workers = [_Worker(device, configure) for device in devices]
+        self._dispatch_lock = threading.Lock()
+
+    @property
+    def devices(self) -> list:
+        return [w.device for w in self._workers]
+
+    def load_model(self, model_type: str, model_path=None, **kwargs):
+        """
+        Loads the model on all the devices, and waits for it to finish. Sets `context.model_paths[model_type]` to
+        `model_path` first, if given. Accepts the same keyword arguments as `sdkit.models.load_model()`.
+        """
+        from sdkit.models import load_model
+        from sdkit.models.model_loader import load_model_replica
+        from sdkit.models.model_loader.replica import make_replica
+
+        def load(context: Context):
+            if model_path is not None:
+                context.model_paths[model_type] = model_path
+            load_model(context, model_type, **kwargs)
+
+        primary, others = self._workers[0], self._workers[1:]
+        if model_type != "stable-diffusion" or not others:
+            return self.run_on_all(load)
+
+        def load_primary(context: Context):
+            load(context)
+            return make_replica(context, model_type)
+
+        replica = primary.submit(load_primary).result()
+        if replica is None:  # can't be copied. load from the disk (uses the converted model cache, if enabled)
+            log.info(f"Loading {model_type} from the disk on each device, since it can't be copied between devices")
+            return _wait_for_all([w.submit(load) for w in others])
+
+        def load_copy(context: Context):
+            if model_path is not None:
+                context.model_paths[model_type] = model_path
+            load_model_replica(context, model_type, replica, **kwargs)
+
+        _wait_for_all([w.submit(load_copy) for w in others])
+
+    def unload_model(self, model_type: str):
+        from sdkit.models import unload_model
+
+        self.run_on_all(lambda context: unload_model(context, model_type))
+
+    def submit(self, fn, *args, **kwargs) -> Future:
+        "Runs `fn(context, *args, **kwargs)` on the least-loaded device. Returns a `concurrent.futures.Future`"
+        with self._dispatch_lock:
+            worker = min(self._workers, key=lambda w: w.pending)
+            return worker.submit(fn, *args, **kwargs)
+
+    def submit_generate(self, **kwargs) -> Future:
+        "Queues a `generate_images()` call (with these keyword arguments) on the least-loaded device"
+        return self.submit(generate_images, **kwargs)
+
+    def generate_images(self, **kwargs) -> list:
+        "Renders on the least-loaded device, and waits for the images"
+        return self.submit_generate(**kwargs).result()
+
+    def run_on_all(self, fn, *args, **kwargs) -> list:
+        "Runs `fn(context, *args, **kwargs)` on every device (after their pending requests), and returns the results"
+        return _wait_for_all([w.submit(fn, *args, **kwargs) for w in self._workers])
+
+    def pending_count(self) -> dict:
+        return {w.device: w.pending for w in self._workers}
+
+    def stop(self):
+        "Stops the workers after their pending requests"
+        for worker in self._workers:
+            worker.stop()
+        for worker in self._workers:
+            worker.thread.join()
+
+
+def _wait_for_all(futures: list) -> list:
+    results = [f.exception() for f in futures]  # wait for all of them, even if one fails
+    for e in results:
+        if e is not None:
+            raise e
+    return [f.result() for f in futures]
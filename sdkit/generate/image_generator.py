@@ -1,3 +1,4 @@
+import inspect
 from contextlib import nullcontext
 
 import torch
@@ -12,15 +13,26 @@ from sdkit.utils import (
     base64_str_to_img,
     gc,
     get_image_latent_and_mask,
+    images_to_tensor,
     latent_samples_to_images,
     resize_img,
+    tensor_to_images,
     log,
     black_to_transparent,
     get_image,
+    trace,
+    trace_module,
 )
 
+from .cuda_graphs import cuda_graph_unet
+from .noise import make_noise
+from .pipeline_cache import get_cache, get_controlnet_engine, get_controlnet_pipeline, get_scheduler
+from .progress import make_progress_callback
+from .prompt_cache import get_prompt_embeddings
 from .prompt_parser import get_cond_and_uncond
+from .step_cache import cache_unet_steps
 from .sampler import make_samples
+from .vae_engine import get_vae_engine
 
 torch.backends.cuda.matmul.allow_tf32 = True
 torch.backends.cudnn.allow_tf32 = True
@@ -28,14 +40,14 @@ torch.backends.cudnn.allow_tf32 = True
 
 def generate_images(
     context: Context,
-    prompt: str = "",
-    negative_prompt: str = "",
-    seed: int = 42,
+    prompt: Union[str, List[str]] = "",
+    negative_prompt: Union[str, List[str]] = "",
+    seed: Union[int, List[int]] = 42,
     width: int = 512,
     height: int = 512,
     num_outputs: int = 1,
     num_inference_steps: int = 25,
-    guidance_scale: float = 7.5,
+    guidance_scale: Union[float, List[float]] = 7.5,
     init_image=None,
     init_image_mask=None,
     control_image=None,
@@ -51,76 +63,137 @@ def generate_images(
     lora_alpha: Union[float, List[float]] = 0,
     sampler_params={},
     callback=None,
+    output_type="pil",
+    on_progress=None,
+    preview_every: int = 0,
+    preview_type: str = "rgb",
+    cancel_token=None,
+    step_cache=None,
+    control_start=0.0,
+    control_end=1.0,
 ):
+    """
+    Generates images using the loaded Stable Diffusion model.
+
+    Returns a list of PIL images, or a tensor of shape (B, 3, H, W) with values in [0, 1] if `output_type` is `"pt"`.
+    The tensor stays on the device (diffusers only), so it can be passed to `sdkit.filter.apply_filters()` directly.
+
+    `prompt`, `negative_prompt`, `seed` and `guidance_scale` can also be lists (one entry per prompt), to render
+    several prompts in a single batch (diffusers only). Each prompt produces `num_outputs` images, with seeds
+    `seed, seed + 1, ...`. The images are returned in prompt order. See `sdkit.generate.BatchScheduler` for
+    grouping independent requests into such batches automatically.
+
+    Progress and cancellation (see `sdkit.generate.progress`):
+    * on_progress: function - called with a `ProgressEvent` after each step.
+    * preview_every: decode a preview (`ProgressEvent.preview`) every N steps, and on the last step. `0` disables it.
+    * preview_type: `"rgb"` (a nearly-free linear projection of the latents), `"taesd"` (the tiny VAE, if the
+      `"taesd"` model is loaded) or `"vae"` (the full VAE, slow).
+    * cancel_token: a `CancelToken`. Cancelling it stops the generation at the next step, by raising
+      `GenerationCancelled`.
+
+    Step caching (diffusers only, see `sdkit.generate.step_cache`):
+    * step_cache: reuse the deep UNet features across adjacent steps, for a faster (but lower-quality) render. A preset
+      (`"draft"`, `"fast"` or `"balanced"`), or a dict with the `"interval"` (a full step every N steps) and the
+      `"depth"` (how many blocks to still compute on the cached steps, larger is better quality). `None` disables it.
+
+    ControlNet (see `sdkit.generate.controlnet_engine`):
+    * control_image: an image, or a list of images (one per ControlNet, if a list of ControlNets is loaded).
+    * control_alpha: the weight of each ControlNet (a number, or a list). ControlNets with a zero weight are skipped.
+    * control_start, control_end: the fraction of the steps (`0` to `1`) where each ControlNet is used (a number, or a
+      list). Outside this range, the ControlNet isn't run (diffusers only).
+    """
     req_args = locals()
 
-    try:
-        images = []
+    span_args = {"width": width, "height": height, "num_outputs": num_outputs, "steps": num_inference_steps}
+    with trace("generate_images", context.torch_device, **span_args, sampler=sampler_name):
+        try:
+            images = []
 
-        if "stable-diffusion" not in context.models:
-            raise RuntimeError(
-                "The model for Stable Diffusion has not been loaded yet! If you've tried to load it, please check the logs above this message for errors (while loading the model)."
-            )
+            if cancel_token is not None:
+                cancel_token.raise_if_cancelled()
 
-        model = context.models["stable-diffusion"]
-
-        if context.test_diffusers:
-            return make_with_diffusers(
-                context,
-                prompt,
-                negative_prompt,
-                seed,
-                width,
-                height,
-                num_outputs,
-                num_inference_steps,
-                guidance_scale,
-                init_image,
-                init_image_mask,
-                control_image,
-                control_alpha,
-                prompt_strength,
-                # preserve_init_image_color_profile,
-                sampler_name,
-                # hypernetwork_strength,
-                lora_alpha,
-                tiling,
-                strict_mask_border,
-                # sampler_params,
-                callback,
+            total_steps = num_inference_steps
+            if init_image is not None:
+                total_steps = max(1, int(num_inference_steps * prompt_strength))
+            callback = make_progress_callback(
+                context, on_progress, preview_every, preview_type, cancel_token, callback, total_steps
             )
 
-        if "hypernetwork" in context.models:
-            context.models["hypernetwork"]["hypernetwork_strength"] = hypernetwork_strength
-
-        seed_everything(seed)
-        precision_scope = torch.autocast if context.half_precision else nullcontext
-
-        with precision_scope(context.torch_device.type):
-            cond, uncond = get_cond_and_uncond(prompt, negative_prompt, num_outputs, model)
-
-        generate_fn = txt2img if init_image is None else img2img
-        common_sampler_params = {
-            "context": context,
-            "sampler_name": sampler_name,
-            "seed": seed,
-            "batch_size": num_outputs,
-            "shape": [4, height // 8, width // 8],
-            "cond": cond,
-            "uncond": uncond,
-            "guidance_scale": guidance_scale,
-            "sampler_params": sampler_params,
-            "callback": callback,
-        }
+            if "stable-diffusion" not in context.models:
+                raise RuntimeError(
+                    "The model for Stable Diffusion has not been loaded yet! If you've tried to load it, please check the logs above this message for errors (while loading the model)."
+                )
+
+            model = context.models["stable-diffusion"]
+
+            is_batch = any(isinstance(x, list) for x in (prompt, negative_prompt, seed, guidance_scale))
+            if is_batch and not context.test_diffusers:
+                raise NotImplementedError("Batches of prompts are only supported with diffusers!")
+
+            if context.test_diffusers:
+                return make_with_diffusers(
+                    context,
+                    prompt,
+                    negative_prompt,
+                    seed,
+                    width,
+                    height,
+                    num_outputs,
+                    num_inference_steps,
+                    guidance_scale,
+                    init_image,
+                    init_image_mask,
+                    control_image,
+                    control_alpha,
+                    prompt_strength,
+                    # preserve_init_image_color_profile,
+                    sampler_name,
+                    # hypernetwork_strength,
+                    lora_alpha,
+                    tiling,
+                    strict_mask_border,
+                    # sampler_params,
+                    callback,
+                    output_type,
+                    step_cache=step_cache,
+                    control_start=control_start,
+                    control_end=control_end,
+                )
+
+            if "hypernetwork" in context.models:
+                context.models["hypernetwork"]["hypernetwork_strength"] = hypernetwork_strength
+
+            seed_everything(seed)
+            precision_scope = torch.autocast if context.half_precision else nullcontext
+
+            with precision_scope(context.torch_device.type), trace("prompt_encode"):
+                cond, uncond = get_cond_and_uncond(prompt, negative_prompt, num_outputs, model)
+
+            generate_fn = txt2img if init_image is None else img2img
+            common_sampler_params = {
+                "context": context,
+                "sampler_name": sampler_name,
+                "seed": seed,
+                "batch_size": num_outputs,
+                "shape": [4, height // 8, width // 8],
+                "cond": cond,
+                "uncond": uncond,
+                "guidance_scale": guidance_scale,
+                "sampler_params": sampler_params,
+                "callback": callback,
+            }
 
-        with torch.no_grad(), precision_scope(context.torch_device.type):
-            for _ in trange(1, desc="Sampling"):
-                images += generate_fn(common_sampler_params.copy(), **req_args)
-                gc(context)
+            with torch.no_grad(), precision_scope(context.torch_device.type), trace("sampling"):
+                for _ in trange(1, desc="Sampling"):
+                    images += generate_fn(common_sampler_params.copy(), **req_args)
+                    gc(context)
 
-        return images
-    finally:
-        context.init_image_latent, context.init_image_mask_tensor = None, None
+            if output_type == "pt":
+                images = images_to_tensor(images, context.torch_device)
+
+            return images
+        finally:
+            context.init_image_latent, context.init_image_mask_tensor = None, None
 
 
 def txt2img(params: dict, context: Context, num_inference_steps, **kwargs):
@@ -180,14 +253,14 @@ def img2img(
 
 def make_with_diffusers(
     context: Context,
-    prompt: str = "",
-    negative_prompt: str = "",
-    seed: int = 42,
+    prompt: Union[str, List[str]] = "",
+    negative_prompt: Union[str, List[str]] = "",
+    seed: Union[int, List[int]] = 42,
     width: int = 512,
     height: int = 512,
     num_outputs: int = 1,
     num_inference_steps: int = 25,
-    guidance_scale: float = 7.5,
+    guidance_scale: Union[float, List[float]] = 7.5,
     init_image=None,
     init_image_mask=None,
     control_image=None,
@@ -203,6 +276,10 @@ def make_with_diffusers(
     tiling=None,
     strict_mask_border=False,
     callback=None,
+    output_type="pil",
+    step_cache=None,
+    control_start=0.0,
+    control_end=1.0,
 ):
     from diffusers import (
         StableDiffusionImg2ImgPipeline,
@@ -218,21 +295,33 @@ def make_with_diffusers(
         StableDiffusionXLControlNetInpaintPipeline,
         StableDiffusionXLControlNetImg2ImgPipeline,
     )
-    from diffusers.models.lora import LoRACompatibleConv
-
     from sdkit.models.model_loader.lora import apply_lora_model
-    from sdkit.generate.sampler import diffusers_samplers
     import numpy as np
 
-    prompt = prompt.lower()
-    negative_prompt = negative_prompt.lower()
+    if isinstance(prompt, list):
+        batch_size = len(prompt)
+        negative_prompt = negative_prompt if isinstance(negative_prompt, list) else [negative_prompt] * batch_size
+        seed = seed if isinstance(seed, list) else [seed + i for i in range(0, batch_size * num_outputs, num_outputs)]
+        guidance_scale = guidance_scale if isinstance(guidance_scale, list) else [guidance_scale] * batch_size
+        if not (len(negative_prompt) == len(seed) == len(guidance_scale) == batch_size):
+            raise ValueError(
+                "prompt, negative_prompt, seed and guidance_scale need to have the same number of entries in a batch!"
+            )
+
+        prompt = [p.lower() for p in prompt]
+        negative_prompt = [p.lower() for p in negative_prompt]
+        generator = [make_generator(context, s + i) for s in seed for i in range(num_outputs)]
+        guidance_scale = (
+            PerPromptGuidanceScale(guidance_scale) if len(set(guidance_scale)) > 1 else float(guidance_scale[0])
+        )
+    else:
+        batch_size = 1
+        prompt = prompt.lower()
+        negative_prompt = negative_prompt.lower()
+        generator = make_generator(context, seed)
 
     model = context.models["stable-diffusion"]
     default_pipe = model["default"]
-    if context.torch_device.type == "mps" and hasattr(torch.backends, "mps") and torch.backends.mps.is_available():
-        generator = torch.Generator().manual_seed(seed)
-    else:
-        generator = torch.Generator(context.torch_device).manual_seed(seed)
 
     is_sd_xl = isinstance(
         default_pipe,
@@ -274,35 +363,20 @@ def make_with_diffusers(
             f"This model does not support {operation_to_apply}! Supported operations: {model.keys()}"
         )
 
-    if control_image is None or "controlnet" not in context.models:
+    controlnets, control_image, control_alpha, control_start, control_end = get_active_controlnets(
+        context, control_image, control_alpha, control_start, control_end, context_dim
+    )
+    use_controlnet = len(controlnets) > 0
+
+    if not use_controlnet:
         operation_to_apply = model[operation_to_apply]
     else:
-        controlnet = context.models["controlnet"]
-
-        if isinstance(control_image, list):
-            assert isinstance(controlnet, list)
-            assert len(control_image) == len(controlnet)
-
-            control_alpha = control_alpha if isinstance(control_alpha, list) else [1.0] * len(control_image)
-            assert len(control_alpha) == len(control_image)
-
-            for cn in controlnet:
-                assert_controlnet_model(cn, context_dim)
-
-            cmd["controlnet_conditioning_scale"] = control_alpha
-            control_image = [get_image(img) for img in control_image]
-            control_image = [resize_img(img.convert("RGB"), width, height, clamp_to_8=True) for img in control_image]
-        else:
-            control_image = get_image(control_image)
-            control_image = resize_img(control_image.convert("RGB"), width, height, clamp_to_8=True)
-            assert_controlnet_model(controlnet, context_dim)
-
-            if control_alpha is None:
-                control_alpha = 1.0
+        from .controlnet_engine import get_control_image_key
 
-            assert not isinstance(control_alpha, list)
-            control_alpha = float(control_alpha)
-            cmd["controlnet_conditioning_scale"] = control_alpha
+        control_image = [resize_img(img.convert("RGB"), width, height, clamp_to_8=True) for img in control_image]
+        cmd["controlnet_conditioning_scale"] = control_alpha
+        cmd["control_guidance_start"] = control_start
+        cmd["control_guidance_end"] = control_end
 
         if operation_to_apply == "txt2img":
             cmd["image"] = control_image
@@ -324,15 +398,16 @@ def make_with_diffusers(
             }
             operation_to_apply_cls = controlnet_op[operation_to_apply]
 
-        operation_to_apply = operation_to_apply_cls(controlnet=controlnet, **default_pipe.components)
-
-        if hasattr(operation_to_apply, "watermark"):
-            operation_to_apply.watermark = None
+        with trace("pipeline_build"):
+            controlnet = get_controlnet_engine(default_pipe, controlnets)
+            controlnet.set_control_keys([get_control_image_key(img) for img in control_image])
+            operation_to_apply = get_controlnet_pipeline(default_pipe, operation_to_apply_cls, controlnet)
 
     if sampler_name.startswith("unipc_tu"):
         sampler_name = "unipc_tu_2" if num_inference_steps < 10 else "unipc_tu"
 
-    operation_to_apply.scheduler = diffusers_samplers.make_sampler(sampler_name, model["default_scheduler_config"])
+    with trace("scheduler_build", sampler=sampler_name):
+        operation_to_apply.scheduler = get_scheduler(default_pipe, sampler_name, model["default_scheduler_config"])
     if operation_to_apply.scheduler is None:
         raise NotImplementedError(f"The sampler '{sampler_name}' is not supported (yet)!")
     log.info(f"Using sampler: {operation_to_apply.scheduler} because of {sampler_name}")
@@ -346,6 +421,15 @@ def make_with_diffusers(
     elif isinstance(operation_to_apply, StableDiffusionInpaintPipeline):
         del cmd["strength"]
 
+    if context.noise_rng == "philox" and "latents" in inspect.signature(operation_to_apply.__call__).parameters:
+        if init_image is None:  # the pipelines use `latents` as the initial noise only for txt2img
+            seeds = seed if isinstance(seed, list) else [seed]
+            seeds = [s + i for s in seeds for i in range(num_outputs)]
+            unet = operation_to_apply.unet
+            scale = operation_to_apply.vae_scale_factor
+            shape = (unet.config.in_channels, height // scale, width // scale)
+            cmd["latents"] = make_noise(seeds, shape, context.torch_device, "philox", unet.dtype)
+
     cmd["callback"] = lambda i, t, x_samples: callback(x_samples, i, operation_to_apply) if callback else None
     cmd["callback_steps"] = 1
 
@@ -355,14 +439,107 @@ def make_with_diffusers(
         lora_count = len(context.models["lora"])
         lora_alpha = lora_alpha if isinstance(lora_alpha, list) else [lora_alpha] * lora_count
         lora_alpha = np.array(lora_alpha)
-        if hasattr(context, "_last_lora_alpha"):
-            apply_lora_model(context, -context._last_lora_alpha)  # undo the last LoRA apply
 
-        apply_lora_model(context, lora_alpha)
-        context._last_lora_alpha = lora_alpha
+        with trace("lora_apply", count=lora_count):
+            apply_lora_model(context, lora_alpha)  # only recomputes the LoRAs whose alpha changed since the last render
 
     # --------------------------------------------------------------------------------------------------
     # -- https://github.com/huggingface/diffusers/issues/2633
+    targets = [
+        operation_to_apply.vae,
+        operation_to_apply.text_encoder,
+        operation_to_apply.unet,
+    ]
+    if is_sd_xl:
+        targets.append(operation_to_apply.text_encoder_2)
+    vae_engine = get_vae_engine(context, operation_to_apply.vae)
+    targets.append(vae_engine.fp32_vae)
+    targets = [t for t in targets if t]
+
+    pipeline_cache = get_cache(default_pipe)
+    tiling_key = (tiling, tuple(id(t) for t in targets))
+    if pipeline_cache.tiling_key != tiling_key:  # the patches stay in place until the tiling mode changes
+        apply_tiling(targets, tiling)
+        pipeline_cache.tiling_key = tiling_key
+    # --------------------------------------------------------------------------------------------------
+    log.info("Parsing the prompt...")
+
+    # make the prompt embeds
+    compel = model["compel"]
+    log.info("compel is ready")
+
+    if is_sd_xl and not operation_to_apply.text_encoder:
+        if init_image is None or init_image_mask is not None:
+            raise Exception(
+                "The SD-XL Refiner model only supports img2img! Please set an initial image, or remove the inpainting mask!"
+            )
+
+        # SDXL refiner doesn't work with prompt embeds yet
+        cmd["prompt"] = prompt
+        cmd["negative_prompt"] = negative_prompt
+    else:
+        prompts = prompt if isinstance(prompt, list) else [prompt]
+        negative_prompts = negative_prompt if isinstance(negative_prompt, list) else [negative_prompt]
+
+        with trace("prompt_encode", count=len(prompts) + len(negative_prompts)):
+            embeds = get_prompt_embeddings(context, compel, prompts + negative_prompts)
+        log.info("Made prompt embeds")
+
+        conditionings = compel.pad_conditioning_tensors_to_same_length([e[0] for e in embeds])
+        cmd["prompt_embeds"] = torch.cat(conditionings[: len(prompts)])
+        cmd["negative_prompt_embeds"] = torch.cat(conditionings[len(prompts) :])
+        if is_sd_xl:
+            cmd["pooled_prompt_embeds"] = torch.cat([e[1] for e in embeds[: len(prompts)]])
+            cmd["negative_pooled_prompt_embeds"] = torch.cat([e[1] for e in embeds[len(prompts) :]])
+
+    log.info("Done parsing the prompt")
+    # --------------------------------------------------------------------------------------------------
+
+    # create TensorRT buffers, if necessary
+    if hasattr(operation_to_apply.unet, "_allocate_trt_buffers"):
+        dtype = torch.float16 if context.half_precision else torch.float32
+        unet = operation_to_apply.unet
+        uses_guidance = guidance_scale > 1 and unet.config.get("time_cond_proj_dim") is None  # as in diffusers
+        unet_batch_size = batch_size * num_outputs * (2 if uses_guidance else 1)
+        unet._allocate_trt_buffers(operation_to_apply, context.torch_device, dtype, unet_batch_size, width, height)
+
+    # apply
+    log.info(f"applying: {operation_to_apply}")
+    log.info(f"Running on diffusers: {cmd}")
+
+    enable_vae_tiling = default_pipe.vae.use_tiling
+    if tiling:
+        log.info(f"Disabling VAE tiling because seamless tiling is enabled: {tiling}")
+        default_pipe.vae.use_tiling = False  # disable VAE tiling before use, otherwise seamless tiling fails
+
+    try:
+        unet = operation_to_apply.unet
+        lora_state = getattr(context, "_last_lora_alpha", None) if context.lora_mode == "runtime" else None
+        graph_key = (tiling_key, None if lora_state is None else tuple(lora_state))
+        with trace("sampling"), trace_module(unet, "unet"), cache_unet_steps(unet, step_cache, use_controlnet):
+            with cuda_graph_unet(context, unet, graph_key):  # not used if the step cache has patched the UNet
+                images = operation_to_apply(**cmd, output_type="latent").images
+        if output_type != "latent":
+            with trace("vae_decode"):
+                images = vae_engine.decode(images, output_type, allow_tiling=not tiling)
+    finally:
+        default_pipe.vae.use_tiling = enable_vae_tiling
+
+    if init_image_mask and strict_mask_border:
+        if output_type == "pt":
+            images = tensor_to_images(images)
+            images = blend_mask(images, init_image, init_image_mask, width, height)
+            images = images_to_tensor(images, context.torch_device)
+        else:
+            images = blend_mask(images, init_image, init_image_mask, width, height)
+
+    return images
+
+
+def apply_tiling(targets: list, tiling=None):
+    "Patches the Conv2d layers of these modules for seamless tiling (`x`, `y` or `xy`), or removes the patches (`None`)"
+    from diffusers.models.lora import LoRACompatibleConv
+
     log.info("Applying tiling settings")
     if tiling == "xy":
         modex = "circular"
@@ -388,16 +565,7 @@ def make_with_diffusers(
     def lora_conv_forward(self, hidden_states, scale=1.0):
         return super(self.__class__, self).forward(hidden_states)
 
-    targets = [
-        operation_to_apply.vae,
-        operation_to_apply.text_encoder,
-        operation_to_apply.unet,
-    ]
-    if is_sd_xl:
-        targets.append(operation_to_apply.text_encoder_2)
-
     conv_layers = []
-    targets = [t for t in targets if t]
     for target in targets:
         for module in target.modules():
             if isinstance(module, torch.nn.Conv2d):
@@ -419,73 +587,90 @@ def make_with_diffusers(
 
         cl._conv_forward = cl._conv_forward_bkp if tiling is None else _conv_forward_tiling
 
-    # --------------------------------------------------------------------------------------------------
-    log.info("Parsing the prompt...")
 
-    # make the prompt embeds
-    compel = model["compel"]
-    log.info("compel is ready")
+def make_generator(context: Context, seed: int):
+    if context.noise_rng != "device":  # the same noise on every device. diffusers copies it to the device
+        return torch.Generator("cpu").manual_seed(seed)
 
-    if is_sd_xl:
-        if operation_to_apply.text_encoder:
-            cmd["prompt_embeds"], cmd["pooled_prompt_embeds"] = compel(prompt)
-            log.info("Made prompt embeds")
+    if context.torch_device.type == "mps" and hasattr(torch.backends, "mps") and torch.backends.mps.is_available():
+        return torch.Generator().manual_seed(seed)
 
-            cmd["negative_prompt_embeds"], cmd["negative_pooled_prompt_embeds"] = compel(negative_prompt)
-            log.info("Made negative prompt embeds")
+    return torch.Generator(context.torch_device).manual_seed(seed)
 
-            cmd["prompt_embeds"], cmd["negative_prompt_embeds"] = compel.pad_conditioning_tensors_to_same_length(
-                [cmd["prompt_embeds"], cmd["negative_prompt_embeds"]]
-            )
-        elif init_image is None or init_image_mask is not None:
-            raise Exception(
-                "The SD-XL Refiner model only supports img2img! Please set an initial image, or remove the inpainting mask!"
-            )
-        else:  # SDXL refiner doesn't work with prompt embeds yet
-            cmd["prompt"] = prompt
-            cmd["negative_prompt"] = negative_prompt
-    else:
-        cmd["prompt_embeds"] = compel(prompt)
-        log.info("Made prompt embeds")
 
-        cmd["negative_prompt_embeds"] = compel(negative_prompt)
-        log.info("Made negative prompt embeds")
+class PerPromptGuidanceScale(float):
+    """
+    A guidance scale with a separate value for each prompt in a batch. Diffusers only uses the guidance scale in
+    comparisons (e.g. `guidance_scale > 1`) and in `noise_pred_uncond + guidance_scale * (noise_pred_text - ...)`.
+    So this compares like the largest value in the batch, and multiplies each item of a noise tensor by the scale
+    of the prompt that it belongs to.
+    """
 
-        cmd["prompt_embeds"], cmd["negative_prompt_embeds"] = compel.pad_conditioning_tensors_to_same_length(
-            [cmd["prompt_embeds"], cmd["negative_prompt_embeds"]]
-        )
+    def __new__(cls, scales: list):
+        obj = super().__new__(cls, max(scales))
+        obj.scales = [float(s) for s in scales]
+        return obj
 
-    log.info("Done parsing the prompt")
-    # --------------------------------------------------------------------------------------------------
+    def __mul__(self, other):
+        if isinstance(other, torch.Tensor) and other.ndim > 0 and other.shape[0] % len(self.scales) == 0:
+            scales = torch.tensor(self.scales, device=other.device, dtype=other.dtype)
+            scales = scales.repeat_interleave(other.shape[0] // len(self.scales))
+            return other * scales.view(-1, *([1] * (other.ndim - 1)))
 
-    # create TensorRT buffers, if necessary
-    if hasattr(operation_to_apply.unet, "_allocate_trt_buffers"):
-        dtype = torch.float16 if context.half_precision else torch.float32
-        operation_to_apply.unet._allocate_trt_buffers(
-            operation_to_apply, context.torch_device, dtype, num_outputs, width, height
-        )
+        return float(self) * other
 
-    # apply
-    log.info(f"applying: {operation_to_apply}")
-    log.info(f"Running on diffusers: {cmd}")
+    __rmul__ = __mul__
 
-    enable_vae_tiling = default_pipe.vae.use_tiling
-    if tiling:
-        log.info(f"Disabling VAE tiling because seamless tiling is enabled: {tiling}")
-        default_pipe.vae.use_tiling = False  # disable VAE tiling before use, otherwise seamless tiling fails
+    def __repr__(self):
+        return f"PerPromptGuidanceScale({self.scales})"
 
-    try:
-        images = operation_to_apply(**cmd).images
-    finally:
-        default_pipe.vae.use_tiling = enable_vae_tiling
 
-    if is_sd_xl and context.half_precision:  # cleanup - workaround since SDXL upcasts the vae
-        operation_to_apply.vae = operation_to_apply.vae.to(dtype=torch.float16)
+def get_active_controlnets(context: Context, control_image, control_alpha, control_start, control_end, sd_context_dim):
+    """
+    Returns the lists `(controlnets, control_images, alphas, starts, ends)` for the ControlNets that affect this
+    request, i.e. without the ones with a zero `control_alpha` or an empty `control_start`..`control_end` range.
+    The lists are empty if no ControlNet is used.
+    """
+    if control_image is None or "controlnet" not in context.models:
+        return [], [], [], [], []
+
+    controlnet = context.models["controlnet"]
+    if isinstance(control_image, list):
+        assert isinstance(controlnet, list)
+        assert len(control_image) == len(controlnet)
 
-    if init_image_mask and strict_mask_border:
-        images = blend_mask(images, init_image, init_image_mask, width, height)
+        control_alpha = control_alpha if isinstance(control_alpha, list) else [1.0] * len(control_image)
+    else:
+        assert not isinstance(control_alpha, list)
+        controlnet, control_image = [controlnet], [control_image]
+        control_alpha = [1.0 if control_alpha is None else control_alpha]
+
+    assert len(control_alpha) == len(control_image)
+    control_start = _get_per_controlnet(control_start, len(controlnet), "control_start")
+    control_end = _get_per_controlnet(control_end, len(controlnet), "control_end")
+
+    for cn in controlnet:
+        assert_controlnet_model(cn, sd_context_dim)
+
+    active = [i for i in range(len(controlnet)) if float(control_alpha[i]) != 0 and control_start[i] < control_end[i]]
+    if len(active) < len(controlnet):
+        skipped = [i for i in range(len(controlnet)) if i not in active]
+        log.info(f"Skipping the ControlNets {skipped}, since they have a zero weight or an empty step range")
+
+    return (
+        [controlnet[i] for i in active],
+        [get_image(control_image[i]) for i in active],
+        [float(control_alpha[i]) for i in active],
+        [control_start[i] for i in active],
+        [control_end[i] for i in active],
+    )
 
-    return images
+
+def _get_per_controlnet(value, count: int, name: str) -> list:
+    values = value if isinstance(value, list) else [value] * count
+    if len(values) != count:
+        raise ValueError(f"{name} needs one entry per ControlNet ({count}), got: {value}")
+    return [float(v) for v in values]
 
 
 def assert_controlnet_model(controlnet, sd_context_dim):
@@ -0,0 +1,87 @@
+"""
+Makes the initial latent noise, with one seed per image. See `Context.noise_rng` for the available modes.
+
+`philox_randn()` is a counter-based RNG (Philox4x32-10, as in Random123), written with integer tensor ops. Each value
+depends only on (seed, position), so the whole batch is made at once, an image gets the same noise regardless of the
+other images in its batch, and the integer stream is identical on every backend (CPU, CUDA, MPS etc). The conversion
+to a normal distribution (Box-Muller) uses float32 `log`/`cos`/`sin`, which can differ by a rounding step between
+backends, i.e. ~1e-7 (visually identical images, but not bitwise-identical latents).
+"""
+
+import math
+
+import torch
+
+NOISE_RNG_TYPES = ("device", "cpu", "philox")
+
+_PHILOX_M0, _PHILOX_M1 = 0xD2511F53, 0xCD9E8D57
+_PHILOX_W0, _PHILOX_W1 = 0x9E3779B9, 0xBB67AE85
+_MASK32 = 0xFFFFFFFF
+
+
+def make_noise(seeds: list, shape: tuple, device, noise_rng: str = "device", dtype=torch.float32):
+    """
+    Returns a tensor of shape `(len(seeds), *shape)` with standard normal noise, one seed per item.
+
+    * noise_rng: `"device"` (the same noise as earlier versions, but it differs between devices), `"cpu"` (made on the
+      CPU and copied, so it's bitwise identical on every device) or `"philox"` (made on the device in one pass, for
+      the whole batch, and identical on every device within float rounding).
+    """
+    if noise_rng not in NOISE_RNG_TYPES:
+        raise ValueError(f"Unknown noise_rng: {noise_rng}. Supported values: {NOISE_RNG_TYPES}")
+
+    device = torch.device(device)
+
+    if noise_rng == "philox":
+        return philox_randn(seeds, shape, device).to(dtype)
+
+    if noise_rng == "cpu":
+        noise = [torch.randn(shape, generator=torch.Generator("cpu").manual_seed(s)) for s in seeds]
+        return torch.stack(noise).to(device, dtype)
+
+    noise = []
+    for seed in seeds:
+        torch.manual_seed(seed)
+        noise.append(torch.randn((1, *shape), device=device))
+    return torch.cat(noise).to(dtype)
+
+
+def philox_randn(seeds: list, shape: tuple, device):
+    "Standard normal noise of shape `(len(seeds), *shape)` in float32, from the Philox counter RNG (one key per seed)"
+    numel = math.prod(shape)
+    num_blocks = (numel + 3) // 4  # each block of the counter gives 4 values
+
+    key0 = torch.tensor([s & _MASK32 for s in seeds], dtype=torch.int64, device=device).view(-1, 1)
+    key1 = torch.tensor([(s >> 32) & _MASK32 for s in seeds], dtype=torch.int64, device=device).view(-1, 1)
+
+    counter = torch.arange(num_blocks, dtype=torch.int64, device=device).view(1, -1)
+    zeros = torch.zeros_like(counter)
+    c0, c1, c2, c3 = philox4x32(counter & _MASK32, counter >> 32, zeros, zeros, key0, key1)
+
+    # Box-Muller: two uniforms in (0, 1) -> two normals. 24 bits, so the uniforms are exact in float32
+    u = [((c >> 8).float() + 0.5) * (1.0 / (1 << 24)) for c in (c0, c1, c2, c3)]
+    r0, r1 = torch.sqrt(-2 * torch.log(u[0])), torch.sqrt(-2 * torch.log(u[2]))
+    theta0, theta1 = (2 * math.pi) * u[1], (2 * math.pi) * u[3]
+    values = [r0 * torch.cos(theta0), r0 * torch.sin(theta0), r1 * torch.cos(theta1), r1 * torch.sin(theta1)]
+    values = torch.stack(values)
+
+    values = values.permute(1, 2, 0).reshape(len(seeds), -1)[:, :numel]
+    return values.reshape(len(seeds), *shape)
+
+
+def philox4x32(c0, c1, c2, c3, key0, key1, rounds=10):
+    "Philox4x32 on int64 tensors holding uint32 values. The counters and keys are broadcast together"
+    for _ in range(rounds):
+        hi0, lo0 = _mulhilo32(_PHILOX_M0, c0)
+        hi1, lo1 = _mulhilo32(_PHILOX_M1, c2)
+        c0, c1, c2, c3 = hi1 ^ c1 ^ key0, lo1, hi0 ^ c3 ^ key1, lo0
+        key0, key1 = (key0 + _PHILOX_W0) & _MASK32, (key1 + _PHILOX_W1) & _MASK32
+
+    return c0, c1, c2, c3
+
+
+def _mulhilo32(a: int, x):
+    "The high and low 32 bits of `a * x`, in 16-bit halves so that the products fit in int64"
+    t = a * (x & 0xFFFF)
+    u = a * (x >> 16) + (t >> 16)
+    return u >> 16, ((u & 0xFFFF) << 16) | (t & 0xFFFF)
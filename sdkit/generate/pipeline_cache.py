@@ -0,0 +1,86 @@
+"""
+Caches the per-request setup of `make_with_diffusers()`: the ControlNet pipelines (and engines), the schedulers and the
+seamless tiling patches. Everything is cached per Stable Diffusion model (keyed weakly by its default pipeline), so
+the cache goes away with the model.
+"""
+
+import weakref
+
+from sdkit import Context
+from sdkit.utils import log
+
+_caches = weakref.WeakKeyDictionary()
+
+
+class _PipelineCache:
+    def __init__(self):
+        self.pipelines = {}  # (pipeline class, controlnet ids) -> (controlnets, pipeline)
+        self.controlnet_engines = {}  # controlnet ids -> ControlNetEngine
+        self.schedulers = {}  # sampler name -> scheduler
+        self.tiling_key = None  # (tiling, target module ids) of the last applied tiling patches
+
+
+def get_cache(default_pipe) -> _PipelineCache:
+    cache = _caches.get(default_pipe)
+    if cache is None:
+        cache = _PipelineCache()
+        _caches[default_pipe] = cache
+    return cache
+
+
+def get_controlnet_pipeline(default_pipe, pipeline_cls, controlnet):
+    "Returns the ControlNet pipeline of this class for these ControlNet model(s), sharing the default pipe's components"
+    cache = get_cache(default_pipe)
+    controlnets = tuple(controlnet) if isinstance(controlnet, list) else (controlnet,)
+    key = (pipeline_cls, tuple(id(cn) for cn in controlnets))
+
+    entry = cache.pipelines.get(key)
+    if entry is not None:
+        return entry[1]
+
+    pipe = pipeline_cls(controlnet=controlnet, **default_pipe.components)
+    if hasattr(pipe, "watermark"):
+        pipe.watermark = None
+
+    cache.pipelines[key] = (controlnets, pipe)  # keeps the controlnets alive, so their ids stay unique
+    return pipe
+
+
+def get_controlnet_engine(default_pipe, controlnets: list):
+    "Returns the `ControlNetEngine` for these ControlNet models (in this order), for `get_controlnet_pipeline()`"
+    from .controlnet_engine import ControlNetEngine
+
+    cache = get_cache(default_pipe)
+    key = tuple(id(cn) for cn in controlnets)
+    if key not in cache.controlnet_engines:
+        cache.controlnet_engines[key] = ControlNetEngine(controlnets)  # keeps the controlnets alive too
+
+    return cache.controlnet_engines[key]
+
+
+def clear_controlnet_pipelines(context: Context):
+    "Drops the cached ControlNet pipelines, so that an unloaded ControlNet model can be freed"
+    model = context.models.get("stable-diffusion")
+    if not isinstance(model, dict) or "default" not in model:
+        return
+
+    cache = _caches.get(model["default"])
+    if cache is not None and cache.pipelines:
+        log.info(f"Clearing {len(cache.pipelines)} cached ControlNet pipelines")
+        cache.pipelines.clear()
+    if cache is not None:
+        cache.controlnet_engines.clear()
+
+
+def get_scheduler(default_pipe, sampler_name: str, scheduler_config):
+    """
+    Returns the scheduler for this sampler, creating it on first use. Reusing the instance is safe, since the
+    pipelines reset the scheduler state in `set_timesteps()` at the start of every call.
+    """
+    from sdkit.generate.sampler import diffusers_samplers
+
+    cache = get_cache(default_pipe)
+    if sampler_name not in cache.schedulers:
+        cache.schedulers[sampler_name] = diffusers_samplers.make_sampler(sampler_name, scheduler_config)
+
+    return cache.schedulers[sampler_name]
@@ -0,0 +1,160 @@
+"""
+Progress events (with optional cheap previews) and cooperative cancellation for `generate_images()`.
+
+Previews are decoded without the full VAE, either with a tiny VAE (TAESD, if the `"taesd"` model is loaded), or with
+a linear projection from the latents to RGB (`sdkit.utils.latents_to_rgb_preview()`), which is nearly free.
+"""
+
+import threading
+import time
+from dataclasses import dataclass, field
+from typing import Any, Optional
+
+from sdkit import Context
+
+PREVIEW_TYPES = (None, "rgb", "taesd", "vae")
+
+
+class GenerationCancelled(Exception):
+    "Raised by `generate_images()` (at the next step) after its `CancelToken` was cancelled"
+
+
+class CancelToken:
+    """
+    Cancels a running (or queued) `generate_images()` request at the next step. Can be cancelled from any thread.
+
+    Example:
+        token = CancelToken()
+        threading.Thread(target=generate_images, kwargs={"context": context, "cancel_token": token, ...}).start()
+        token.cancel()  # e.g. when the client disconnects
+    """
+
+    def __init__(self):
+        self._event = threading.Event()
+
+    def cancel(self):
+        self._event.set()
+
+    @property
+    def is_cancelled(self) -> bool:
+        return self._event.is_set()
+
+    def raise_if_cancelled(self, step=None):
+        if self.is_cancelled:
+            at = "" if step is None else f" at step {step}"
+            raise GenerationCancelled(f"The image generation was cancelled{at}")
+
+    @staticmethod
+    def all_of(tokens: list) -> "CancelToken":
+        "A token that's cancelled once all the given tokens are cancelled (e.g. for a batch of requests)"
+        if not tokens or any(t is None for t in tokens):
+            return None  # a request that can't be cancelled keeps the batch running
+        return _AllOfCancelToken(tokens)
+
+
+class _AllOfCancelToken(CancelToken):
+    def __init__(self, tokens: list):
+        self.tokens = tokens
+
+    def cancel(self):
+        for token in self.tokens:
+            token.cancel()
+
+    @property
+    def is_cancelled(self) -> bool:
+        return all(t.is_cancelled for t in self.tokens)
+
+
+@dataclass
+class ProgressEvent:
+    """
+    Sent to the `on_progress` function of `generate_images()` after each step.
+
+    * step: the number of steps completed so far (starting at 1).
+    * total_steps: the number of steps that will run (approx. `num_inference_steps * prompt_strength` with img2img).
+    * elapsed: the seconds since the first step started.
+    * preview: a list of PIL images (one per output), if a preview was decoded for this step. Otherwise `None`.
+    * latents: the raw latents of this step, for integrators that want to decode them differently.
+    """
+
+    step: int
+    total_steps: int
+    elapsed: float
+    preview: Optional[list] = None
+    latents: Any = field(default=None, repr=False)
+
+
+def make_progress_callback(
+    context: Context,
+    on_progress=None,
+    preview_every: int = 0,
+    preview_type: str = "rgb",
+    cancel_token: CancelToken = None,
+    callback=None,
+    total_steps: int = None,
+):
+    """
+    Returns a step callback (for the samplers) which checks `cancel_token`, calls `callback` (the legacy raw-latent
+    callback, if given), and sends a `ProgressEvent` to `on_progress`, with a preview every `preview_every` steps.
+    Returns `callback` unchanged if there's nothing else to do.
+    """
+    if preview_type not in PREVIEW_TYPES:
+        raise ValueError(f"Unknown preview_type: {preview_type}. Supported values: {PREVIEW_TYPES}")
+
+    if on_progress is None and cancel_token is None:
+        return callback
+
+    start_time = None
+
+    def wrapper(x_samples, i, *args):
+        nonlocal start_time
+
+        if start_time is None:
+            start_time = time.perf_counter()
+
+        if cancel_token is not None:
+            cancel_token.raise_if_cancelled(i)
+
+        if callback:
+            callback(x_samples, i, *args)
+
+        if on_progress is None:
+            return
+
+        step = i + 1
+        is_last = total_steps is not None and step >= total_steps
+        preview = None
+        if preview_type and preview_every > 0 and (step % preview_every == 0 or is_last):
+            preview = decode_preview(context, x_samples, preview_type, pipe=args[0] if args else None)
+
+        elapsed = time.perf_counter() - start_time
+        on_progress(ProgressEvent(step, total_steps or step, elapsed, preview, x_samples))
+
+    return wrapper
+
+
+def decode_preview(context: Context, latents, preview_type: str = "rgb", pipe=None) -> list:
+    """
+    Decodes the latents of an intermediate step into a list of PIL images.
+
+    * preview_type: `"rgb"` (linear projection, 1/8th of the image size, nearly free), `"taesd"` (the tiny VAE, full
+      size, needs the `"taesd"` model to be loaded, falls back to `"rgb"`) or `"vae"` (the full VAE, slow).
+    """
+    import torch
+
+    from sdkit.utils import diffusers_latent_samples_to_images, latents_to_rgb_preview, tensor_to_images
+
+    model = context.models.get("stable-diffusion", {})
+    model_type = model.get("type", "SD1") if isinstance(model, dict) else "SD1"
+
+    with torch.no_grad():
+        if preview_type == "taesd" and "taesd" in context.models:
+            taesd = context.models["taesd"]
+            latents = latents.to(taesd.device, taesd.dtype)
+            images = taesd.decode(latents / taesd.config.scaling_factor, return_dict=False)[0]
+            return tensor_to_images(((images.float() + 1) / 2).clamp(0, 1))
+
+        if preview_type == "vae" and pipe is not None:
+            return diffusers_latent_samples_to_images(context, (latents, pipe))
+
+        return tensor_to_images(latents_to_rgb_preview(latents, model_type))
@@ -0,0 +1,158 @@
+from collections import OrderedDict
+from threading import Lock
+
+from sdkit import Context
+from sdkit.utils import log
+
+MB = 1024 * 1024
+
+
+class PromptEmbeddingsCache:
+    """
+    An LRU cache of the prompt embeddings produced by compel (the conditioning tensor, and the pooled tensor for SDXL).
+
+    Recently-used entries are kept on the device, up to `device_budget` bytes. Older entries are moved to the CPU,
+    up to `cpu_budget` bytes, and are moved back to the device when they're used again. Entries beyond that are
+    discarded.
+    """
+
+    def __init__(self, device_budget: int, cpu_budget: int):
+        self.device_budget = device_budget
+        self.cpu_budget = cpu_budget
+
+        self._entries = OrderedDict()  # key -> [tensors, is_on_device, size]
+        self._used = {True: 0, False: 0}
+        self._lock = Lock()
+
+    def get(self, key, device):
+        with self._lock:
+            entry = self._entries.get(key)
+            if entry is None:
+                return None
+
+            self._entries.move_to_end(key)
+            tensors, on_device, size = entry
+            if not on_device:
+                entry[0] = tuple(t.to(device, non_blocking=True) for t in tensors)
+                entry[1] = True
+                self._used[False] -= size
+                self._used[True] += size
+                self._evict()
+
+            return entry[0]
+
+    def put(self, key, tensors: tuple):
+        size = sum(t.numel() * t.element_size() for t in tensors)
+        if size > self.device_budget and size > self.cpu_budget:
+            return
+
+        with self._lock:
+            if key in self._entries:
+                _, on_device, old_size = self._entries.pop(key)
+                self._used[on_device] -= old_size
+
+            self._entries[key] = [tensors, True, size]
+            self._used[True] += size
+            self._evict()
+
+    def clear(self):
+        with self._lock:
+            self._entries.clear()
+            self._used = {True: 0, False: 0}
+
+    def __len__(self):
+        return len(self._entries)
+
+    def _evict(self):
+        # move the least-recently used entries to the cpu, and then discard the ones that don't fit there either
+        for key, entry in list(self._entries.items()):
+            if self._used[True] <= self.device_budget:
+                break
+            if not entry[1]:
+                continue
+
+            self._used[True] -= entry[2]
+            if entry[2] > self.cpu_budget:
+                del self._entries[key]
+                continue
+
+            entry[0] = tuple(t.to("cpu") for t in entry[0])
+            entry[1] = False
+            self._used[False] += entry[2]
+
+        for key, entry in list(self._entries.items()):
+            if self._used[False] <= self.cpu_budget:
+                break
+            if entry[1]:
+                continue
+
+            del self._entries[key]
+            self._used[False] -= entry[2]
+
+
+def get_prompt_cache(context: Context):
+    "Returns the prompt embeddings cache for this context, or None if it is disabled"
+    device_budget, cpu_budget = context.prompt_cache_size
+    if device_budget <= 0 and cpu_budget <= 0:
+        return None
+
+    cache = getattr(context, "_prompt_cache", None)
+    if cache is None:
+        cache = PromptEmbeddingsCache(device_budget * MB, cpu_budget * MB)
+        context._prompt_cache = cache
+    else:
+        cache.device_budget, cache.cpu_budget = device_budget * MB, cpu_budget * MB
+
+    return cache
+
+
+def clear_prompt_cache(context: Context):
+    "Called when the text encoders change, e.g. when a Stable Diffusion, LoRA or embeddings model is (un)loaded"
+    cache = getattr(context, "_prompt_cache", None)
+    if cache is not None and len(cache) > 0:
+        log.info("Clearing the prompt embeddings cache")
+        cache.clear()
+
+
+def get_prompt_embeddings(context: Context, compel, prompts: list) -> list:
+    """
+    Returns the compel embeddings for each prompt, as a list of tuples: `(embeds,)` or `(embeds, pooled_embeds)`
+    for SDXL. The embeddings aren't padded to the same length.
+    """
+    cache = get_prompt_cache(context)
+    key_prefix = get_cache_key_prefix(context) if cache else None
+
+    results = []
+    for prompt in prompts:
+        key = key_prefix + (prompt,) if cache else None
+        embeds = cache.get(key, context.torch_device) if cache else None
+        if embeds is None:
+            embeds = compel(prompt)
+            embeds = tuple(embeds) if isinstance(embeds, (tuple, list)) else (embeds,)
+            if cache:
+                cache.put(key, embeds)
+
+        results.append(embeds)
+
+    return results
+
+
+def get_cache_key_prefix(context: Context) -> tuple:
+    "The state of the text encoders: the model, clip skip, the loaded embeddings and the LoRAs applied on them"
+    model = context.models["stable-diffusion"]
+    pipe = model["default"]
+
+    embeddings = context.model_paths.get("embeddings") if "embeddings" in context.models else None
+    embeddings = tuple(embeddings) if isinstance(embeddings, list) else (embeddings,)
+
+    lora_state = ()
+    if context.models.get("lora") and hasattr(context, "_last_lora_alpha"):
+        lora_paths = context.model_paths.get("lora")
+        lora_paths = lora_paths if isinstance(lora_paths, list) else [lora_paths]
+        for path, lora, alpha in zip(lora_paths, context.models["lora"], context._last_lora_alpha):
+            if abs(alpha) >= 0.0001 and any(name.startswith("text_encoder") for name in lora):
+                lora_state += ((path, float(alpha)),)
+
+    tokenizer_len = len(pipe.tokenizer) if getattr(pipe, "tokenizer", None) is not None else 0
+
+    return (model.get("hash"), model["params"].get("clip_skip"), tokenizer_len, embeddings, lora_state)
@@ -1,4 +1,3 @@
-import torch
 from torch import Tensor
 
 from sdkit import Context
@@ -50,24 +49,17 @@ def make_samples(
     if sampler_module is None:
         raise RuntimeError(f'Unknown sampler "{sampler_name}"!')
 
-    noise = make_some_noise(seed, batch_size, shape, context.torch_device)
+    noise = make_some_noise(seed, batch_size, shape, context.torch_device, getattr(context, "noise_rng", "device"))
 
     return sampler_module.sample(
         context, sampler_name, noise, batch_size, shape, steps, cond, uncond, guidance_scale, callback, **kwargs
     )
 
 
-def make_some_noise(seed, batch_size, shape, device):
-    b1, b2, b3 = shape
-    img_shape = (1, b1, b2, b3)
-    tens = []
-    log.info(f"seeds used = {[seed+s for s in range(batch_size)]}")
+def make_some_noise(seed, batch_size, shape, device, noise_rng="device"):
+    from sdkit.generate.noise import make_noise
 
-    for _ in range(batch_size):
-        torch.manual_seed(seed)
-        tens.append(torch.randn(img_shape, device=device))
-        seed += 1
-    noise = torch.cat(tens)
-    del tens
+    seeds = [seed + s for s in range(batch_size)]
+    log.info(f"seeds used = {seeds}")
 
-    return noise
+    return make_noise(seeds, tuple(shape), device, noise_rng)
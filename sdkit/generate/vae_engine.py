@@ -0,0 +1,236 @@
+"""
+Decodes latents with the VAE, without converting the VAE on every call.
+
+For VAEs that overflow in fp16 (`force_upcast` in their config, e.g. SDXL's), diffusers converts the entire VAE to
+fp32 before decoding, and back to fp16 after. `VaeEngine` instead keeps a separate fp32 copy of the VAE, made once per
+model (see `Context.vae_precision`).
+
+The latents are decoded in micro-batches, sized as per the free VRAM (or in tiles, if a single image doesn't fit).
+Each micro-batch is converted to uint8 on the GPU, and copied to (pinned) RAM on a separate CUDA stream while the next
+micro-batch is decoded. The finished images are passed to `on_image` (e.g. to encode them as PNG or JPEG) on a worker
+thread, which overlaps with the decoding too.
+"""
+
+import weakref
+from concurrent.futures import ThreadPoolExecutor
+
+from sdkit import Context
+from sdkit.utils import log
+
+VAE_PRECISIONS = ("auto", "fp32", "fp16")
+
+DECODE_BYTES_PER_PIXEL = 128 * 6  # a rough peak of the decoder's activations, per output pixel (times element size)
+TILE_SIZES = (1024, 768, 512, 256)
+
+_engines = weakref.WeakKeyDictionary()  # vae -> VaeEngine
+
+
+def get_vae_engine(context: Context, vae) -> "VaeEngine":
+    engine = _engines.get(vae)
+    if engine is None or engine.precision != context.vae_precision:
+        engine = VaeEngine(context, vae)
+        _engines[vae] = engine
+    return engine
+
+
+def refresh_vae_engine(vae):
+    "Call this after changing the weights of the VAE (e.g. for a custom VAE), to update its fp32 copy"
+    engine = _engines.get(vae)
+    if engine is not None:
+        engine.refresh()
+
+
+def release_vae_engine(vae):
+    "Frees the fp32 copy of this VAE (if any). It's made again when the VAE is used next"
+    _engines.pop(vae, None)
+
+
+class VaeEngine:
+    def __init__(self, context: Context, vae):
+        if context.vae_precision not in VAE_PRECISIONS:
+            raise ValueError(f"Unknown vae_precision: {context.vae_precision}. Supported values: {VAE_PRECISIONS}")
+
+        self.context = context
+        self.precision = context.vae_precision
+        self._vae = weakref.ref(vae)  # the engine is cached per VAE, so it shouldn't keep the VAE alive
+        self.fp32_vae = self._make_fp32_copy(vae)
+        self._compile(self.decode_vae)
+
+        self._copy_stream = None
+        self._executor = None
+
+    @property
+    def vae(self):
+        return self._vae()
+
+    @property
+    def decode_vae(self):
+        "The module used for decoding: the fp32 copy, or the VAE itself"
+        return self.fp32_vae if self.fp32_vae is not None else self.vae
+
+    def refresh(self):
+        if self.fp32_vae is not None:
+            self.fp32_vae.load_state_dict(self.vae.state_dict())
+
+    def decode(self, latents, output_type="pil", on_image=None, allow_tiling=True):
+        """
+        Decodes the (scaled) latents returned by the diffusers pipelines with `output_type="latent"`.
+
+        Returns a list of PIL images, or a tensor of shape (B, 3, H, W) with values in [0, 1] if `output_type` is
+        `"pt"`. `on_image(index, image)` is called for each PIL image on a worker thread, as soon as it's ready. All
+        the calls are complete when this returns.
+        """
+        import torch
+
+        vae = self.vae
+        dec = self.decode_vae
+        needs_upcast = dec is vae and vae.dtype == torch.float16 and self._needs_fp32(vae)  # e.g. cpu offloaded
+
+        with torch.no_grad():
+            if needs_upcast:
+                vae.to(dtype=torch.float32)
+            try:
+                if dec is not vae:
+                    dec.use_tiling, dec.use_slicing = vae.use_tiling, vae.use_slicing
+                latents = self._unscale(latents).to(_get_device(dec), dec.dtype)
+                return self._decode(dec, latents, output_type, on_image, allow_tiling)
+            finally:
+                if needs_upcast:
+                    vae.to(dtype=torch.float16)
+
+    def _decode(self, dec, latents, output_type, on_image, allow_tiling):
+        import torch
+
+        micro_batch, tile_size = self._plan(dec, latents, allow_tiling)
+        device = _get_device(dec)
+        is_cuda = device.type == "cuda" and output_type != "pt"
+        if is_cuda and self._copy_stream is None:
+            self._copy_stream = torch.cuda.Stream(device)
+        if on_image is not None and self._executor is None:
+            self._executor = ThreadPoolExecutor(max_workers=1, thread_name_prefix="sdkit-vae-output")
+
+        old_tiling = (dec.use_tiling, dec.tile_sample_min_size, dec.tile_latent_min_size)
+        if tile_size:
+            log.info(f"Decoding in tiles of {tile_size}x{tile_size}, to fit in VRAM")
+            dec.use_tiling, dec.tile_sample_min_size, dec.tile_latent_min_size = True, tile_size, tile_size // 8
+
+        images, tensors, futures = [], [], []
+        pending = None  # a micro-batch that is being copied to the CPU
+        try:
+            for start in range(0, latents.shape[0], micro_batch):
+                x = dec.decode(latents[start : start + micro_batch], return_dict=False)[0]
+                x = (x / 2 + 0.5).clamp(0, 1)
+                if output_type == "pt":
+                    tensors.append(x)
+                    continue
+
+                x = (x * 255).round().to(torch.uint8).permute(0, 2, 3, 1)  # on the GPU, so 1/4th of the bytes to copy
+                if not is_cuda:
+                    images += self._to_images(x.cpu(), start, on_image, futures)
+                    continue
+
+                stream = self._copy_stream
+                stream.wait_stream(torch.cuda.current_stream(device))
+                with torch.cuda.stream(stream):
+                    cpu = torch.empty(x.shape, dtype=torch.uint8, pin_memory=True)
+                    cpu.copy_(x, non_blocking=True)
+                    event = torch.cuda.Event()
+                    event.record(stream)
+                x.record_stream(stream)
+
+                if pending is not None:  # while this micro-batch is copied, make the images of the previous one
+                    images += self._finish_copy(*pending, on_image, futures)
+                pending = (event, cpu, start)
+
+            if pending is not None:
+                images += self._finish_copy(*pending, on_image, futures)
+        finally:
+            dec.use_tiling, dec.tile_sample_min_size, dec.tile_latent_min_size = old_tiling
+
+        for f in futures:
+            f.result()
+
+        return torch.cat(tensors) if output_type == "pt" else images
+
+    def _finish_copy(self, event, cpu, start, on_image, futures):
+        event.synchronize()
+        return self._to_images(cpu, start, on_image, futures)
+
+    def _to_images(self, batch, start, on_image, futures):
+        from PIL import Image
+
+        images = [Image.fromarray(a) for a in batch.numpy()]
+        if on_image is not None:
+            futures += [self._executor.submit(on_image, start + i, img) for i, img in enumerate(images)]
+        return images
+
+    def _plan(self, dec, latents, allow_tiling):
+        "Returns (micro-batch size, tile size or None), as per the free VRAM"
+        from sdkit.utils import get_available_memory
+
+        batch_size = latents.shape[0]
+        device = _get_device(dec)
+        if device.type != "cuda":
+            return batch_size, None
+
+        mem_free = get_available_memory(device) * 0.8
+        pixel_bytes = DECODE_BYTES_PER_PIXEL * latents.element_size()
+        image_bytes = latents.shape[2] * latents.shape[3] * 64 * pixel_bytes
+        if image_bytes <= mem_free:
+            return max(1, min(batch_size, int(mem_free // image_bytes))), None
+
+        if not allow_tiling or dec.use_tiling:
+            return 1, None
+
+        tile_size = next((t for t in TILE_SIZES if t * t * pixel_bytes <= mem_free), TILE_SIZES[-1])
+        return 1, tile_size
+
+    def _unscale(self, latents):
+        import torch
+
+        config = self.vae.config
+        mean, std = getattr(config, "latents_mean", None), getattr(config, "latents_std", None)
+        if mean is None or std is None:
+            return latents / config.scaling_factor
+
+        mean = torch.tensor(mean, device=latents.device, dtype=latents.dtype).view(1, -1, 1, 1)
+        std = torch.tensor(std, device=latents.device, dtype=latents.dtype).view(1, -1, 1, 1)
+        return latents * std / config.scaling_factor + mean
+
+    def _needs_fp32(self, vae) -> bool:
+        if self.precision == "auto":
+            return bool(getattr(vae.config, "force_upcast", False))
+        return self.precision == "fp32"
+
+    def _compile(self, dec):
+        "Compiles the decoder, if the VAE was loaded with a `compile_config` (see `stable_diffusion.compile`)"
+        from sdkit.models.model_loader.stable_diffusion.compile import compile_module
+
+        options = getattr(self.vae, "_compile_options", None)
+        if options is not None:
+            compile_module(dec.decoder, options)
+
+    def _make_fp32_copy(self, vae):
+        import torch
+        from sdkit.models.model_loader.stable_diffusion.attention import set_attention_backend
+
+        if vae.dtype == torch.float32 or not self._needs_fp32(vae):
+            return None
+        if hasattr(vae, "_hf_hook") or hasattr(vae.decoder, "_trt_forward"):  # cpu offloaded, or TensorRT (in fp32)
+            return None
+
+        log.info("Making an fp32 copy of the VAE, for decoding")
+        copy = type(vae).from_config(vae.config)
+        copy.load_state_dict(vae.state_dict())
+        copy = copy.to(vae.device, torch.float32).eval().requires_grad_(False)
+        set_attention_backend(self.context, copy)
+        return copy
+
+
+def _get_device(vae):
+    "The device that the VAE runs on. Cpu offloaded VAEs keep their weights on the meta device, and run on another"
+    import torch
+
+    hook = getattr(vae, "_hf_hook", None)
+    device = getattr(hook, "execution_device", None)
+    return vae.device if device is None else torch.device(device)
@@ -0,0 +1,66 @@
+"""
+Warms up the loaded Stable Diffusion model, so that the first real request runs at the steady-state latency.
+
+The first render of each image size and batch size pays for things that happen only once: `torch.compile` (if the
+model was loaded with a `compile_config`), cuDNN autotuning, loading the CUDA kernels, growing torch's memory pool,
+the attention-backend calibration and CUDA-graph capture. `warmup()` renders a short request for each shape, e.g.
+when a worker starts, before it receives any traffic.
+"""
+
+import time
+
+from sdkit import Context
+from sdkit.utils import log
+
+WARMUP_STEPS = 2
+
+
+def warmup(context: Context, shapes: list = None, num_inference_steps=WARMUP_STEPS, runs=1, **kwargs) -> dict:
+    """
+    Renders a request (with a fixed prompt and seed) for each shape. Returns `{shape: seconds}`, the time of the last
+    run of each shape.
+
+    * shapes: a list of `(width, height)` or `(width, height, batch_size)`. Defaults to the `"shapes"` in the model's
+        `compile_config`, or else the native size of the model (e.g. 512x512 for SD 1.x, 1024x1024 for SDXL).
+    * runs: the renders per shape. The first one compiles, the next ones (if any) confirm the steady-state timing.
+    * kwargs: passed to `generate_images()`, e.g. `sampler_name`, or `control_image` to warm up a ControlNet.
+    """
+    from sdkit.generate import generate_images
+
+    if "stable-diffusion" not in context.models:
+        raise RuntimeError("The Stable Diffusion model needs to be loaded before warming it up!")
+
+    shapes = shapes or get_default_warmup_shapes(context)
+    timings = {}
+    for shape in shapes:
+        width, height, batch_size = (tuple(shape) + (1,))[:3]
+        for _ in range(runs):
+            start = time.perf_counter()
+            generate_images(
+                context,
+                prompt="warmup",
+                seed=42,
+                width=width,
+                height=height,
+                num_outputs=batch_size,
+                num_inference_steps=num_inference_steps,
+                **kwargs,
+            )
+            timings[(width, height, batch_size)] = time.perf_counter() - start
+
+        log.info(f"Warmed up {width}x{height} (batch {batch_size}) in {timings[(width, height, batch_size)]:.2f}s")
+
+    return timings
+
+
+def get_default_warmup_shapes(context: Context) -> list:
+    model = context.models["stable-diffusion"]
+    compile_config = model.get("params", {}).get("compile_config")
+    if isinstance(compile_config, dict) and compile_config.get("shapes"):
+        return compile_config["shapes"]
+
+    pipe = model.get("default")
+    if pipe is None or not hasattr(pipe, "unet"):  # not diffusers
+        return [(512, 512)]
+    size = pipe.unet.config.sample_size * pipe.vae_scale_factor
+    return [(size, size)]
@@ -4,5 +4,7 @@ from .model_downloader import (
     resolve_downloaded_model_path,
 )
 from .model_loader import load_model, unload_model
+from .model_loader.controlnet import unload_parked_controlnets
+from .model_loader.residency import prefetch_model, unload_parked_models
 from .models_db import get_model_info_from_db, get_models_db
-from .scan_models import scan_model
+from .scan_models import scan_model, scan_models
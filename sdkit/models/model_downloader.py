@@ -1,15 +1,21 @@
 import os
 from urllib.parse import urlparse
 
-from sdkit.utils import download_file, log
+from sdkit.utils import DownloadEngine, log
+from sdkit.utils.http_utils import DOWNLOAD_CONNECTIONS
 
 
 def download_models(
-    models: dict, download_base_dir: str = None, subdir_for_model_type=True, download_config_if_available=True
+    models: dict,
+    download_base_dir: str = None,
+    subdir_for_model_type=True,
+    download_config_if_available=True,
+    max_connections=DOWNLOAD_CONNECTIONS,
 ):
     """
     Downloads the requested models (and config files) based on the SDKit models database.
-    Resumes incomplete downloads, and shows a progress bar.
+    Resumes incomplete downloads, and shows a progress bar. The models are downloaded concurrently, in parallel byte
+    ranges, and verified against the `quick_hash` in the models database.
 
     Args:
     * models: dict of {string: string or list}. Models to download of `model_type: model_ids`.
@@ -21,12 +27,24 @@ def download_models(
     * subdir_for_model_type: bool - default True. Saves the downloaded model in a subdirectory (named with the model_type).
               For e.g. if `download_base_dir` is `D:\\models`, then a `stable-diffusion` type model is downloaded to
               `D:\\models\\stable-diffusion`, a `hypernetwork` type model is downloaded to `D:\\models\\hypernetwork` and so on.
+    * max_connections: int - the number of connections shared by all the downloads.
     """
-    for model_type, model_ids in models.items():
-        model_ids = model_ids if isinstance(model_ids, list) else [model_ids]
+    with DownloadEngine(max_connections=max_connections) as engine:
+        downloads = []
+        for model_type, model_ids in models.items():
+            model_ids = model_ids if isinstance(model_ids, list) else [model_ids]
+
+            for model_id in model_ids:
+                args = (model_type, model_id, download_base_dir, subdir_for_model_type, download_config_if_available)
+                downloads.append((model_type, model_id, _submit_model_download(engine, *args)))
 
-        for model_id in model_ids:
-            download_model(model_type, model_id, download_base_dir, subdir_for_model_type, download_config_if_available)
+        for model_type, model_id, futures in downloads:
+            for f in futures:
+                try:
+                    f.result()
+                except Exception as e:
+                    log.error(f"Could not download {model_type} {model_id}")
+                    log.exception(e)
 
 
 def download_model(
@@ -50,6 +68,15 @@ def download_model(
               For e.g. if `download_base_dir` is `D:\\models`, then a `stable-diffusion` type model is downloaded to
               `D:\\models\\stable-diffusion`, a `hypernetwork` type model is downloaded to `D:\\models\\hypernetwork` and so on.
     """
+    download_models({model_type: model_id}, download_base_dir, subdir_for_model_type, download_config_if_available)
+
+
+def _submit_model_download(
+    engine: DownloadEngine, model_type, model_id, download_base_dir, subdir_for_model_type, download_config_if_available
+) -> list:
+    "Returns the futures of the model (and config file) downloads"
+    from sdkit.models import get_model_info_from_db
+
     download_base_dir = get_actual_base_dir(model_type, download_base_dir, subdir_for_model_type)
     try:
         model_url, model_file_name = get_url_and_filename(model_type, model_id, url_key="url")
@@ -57,17 +84,21 @@ def download_model(
 
         if model_url is None:
             log.warn(f"No download url found for model {model_type} {model_id}")
-            return
+            return []
+
+        quick_hash = get_model_info_from_db(model_type=model_type, model_id=model_id).get("quick_hash")
 
         os.makedirs(download_base_dir, exist_ok=True)
-        out_path = os.path.join(download_base_dir, model_file_name)
-        download_file(model_url, out_path)
+        futures = [engine.submit(model_url, os.path.join(download_base_dir, model_file_name), quick_hash)]
+
+        # relative config urls point to the config files included in the models db
+        if config_url and download_config_if_available and urlparse(config_url).scheme in ("http", "https"):
+            futures.append(engine.submit(config_url, os.path.join(download_base_dir, config_file_name)))
 
-        if config_url and download_config_if_available:
-            out_path = os.path.join(download_base_dir, config_file_name)
-            download_file(config_url, out_path)
+        return futures
     except Exception as e:
         log.exception(e)
+        return []
 
 
 def resolve_downloaded_model_path(
@@ -1,5 +1,5 @@
 from sdkit import Context
-from sdkit.utils import gc, log
+from sdkit.utils import gc, log, trace
 
 import importlib
 import traceback
@@ -12,6 +12,9 @@ class Loader:
 
 model_load_lock = Lock()
 
+# models that change the text encoders (i.e. invalidate the cached prompt embeddings)
+TEXT_ENCODER_MODELS = ("stable-diffusion", "lora", "embeddings")
+
 
 def _get_module(model_type):
     models = {  # model_type -> local_module_name
@@ -26,6 +29,7 @@ def _get_module(model_type):
         "latent_upscaler": "latent_upscaler",
         "controlnet": "controlnet",
         "embeddings": "embeddings",
+        "taesd": "taesd",
     }
     if model_type not in models:
         return
@@ -35,6 +39,12 @@ def _get_module(model_type):
     return importlib.import_module("." + module_name, __name__)
 
 
+def clear_prompt_cache(context: Context):
+    from sdkit.generate.prompt_cache import clear_prompt_cache
+
+    clear_prompt_cache(context)
+
+
 def load_model(context: Context, model_type: str, **kwargs):
     if context.test_diffusers:
         from . import diffusers_bugfixes
@@ -42,33 +52,80 @@ def load_model(context: Context, model_type: str, **kwargs):
     if context.model_paths.get(model_type) is None and model_type != "nsfw_checker":
         return
 
+    parked_model = None
+    if model_type == "stable-diffusion":
+        from . import residency
+
+        # keeps the current model loaded (if enabled), and gets the requested model if it's already loaded
+        parked_model = residency.switch_model(context, **kwargs)
+
     if model_type in context.models:
         unload_model(context, model_type)
 
-    with model_load_lock:
+    if model_type in TEXT_ENCODER_MODELS:
+        clear_prompt_cache(context)
+
+    with model_load_lock, trace(f"load_model:{model_type}", context.torch_device):
         # only allow one model to load at a time, regardless of how many threads are running
         # this works around a thread-unsafe behavior of accelerate: https://github.com/huggingface/diffusers/issues/4296
 
         log.info(f"loading {model_type} model from {context.model_paths.get(model_type)} to device: {context.device}")
 
-        context.models[model_type] = get_loader_module(model_type).load_model(context, **kwargs)
+        if parked_model is not None:
+            context.models[model_type] = parked_model
+        else:
+            context.models[model_type] = get_loader_module(model_type).load_model(context, **kwargs)
+
+            if model_type == "stable-diffusion":
+                residency.on_model_loaded(context, **kwargs)
 
     log.info(f"loaded {model_type} model from {context.model_paths.get(model_type)} to device: {context.device}")
 
-    # reload dependent models
     if model_type == "stable-diffusion":
-        for m in ("vae", "hypernetwork", "lora", "embeddings"):
-            try:
-                if m == "lora" and "lora" in context.models and hasattr(context, "_last_lora_alpha"):
-                    del context._last_lora_alpha
-                load_model(context, m)
-            except Exception as e:
-                log.error(f"Could not load dependent model: {m}")
-                traceback.print_exc()
-                if m in context.models:
-                    del context.models[m]
+        _load_dependent_models(context)
+
+
+def load_model_replica(context: Context, model_type: str, replica, **kwargs):
+    """
+    Loads a copy of a model that was already loaded on another device (see `replica.make_replica()`), without
+    reading the model file. Unlike `load_model()`, this doesn't hold the model load lock, so several devices can
+    load the replica in parallel. `kwargs` are the arguments that the original model was loaded with.
+    """
+    if model_type in context.models:
+        unload_model(context, model_type)
+
+    if model_type in TEXT_ENCODER_MODELS:
+        clear_prompt_cache(context)
+
+    log.info(f"loading {model_type} model from a replica to device: {context.device}")
+
+    context.models[model_type] = replica.to_device(context)
+    if model_type == "stable-diffusion":
+        from . import residency
+
+        context._loaded_embeddings = set(())
+        residency.on_model_loaded(context, **kwargs)
+
+    log.info(f"loaded {model_type} model from a replica to device: {context.device}")
+
+    if model_type == "stable-diffusion":
+        _load_dependent_models(context)
 
-                gc(context)
+
+def _load_dependent_models(context: Context):
+    "Reloads the models that are applied to the Stable Diffusion model, e.g. the VAE and LoRA"
+    for m in ("vae", "hypernetwork", "lora", "embeddings"):
+        try:
+            if m == "lora" and "lora" in context.models and hasattr(context, "_last_lora_alpha"):
+                del context._last_lora_alpha
+            load_model(context, m)
+        except Exception as e:
+            log.error(f"Could not load dependent model: {m}")
+            traceback.print_exc()
+            if m in context.models:
+                del context.models[m]
+
+            gc(context)
 
 
 def unload_model(context: Context, model_type: str, **kwargs):
@@ -82,6 +139,9 @@ def unload_model(context: Context, model_type: str, **kwargs):
         del context.models[model_type]
         get_loader_module(model_type).unload_model(context)
 
+    if model_type in TEXT_ENCODER_MODELS:
+        clear_prompt_cache(context)
+
     gc(context)
 
     log.info(f"unloaded {model_type} model from device: {context.device}")
@@ -35,4 +35,6 @@ def load_model(context: Context, **kwargs):
 
 
 def unload_model(context: Context, **kwargs):
-    pass
+    from sdkit.filter.codeformer import unload_face_helper
+
+    unload_face_helper(context.torch_device)  # the face detection and parsing models
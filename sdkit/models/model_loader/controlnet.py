@@ -1,8 +1,22 @@
+"""
+Loads ControlNet models (one, or a list).
+
+Checkpoints in the original format are converted to the diffusers format on the first load, and saved in
+`context.converted_model_cache_dir` (as `controlnet-{quick_hash}-{fp16|fp32}-diffusers{version}`), so later loads
+skip the conversion.
+
+With `context.controlnet_residency`, unloaded ControlNets are parked in RAM (the most recent ones), so loading them
+again (e.g. when switching between sets of ControlNets) only copies them back to the GPU. Not with
+`vram_usage_level="low"`. `unload_parked_controlnets()` frees them.
+"""
+
 import os
+import shutil
+from collections import OrderedDict
 from pathlib import Path
 
 from sdkit import Context
-from sdkit.utils import hash_file_quick, log
+from sdkit.utils import gc, hash_file_quick, log
 
 
 def load_model(context: Context, **kwargs):
@@ -15,18 +29,69 @@ def load_model(context: Context, **kwargs):
 
 
 def load_controlnet(context, controlnet_path):
+    quick_hash = hash_file_quick(controlnet_path)
+    controlnet = unpark_controlnet(context, quick_hash)
+    if controlnet is None:
+        controlnet = _load_controlnet(context, controlnet_path, quick_hash)
+        controlnet._quick_hash = quick_hash
+    return controlnet
+
+
+def _load_controlnet(context, controlnet_path, quick_hash):
     import torch
-    from sdkit.models import get_model_info_from_db
-    from sdkit.models import models_db
-    from sdkit.utils import load_tensor_file, is_cpu_device
+    from sdkit.utils import is_cpu_device
+    from .stable_diffusion.model_cache import get_cache_path
 
     from accelerate import cpu_offload
+    from diffusers import ControlNetModel
+
+    dtype = torch.float16 if context.half_precision else torch.float32
+
+    cache_path = get_cache_path(context, f"controlnet-{quick_hash}")
+    if cache_path is not None and _is_complete(cache_path):  # converted by an earlier load
+        log.info(f"Loading the converted ControlNet from {cache_path}")
+        controlnet = ControlNetModel.from_pretrained(
+            cache_path, torch_dtype=dtype, use_safetensors=True, local_files_only=True
+        )
+    else:
+        controlnet, is_converted = read_controlnet_file(controlnet_path, quick_hash)
+        if is_converted and cache_path is not None:
+            controlnet = save_converted_controlnet(controlnet, dtype, cache_path)
+
+    # memory optimizations
+
+    if context.vram_usage_level == "low" and not is_cpu_device(context.torch_device):
+        controlnet = controlnet.to("cpu", dtype)
+
+        offload_buffers = len(controlnet._parameters) > 0
+        cpu_offload(controlnet, context.torch_device, offload_buffers=offload_buffers)
+    else:
+        controlnet = controlnet.to(context.torch_device, dtype)
+
+    from .stable_diffusion.attention import set_attention_backend
+
+    set_attention_backend(context, controlnet)
+
+    # /memory optimizations
+
+    # where the TensorRT engines of this ControlNet go, if the Stable Diffusion model uses TensorRT. Not for SDXL
+    if controlnet.config.get("addition_embed_type") is None and not hasattr(controlnet, "_hf_hook"):
+        controlnet._trt_dir = os.path.splitext(controlnet_path)[0] + ".trt"
+
+    return controlnet
+
+
+def read_controlnet_file(controlnet_path, quick_hash):
+    "Returns (the ControlNet, whether it was converted from the original format)"
+    from sdkit.models import get_model_info_from_db
+    from sdkit.models import models_db
+    from sdkit.utils import load_tensor_file, trace
 
     import json
     from diffusers import ControlNetModel
     from diffusers.pipelines.stable_diffusion.convert_from_ckpt import convert_controlnet_checkpoint
 
-    controlnet_state_dict = load_tensor_file(controlnet_path)
+    controlnet_state_dict = load_tensor_file(controlnet_path, lazy=True)
     while "state_dict" in controlnet_state_dict:
         controlnet_state_dict = controlnet_state_dict["state_dict"]
 
@@ -53,7 +118,6 @@ def load_controlnet(context, controlnet_path):
         controlnet_base_path = os.path.splitext(controlnet_path)[0]
         controlnet_config_path = controlnet_base_path + ".yaml"
         if not os.path.exists(controlnet_config_path):
-            quick_hash = hash_file_quick(controlnet_path)
             model_info = get_model_info_from_db(quick_hash=quick_hash)
             if not model_info:
                 raise RuntimeError(
@@ -70,33 +134,95 @@ def load_controlnet(context, controlnet_path):
 
         controlnet_config = OmegaConf.load(controlnet_config_path)
 
-        controlnet = convert_controlnet_checkpoint(
-            controlnet_state_dict, controlnet_config, controlnet_path, 512, None, False
-        )
+        with trace("model_convert", model_type="controlnet"):
+            controlnet = convert_controlnet_checkpoint(
+                controlnet_state_dict, controlnet_config, controlnet_path, 512, None, False
+            )
+        return controlnet, True
 
-    # memory optimizations
+    return controlnet, False
 
-    if context.vram_usage_level == "low" and not is_cpu_device(context.torch_device):
-        controlnet = controlnet.to("cpu", torch.float16 if context.half_precision else torch.float32)
 
-        offload_buffers = len(controlnet._parameters) > 0
-        cpu_offload(controlnet, context.torch_device, offload_buffers=offload_buffers)
-    else:
-        controlnet = controlnet.to(context.torch_device, torch.float16 if context.half_precision else torch.float32)
+def save_converted_controlnet(controlnet, dtype, cache_path: str):
+    "Saves the converted ControlNet (in the dtype used for rendering), and returns it in that dtype"
+    from .stable_diffusion.model_cache import commit_entry, make_tmp_dir
 
-    controlnet.set_attention_slice(1)
+    controlnet = controlnet.to("cpu", dtype)
 
+    tmp_path = None
     try:
-        import xformers
+        tmp_path = make_tmp_dir(cache_path)
+        log.info(f"Saving the converted ControlNet to {cache_path}")
+        controlnet.save_pretrained(tmp_path, safe_serialization=True)
+    except Exception as e:
+        log.warn(f"Could not save the converted ControlNet to {cache_path}: {e}")
+        if tmp_path is not None:
+            shutil.rmtree(tmp_path, ignore_errors=True)
+        return controlnet
+
+    commit_entry(tmp_path, cache_path, is_complete=_is_complete)
+    return controlnet
 
-        controlnet.enable_xformers_memory_efficient_attention()
-    except:
-        pass
 
-    # /memory optimizations
+def _is_complete(cache_path: str) -> bool:
+    return os.path.exists(os.path.join(cache_path, "config.json"))
+
+
+def unload_model(context: Context, **kwargs):
+    from sdkit.generate.pipeline_cache import clear_controlnet_pipelines
+
+    clear_controlnet_pipelines(context)
+    park_controlnets(context)
+
+
+def park_controlnets(context: Context):
+    "Moves the loaded ControlNets to RAM, to be reused by a later `load_model()` of the same files"
+    from sdkit.generate.controlnet_engine import clear_control_features
+
+    controlnet = context.models.get("controlnet")
+    controlnets = controlnet if isinstance(controlnet, list) else [controlnet]
+    parked = _get_parked_controlnets(context)
+    if context.controlnet_residency > 0 and context.vram_usage_level != "low":
+        for cn in controlnets:
+            if cn is None or hasattr(cn, "_hf_hook") or not hasattr(cn, "_quick_hash"):  # offloaded, or not loaded here
+                continue
+
+            clear_control_features(cn)
+            key = (cn._quick_hash, context.half_precision)
+            parked[key] = cn.to("cpu")
+            parked.move_to_end(key)
+
+    while len(parked) > max(0, context.controlnet_residency):  # e.g. if the residency was lowered
+        parked.popitem(last=False)
 
+
+def unpark_controlnet(context: Context, quick_hash):
+    "Returns the parked ControlNet of this file (moved to the GPU), or None if it isn't parked"
+    parked = _get_parked_controlnets(context)
+    controlnet = parked.pop((quick_hash, context.half_precision), None)
+    if controlnet is None or context.vram_usage_level == "low":
+        return None
+
+    from .stable_diffusion.attention import set_attention_backend
+
+    log.info(f"Using the parked ControlNet {quick_hash}")
+    controlnet = controlnet.to(context.torch_device)
+    set_attention_backend(context, controlnet)  # context.attention_backend may have changed since it was parked
     return controlnet
 
 
-def unload_model(context: Context, **kwargs):
-    pass
+def unload_parked_controlnets(context: Context):
+    "Frees the ControlNets parked in RAM (see `context.controlnet_residency`)"
+    parked = _get_parked_controlnets(context)
+    if not parked:
+        return
+
+    parked.clear()
+    gc(context)
+    log.info("Unloaded all the parked ControlNets")
+
+
+def _get_parked_controlnets(context: Context) -> OrderedDict:
+    if not hasattr(context, "_parked_controlnets"):
+        context._parked_controlnets = OrderedDict()
+    return context._parked_controlnets
@@ -1,9 +1,7 @@
 import os
 
 from sdkit import Context
-from sdkit.utils import load_tensor_file, log
-
-from sdkit import Context
+from sdkit.utils import load_tensor_files, log
 
 EMBEDDING_TYPES = {768: "SD1", 1024: "SD2", 1280: "SDXL"}
 
@@ -48,12 +46,15 @@ def get_embeddings_to_load(pipe, embeddings_paths, sd_type):
 
     vocab = pipe.tokenizer.get_vocab()
 
+    paths_to_load, tokens_to_load = [], []
     for path in embeddings_paths:
         token = get_embedding_token(path.lower())
-        if token in vocab:
-            continue
+        if token not in vocab and token not in tokens_to_load:
+            paths_to_load.append(path)
+            tokens_to_load.append(token)
 
-        embedding = load_tensor_file(path)
+    # read the files in parallel
+    for path, token, embedding in zip(paths_to_load, tokens_to_load, load_tensor_files(paths_to_load)):
         embedding = get_embedding(embedding)
         if not embedding:
             raise RuntimeError(f"Sorry, could not load {path}. Unknown embedding model type!")
@@ -1,10 +1,14 @@
 import traceback
+import weakref
+from functools import lru_cache
 
 import torch
 import torch.nn as nn
 
 from sdkit import Context
-from sdkit.utils import load_tensor_file, log, get_nested_attr
+from sdkit.utils import load_tensor_files, log, get_nested_attr
+
+from .stable_diffusion.quantization import is_quantized, dequantize_weight, requantize_weight
 
 from dataclasses import dataclass
 
@@ -22,35 +26,74 @@ class LoraBlock:
         return self.up.shape[1]
 
     def apply(self, alpha):
+        "Adds the LoRA (with this alpha) to the weight of the module. Returns the delta that was added"
         try:
-            weight = self._get_weight()
-
-            # mix of ideas from diffusers and automatic1111
-            up = self.up.to(weight.device, dtype=torch.float32)
-            down = self.down.to(weight.device, dtype=torch.float32)
-            rank = up.shape[1]
-
-            if up.shape[2:] == (1, 1) and down.shape[2:] == (1, 1):
-                up = up.squeeze(2).squeeze(2)
-                down = down.squeeze(2).squeeze(2)
-                y = torch.mm(up, down).unsqueeze(2).unsqueeze(3)
-            elif up.shape[2:] == (3, 3) or down.shape[2:] == (3, 3):
-                y = torch.nn.functional.conv2d(down.permute(1, 0, 2, 3), up).permute(1, 0, 2, 3)
-            else:
-                y = torch.mm(up, down)
-
-            x = self.alpha * alpha / rank
-            if isinstance(x, torch.Tensor):
-                x = x.to(y.device, dtype=y.dtype)
-            y *= x
+            quantized = is_quantized(self.module)
+            weight = dequantize_weight(self.module) if quantized else self._get_weight()
 
+            y = self.get_delta(weight.device) * alpha
             weight.data += y
+
+            if quantized:
+                requantize_weight(self.module, weight)
         except Exception as e:
             log.error(f"Unable to apply {alpha} to {self.block_name}")
             raise e
 
         return y
 
+    def get_delta(self, device):
+        "Returns the change in the weight (in fp32) for alpha = 1"
+        # mix of ideas from diffusers and automatic1111
+        up = self.up.to(device, dtype=torch.float32)
+        down = self.down.to(device, dtype=torch.float32)
+
+        if up.shape[2:] == (1, 1) and down.shape[2:] == (1, 1):
+            up = up.squeeze(2).squeeze(2)
+            down = down.squeeze(2).squeeze(2)
+            y = torch.mm(up, down).unsqueeze(2).unsqueeze(3)
+        elif up.shape[2:] == (3, 3) or down.shape[2:] == (3, 3):
+            y = torch.nn.functional.conv2d(down.permute(1, 0, 2, 3), up).permute(1, 0, 2, 3)
+        else:
+            y = torch.mm(up, down)
+
+        return y * self._get_scale(y)
+
+    def forward_low_rank(self, x):
+        "Computes the output of the LoRA path (for alpha = 1), without modifying the weight of the module"
+        F = torch.nn.functional
+        up, down = self._get_runtime_weights(x)
+        scale = self._get_scale(x)
+
+        if isinstance(self.module, nn.Conv2d):
+            m = self.module
+            if up.shape[2:] == (1, 1):
+                padding = m.padding if down.shape[-1] > 1 else 0
+                h = F.conv2d(x, down, None, m.stride, padding, m.dilation)
+                return F.conv2d(h, up) * scale
+
+            delta = self.get_delta(x.device).to(x.dtype)  # e.g. a 3x3 up, not worth splitting
+            return F.conv2d(x, delta, None, m.stride, m.padding, m.dilation)
+
+        return F.linear(F.linear(x, down), up) * scale
+
+    def _get_scale(self, like):
+        x = self.alpha / self.rank
+        if isinstance(x, torch.Tensor):
+            x = x.to(like.device, dtype=like.dtype)
+        return x
+
+    def _get_runtime_weights(self, x):
+        cache = getattr(self, "_runtime_weights", None)
+        if cache is None or cache[0].device != x.device or cache[0].dtype != x.dtype:
+            up = self.up.to(x.device, dtype=x.dtype)
+            down = self.down.to(x.device, dtype=x.dtype)
+            if not isinstance(self.module, nn.Conv2d) and up.ndim == 4:
+                up, down = up.squeeze(3).squeeze(2), down.squeeze(3).squeeze(2)
+            cache = (up, down)
+            self._runtime_weights = cache
+        return cache
+
     def _get_weight(self):
         if hasattr(self.module, "_hf_hook"):
             weight = self.module._hf_hook.weights_map["weight"]
@@ -68,9 +111,13 @@ def load_model(context: Context, **kwargs):
     pipe = model["default"]
     sd_type = model["type"]
 
-    loras = [(load_tensor_file(path), path) for path in lora_model_paths]
+    # read the files in parallel, and then move all the LoRA tensors to the device together
+    loras = zip(load_tensor_files(lora_model_paths), lora_model_paths)
     loras = [load_lora(pipe, lora, sd_type, path) for lora, path in loras]
 
+    if context.vram_usage_level != "low":  # otherwise keep them in RAM, they're moved to the device while applying
+        move_blocks_to_device(loras, context.torch_device)
+
     return loras
 
 
@@ -94,6 +141,7 @@ def get_lora_type(lora):
 def load_lora(pipe, lora, sd_type, lora_path):
     lora_blocks = {}
     lora = {_name(key): val for key, val in lora.items()}
+    modules = _get_module_cache(pipe)
 
     lora_type = get_lora_type(lora)
     if lora_type != sd_type:
@@ -111,7 +159,9 @@ def load_lora(pipe, lora, sd_type, lora_path):
             block = LoraBlock(block_name)
 
             try:
-                block.module = get_nested_attr(pipe, block_name)
+                if block_name not in modules:
+                    modules[block_name] = get_nested_attr(pipe, block_name)
+                block.module = modules[block_name]
             except Exception as e:
                 if is_lycoris:
                     log.warn(f"Skipping layer {key}, since we don't fully support LyCORIS models yet!")
@@ -131,39 +181,197 @@ def load_lora(pipe, lora, sd_type, lora_path):
     return lora_blocks
 
 
+def move_blocks_to_device(loras: list, device):
+    """
+    Moves the `up` and `down` tensors of all the LoRA blocks to the device, using one copy per dtype (instead of a
+    copy per tensor). The tensors become views into the device buffer.
+    """
+    tensors = {}  # dtype -> [(block, attr, tensor)]
+    for lora in loras:
+        for block in lora.values():
+            for attr in ("up", "down"):
+                t = getattr(block, attr)
+                if isinstance(t, torch.Tensor) and t.device != torch.device(device):
+                    tensors.setdefault(t.dtype, []).append((block, attr, t))
+
+    pin = torch.device(device).type == "cuda"
+    for entries in tensors.values():
+        flat = torch.cat([t.reshape(-1) for _, _, t in entries])
+        if pin:
+            flat = flat.pin_memory()
+        flat = flat.to(device, non_blocking=pin)
+
+        offset = 0
+        for block, attr, t in entries:
+            setattr(block, attr, flat[offset : offset + t.numel()].view(t.shape))
+            offset += t.numel()
+
+
 def move_model_to_cpu(context: Context):
     pass
 
 
 def unload_model(context: Context, **kwargs):
+    loras = context.models.get("lora") or []
     if hasattr(context, "_last_lora_alpha"):
-        removal_alpha = -1 * context._last_lora_alpha
+        _remove_lora(context, loras)
         del context._last_lora_alpha
-        apply_lora_model(context, removal_alpha)
+
+    for module, _ in _get_module_blocks(loras).values():  # free the RAM used by the copies of the original weights
+        if hasattr(module, "_lora_base_weight"):
+            del module._lora_base_weight
 
 
 def apply_lora_model(context, alphas):
+    """
+    Sets the alphas of the loaded LoRA models (one alpha per LoRA). Does nothing if these alphas are already applied.
+
+    With `context.lora_mode = "fused"`, the LoRAs are merged into the weights. The original weights of the modified
+    layers are kept in RAM, so the weights are always computed from the original weights (no drift), and only the
+    layers of the LoRAs whose alpha changed are recomputed. With `context.lora_mode = "runtime"`, the LoRAs are
+    computed as a separate low-rank path in each layer (`x @ down @ up`), so changing the alphas is free, but each
+    step is slightly slower.
+    """
+    import numpy as np
+
     if not context.test_diffusers:
         return
 
-    log.info(f"Applying lora, alphas: {alphas}")
-
     try:
         loras = context.models["lora"]
+        alphas = np.array(alphas, dtype=float)
         if len(loras) != len(alphas):
             traceback.print_stack()
             raise RuntimeError(f"{len(loras)} != {len(alphas)}")
 
-        for lora, alpha in zip(loras, alphas):
-            if abs(alpha) < 0.0001:  # alpha is too small, not applying
-                continue
-            for block in lora.values():
-                block.apply(alpha)
+        mode = context.lora_mode
+        last_alphas = getattr(context, "_last_lora_alpha", None)
+        if last_alphas is not None and getattr(context, "_lora_applied_mode", None) != mode:
+            _remove_lora(context, loras)
+            last_alphas = None
+
+        if last_alphas is not None and np.array_equal(last_alphas, alphas):
+            log.info(f"LoRA alphas are already applied: {alphas}")
+            return
+
+        log.info(f"Applying lora, alphas: {alphas}, mode: {mode}")
+
+        if mode == "runtime":
+            _set_runtime_alphas(loras, alphas)
+        else:
+            _fuse(context, loras, alphas, last_alphas)
+
+        context._last_lora_alpha = alphas
+        context._lora_applied_mode = mode
     except Exception as e:
         log.error(traceback.format_exc())
         raise e
 
 
+def _fuse(context, loras, alphas, last_alphas):
+    # modify the RAM copy of the weights, if the UNet is offloaded
+    block_offloader = getattr(context, "block_offloader", None)
+    if block_offloader is not None:
+        block_offloader.evict_all()
+
+    changed = [i for i in range(len(loras)) if last_alphas is None or alphas[i] != last_alphas[i]]
+    changed_modules = {id(block.module) for i in changed for block in loras[i].values()}
+
+    with torch.no_grad():
+        for module_id, (module, blocks) in _get_module_blocks(loras).items():
+            if module_id not in changed_modules:
+                continue
+
+            quantized = is_quantized(module)
+            base = _get_base_weight(module, blocks[0][1])
+            device = module.weight_q.device if quantized else blocks[0][1]._get_weight().device
+
+            weight = base.to(device, dtype=torch.float32)
+            for i, block in blocks:
+                if abs(alphas[i]) >= 0.0001:  # alpha is too small, not applying
+                    weight += block.get_delta(device) * alphas[i]
+
+            if quantized:
+                requantize_weight(module, weight.to(base.dtype))
+            else:
+                blocks[0][1]._get_weight().copy_(weight)
+
+
+def _remove_lora(context, loras):
+    "Restores the original weights, and removes the runtime LoRA hooks"
+    if getattr(context, "_lora_applied_mode", None) == "runtime":
+        for module, _ in _get_module_blocks(loras).values():
+            if hasattr(module, "_lora_runtime_hook"):
+                module._lora_runtime_hook.remove()
+                del module._lora_runtime_hook, module._lora_runtime
+        return
+
+    block_offloader = getattr(context, "block_offloader", None)
+    if block_offloader is not None:
+        block_offloader.evict_all()
+
+    with torch.no_grad():
+        for module, blocks in _get_module_blocks(loras).values():
+            if not hasattr(module, "_lora_base_weight"):
+                continue
+
+            if is_quantized(module):
+                requantize_weight(module, module._lora_base_weight.to(module.weight_q.device))
+            else:
+                blocks[0][1]._get_weight().copy_(module._lora_base_weight)
+
+
+def _set_runtime_alphas(loras, alphas):
+    for i, lora in enumerate(loras):
+        for block in lora.values():
+            module = block.module
+            if not hasattr(module, "_lora_runtime_hook"):
+                module._lora_runtime = {}
+                module._lora_runtime_hook = module.register_forward_hook(_runtime_lora_hook)
+
+            module._lora_runtime[i] = (block, alphas[i])
+
+
+def _runtime_lora_hook(module, args, output):
+    x = args[0]
+    for block, alpha in module._lora_runtime.values():
+        if abs(alpha) >= 0.0001:
+            output = output + block.forward_low_rank(x) * alpha
+    return output
+
+
+def _get_module_blocks(loras) -> dict:
+    "Returns {id(module): (module, [(lora_index, block), ...])} for all the modules modified by the LoRAs"
+    modules = {}
+    for i, lora in enumerate(loras):
+        for block in lora.values():
+            entry = modules.setdefault(id(block.module), (block.module, []))
+            entry[1].append((i, block))
+    return modules
+
+
+def _get_base_weight(module, block):
+    "Returns a copy (in RAM) of the weight of the module, before any LoRA was fused into it"
+    if not hasattr(module, "_lora_base_weight"):
+        weight = dequantize_weight(module) if is_quantized(module) else block._get_weight()
+        module._lora_base_weight = weight.to("cpu", copy=True)
+
+    return module._lora_base_weight
+
+
+def _get_module_cache(pipe) -> dict:
+    "The modules of this pipeline that were resolved by their (diffusers) name, shared by all the LoRAs loaded on it"
+    cache = _module_caches.get(pipe)
+    if cache is None:
+        cache = {}
+        _module_caches[pipe] = cache
+    return cache
+
+
+_module_caches = weakref.WeakKeyDictionary()
+
+
+@lru_cache(maxsize=None)
 def _name(key, unet_layers_per_block=2):
     diffusers_name = key
     diffusers_name = diffusers_name.replace("_", ".")
@@ -4,13 +4,26 @@ from transformers import AutoFeatureExtractor
 from sdkit import Context
 
 
-def load_model(context: Context, **kwargs):
+def load_model(context: Context, run_on_device=False, **kwargs):
+    """
+    * run_on_device: if True, the safety checker is kept on `context.device` (in fp16, if `context.half_precision`),
+        and the images are checked in batches without converting them to PIL. Uses about 600 MB of VRAM in fp16.
+        Otherwise it runs on the CPU.
+    """
+    import torch
+
+    from sdkit.utils import is_cpu_device
+
     model_path = "CompVis/stable-diffusion-safety-checker"
     revision = "cb41f3a270d63d454d385fc2e4f571c487c253c5"
 
     safety_checker = StableDiffusionSafetyChecker.from_pretrained(model_path, revision=revision)
     feature_extractor = AutoFeatureExtractor.from_pretrained(model_path, revision=revision)
 
+    if run_on_device and not is_cpu_device(context.torch_device):
+        dtype = torch.float16 if context.half_precision else torch.float32
+        safety_checker = safety_checker.to(context.torch_device, dtype)
+
     return (safety_checker, feature_extractor)
 
 
@@ -47,7 +47,7 @@ def load_model(context: Context, **kwargs):
         model=model_to_use,
         pre_pad=0,
         half=half,
-        tile=256,
+        tile=0,  # i.e. filter.realesrgan.apply_batch() picks the tile size that fits in the free memory
     )
     if is_cpu_device(context.torch_device):
         model.model.to(context.torch_device)
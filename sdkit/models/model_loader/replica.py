@@ -0,0 +1,119 @@
+"""
+Copies a loaded Stable Diffusion model to other devices, without loading (or converting) it from the disk again.
+
+`make_replica()` copies the loaded model once (on the thread that uses it), with its weights in pinned RAM. This
+snapshot isn't used for rendering, so it doesn't change while it's being copied, e.g. when the source device fuses a
+LoRA. `ModelReplica.to_device()` then builds a copy of the snapshot for another device, by copying the weights from
+RAM directly to the device (the model structure is copied with `copy.deepcopy()`, with the tensors pre-filled). This
+doesn't use accelerate or the model load lock, so several devices can be filled in parallel.
+
+Only for diffusers models that are fully on the device (i.e. not with `vram_usage_level="low"`, TensorRT or DirectML).
+"""
+
+import copy
+
+from sdkit import Context
+from sdkit.utils import log
+
+
+class ModelReplica:
+    def __init__(self, model: dict, host_tensors: list, source_device, settings: dict):
+        self.model = model  # a snapshot of the model, with its weights in (pinned) RAM. never changed after this
+        self.host_tensors = host_tensors  # the tensors of `model`
+        self.source_device = source_device
+        self.settings = settings  # the context settings that were changed while loading, e.g. `half_precision`
+
+    def to_device(self, context: Context) -> dict:
+        import torch
+
+        device = context.torch_device
+        memo = {}
+        for host in self.host_tensors:
+            value = host.data.to(device, non_blocking=host.is_pinned())
+            if isinstance(host, torch.nn.Parameter):
+                value = torch.nn.Parameter(value, requires_grad=host.requires_grad)
+            memo[id(host)] = value
+
+        model = copy.deepcopy(self.model, memo)
+        _retarget_device(model.get("compel"), self.source_device, device)
+
+        if device.type == "cuda":
+            torch.cuda.synchronize(device)
+
+        for key, value in self.settings.items():
+            setattr(context, key, value)
+
+        return model
+
+
+def can_replicate(context: Context, model_type: str) -> bool:
+    from .residency import _can_park
+    from .stable_diffusion import use_directml
+
+    model = context.models.get(model_type)
+    return (
+        model_type == "stable-diffusion"
+        and context.test_diffusers
+        and context.vram_usage_level != "low"
+        and not use_directml()
+        and isinstance(model, dict)
+        and _can_park(model)
+    )
+
+
+def make_replica(context: Context, model_type: str = "stable-diffusion") -> ModelReplica:
+    "Copies the weights of the loaded model to pinned RAM. Returns None if this model can't be replicated"
+    import torch
+
+    from .residency import _get_modules, _iter_tensors
+
+    if not can_replicate(context, model_type):
+        return None
+
+    model = context.models[model_type]
+    pin = context.torch_device.type == "cuda"
+
+    memo = {}  # id(tensor) -> its copy in RAM
+    for _, _, tensor, is_param in _iter_tensors(_get_modules(model)):
+        if id(tensor) in memo:
+            continue
+        host = torch.empty(tensor.shape, dtype=tensor.dtype, device="cpu", pin_memory=pin)
+        host.copy_(tensor.data)
+        if is_param:
+            host = torch.nn.Parameter(host, requires_grad=tensor.requires_grad)
+        memo[id(tensor)] = host
+
+    host_tensors = list(memo.values())
+    snapshot = copy.deepcopy(model, memo)  # copies the structure, with the tensors from RAM
+
+    settings = {"half_precision": context.half_precision}
+    if hasattr(context, "orig_half_precision"):
+        settings["orig_half_precision"] = context.orig_half_precision
+
+    size = sum(h.numel() * h.element_size() for h in host_tensors)
+    log.info(f"Copied the {model_type} model to RAM for replication ({size / 1024**3:.1f} GB)")
+
+    return ModelReplica(snapshot, host_tensors, context.torch_device, settings)
+
+
+def _retarget_device(obj, old_device, new_device, depth=3):
+    "Updates the device attributes of compel (and its embedding providers), which aren't modules"
+    import torch
+
+    if depth == 0 or obj is None or isinstance(obj, torch.nn.Module):
+        return
+
+    if isinstance(obj, (list, tuple)):
+        for value in obj:
+            _retarget_device(value, old_device, new_device, depth - 1)
+        return
+
+    if not hasattr(obj, "__dict__"):
+        return
+
+    for name, value in list(vars(obj).items()):
+        if isinstance(value, (torch.device, str)):
+            if str(value) == str(old_device):
+                setattr(obj, name, new_device if isinstance(value, torch.device) else str(new_device))
+        else:
+            _retarget_device(value, old_device, new_device, depth - 1)
@@ -0,0 +1,315 @@
+"""
+Keeps recently-used Stable Diffusion models loaded, so that switching back to them doesn't need a reload from the disk.
+
+When a different Stable Diffusion model is loaded, the current one is "parked" instead of being unloaded. Parked
+models are kept in VRAM (up to `context.model_residency_budget["vram"]` GB), or in pinned RAM (up to
+`context.model_residency_budget["ram"]` GB), and the least-recently used (or least-frequently used, depending on
+`context.model_residency_policy`) models are moved from VRAM to RAM, or discarded, to stay within the budgets.
+Discarded models are loaded from the disk again (from the converted model cache, if enabled).
+
+Switching to a model parked in VRAM doesn't copy anything. Switching to a model parked in RAM copies its weights to
+the GPU, which can be started in advance (while the current model is still rendering) with `prefetch_model()`.
+
+This is used only for diffusers models that are fully on the GPU (i.e. not with `vram_usage_level="low"`, TensorRT
+or DirectML).
+"""
+
+import os
+import tempfile
+import time
+
+from sdkit import Context
+from sdkit.utils import gc, log, save_tensor_file
+
+GB = 1024**3
+
+COMPONENTS = ("unet", "vae", "text_encoder", "text_encoder_2")
+
+
+class ParkedModel:
+    def __init__(self, key, model, size):
+        self.key = key
+        self.model = model
+        self.size = size  # bytes
+        self.tier = "vram"
+        self.last_used = time.monotonic()
+        self.use_count = 1
+        self.pending_copy = None  # (cuda event, source tensors, device) for an in-flight promotion to the GPU
+
+
+def is_enabled(context: Context) -> bool:
+    budget = context.model_residency_budget
+    return (
+        context.test_diffusers
+        and context.vram_usage_level != "low"
+        and (budget.get("vram", 0) > 0 or budget.get("ram", 0) > 0)
+    )
+
+
+def get_model_key(context: Context, load_kwargs: dict):
+    "The identity of a loaded Stable Diffusion model: its file, config, precision and load arguments"
+    return repr(
+        (
+            context.model_paths.get("stable-diffusion"),
+            str(context.model_configs.get("stable-diffusion")),
+            context.half_precision,
+            sorted(load_kwargs.items()),
+        )
+    )
+
+
+def switch_model(context: Context, **load_kwargs):
+    """
+    Parks the currently loaded Stable Diffusion model (if possible), and returns the requested model if it
+    was parked earlier. Returns None if the requested model needs to be loaded from the disk.
+    """
+    if not is_enabled(context):
+        return None
+
+    key = get_model_key(context, load_kwargs)
+    current_key = getattr(context, "_sd_model_key", None)
+    if "stable-diffusion" in context.models and current_key != key:
+        park_current_model(context)
+
+    parked_models = _get_parked_models(context)
+    entry = parked_models.pop(key, None)
+    if entry is None:
+        return None
+
+    log.info(f"Switching to the parked model: {context.model_paths.get('stable-diffusion')} ({entry.tier})")
+    if entry.tier == "ram":
+        _move_to_gpu(context, entry)
+    _wait_for_pending_copy(entry)
+
+    pipe = entry.model["default"]
+    save_tensor_file(pipe.vae.state_dict(), os.path.join(tempfile.gettempdir(), "sd-base-vae.safetensors"))
+    context._sd_model_key = key
+    context._sd_model_use_count = entry.use_count + 1
+
+    return entry.model
+
+
+def on_model_loaded(context: Context, **load_kwargs):
+    context._sd_model_key = get_model_key(context, load_kwargs)
+    context._sd_model_use_count = 1
+
+
+def park_current_model(context: Context):
+    "Moves the current Stable Diffusion model out of `context.models`, and keeps it in VRAM or RAM (if it fits)"
+    from . import unload_model
+
+    model = context.models.get("stable-diffusion")
+    key = getattr(context, "_sd_model_key", None)
+    if not isinstance(model, dict) or key is None or not _can_park(model):
+        return
+
+    # restore the original weights of the model, undoing the LoRA and custom VAE
+    for m in ("lora", "vae"):
+        unload_model(context, m)
+
+    from sdkit.generate.cuda_graphs import release_cuda_graphs
+    from sdkit.generate.vae_engine import release_vae_engine
+
+    release_vae_engine(model["default"].vae)  # the fp32 copy of the VAE (if any) isn't counted in the budgets
+    release_cuda_graphs(model["default"].unet)
+
+    entry = ParkedModel(key, model, _get_model_size(model))
+    entry.use_count = getattr(context, "_sd_model_use_count", 1)
+
+    del context.models["stable-diffusion"]
+    del context._sd_model_key
+    context.module_in_gpu = None
+
+    budget = context.model_residency_budget
+    if entry.size > budget.get("vram", 0) * GB and entry.size > budget.get("ram", 0) * GB:
+        log.info("Not parking the Stable Diffusion model, it is larger than the residency budgets")
+        del entry
+        gc(context)
+        return
+
+    _get_parked_models(context)[key] = entry
+    log.info(f"Parked the model {key} ({entry.size / GB:.1f} GB)")
+
+    _enforce_budgets(context)
+
+
+def prefetch_model(context: Context, **load_kwargs):
+    """
+    Starts copying a model parked in RAM to the GPU in the background, if it fits in the VRAM budget. Uses the
+    current value of `context.model_paths["stable-diffusion"]` and the given load arguments to identify the model.
+    """
+    if not is_enabled(context):
+        return
+
+    entry = _get_parked_models(context).get(get_model_key(context, load_kwargs))
+    if entry is None or entry.tier != "ram":
+        return
+
+    if _get_tier_usage(context, "vram") + entry.size > context.model_residency_budget.get("vram", 0) * GB:
+        return
+
+    _move_to_gpu(context, entry, non_blocking=True)
+
+
+def unload_parked_models(context: Context):
+    parked_models = _get_parked_models(context)
+    if not parked_models:
+        return
+
+    parked_models.clear()
+    gc(context)
+    log.info("Unloaded all the parked models")
+
+
+def _get_parked_models(context: Context) -> dict:
+    if not hasattr(context, "_parked_models"):
+        context._parked_models = {}
+    return context._parked_models
+
+
+def _can_park(model: dict):
+    pipe = model["default"]
+    if model["params"].get("convert_to_tensorrt"):
+        return False
+
+    for name in COMPONENTS:
+        module = getattr(pipe, name, None)
+        if module is None:
+            continue
+        if not hasattr(module, "parameters") or hasattr(module, "_hf_hook"):  # DirectML or cpu offloaded
+            return False
+
+    return True
+
+
+def _get_modules(model: dict):
+    pipe = model["default"]
+    return [getattr(pipe, name) for name in COMPONENTS if getattr(pipe, name, None) is not None]
+
+
+def _get_model_size(model: dict):
+    size = 0
+    for module in _get_modules(model):
+        size += sum(p.numel() * p.element_size() for p in module.parameters())
+        size += sum(b.numel() * b.element_size() for b in module.buffers())
+    return size
+
+
+def _get_tier_usage(context: Context, tier: str):
+    return sum(e.size for e in _get_parked_models(context).values() if e.tier == tier)
+
+
+def _eviction_order(context: Context, entries: list):
+    if context.model_residency_policy == "lfu":
+        return sorted(entries, key=lambda e: (e.use_count, e.last_used))
+    return sorted(entries, key=lambda e: e.last_used)
+
+
+def _enforce_budgets(context: Context):
+    parked_models = _get_parked_models(context)
+    budget = context.model_residency_budget
+    vram_budget, ram_budget = budget.get("vram", 0) * GB, budget.get("ram", 0) * GB
+
+    vram_entries = [e for e in parked_models.values() if e.tier == "vram"]
+    for entry in _eviction_order(context, vram_entries):
+        if _get_tier_usage(context, "vram") <= vram_budget:
+            break
+
+        if entry.size <= ram_budget:
+            _move_to_ram(context, entry)
+        else:
+            log.info(f"Discarding the parked model {entry.key}")
+            del parked_models[entry.key]
+
+    ram_entries = [e for e in parked_models.values() if e.tier == "ram"]
+    for entry in _eviction_order(context, ram_entries):
+        if _get_tier_usage(context, "ram") <= ram_budget:
+            break
+
+        log.info(f"Discarding the parked model {entry.key}")
+        del parked_models[entry.key]
+
+    gc(context)
+
+
+def _iter_tensors(modules):
+    "Yields (module, name, tensor, is_param) for all the parameters and buffers of the given modules"
+    for module in modules:
+        for m in module.modules():
+            for name, p in m._parameters.items():
+                if p is not None:
+                    yield m, name, p, True
+            for name, b in m._buffers.items():
+                if b is not None:
+                    yield m, name, b, False
+
+
+def _set_tensor(module, name, tensor, is_param, value):
+    if is_param:
+        tensor.data = value
+    else:
+        module._buffers[name] = value
+
+
+def _move_to_ram(context: Context, entry: ParkedModel):
+    import torch
+
+    _wait_for_pending_copy(entry)
+
+    pin = context.torch_device.type == "cuda"
+    for module, name, tensor, is_param in _iter_tensors(_get_modules(entry.model)):
+        cpu_tensor = torch.empty(tensor.shape, dtype=tensor.dtype, device="cpu", pin_memory=pin)
+        cpu_tensor.copy_(tensor.data, non_blocking=pin)
+        _set_tensor(module, name, tensor, is_param, cpu_tensor)
+
+    if pin:
+        torch.cuda.current_stream(context.torch_device).synchronize()
+
+    entry.tier = "ram"
+    log.info(f"Moved the parked model {entry.key} to RAM")
+
+
+def _move_to_gpu(context: Context, entry: ParkedModel, non_blocking=False):
+    import torch
+
+    device = context.torch_device
+    if device.type != "cuda":
+        for module in _get_modules(entry.model):
+            module.to(device)
+        entry.tier = "vram"
+        return
+
+    if not hasattr(context, "_residency_stream"):
+        context._residency_stream = torch.cuda.Stream(device)
+
+    stream = context._residency_stream
+    current_stream = torch.cuda.current_stream(device)
+    sources = []
+    with torch.cuda.stream(stream):
+        for module, name, tensor, is_param in _iter_tensors(_get_modules(entry.model)):
+            src = tensor.data
+            gpu_tensor = src.to(device, non_blocking=True)
+            gpu_tensor.record_stream(current_stream)  # it'll be used on the main stream
+            _set_tensor(module, name, tensor, is_param, gpu_tensor)
+            sources.append(src)
+
+        event = torch.cuda.Event()
+        event.record(stream)
+
+    entry.pending_copy = (event, sources, device)  # keep the pinned tensors alive until the copy finishes
+    entry.tier = "vram"
+
+    if not non_blocking:
+        _wait_for_pending_copy(entry)
+
+
+def _wait_for_pending_copy(entry: ParkedModel):
+    import torch
+
+    if entry.pending_copy is None:
+        return
+
+    event, _, device = entry.pending_copy
+    torch.cuda.current_stream(device).wait_event(event)
+    event.synchronize()
+    entry.pending_copy = None
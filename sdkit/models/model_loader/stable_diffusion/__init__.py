@@ -14,6 +14,7 @@ from transformers import logging as tr_logging
 
 from sdkit import Context
 from sdkit.utils import download_file, hash_file_quick, load_tensor_file, log, save_tensor_file, is_cpu_device
+from sdkit.utils import trace
 
 tr_logging.set_verbosity_error()  # suppress unnecessary logging
 
@@ -25,8 +26,23 @@ def load_model(
     clip_skip=False,
     convert_to_tensorrt=False,
     trt_build_config={"batch_size_range": (1, 1), "dimensions_range": [(768, 1024)]},
+    quantize_unet=None,
+    compile_config=None,
     **kwargs,
 ):
+    """
+    * quantize_unet: `None`, `"int8"` or `"fp8"`. Stores the weights of the UNet's linear and conv layers in 8 bits
+        (with a scale per output channel), halving the VRAM used by the UNet. Diffusers only. `"fp8"` requires torch 2.1+.
+    * trt_build_config: the `batch_size_range` and `dimensions_range` of the TensorRT engines built while loading. Or
+        `"background_builds": True` to build the engines in the background instead, for the requested batch sizes
+        and image sizes (rendering with PyTorch until they're ready). `"max_loaded_engines"` (default 2) caps the
+        number of engines kept in VRAM.
+    * compile_config: compile the UNet and the VAE decoder with `torch.compile` (diffusers only). `True`, or a dict
+        with `"unet"`, `"vae"`, `"mode"`, `"dynamic"` and `"shapes"` (see `compile.COMPILE_DEFAULTS`). The compiled
+        kernels are saved in `context.compiled_model_cache_dir` (process-wide, see `compile.py`). Call
+        `sdkit.generate.warmup()` after loading, to compile the `"shapes"` before the first request. A compiled UNet
+        doesn't use `step_cache` or `context.cuda_graphs`.
+    """
     from sdkit.models import scan_model as scan_model_fn
 
     from . import optimizations
@@ -43,10 +59,30 @@ def load_model(
         if scan_result.issues_count > 0 or scan_result.infected_files > 0:
             raise Exception(f"Model scan failed! Potentially infected model: {model_path}")
 
+    if context.test_diffusers and not convert_to_tensorrt and not use_directml():
+        from .model_cache import get_cache_path, get_cached_model_meta
+
+        # the checkpoint is still scanned (above), in case it was replaced with a malicious file of the same hash
+        cache_path = get_cache_path(context, hash_file_quick(model_path))
+        cache_meta = get_cached_model_meta(cache_path, config_file_path)
+        if cache_meta:
+            return load_diffusers_model(
+                context,
+                None,
+                model_path,
+                cache_meta["config_file_path"],
+                clip_skip,
+                convert_to_tensorrt,
+                trt_build_config,
+                quantize_unet=quantize_unet,
+                cache_meta=cache_meta,
+                compile_config=compile_config,
+            )
+
     if context.test_diffusers:
         from sdkit.models import get_model_info_from_db
 
-        sd = load_tensor_file(model_path)
+        sd = load_tensor_file(model_path, lazy=True)  # read the tensors only when the conversion needs them
         sd = sd["state_dict"] if "state_dict" in sd else sd
 
         if config_file_path is None:
@@ -78,7 +114,15 @@ def load_model(
             config_file_path = resolve_model_config_file_path(sd_v1_4_info, model_path)
 
         return load_diffusers_model(
-            context, sd, model_path, config_file_path, clip_skip, convert_to_tensorrt, trt_build_config
+            context,
+            sd,
+            model_path,
+            config_file_path,
+            clip_skip,
+            convert_to_tensorrt,
+            trt_build_config,
+            quantize_unet=quantize_unet,
+            compile_config=compile_config,
         )
 
     # load the model file
@@ -141,10 +185,37 @@ def load_model(
 
 def unload_model(context: Context, **kwargs):
     context.module_in_gpu = None  # don't keep a dangling reference, prevents gc
+    context.block_offloader = None
+
+
+def use_directml():
+    "Whether to run the UNet with DirectML (AMD on Windows)"
+    import platform
+    from sdkit.utils import has_amd_gpu
+
+    if platform.system() != "Windows" or not has_amd_gpu():
+        return False
+
+    try:
+        from importlib.metadata import version
+
+        version("onnxruntime-directml")  # check if this is installed
+        return True
+    except:
+        return False
 
 
 def load_diffusers_model(
-    context: Context, state_dict, model_path, config_file_path, clip_skip, convert_to_tensorrt, trt_build_config
+    context: Context,
+    state_dict,
+    model_path,
+    config_file_path,
+    clip_skip,
+    convert_to_tensorrt,
+    trt_build_config,
+    quantize_unet=None,
+    cache_meta=None,
+    compile_config=None,
 ):
     import torch
     from diffusers import (
@@ -157,14 +228,16 @@ def load_diffusers_model(
     )
     from diffusers.models.attention_processor import Attention
     from compel import Compel, DiffusersTextualInversionManager, ReturnedEmbeddingsType as Skip
-    import platform
 
     from sdkit.generate.sampler import diffusers_samplers
-    from sdkit.utils import gc, has_amd_gpu
+    from sdkit.utils import gc
+    from sdkit.utils import LazyTensorDict
     import torch.nn.functional as F
 
     from diffusers.pipelines.stable_diffusion.convert_from_ckpt import download_from_original_stable_diffusion_ckpt
 
+    from . import model_cache
+
     log.info("loading on diffusers")
 
     log.info(f"using config: {config_file_path}")
@@ -173,13 +246,16 @@ def load_diffusers_model(
         config.model.params.unet_config.params.use_fp16 = context.half_precision
 
     is_sd_xl = hasattr(config.model.params, "network_config")
-    if "model.diffusion_model.input_blocks.0.0.weight" in state_dict:
+    if cache_meta:
+        is_inpainting = cache_meta["is_inpainting"]
+    elif "model.diffusion_model.input_blocks.0.0.weight" in state_dict:
         is_inpainting = state_dict["model.diffusion_model.input_blocks.0.0.weight"].shape[1] == 9
     else:
         is_inpainting = False
 
     # fix for NAI keys
-    check_and_fix_nai_keys(state_dict)
+    if state_dict is not None:
+        check_and_fix_nai_keys(state_dict)
 
     extra_config = config.get("extra", {})
     attn_precision = extra_config.get("attn_precision", "fp16" if context.half_precision else "fp32")
@@ -208,28 +284,39 @@ def load_diffusers_model(
     model_trt_path = model_component + ".trt"
     unet_onnx_path = model_component + ".unet.onnx"
 
-    use_directml = platform.system() == "Windows" and has_amd_gpu()
-    try:
-        from importlib.metadata import version
-
-        version("onnxruntime-directml")  # check if this is installed
-    except:
-        use_directml = False
+    is_directml = use_directml()
 
     if is_cpu_device(context.torch_device):
         convert_to_tensorrt = False
 
+    # with background builds, the engines are built later (for the requested image sizes), from a copy of the model
+    trt_background_builds = convert_to_tensorrt and trt_build_config.get("background_builds", False)
+    convert_now = convert_to_tensorrt and not trt_background_builds
+
+    model_hash = hash_file_quick(model_path)
+    cache_path = None if convert_now or is_directml else model_cache.get_cache_path(context, model_hash)
+
     # remove SDPA if torch 2.0 and need to convert to ONNX
-    needs_onnx = convert_to_tensorrt or (
-        use_directml and (not os.path.exists(unet_onnx_path) or os.stat(unet_onnx_path).st_size == 0)
+    needs_onnx = convert_now or (
+        is_directml and (not os.path.exists(unet_onnx_path) or os.stat(unet_onnx_path).st_size == 0)
     )
     swap_sdpa = needs_onnx and hasattr(F, "scaled_dot_product_attention")
     old_sdpa = getattr(F, "scaled_dot_product_attention", None) if swap_sdpa else None
     if swap_sdpa:
         delattr(F, "scaled_dot_product_attention")
 
+    # read the weights directly in fp16 if the pipeline will use fp16 anyway, to halve the RAM used while converting.
+    # the ONNX and TensorRT conversions run in fp32.
+    if isinstance(state_dict, LazyTensorDict) and context.half_precision and not needs_onnx:
+        state_dict.dtype = torch.float16
+
     # txt2img
-    default_pipe = download_from_original_stable_diffusion_ckpt(state_dict, **model_load_params)
+    if cache_meta:
+        with trace("model_load_converted"):
+            default_pipe = model_cache.load_cached_pipeline(context, cache_path, cache_meta)
+    else:
+        with trace("model_convert"):
+            default_pipe = download_from_original_stable_diffusion_ckpt(state_dict, **model_load_params)
 
     if swap_sdpa and old_sdpa:
         setattr(F, "scaled_dot_product_attention", old_sdpa)
@@ -247,17 +334,23 @@ def load_diffusers_model(
         elif context_dim == 1024:
             model_type = "SD2"
 
+    # save the converted model, to skip the conversion the next time this model is loaded
+    cache_tmp_path = None
+    if cache_path and not cache_meta:
+        default_pipe, cache_tmp_path = model_cache.save_pipeline(context, default_pipe, cache_path)
+
     if is_sd_xl:
         # until the image artifacts go away: https://huggingface.co/stabilityai/stable-diffusion-xl-base-0.9/discussions/31
         default_pipe.watermark.apply_watermark = lambda images: images
 
-    if use_directml and (not os.path.exists(unet_onnx_path) or os.stat(unet_onnx_path).st_size == 0):
+    if is_directml and (not os.path.exists(unet_onnx_path) or os.stat(unet_onnx_path).st_size == 0):
         from sdkit.utils import gc, convert_pipeline_unet_to_onnx
 
         log.info("Converting UNet to ONNX to run on AMD on Windows..")
-        convert_pipeline_unet_to_onnx(default_pipe, unet_onnx_path, device="cpu", fp16=False)  # on cpu, so fp32
+        with trace("onnx_convert"):
+            convert_pipeline_unet_to_onnx(default_pipe, unet_onnx_path, device="cpu", fp16=False)  # on cpu, so fp32
         log.info("Converted UNet to ONNX to run on AMD on Windows!")
-    elif convert_to_tensorrt:
+    elif convert_now:
         from sdkit.utils import gc, convert_pipeline_to_tensorrt
 
         default_pipe = default_pipe.to(context.torch_device, torch.float16 if context.half_precision else torch.float32)
@@ -266,9 +359,10 @@ def load_diffusers_model(
         dimensions_range = trt_build_config["dimensions_range"]
 
         log.info("Converting model to TensorRT for acceleration..")
-        convert_pipeline_to_tensorrt(
-            default_pipe, model_trt_path, batch_size_range, dimensions_range, fp16=context.half_precision
-        )
+        with trace("tensorrt_convert"):
+            convert_pipeline_to_tensorrt(
+                default_pipe, model_trt_path, batch_size_range, dimensions_range, fp16=context.half_precision
+            )
         log.info("Converted model to TensorRT for acceleration!")
 
         default_pipe = default_pipe.to("cpu", torch.float32)
@@ -278,27 +372,39 @@ def load_diffusers_model(
 
     # memory optimizations
 
-    if context.vram_usage_level == "low" and not is_cpu_device(context.torch_device):
+    if quantize_unet and (convert_to_tensorrt or is_directml):
+        log.warn("Not quantizing the UNet, since it is replaced by an accelerated (TensorRT/DirectML) UNet")
+        quantize_unet = None
+    elif quantize_unet and context.vram_usage_level == "low" and context.torch_device.type != "cuda":
+        log.warn("Not quantizing the UNet, since it isn't supported with accelerate's cpu offload")
+        quantize_unet = None
+
+    if quantize_unet:  # quantize on the cpu (after converting to the final dtype), to avoid the full UNet in VRAM
+        from .quantization import quantize_unet as quantize
+
         if context.half_precision:
             default_pipe = default_pipe.to("cpu", torch.float16, silence_dtype_warnings=True)
-        default_pipe.enable_sequential_cpu_offload(device=context.torch_device)
+        quantize(default_pipe.unet, quantize_unet)
+
+    if context.vram_usage_level == "low" and not is_cpu_device(context.torch_device):
+        if context.half_precision and not quantize_unet:
+            default_pipe = default_pipe.to("cpu", torch.float16, silence_dtype_warnings=True)
+
+        if context.torch_device.type == "cuda":
+            from .offload import offload_diffusers_pipeline
+
+            offload_diffusers_pipeline(context, default_pipe)
+        else:
+            default_pipe.enable_sequential_cpu_offload(device=context.torch_device)
     else:
-        if context.half_precision:
+        if context.half_precision and not quantize_unet:
             default_pipe = default_pipe.to(context.torch_device, torch.float16)
-        else:
+        else:  # a dtype conversion would also convert the fp8 weights
             default_pipe = default_pipe.to(context.torch_device)
 
-    if context.vram_usage_level == "high":
-        default_pipe.enable_attention_slicing(4)
-    else:
-        default_pipe.enable_attention_slicing(1)
-
-    try:
-        import xformers
+    from .attention import set_attention_backend
 
-        default_pipe.enable_xformers_memory_efficient_attention()
-    except:
-        pass
+    set_attention_backend(context, default_pipe, legacy=needs_onnx)
 
     if hasattr(default_pipe, "enable_vae_slicing"):
         default_pipe.enable_vae_slicing()
@@ -309,8 +415,21 @@ def load_diffusers_model(
 
     scheduler_config = dict(default_pipe.scheduler.config)
 
+    upcast_attention = False
+
+    if cache_meta:
+        if "prediction_type" in cache_meta:
+            scheduler_config["prediction_type"] = cache_meta["prediction_type"]
+            log.info(f"Using {scheduler_config['prediction_type']} parameterization")
+
+        upcast_attention = cache_meta["upcast_attention"]
+        if upcast_attention:
+            for m in default_pipe.unet.modules():
+                if isinstance(m, Attention):
+                    m.upcast_attention = True
+
     # if SD 2, test whether to use 'v' prediction mode
-    if model_type == "SD2" and not is_inpainting:
+    elif model_type == "SD2" and not is_inpainting:
         # idea based on https://github.com/AUTOMATIC1111/stable-diffusion-webui/commit/d04e3e921e8ee71442a1f4a1d6e91c05b8238007
 
         dtype = torch.float16 if context.half_precision else torch.float32
@@ -327,6 +446,7 @@ def load_diffusers_model(
 
         if math.isnan(out):
             log.info("Probably black images, trying fp32 attention precision")
+            upcast_attention = True
             for m in default_pipe.unet.modules():
                 if not isinstance(m, Attention):
                     continue
@@ -365,15 +485,21 @@ def load_diffusers_model(
         )
 
     # load the TensorRT or DirectML unet, if present
-    if use_directml and os.path.exists(unet_onnx_path) and os.stat(unet_onnx_path).st_size > 0:
+    if is_directml and os.path.exists(unet_onnx_path) and os.stat(unet_onnx_path).st_size > 0:
         from .accelerators import apply_directml_unet
 
         apply_directml_unet(default_pipe, unet_onnx_path)
         log.info("Using DirectML accelerated UNet")
-    elif convert_to_tensorrt and os.path.exists(model_trt_path):
+    elif convert_to_tensorrt and (trt_background_builds or os.path.exists(model_trt_path)):
         from .accelerators import apply_tensorrt
 
-        apply_tensorrt(default_pipe, model_trt_path)
+        max_loaded_engines = trt_build_config.get("max_loaded_engines", 2)
+        apply_tensorrt(default_pipe, model_trt_path, trt_background_builds, max_loaded_engines)
+
+    if compile_config and context.vram_usage_level != "low" and not is_directml:
+        from .compile import compile_pipeline
+
+        compile_pipeline(context, default_pipe, model_hash, compile_config)
 
     model = {
         "config": config,
@@ -381,13 +507,30 @@ def load_diffusers_model(
         "compel": compel,
         "default_scheduler_config": scheduler_config,
         "type": model_type,
+        "hash": model_hash,
         "params": {
             "clip_skip": clip_skip,
             "convert_to_tensorrt": convert_to_tensorrt,
             "trt_build_config": trt_build_config,
+            "quantize_unet": quantize_unet,
+            "compile_config": compile_config,
         },
     }
 
+    if cache_path and not cache_meta:
+        meta = {
+            "pipeline_class": type(default_pipe).__name__,
+            "config_file_path": config_file_path,
+            "model_type": model_type,
+            "is_inpainting": is_inpainting,
+            "attn_precision": attn_precision,
+            "upcast_attention": upcast_attention,
+        }
+        if "prediction_type" in scheduler_config:
+            meta["prediction_type"] = scheduler_config["prediction_type"]
+
+        model_cache.save_meta(cache_tmp_path, cache_path, meta)
+
     if hasattr(config, "model") and hasattr(config.model, "target") and "LatentInpaintDiffusion" in config.model.target:
         log.info("Loaded on diffusers")
         model["inpainting"] = StableDiffusionInpaintPipeline(**default_pipe.components)
@@ -1,4 +1,8 @@
+import math
 import os
+import queue
+import threading
+from collections import OrderedDict
 
 import torch
 from dataclasses import dataclass
@@ -21,6 +25,7 @@ Current issues:
  > Currently it takes an entire different ONNX file and transfers their weights. One can modify it to target specifically the KQV part of the network for LORAs instead.
 
 5. TRT performance is pretty restricted to narrow image size ranges. Loading multiple engines results in excessive VRAM usage.
+ > TRTEngineManager keeps at most `max_loaded_engines` deserialized engines (LRU).
 """
 
 SIZE_SPAN = 256
@@ -32,23 +37,23 @@ def apply_directml_unet(pipeline, onnx_path):
     pipeline.unet.forward = unet_dml.forward
 
 
-def apply_tensorrt(pipeline, trt_dir):
+def apply_tensorrt(pipeline, trt_dir, background_builds=False, max_loaded_engines=2):
     old_unet_forward = pipeline.unet.forward
     old_vae_forward = pipeline.vae.decoder.forward
 
     try:
-        trt = TRTModel(pipeline, trt_dir)
+        trt = TRTEngineManager(pipeline, trt_dir, background_builds, max_loaded_engines)
 
         pipeline.unet.forward = trt.forward_unet
-        # pipeline.vae.decoder.forward = trt.forward_vae
+        pipeline.vae.decoder.forward = trt.forward_vae
 
         setattr(pipeline.unet, "_allocate_trt_buffers", trt.allocate_buffers)
         setattr(pipeline.unet, "_non_trt_forward", old_unet_forward)
         setattr(pipeline.unet, "_trt_forward", trt.forward_unet)
-        # setattr(pipeline.vae.decoder, "_non_trt_forward", old_vae_forward)
-        # setattr(pipeline.vae.decoder, "_trt_forward", trt.forward_vae)
+        setattr(pipeline.vae.decoder, "_non_trt_forward", old_vae_forward)
+        setattr(pipeline.vae.decoder, "_trt_forward", trt.forward_vae)
 
-        log.info("Using TensorRT accelerated UNet and VAE")
+        log.info("Using TensorRT accelerated UNet, VAE and ControlNet (for the available engines)")
     except:
         traceback.print_exc()
         pipeline.unet.forward = old_unet_forward
@@ -114,264 +119,400 @@ class UnetDirectML:
         return [sample]
 
 
-class TRTModel:
-    ENGINE_TYPES = ("unet",)  # "vae")
-    # ENGINE_SPANS = [(512, 768), (768, 1024), (1024, 1280)]  # pixels
+ENGINE_TYPES = ("unet", "vae", "controlnet")
+SAMPLES_PER_IMAGE = {"unet": 2, "vae": 1, "controlnet": 2}  # the engines are built for classifier-free guidance
 
-    def __init__(self, pipeline, trt_dir):
-        import tensorrt as trt
 
-        self.base_dir = trt_dir
+@dataclass
+class EngineInfo:
+    "A TensorRT engine file, named `{batch_min}_{batch_max},{res_min}_{res_max}.trt` (sizes in pixels)"
 
-        self.pipeline = pipeline
-        self.old_forward = {
-            "unet": pipeline.unet.forward,
-            "vae": pipeline.vae.decoder.forward,
-        }
+    batch_min: int
+    batch_max: int
+    res_min: int
+    res_max: int
+    engine_path: str
 
-        self.available_engines = {}
-        self.tensors = {engine_type: {} for engine_type in self.ENGINE_TYPES}
-        self.engines_for_forward = {engine_type: None for engine_type in self.ENGINE_TYPES}
+    def covers(self, batch_size, width, height, samples_per_image=1) -> bool:
+        "`batch_size` is the batch size of the model's input, with `samples_per_image` samples per image"
+        return (
+            self.batch_min * samples_per_image <= batch_size <= self.batch_max * samples_per_image
+            and self.res_min <= width <= self.res_max
+            and self.res_min <= height <= self.res_max
+        )
 
-        self.TRT_LOGGER = trt.Logger(trt.Logger.INFO)
-        trt.init_libnvinfer_plugins(None, "")
+    def score(self, batch_size, width, height) -> float:
+        "Higher is better: prefers narrow batch ranges, and engines whose minimum size is close to the image size"
+        batch_span_score = 1 / (abs(self.batch_max - self.batch_min) + 1)  # 1 -> 0, 1 is best
+        res_dist_score = 1 - (max(width, height) - self.res_min) / SIZE_SPAN  # 1 -> 0, 1 is best
+        return batch_span_score + 2 * res_dist_score
+
+
+def find_engines(engine_dir) -> list:
+    engines = []
+    if not os.path.isdir(engine_dir):
+        return engines
+
+    for f in os.listdir(engine_dir):
+        engine_path = os.path.join(engine_dir, f)
+        if not f.endswith(".trt") or len(f.split(",")) != 2 or os.stat(engine_path).st_size == 0:
+            continue
 
-        for engine_type in self.ENGINE_TYPES:
-            engine_infos = self.available_engines[engine_type] = []
-            engine_type_dir = os.path.join(trt_dir, engine_type)
+        try:
+            batch_range, res_range = os.path.splitext(f)[0].split(",")
+            batch_min, batch_max = (int(p) for p in batch_range.split("_"))
+            res_min, res_max = (int(p) for p in res_range.split("_"))
+            engines.append(EngineInfo(batch_min, batch_max, res_min, res_max, engine_path))
+        except Exception:
+            traceback.print_exc()
 
-            for f in os.listdir(engine_type_dir):
-                engine_path = os.path.join(engine_type_dir, f)
-                if not f.endswith(".trt") or len(f.split(",")) != 2 or os.stat(engine_path).st_size == 0:
-                    continue
+    return engines
 
-                try:
-                    info = os.path.splitext(f)[0]
-                    parts = info.split(",")
-                    batch_min, batch_max = parts[0].split("_")
-                    res_min, res_max = parts[1].split("_")
 
-                    batch_min, batch_max, res_min, res_max = tuple(
-                        int(p) for p in (batch_min, batch_max, res_min, res_max)
-                    )
+def get_engine_bucket(batch_size, width, height) -> tuple:
+    "The (batch_size_range, dimensions_range) of the engine to build for this request"
+    batch_max = 1 << max(0, batch_size - 1).bit_length()  # 1, 2, 4, 8 ..
+    batch_min = batch_max // 2 + 1 if batch_max > 1 else 1
 
-                    engine_info = {
-                        "batch_min": batch_min,
-                        "batch_max": batch_max,
-                        "res_min": res_min,
-                        "res_max": res_max,
-                        "engine_path": engine_path,
-                    }
+    res_min = max(64, min(width, height) // SIZE_SPAN * SIZE_SPAN)
+    res_max = max(res_min + SIZE_SPAN, math.ceil(max(width, height) / SIZE_SPAN) * SIZE_SPAN)
+    return (batch_min, batch_max), (res_min, res_max)
 
-                    engine_infos.append(engine_info)
-                except Exception as e:
-                    traceback.print_exc()
 
-        print("Available engines", self.available_engines)
+class LoadedEngine:
+    "A deserialized engine, with I/O buffers that are reallocated only when the input shapes change"
 
-    def load_engine(self, engine_type, engine_info):
+    def __init__(self, info: EngineInfo, engine, trt_context):
         import tensorrt as trt
 
-        engine_path = engine_info["engine_path"]
-        curr_engine = self.engines_for_forward[engine_type]
-        if curr_engine:
-            if curr_engine[2] == engine_path:
-                log.info(f"Reusing loaded {engine_type} TensorRT engine for {engine_path}")
-                return self.engines_for_forward[engine_type]
+        self.info = info
+        self.engine = engine
+        self.trt_context = trt_context
+
+        names = [engine.get_tensor_name(i) for i in range(engine.num_io_tensors)]
+        self.input_names = [n for n in names if engine.get_tensor_mode(n) == trt.TensorIOMode.INPUT]
+        self.output_names = [n for n in names if engine.get_tensor_mode(n) != trt.TensorIOMode.INPUT]
+        self.tensors = {}
+        self.shapes = None
+
+    def allocate(self, shapes: dict, device):
+        if shapes == self.shapes:
+            return
+
+        self.tensors.clear()
+        for name in self.input_names:
+            self.trt_context.set_input_shape(name, shapes[name])
+            self.tensors[name] = torch.empty(shapes[name], dtype=torch.float32, device=device)
+        for name in self.output_names:
+            shape = tuple(self.trt_context.get_tensor_shape(name))
+            self.tensors[name] = torch.empty(shape, dtype=torch.float32, device=device)
+
+        for name, tensor in self.tensors.items():
+            self.trt_context.set_tensor_address(name, tensor.data_ptr())
+
+        self.shapes = shapes
+        log.info(f"Allocated the TensorRT buffers of {self.info.engine_path} for {shapes}")
+
+    def run(self, feed_dict: dict):
+        "Returns a dict of the outputs (in float32, valid until the next call), or None if TensorRT failed"
+        for name, value in feed_dict.items():
+            if isinstance(value, torch.Tensor):
+                self.tensors[name].copy_(value)  # also broadcasts a scalar timestep
             else:
-                old_engine, old_context, _ = curr_engine
-                del old_engine
-                del old_context
+                self.tensors[name].fill_(value)
 
-        log.info(f"Loading {engine_type} TensorRT engine from {engine_path}")
+        stream = torch.cuda.current_stream(self.tensors[self.input_names[0]].device)
+        if not self.trt_context.execute_async_v3(stream_handle=stream.cuda_stream):
+            return None
 
-        with open(engine_path, "rb") as f, trt.Runtime(self.TRT_LOGGER) as runtime:
-            engine = runtime.deserialize_cuda_engine(f.read())
-            trt_context = engine.create_execution_context()
+        return {name: self.tensors[name] for name in self.output_names}
 
-            self.engines_for_forward[engine_type] = (engine, trt_context, engine_path)
 
-        return self.engines_for_forward[engine_type]
+class TRTEngineManager:
+    """
+    Runs the UNet, the VAE decoder and the ControlNet models with TensorRT engines, if an engine is available for the
+    shape of the input. Otherwise they run with PyTorch.
 
-    def get_engine_info_for_request(self, engine_type, batch_size, width, height) -> tuple:
-        "Returns a tuple (engine, engine_trt_context)"
+    Engines are picked per input shape, and a bounded LRU of deserialized engines (with their I/O buffers) is kept, so
+    switching between image sizes doesn't deserialize an engine every time. With `background_builds`, the engines for
+    new shapes are built in a background thread (from the observed requests), while rendering continues with PyTorch.
 
-        possible_engines = []
-        for engine_info in self.available_engines[engine_type]:
-            batch_min, batch_max = engine_info["batch_min"], engine_info["batch_max"]
-            res_min, res_max = engine_info["res_min"], engine_info["res_max"]
-            size = max(width, height)
-            if (
-                batch_size >= batch_min
-                and batch_size <= batch_max
-                and width >= res_min
-                and width <= res_max
-                and height >= res_min
-                and height <= res_max
-            ):
-                batch_span = abs(batch_max - batch_min) + 1  # 1, 2, 3, 4, .. etc
-                batch_span_score = 1 / batch_span  # 1 -> 0, 1 is best
+    The engines are in `{trt_dir}/unet/` and `{trt_dir}/vae/` for the Stable Diffusion model, and in
+    `{controlnet._trt_dir}/controlnet/` for each ControlNet model.
+    """
 
-                res_dist = size - res_min
-                res_dist_score = 1 - res_dist / SIZE_SPAN  # 1 -> 0, 1 is best
+    def __init__(self, pipeline, trt_dir, background_builds=False, max_loaded_engines=2):
+        import tensorrt as trt
 
-                score = batch_span_score + 2 * res_dist_score
-                possible_engines.append((engine_info, score))
+        self.pipeline = pipeline
+        self.trt_dir = trt_dir
+        self.max_loaded_engines = max(1, max_loaded_engines)
+        self.old_forward = {
+            "unet": pipeline.unet.forward,
+            "vae": pipeline.vae.decoder.forward,
+        }
 
-        possible_engines.sort(key=lambda e: e[1], reverse=True)
+        self.num_tokens = pipeline.text_encoder.config.max_position_embeddings
+        self.text_hidden_size = pipeline.text_encoder.config.hidden_size
 
-        print("engine scores", possible_engines)
+        self.TRT_LOGGER = trt.Logger(trt.Logger.INFO)
+        trt.init_libnvinfer_plugins(None, "")
 
-        engine = possible_engines[0][0] if len(possible_engines) > 0 else None
+        self._available = {}  # engine dir -> [EngineInfo]
+        self._loaded = OrderedDict()  # engine path -> LoadedEngine, in LRU order
+        self._selected = {}  # (engine dir, batch size, width, height) -> EngineInfo or None
+        self._lock = threading.RLock()
 
-        print("chosen engine:", engine)
+        self.builder = BackgroundEngineBuilder(self) if background_builds else None
 
-        return engine
+        for engine_type in ("unet", "vae"):
+            log.info(f"Available {engine_type} TensorRT engines: {self.get_engines(self._get_engine_dir(engine_type))}")
 
-    def allocate_buffers(self, pipeline, device, dtype, batch_size, width, height):
-        "Call this once before an image is generated, not per sample"
+    def get_engines(self, engine_dir) -> list:
+        with self._lock:
+            if engine_dir not in self._available:
+                self._available[engine_dir] = find_engines(engine_dir)
+            return self._available[engine_dir]
 
-        for engine_type in self.ENGINE_TYPES:
-            engine_info = self.get_engine_info_for_request(engine_type, batch_size, width, height)
-            if not engine_info:
-                log.warn(
-                    f"Did not find a {engine_type} TensorRT engine for {width}x{height} and batch {batch_size}. Using non-TRT rendering.."
-                )
-                self.engines_for_forward[engine_type] = None
-                continue
+    def on_engine_built(self, engine_dir):
+        "Called (from any thread) after new engines were saved in this directory"
+        with self._lock:
+            self._available.pop(engine_dir, None)
+            self._selected = {k: v for k, v in self._selected.items() if k[0] != engine_dir}
 
-            log.info(f"Using {engine_type} TensorRT engine to render for {width}x{height} and batch {batch_size}..")
+    def allocate_buffers(self, pipeline, device, dtype, batch_size, width, height):
+        """
+        Call this once before an image is generated, not per sample. Prepares the engines for this request.
+        `batch_size` is the batch size of the UNet's input, e.g. 2 per image with classifier-free guidance.
+        """
+        torch.cuda.set_device(device)
+
+        controlnets = getattr(pipeline, "controlnet", None)
+        controlnets = getattr(controlnets, "nets", controlnets)  # MultiControlNetModel
+        controlnets = controlnets if isinstance(controlnets, (list, tuple, torch.nn.ModuleList)) else [controlnets]
+        for controlnet in controlnets:
+            if controlnet is not None and getattr(controlnet, "_trt_dir", None):
+                self._patch_controlnet(controlnet)
+
+        # deserialize the UNet engine before the first step (if necessary)
+        self._get_engine("unet", pipeline.unet, batch_size, width, height, device)
 
-            torch.cuda.set_device(device)
-            try:
-                engine = self.load_engine(engine_type, engine_info)
-            except Exception as e:
-                log.warn(f"Error while loading {engine_type} TensorRT engine: {engine_info}: {e}")
-                traceback.print_exc()
-                self.engines_for_forward[engine_type] = None
-                continue
+    def forward_unet(self, sample, timestep, encoder_hidden_states, **kwargs):
+        def fallback():
+            return self.old_forward["unet"](sample, timestep, encoder_hidden_states, **kwargs)
+
+        if any(kwargs.get(k) is not None for k in kwargs if k != "return_dict"):  # e.g. ControlNet residuals
+            return fallback()
+
+        feed_dict = {"sample": sample, "timestep": timestep, "encoder_hidden_states": encoder_hidden_states}
+        outputs = self._forward("unet", self.pipeline.unet, feed_dict)
+        if outputs is None:
+            return fallback()
+
+        return [outputs["out_sample"].to(sample.dtype, copy=True)]
+
+    def forward_vae(self, sample, latent_embeds=None):
+        if latent_embeds is None:
+            outputs = self._forward("vae", self.pipeline.vae, {"sample": sample})
+            if outputs is not None:
+                return outputs["out_sample"].to(sample.dtype, copy=True)
+
+        return self.old_forward["vae"](sample, latent_embeds)
+
+    def _patch_controlnet(self, controlnet):
+        if hasattr(controlnet, "_trt_forward"):
+            return
+
+        from diffusers.models.controlnet import ControlNetOutput
+
+        old_forward = controlnet.forward
+
+        def forward(
+            sample,
+            timestep,
+            encoder_hidden_states,
+            controlnet_cond=None,
+            conditioning_scale=1.0,
+            guess_mode=False,
+            return_dict=True,
+            **kwargs,
+        ):
+            args = dict(controlnet_cond=controlnet_cond, conditioning_scale=conditioning_scale, guess_mode=guess_mode)
+            if guess_mode or controlnet_cond is None or any(v is not None for v in kwargs.values()):
+                return old_forward(sample, timestep, encoder_hidden_states, **args, return_dict=return_dict, **kwargs)
+
+            feed_dict = {
+                "sample": sample,
+                "timestep": timestep,
+                "encoder_hidden_states": encoder_hidden_states,
+                "controlnet_cond": controlnet_cond,
+                "conditioning_scale": float(conditioning_scale),
+            }
+            outputs = self._forward("controlnet", controlnet, feed_dict)
+            if outputs is None:
+                return old_forward(sample, timestep, encoder_hidden_states, **args, return_dict=return_dict, **kwargs)
+
+            num_down = len(outputs) - 1
+            down = [outputs[f"down_{i}"].to(sample.dtype, copy=True) for i in range(num_down)]
+            mid = outputs["mid"].to(sample.dtype, copy=True)
+            return ControlNetOutput(down, mid) if return_dict else (down, mid)
+
+        controlnet._non_trt_forward = old_forward
+        controlnet._trt_forward = forward
+        controlnet.forward = forward
+
+    def _get_engine_dir(self, engine_type, model=None):
+        if engine_type == "controlnet":
+            return os.path.join(model._trt_dir, "controlnet")
+        return os.path.join(self.trt_dir, engine_type)
+
+    def _forward(self, engine_type, model, feed_dict):
+        "Returns the engine outputs, or None if there's no engine for this input (or if TensorRT failed)"
+        sample = feed_dict["sample"]
+        width, height = sample.shape[3] * 8, sample.shape[2] * 8
+
+        engine = self._get_engine(engine_type, model, sample.shape[0], width, height, sample.device)
+        if engine is None:
+            return None
+
+        shapes = {name: tuple(value.shape) for name, value in feed_dict.items() if isinstance(value, torch.Tensor)}
+        shapes["timestep"] = (sample.shape[0],)  # a scalar timestep is broadcast to the batch
+        shapes["conditioning_scale"] = (1,)
+        engine.allocate({name: shapes[name] for name in engine.input_names}, sample.device)
+
+        outputs = engine.run(feed_dict)
+        if outputs is None:
+            log.warn(f"Error running the {engine_type} TensorRT engine {engine.info.engine_path}. Using PyTorch..")
+        return outputs
+
+    def _get_engine(self, engine_type, model, batch_size, width, height, device):
+        "`batch_size` is the batch size of the model's input (not the number of images)"
+        engine_dir = self._get_engine_dir(engine_type, model)
+        key = (engine_dir, batch_size, width, height)
+        per_image = SAMPLES_PER_IMAGE[engine_type]
+
+        with self._lock:  # on_engine_built() resets the selection from the builder thread
+            is_new = key not in self._selected
+            if is_new:
+                engines = [e for e in self.get_engines(engine_dir) if e.covers(batch_size, width, height, per_image)]
+                engines.sort(key=lambda e: e.score(batch_size / per_image, width, height), reverse=True)
+                self._selected[key] = engines[0] if engines else None
+            info = self._selected[key]
+
+        if is_new and info is None:
+            log.info(f"No {engine_type} TensorRT engine for {width}x{height}, batch {batch_size}. Using PyTorch..")
+            if self.builder and batch_size % per_image == 0:  # e.g. not for the UNet without guidance
+                self.builder.request(engine_type, model, engine_dir, batch_size // per_image, width, height)
+        elif is_new:
+            log.info(f"Using {engine_type} TensorRT engine {info.engine_path} for {width}x{height}..")
+
+        if info is None:
+            return None
+
+        try:
+            return self._load_engine(info)
+        except Exception as e:
+            log.warn(f"Error while loading {engine_type} TensorRT engine: {info}: {e}")
+            traceback.print_exc()
+            with self._lock:
+                self._selected[key] = None
+            return None
+
+    def _load_engine(self, info: EngineInfo) -> LoadedEngine:
+        import tensorrt as trt
 
-            self._allocate_buffers(engine_type, pipeline, device, dtype, batch_size, width, height, engine)
+        engine = self._loaded.get(info.engine_path)
+        if engine is not None:
+            self._loaded.move_to_end(info.engine_path)
+            return engine
 
-    def _allocate_buffers(self, engine_type, pipeline, device, dtype, batch_size, width, height, engine):
-        tensors = self.tensors[engine_type]
-        tensors.clear()
+        while len(self._loaded) >= self.max_loaded_engines:
+            path, _ = self._loaded.popitem(last=False)
+            log.info(f"Unloaded TensorRT engine {path}")
 
-        dtype = torch.float32  # HACK: but TRT generates black images otherwise
+        log.info(f"Loading TensorRT engine from {info.engine_path}")
+        with open(info.engine_path, "rb") as f, trt.Runtime(self.TRT_LOGGER) as runtime:
+            engine = runtime.deserialize_cuda_engine(f.read())
 
-        if engine_type == "unet":
-            unet_in_channels = pipeline.unet.config.in_channels
-            num_tokens = pipeline.text_encoder.config.max_position_embeddings
-            text_hidden_size = pipeline.text_encoder.config.hidden_size
+        engine = LoadedEngine(info, engine, engine.create_execution_context())
+        self._loaded[info.engine_path] = engine
+        return engine
 
-            shape_dict = {
-                "sample": (batch_size * 2, unet_in_channels, height // 8, width // 8),
-                "encoder_hidden_states": (batch_size * 2, num_tokens, text_hidden_size),
-                "timestep": (batch_size * 2,),
-            }
-        elif engine_type == "vae":
-            num_channels_latents = pipeline.unet.config.in_channels
-            vae_scale_factor = pipeline.vae_scale_factor
 
-            shape_dict = {
-                "sample": (batch_size * 2, num_channels_latents, height // vae_scale_factor, width // vae_scale_factor),
-            }
+TRTModel = TRTEngineManager
 
-        engine, trt_context, _ = engine
 
-        for i, binding in enumerate(engine):
-            if binding in shape_dict:
-                shape = shape_dict[binding]
-            else:
-                shape = engine.get_binding_shape(binding)
+class BackgroundEngineBuilder:
+    """
+    Builds TensorRT engines for new shapes in a background thread, one at a time. If the ONNX file doesn't exist yet,
+    `request()` takes a CPU copy of the weights (on the render thread, without any fused LoRA), and the ONNX file is
+    exported from that copy, so rendering can continue on the GPU. So the engines have the weights of the model
+    without LoRAs, like the engines converted while loading the model. Quantized models aren't built.
+    """
 
-            if binding == "out_sample":
-                shape = shape_dict["sample"]
+    def __init__(self, manager: TRTEngineManager):
+        self.manager = manager
+        self._queue = queue.Queue()
+        self._requested = set()
+        self._exports = set()  # engine dirs with a queued ONNX export
 
-            if engine.binding_is_input(binding):
-                trt_context.set_binding_shape(i, shape)
+        self.thread = threading.Thread(target=self._run, name="trt-engine-builder", daemon=True)
+        self.thread.start()
 
-            log.info(f"Bound: {binding} with {shape} {dtype} on {device}")
-            tensors[binding] = torch.empty(tuple(shape), dtype=dtype, device=device)
+    def request(self, engine_type, model, engine_dir, batch_size, width, height):
+        batch_size_range, dimensions_range = get_engine_bucket(batch_size, width, height)
+        key = (engine_dir, batch_size_range, dimensions_range)
+        if key in self._requested:
+            return
 
-    def forward_unet(self, sample, timestep, encoder_hidden_states, **kwargs):
-        feed_dict = {
-            "sample": sample,
-            "timestep": timestep,
-            "encoder_hidden_states": encoder_hidden_states,
-        }
-        return self._forward("unet", feed_dict)
+        self._requested.add(key)
 
-    def forward_vae(self, sample, **kwargs):
-        feed_dict = {
-            "sample": sample,
-        }
-        return self._forward("vae", feed_dict)
+        from sdkit.utils.convert_model_utils import get_onnx_state_dict
 
-    def _forward(self, engine_type, feed_dict):
-        from polygraphy import cuda
+        state_dict = None  # only needed by the first job of this dir, which exports the ONNX file
+        if not _has_onnx(engine_dir) and engine_dir not in self._exports:
+            try:
+                state_dict = get_onnx_state_dict(model)
+            except ValueError as e:
+                log.warn(f"Can't build {engine_type} TensorRT engines in the background: {e}")
+                return
+            self._exports.add(engine_dir)
 
-        sample = feed_dict["sample"]
+        log.info(f"Queued a {engine_type} TensorRT engine build for batch {batch_size_range}, size {dimensions_range}")
+        self._queue.put((engine_type, model, engine_dir, batch_size_range, dimensions_range, state_dict))
 
-        # check if we have an engine for this sample, else use the non-trt forward
-        factor = 8 if engine_type == "unet" else self.pipeline.vae_scale_factor
-
-        batch_size = int(sample.shape[0] / 2)
-        width = sample.shape[3] * factor
-        height = sample.shape[2] * factor
-
-        engine = self.engines_for_forward[engine_type]
-        if not engine:
-            log.warn(
-                f"Did not find a {engine_type} TensorRT engine for input: {width}x{height}, batch: {batch_size}. Using non-TRT rendering.."
-            )
-            if engine_type == "unet":
-                return self.old_forward["unet"](
-                    feed_dict["sample"],
-                    feed_dict["timestep"],
-                    feed_dict["encoder_hidden_states"],
-                    return_dict=False,
-                )
-            elif engine_type == "vae":
-                return self.old_forward["vae"](feed_dict["sample"])
+    def stop(self):
+        self._queue.put(None)
 
-        orig_dtype = sample.dtype
-        target_dtype = torch.float32
+    def _run(self):
+        from sdkit.utils.convert_model_utils import build_tensorrt_engines, export_model_to_onnx
 
-        tensors = self.tensors[engine_type]
-        engine, trt_context, engine_path = engine
+        while True:
+            job = self._queue.get()
+            if job is None:
+                return
 
-        if not trt_context:
-            log.warn(
-                f"No valid {engine_type} TensorRT engine {engine_path} found for input: {width}x{height}, batch: {batch_size}!"
-            )
+            engine_type, model, engine_dir, batch_size_range, dimensions_range, state_dict = job
+            try:
+                onnx_path = os.path.join(engine_dir, "model.onnx")
+                args = (self.manager.num_tokens, self.manager.text_hidden_size)
+                if state_dict is not None:
+                    export_model_to_onnx(engine_type, model, onnx_path, *args, state_dict=state_dict)
+                    state_dict = job = None  # frees the copy of the weights, before building the engine
+                elif not _has_onnx(engine_dir):
+                    raise RuntimeError(f"The ONNX export of {engine_dir} failed")
+
+                in_channels = model.config.latent_channels if engine_type == "vae" else model.config.in_channels
+                build_tensorrt_engines(
+                    engine_type, onnx_path, engine_dir, batch_size_range, [dimensions_range], in_channels, *args
+                )
+                self.manager.on_engine_built(engine_dir)
+                log.info(f"Built a {engine_type} TensorRT engine for batch {batch_size_range}, size {dimensions_range}")
+            except Exception:
+                log.error(f"Could not build a {engine_type} TensorRT engine for {batch_size_range}, {dimensions_range}")
+                traceback.print_exc()
 
-        stream = cuda.Stream()
 
-        for name, tensor in feed_dict.items():
-            try:
-                tensors[name].copy_(tensor.to(target_dtype))
-            except Exception as e:
-                # print("failed for", name)
-                raise e
-
-        for name, tensor in tensors.items():
-            trt_context.set_tensor_address(name, tensor.data_ptr())
-
-        if not trt_context.execute_async_v3(stream_handle=stream.ptr):
-            log.warn(
-                f"Error processing the {engine_type} TensorRT engine {engine_path} for input: {width}x{height}, batch: {batch_size}. Using non-TRT rendering.."
-            )
-            if engine_type == "unet":
-                sample = self.old_forward["unet"](
-                    feed_dict["sample"], feed_dict["timestep"], feed_dict["encoder_hidden_states"], return_dict=False
-                )[0]
-            elif engine_type == "vae":
-                sample = self.old_forward["vae"](feed_dict["sample"])
-
-            sample = sample.to(orig_dtype)
-            return [sample] if engine_type == "unet" else sample
-
-        sample = tensors["out_sample"]
-        sample = sample.to(orig_dtype)
-        return [sample] if engine_type == "unet" else sample
+def _has_onnx(engine_dir) -> bool:
+    onnx_path = os.path.join(engine_dir, "model.onnx")
+    return os.path.exists(onnx_path) and os.stat(onnx_path).st_size > 0
@@ -0,0 +1,314 @@
+"""
+Picks the attention implementation for the diffusers models: SDPA (flash/memory-efficient kernels in torch),
+xformers, chunked SDPA (over slices of the query, for less memory) or sliced attention (over the heads, the least
+memory and the slowest).
+
+With `context.attention_backend = "auto"`, the choice is made per bucket of (query length, key length, batch size,
+heads, dtype) - i.e. per resolution, batch size and attention layer type. The first call of each bucket times the
+candidates that fit in the free memory, and the fastest one is cached (per device, for the rest of the process).
+Later calls only look up the cached choice, without querying the device.
+
+Layers with `upcast_attention` (e.g. for SD 2.x 768-v in fp16, which overflows otherwise) compute the attention in
+fp32, and `upcast_softmax` computes the softmax in fp32 - like diffusers' `Attention.get_attention_scores()`.
+"""
+
+import math
+import time
+
+import torch
+import torch.nn.functional as F
+
+from sdkit import Context
+from sdkit.utils import log
+
+ATTENTION_BACKENDS = ("auto", "sdpa", "xformers", "chunked", "sliced")
+
+CALIBRATION_RUNS = 2
+MAX_CHUNKS = 64
+
+# (device, requested backend, bucket) -> (backend, chunks). shared by all the models on that device
+_calibrations = {}
+
+
+def set_attention_backend(context: Context, model, legacy=False):
+    """
+    Sets the attention processors of a diffusers pipeline (its UNet and VAE), or of a single model (e.g. ControlNet),
+    as per `context.attention_backend`.
+
+    * legacy: use sliced attention (and xformers, if installed), e.g. for models that will be exported to ONNX.
+    """
+    from sdkit.models.model_loader.stable_diffusion import use_directml
+
+    models = [getattr(model, name, None) for name in ("unet", "vae")] if hasattr(model, "components") else [model]
+    models = [m for m in models if m is not None and hasattr(m, "set_attn_processor")]
+
+    backend = context.attention_backend
+    if backend not in ATTENTION_BACKENDS:
+        raise ValueError(f"Unknown attention_backend: {backend}. Supported values: {ATTENTION_BACKENDS}")
+
+    if legacy or use_directml() or not hasattr(F, "scaled_dot_product_attention"):
+        for m in models:
+            _set_legacy_attention(context, m)
+        return
+
+    if backend == "xformers" and not has_xformers():
+        log.warn("xformers is not installed, using SDPA attention instead")
+        backend = "sdpa"
+
+    log.info(f"Using attention backend: {backend}")
+    for m in models:
+        m.set_attn_processor(AdaptiveAttnProcessor(context.torch_device, backend))
+
+
+def has_xformers() -> bool:
+    try:
+        import xformers.ops  # noqa: F401
+
+        return True
+    except ImportError:
+        return False
+
+
+def get_calibrations() -> dict:
+    "The backends picked so far, as `{(device, requested backend, bucket): (backend, chunks)}`"
+    return dict(_calibrations)
+
+
+class AdaptiveAttnProcessor:
+    """
+    A diffusers attention processor, which runs the attention with the backend picked for the bucket of each call.
+    Same inputs and outputs as diffusers' `AttnProcessor2_0`.
+    """
+
+    def __init__(self, device, backend="auto"):
+        self.device = str(device)
+        self.backend = backend
+        self.use_calibration = backend == "auto" and torch.device(device).type == "cuda"
+
+    def __call__(self, attn, hidden_states, encoder_hidden_states=None, attention_mask=None, temb=None, *args, **kw):
+        residual = hidden_states
+        if attn.spatial_norm is not None:
+            hidden_states = attn.spatial_norm(hidden_states, temb)
+
+        input_ndim = hidden_states.ndim
+        if input_ndim == 4:
+            batch_size, channel, height, width = hidden_states.shape
+            hidden_states = hidden_states.view(batch_size, channel, height * width).transpose(1, 2)
+
+        context = hidden_states if encoder_hidden_states is None else encoder_hidden_states
+        batch_size, sequence_length, _ = context.shape
+
+        if attention_mask is not None:
+            attention_mask = attn.prepare_attention_mask(attention_mask, sequence_length, batch_size)
+            attention_mask = attention_mask.view(batch_size, attn.heads, -1, attention_mask.shape[-1])
+
+        if attn.group_norm is not None:
+            hidden_states = attn.group_norm(hidden_states.transpose(1, 2)).transpose(1, 2)
+
+        query = attn.to_q(hidden_states)
+        if encoder_hidden_states is None:
+            encoder_hidden_states = hidden_states
+        elif attn.norm_cross:
+            encoder_hidden_states = attn.norm_encoder_hidden_states(encoder_hidden_states)
+
+        key = attn.to_k(encoder_hidden_states)
+        value = attn.to_v(encoder_hidden_states)
+
+        head_dim = key.shape[-1] // attn.heads
+        query, key, value = (x.view(batch_size, -1, attn.heads, head_dim).transpose(1, 2) for x in (query, key, value))
+
+        options = {"scale": attn.scale, "upcast": attn.upcast_attention, "upcast_softmax": attn.upcast_softmax}
+        hidden_states = self.attention(query, key, value, attention_mask, **options)
+        hidden_states = hidden_states.transpose(1, 2).reshape(batch_size, -1, attn.heads * head_dim)
+        hidden_states = hidden_states.to(query.dtype)
+
+        hidden_states = attn.to_out[0](hidden_states)
+        hidden_states = attn.to_out[1](hidden_states)
+
+        if input_ndim == 4:
+            hidden_states = hidden_states.transpose(-1, -2).reshape(batch_size, channel, height, width)
+
+        if attn.residual_connection:
+            hidden_states = hidden_states + residual
+
+        return hidden_states / attn.rescale_output_factor
+
+    def attention(self, query, key, value, mask=None, **options):
+        """
+        query, key and value are of shape (batch, heads, length, head_dim). `options` are passed to `run_attention()`,
+        e.g. `upcast=True`.
+        """
+        if _is_vmapped(query):  # e.g. batched ControlNets. The candidates can't be timed, and xformers can't be vmapped
+            return run_attention("sdpa", 1, query, key, value, mask, **options)
+
+        upcast = options.get("upcast", False)
+        bucket = get_bucket(query, key, mask, upcast)
+        cache_key = (self.device, self.backend, bucket)
+        choice = _calibrations.get(cache_key)
+        if choice is not None:
+            return run_attention(*choice, query, key, value, mask, **options)
+
+        if _is_compiling():  # timing the candidates doesn't work inside a compiled graph
+            backend = "sdpa" if self.backend == "auto" else self.backend
+            return run_attention(backend, 1, query, key, value, mask, **options)
+
+        # the chunks are computed for the bucket's batch size, since the choice is reused for the whole bucket
+        bucket_batch = bucket[2]
+        if self.use_calibration:
+            choice, output = self._calibrate(query, key, value, mask, bucket_batch, options)
+            log.info(f"Attention backend for {bucket}: {choice[0]} ({choice[1]} chunks)")
+        else:
+            backend = "sdpa" if self.backend == "auto" else self.backend
+            mem_free = _get_free_memory(query.device)
+            chunks = 1 if backend in ("sdpa", "xformers") else _get_chunks(query, key, mem_free, bucket_batch, upcast)
+            choice, output = (backend, chunks), None
+
+        _calibrations[cache_key] = choice
+        return output if output is not None else run_attention(*choice, query, key, value, mask, **options)
+
+    def _calibrate(self, query, key, value, mask, batch, options):
+        mem_free = _get_free_memory(query.device)
+        chunks = _get_chunks(query, key, mem_free, batch, options.get("upcast", False))
+
+        candidates = [("sdpa", 1)]
+        if has_xformers() and mask is None:
+            candidates.append(("xformers", 1))
+        candidates += [("chunked", max(2, chunks)), ("sliced", max(2, chunks))]
+
+        best, best_time, best_output = None, math.inf, None
+        for choice in candidates:
+            try:
+                output = run_attention(*choice, query, key, value, mask, **options)  # warmup
+                torch.cuda.synchronize(query.device)
+                start = time.perf_counter()
+                for _ in range(CALIBRATION_RUNS):
+                    output = run_attention(*choice, query, key, value, mask, **options)
+                torch.cuda.synchronize(query.device)
+                elapsed = time.perf_counter() - start
+            except Exception as e:  # e.g. out of memory, or a shape/dtype that xformers doesn't support
+                log.debug(f"Attention backend {choice} failed for {tuple(query.shape)}: {e}")
+                torch.cuda.empty_cache()
+                continue
+
+            if elapsed < best_time:
+                best, best_time, best_output = choice, elapsed, output
+
+        if best is None:
+            raise RuntimeError(f"Not enough memory for the attention of shape {tuple(query.shape)}")
+
+        return best, best_output
+
+
+def get_bucket(query, key, mask=None, upcast=False) -> tuple:
+    "Calls in the same bucket use the same backend. The batch size is rounded up to a power of 2"
+    batch, heads, q_len, head_dim = query.shape
+    batch = 1 << max(0, batch - 1).bit_length()
+    return (q_len, key.shape[2], batch, heads, head_dim, str(query.dtype), mask is not None, upcast)
+
+
+def run_attention(backend, chunks, query, key, value, mask=None, scale=None, upcast=False, upcast_softmax=False):
+    """
+    * scale: the scale of the scores (of the sliced backend). Defaults to `1 / sqrt(head_dim)`, same as SDPA.
+    * upcast: compute the attention in fp32 (`Attention.upcast_attention`), and return it in the dtype of `value`.
+    * upcast_softmax: compute the softmax in fp32 (`Attention.upcast_softmax`). The other backends do this already.
+    """
+    if backend == "sliced" and chunks > 1:
+        return _sliced_attention(chunks, query, key, value, mask, scale, upcast, upcast or upcast_softmax)
+
+    if upcast and query.dtype != torch.float32:
+        dtype = value.dtype
+        query, key, value = query.float(), key.float(), value.float()
+        if mask is not None and mask.is_floating_point():
+            mask = mask.float()
+        return run_attention(backend, chunks, query, key, value, mask).to(dtype)
+
+    if backend == "xformers" and mask is None:
+        import xformers.ops
+
+        q, k, v = (x.transpose(1, 2).contiguous() for x in (query, key, value))
+        return xformers.ops.memory_efficient_attention(q, k, v).transpose(1, 2)
+
+    if backend == "chunked" and chunks > 1:  # slices of the query, so only a slice of the scores is in memory
+        out = torch.empty_like(query)
+        chunk_size = math.ceil(query.shape[2] / chunks)
+        for i in range(0, query.shape[2], chunk_size):
+            m = mask[:, :, i : i + chunk_size] if mask is not None and mask.shape[2] > 1 else mask
+            q = query[:, :, i : i + chunk_size]
+            out[:, :, i : i + chunk_size] = F.scaled_dot_product_attention(q, key, value, attn_mask=m)
+        return out
+
+    return F.scaled_dot_product_attention(query, key, value, attn_mask=mask)
+
+
+def _sliced_attention(chunks, query, key, value, mask, scale, upcast, upcast_softmax):
+    "Groups of heads at a time, with the plain math implementation (same as diffusers' `get_attention_scores()`)"
+    batch, heads = query.shape[:2]
+    q, k, v = (x.reshape(batch * heads, *x.shape[2:]) for x in (query, key, value))
+    if mask is not None:
+        mask = mask.expand(batch, heads, *mask.shape[2:]).reshape(batch * heads, *mask.shape[2:])
+
+    out = torch.empty_like(q)
+    slice_size = max(1, math.ceil(q.shape[0] / chunks))
+    scale = scale or 1 / math.sqrt(q.shape[-1])
+    for i in range(0, q.shape[0], slice_size):
+        q_slice, k_slice = q[i : i + slice_size], k[i : i + slice_size]
+        if upcast:
+            q_slice, k_slice = q_slice.float(), k_slice.float()
+
+        if mask is None:
+            bias, beta = torch.empty(1, 1, 1, dtype=q_slice.dtype, device=q_slice.device), 0
+        else:
+            bias, beta = mask[i : i + slice_size].to(q_slice.dtype), 1
+
+        # scaled while multiplying, so fp16 scores don't overflow before the scale
+        scores = torch.baddbmm(bias, q_slice, k_slice.transpose(1, 2), beta=beta, alpha=scale)
+        if upcast_softmax:
+            scores = scores.float()
+        probs = scores.softmax(dim=-1).to(v.dtype)
+        out[i : i + slice_size] = torch.bmm(probs, v[i : i + slice_size])
+    return out.view(batch, heads, *out.shape[1:])
+
+
+def _get_chunks(query, key, mem_free, batch=None, upcast=False) -> int:
+    """
+    The number of chunks needed to fit the attention scores (of the plain implementation) in the free memory.
+    `batch` overrides the batch size of `query`, e.g. with the batch size of its bucket. The scores are in fp32 with
+    `upcast`.
+    """
+    _, heads, q_len, _ = query.shape
+    batch = batch or query.shape[0]
+    element_size = 4 if upcast else query.element_size()
+    mem_required = batch * heads * q_len * key.shape[2] * element_size * 3
+    if mem_required <= mem_free:
+        return 1
+    return min(MAX_CHUNKS, 2 ** math.ceil(math.log2(mem_required / mem_free)))
+
+
+def _is_compiling() -> bool:
+    compiler = getattr(torch, "compiler", None)
+    return compiler is not None and hasattr(compiler, "is_compiling") and compiler.is_compiling()
+
+
+def _is_vmapped(tensor) -> bool:
+    functorch = getattr(torch._C, "_functorch", None)
+    return functorch is not None and hasattr(functorch, "is_batchedtensor") and functorch.is_batchedtensor(tensor)
+
+
+def _get_free_memory(device):
+    from sdkit.utils import get_available_memory, is_cpu_device
+
+    if is_cpu_device(device):
+        return math.inf
+    return get_available_memory(device) * 0.8
+
+
+def _set_legacy_attention(context: Context, model):
+    "The previous behavior: sliced attention, replaced by xformers if it's installed"
+    if hasattr(model, "set_attention_slice"):
+        model.set_attention_slice(4 if context.vram_usage_level == "high" else 1)
+
+    if has_xformers() and hasattr(model, "enable_xformers_memory_efficient_attention"):
+        try:
+            model.enable_xformers_memory_efficient_attention()
+        except Exception as e:
+            log.warn(f"Could not enable xformers: {e}")
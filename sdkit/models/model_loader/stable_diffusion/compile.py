@@ -0,0 +1,135 @@
+"""
+Compiles the UNet and the VAE decoder with `torch.compile`, when the model is loaded with
+`load_model(context, "stable-diffusion", compile_config={...})`.
+
+The compiled kernels and the autotuning results (of inductor and triton) are saved in
+`{context.compiled_model_cache_dir}/{model_hash}-torch{version}-{device name}`, so a fresh process that loads the
+same model on the same kind of GPU reuses them, instead of compiling and autotuning again. The cache directory is
+process-wide (torch reads it from environment variables, and keeps using the first one), so it's set by the first
+compiled model of the process, and is shared by the models (and threads) that are compiled after it. The cached
+artifacts are keyed by their graph and inputs, so sharing the directory is safe.
+
+A compiled UNet has its own `forward`, so `step_cache` and `context.cuda_graphs` don't apply to it (the `mode`
+`"reduce-overhead"` uses CUDA graphs instead).
+
+The compilation itself happens on the first call of each shape, so use `sdkit.generate.warmup()` to compile (and
+warm up) the shapes in `compile_config["shapes"]` before the first real request.
+"""
+
+import os
+import re
+import threading
+
+from sdkit import Context
+from sdkit.utils import log
+
+COMPILE_DEFAULTS = {
+    "unet": True,
+    "vae": True,
+    "mode": "max-autotune-no-cudagraphs",  # `"default"` compiles faster, but the kernels aren't autotuned
+    "dynamic": False,
+    "shapes": [],  # (width, height) or (width, height, batch_size), for `warmup()`
+}
+
+_cache_dir_lock = threading.Lock()
+_cache_dir = None  # the compile cache directory of this process, see use_compile_cache_dir()
+
+
+def get_compile_config(compile_config) -> dict:
+    if not compile_config:
+        return None
+    if compile_config is True:
+        compile_config = {}
+    return {**COMPILE_DEFAULTS, **compile_config}
+
+
+def get_compile_cache_dir(context: Context, model_hash: str):
+    "Returns the directory for the compiled artifacts of this model, torch version and device, or None if disabled"
+    import torch
+
+    if not context.compiled_model_cache_dir or not model_hash:
+        return None
+
+    device = context.torch_device
+    device_name = torch.cuda.get_device_name(device) if device.type == "cuda" else device.type
+    key = f"{model_hash}-torch{torch.__version__}-{device_name}"
+    return os.path.join(context.compiled_model_cache_dir, re.sub(r"[^\w.+-]+", "_", key))
+
+
+def use_compile_cache_dir(cache_dir: str) -> str:
+    """
+    Points the caches of inductor (compiled graphs, autotuning) and triton (kernels) to this directory, unless this
+    process already uses one (torch caches the directory once read). Returns the directory in use.
+    """
+    global _cache_dir
+
+    import torch
+
+    with _cache_dir_lock:
+        if cache_dir is None or _cache_dir is not None:
+            return _cache_dir
+        if "TORCHINDUCTOR_CACHE_DIR" in os.environ:  # set by the user
+            _cache_dir = os.environ["TORCHINDUCTOR_CACHE_DIR"]
+            return _cache_dir
+
+        os.makedirs(cache_dir, exist_ok=True)
+        os.environ["TORCHINDUCTOR_CACHE_DIR"] = os.path.join(cache_dir, "inductor")
+        os.environ.setdefault("TRITON_CACHE_DIR", os.path.join(cache_dir, "triton"))
+
+        inductor_config = torch._inductor.config
+        if hasattr(inductor_config, "fx_graph_cache"):
+            inductor_config.fx_graph_cache = True
+
+        _cache_dir = cache_dir
+        return _cache_dir
+
+
+def compile_pipeline(context: Context, pipe, model_hash: str, compile_config: dict):
+    "Compiles the UNet and the VAE decoder (in place), as per `compile_config` (see `COMPILE_DEFAULTS`)"
+    import torch
+    import torch._dynamo
+    import torch._inductor.config
+
+    from sdkit.generate.vae_engine import get_vae_engine, release_vae_engine
+
+    config = get_compile_config(compile_config)
+    if config is None:
+        return
+    if not hasattr(torch, "compile"):
+        log.warn("torch.compile needs torch 2.0 or newer, not compiling the model")
+        return
+
+    cache_dir = use_compile_cache_dir(get_compile_cache_dir(context, model_hash))
+
+    # each shape of a non-dynamic graph is a separate compilation
+    min_cache_size = 2 * len(config["shapes"]) + 8
+    torch._dynamo.config.cache_size_limit = max(torch._dynamo.config.cache_size_limit, min_cache_size)
+    if context.torch_device.type == "cuda":
+        torch.backends.cudnn.benchmark = True
+
+    options = {"mode": config["mode"], "dynamic": config["dynamic"]}
+    if config["unet"]:
+        if compile_module(pipe.unet, options):
+            log.info("The UNet is compiled, so step_cache and context.cuda_graphs won't apply to it")
+        else:
+            log.info("Not compiling the UNet, since it's already accelerated or offloaded")
+
+    if config["vae"]:
+        # the VAE engine compiles the decoder of the VAE that it decodes with, also when it makes a new fp32 copy
+        pipe.vae._compile_options = options
+        release_vae_engine(pipe.vae)
+        if "forward" not in vars(get_vae_engine(context, pipe.vae).decode_vae.decoder):
+            log.info("Not compiling the VAE decoder, since it's already accelerated or offloaded")
+
+    log.info(f"Compiling the model with {options}, using the cache at {cache_dir}. Use warmup() to compile it now")
+
+
+def compile_module(module, options: dict) -> bool:
+    "Compiles the forward of this module (in place). Returns False for modules that are patched or offloaded"
+    import torch
+
+    if "forward" in vars(module) or hasattr(module, "_hf_hook"):  # TensorRT, DirectML, offloaded or compiled already
+        return False
+
+    module.forward = torch.compile(type(module).forward.__get__(module), **options)
+    return True
@@ -0,0 +1,158 @@
+"""
+An on-disk cache of Stable Diffusion checkpoints that have been converted to the diffusers format.
+
+Disabled by default, enable it by setting `context.converted_model_cache_dir`. Each entry is a directory named
+`{quick_hash}-{fp16|fp32}-diffusers{version}` in that directory, containing the pipeline (saved with
+`save_pretrained()` as safetensors, in the dtype used for rendering) and a `sdkit_meta.json` file with the properties
+that are otherwise detected while loading the checkpoint (model type, prediction type etc). Entries aren't evicted,
+so old entries (e.g. of older diffusers versions, or deleted models) and the `.tmp` directories left by a crashed
+conversion need to be deleted manually.
+
+An entry is written in a temporary directory (unique to each writer), and is renamed to its final name after the
+meta file is written, i.e. after the model has loaded successfully. So several processes can convert the same model
+at the same time, and a completed entry is never deleted by another writer. A directory without a meta file (e.g.
+from an older sdkit version) is an incomplete entry, and is replaced on the next load.
+"""
+
+import json
+import os
+import shutil
+import tempfile
+
+from sdkit import Context
+from sdkit.utils import log
+
+META_FILE_NAME = "sdkit_meta.json"
+CACHE_VERSION = 1
+
+
+def get_cache_path(context: Context, model_hash: str):
+    "Returns the directory for this model in the cache, or None if the cache is disabled"
+    import diffusers
+
+    if not context.converted_model_cache_dir or not model_hash:
+        return None
+
+    precision = "fp16" if context.half_precision else "fp32"
+    return os.path.join(context.converted_model_cache_dir, f"{model_hash}-{precision}-diffusers{diffusers.__version__}")
+
+
+def get_cached_model_meta(cache_path: str, config_file_path=None):
+    """
+    Returns the saved meta data of the converted model, or None if it isn't in the cache (or was converted
+    using a different config file).
+    """
+    if cache_path is None:
+        return None
+
+    meta_path = os.path.join(cache_path, META_FILE_NAME)
+    if not os.path.exists(meta_path):
+        return None
+
+    try:
+        with open(meta_path, "r", encoding="utf-8") as f:
+            meta = json.load(f)
+    except Exception as e:
+        log.warn(f"Ignoring the converted model cache at {cache_path}, since its meta file is unreadable: {e}")
+        return None
+
+    if meta.get("version") != CACHE_VERSION:
+        return None
+    if config_file_path is not None and os.path.abspath(str(config_file_path)) != meta["config_file_path"]:
+        return None
+    if not os.path.exists(meta["config_file_path"]):
+        return None
+
+    return meta
+
+
+def load_cached_pipeline(context: Context, cache_path: str, meta: dict):
+    import torch
+    import diffusers
+
+    log.info(f"Loading the converted model from {cache_path}")
+
+    pipeline_class = getattr(diffusers, meta["pipeline_class"])
+    kwargs = {}
+    if "XL" not in meta["pipeline_class"]:
+        kwargs = {"safety_checker": None, "requires_safety_checker": False}
+
+    return pipeline_class.from_pretrained(
+        cache_path,
+        torch_dtype=torch.float16 if context.half_precision else torch.float32,
+        use_safetensors=True,
+        local_files_only=True,
+        **kwargs,
+    )
+
+
+def save_pipeline(context: Context, pipe, cache_path: str):
+    """
+    Saves the weights of the converted pipeline (on the CPU, in the dtype used for rendering) in a temporary directory.
+    Returns `(pipeline, tmp_path)`, the pipeline converted to that dtype, and the directory to pass to `save_meta()`
+    (which completes the entry). `tmp_path` is None if the weights couldn't be saved.
+    """
+    import torch
+
+    dtype = torch.float16 if context.half_precision else torch.float32
+    pipe = pipe.to("cpu", dtype, silence_dtype_warnings=True)
+
+    tmp_path = None
+    try:
+        tmp_path = make_tmp_dir(cache_path)
+        log.info(f"Saving the converted model to {cache_path}")
+        pipe.save_pretrained(tmp_path, safe_serialization=True)
+    except Exception as e:
+        log.warn(f"Could not save the converted model to {cache_path}: {e}")
+        if tmp_path is not None:
+            shutil.rmtree(tmp_path, ignore_errors=True)
+        tmp_path = None
+
+    return pipe, tmp_path
+
+
+def save_meta(tmp_path: str, cache_path: str, meta: dict):
+    "Writes the meta file, and moves the entry from `tmp_path` to `cache_path`"
+    if tmp_path is None:  # the weights couldn't be saved
+        return
+
+    meta = dict(meta, version=CACHE_VERSION, config_file_path=os.path.abspath(str(meta["config_file_path"])))
+    try:
+        with open(os.path.join(tmp_path, META_FILE_NAME), "w", encoding="utf-8") as f:
+            json.dump(meta, f, indent=2)
+    except Exception as e:
+        log.warn(f"Could not save the converted model meta data to {cache_path}: {e}")
+        shutil.rmtree(tmp_path, ignore_errors=True)
+        return
+
+    commit_entry(tmp_path, cache_path, is_complete=lambda path: os.path.exists(os.path.join(path, META_FILE_NAME)))
+
+
+def make_tmp_dir(cache_path: str) -> str:
+    "Returns a new directory (unique to this writer) next to `cache_path`, for writing a cache entry"
+    parent = os.path.dirname(cache_path)
+    os.makedirs(parent, exist_ok=True)
+    return tempfile.mkdtemp(prefix=os.path.basename(cache_path) + ".", suffix=".tmp", dir=parent)
+
+
+def commit_entry(tmp_path: str, cache_path: str, is_complete):
+    """
+    Renames the finished entry in `tmp_path` to `cache_path`. If another writer has already completed `cache_path`,
+    keeps that one and deletes `tmp_path`. An incomplete directory at `cache_path` (`is_complete(path)` is False) is
+    replaced.
+    """
+    if os.path.isdir(cache_path) and not is_complete(cache_path):
+        parent, name = os.path.split(cache_path)
+        stale_path = tempfile.mkdtemp(prefix=name + ".", suffix=".old", dir=parent)
+        try:
+            os.replace(cache_path, os.path.join(stale_path, "entry"))  # moved aside first, in case it's being replaced
+        except OSError:
+            pass
+        shutil.rmtree(stale_path, ignore_errors=True)
+
+    try:
+        os.rename(tmp_path, cache_path)
+    except OSError:  # completed by another writer in the meantime
+        if not os.path.isdir(cache_path):
+            log.warn(f"Could not save the cache entry at {cache_path}")
+        shutil.rmtree(tmp_path, ignore_errors=True)
@@ -0,0 +1,275 @@
+"""
+Runs a model that doesn't fit in VRAM, by keeping its weights in pinned RAM and copying each block to the GPU only
+while it runs. Unlike moving each block with `.to()` (or accelerate's sequential cpu offload), the next block is
+copied on a separate CUDA stream while the current block computes, so the PCIe transfers overlap with the compute.
+
+* The weights of each block are packed into one contiguous pinned buffer, so a block is copied with a single copy.
+* The blocks are copied into a small ring of reusable device buffers. Nothing is allocated while rendering.
+* The weights are read-only, so evicting a block only points its tensors back to the pinned buffer (no copy).
+* The order of the blocks is learnt while running, so the prefetch follows the actual execution order.
+
+Requires CUDA.
+"""
+
+from functools import partial
+
+import torch
+
+from sdkit.utils import log
+
+ALIGNMENT = 256  # bytes
+
+
+class _TensorRef:
+    __slots__ = ("module", "name", "is_param", "offset", "nbytes", "dtype", "shape", "host", "device_view")
+
+    def __init__(self, module, name, is_param, offset, tensor):
+        self.module = module
+        self.name = name
+        self.is_param = is_param
+        self.offset = offset
+        self.nbytes = tensor.numel() * tensor.element_size()
+        self.dtype = tensor.dtype
+        self.shape = tensor.shape
+        self.host = None
+        self.device_view = None
+
+    def get(self):
+        return self.module._parameters[self.name] if self.is_param else self.module._buffers[self.name]
+
+    def point_to(self, value):
+        if self.is_param:
+            self.module._parameters[self.name].data = value
+        else:
+            self.module._buffers[self.name] = value
+
+
+class _Block:
+    def __init__(self, module):
+        self.module = module
+        self.refs = []
+        self.host_buffer = None
+        self.nbytes = 0
+        self.slot = None
+
+
+class PrefetchingBlockOffloader:
+    """
+    * device: the CUDA device to run the blocks on
+    * blocks: the list of modules (roughly in the order of execution) that are kept in RAM
+    * buffer_count: the number of device buffers (i.e. blocks in VRAM at a time). At least 2, to allow prefetching.
+    """
+
+    def __init__(self, device, blocks: list, buffer_count: int = 2):
+        self.device = torch.device(device)
+        self.blocks = [_Block(b) for b in blocks]
+        self.stream = torch.cuda.Stream(self.device)
+
+        for block in self.blocks:
+            self._adopt(block)
+
+        slot_size = max((b.nbytes for b in self.blocks), default=0)
+        self.slots = [torch.empty(slot_size, dtype=torch.uint8, device=self.device) for _ in range(buffer_count)]
+        self.slot_block = [None] * buffer_count  # index of the block that is (being) copied to each slot
+        self.slot_ready = [None] * buffer_count  # cuda event, recorded after the copy to the slot
+        self.next_slot = 0
+
+        self.next_block = {}  # block index -> index of the block that ran after it
+        self.last_block = None
+
+        self._hooks = [
+            b.module.register_forward_pre_hook(partial(self._pre_hook, i)) for i, b in enumerate(self.blocks)
+        ]
+
+        total = sum(b.nbytes for b in self.blocks)
+        log.info(
+            f"Offloading {len(self.blocks)} blocks ({total / 1024**2:.0f} MB) to pinned RAM, "
+            f"using {buffer_count} x {slot_size / 1024**2:.0f} MB device buffers"
+        )
+
+    def evict_all(self):
+        "Points all the blocks to their RAM copy. Call this before modifying the weights (e.g. applying a LoRA)"
+        self.stream.synchronize()
+        for i, block in enumerate(self.blocks):
+            if block.slot is not None:
+                self._evict(i)
+
+    def remove(self):
+        "Removes the hooks and leaves the weights in RAM"
+        self.evict_all()
+        for hook in self._hooks:
+            hook.remove()
+        self.slots = []
+
+    def _pre_hook(self, i, module, args):
+        compute_stream = torch.cuda.current_stream(self.device)
+
+        if self.last_block is not None and self.last_block != i:
+            self.next_block[self.last_block] = i
+        self.last_block = i
+
+        block = self.blocks[i]
+        self._check_adopted(block)
+
+        if block.slot is None:  # wasn't prefetched
+            self._load(i, compute_stream)
+
+        compute_stream.wait_event(self.slot_ready[block.slot])
+
+        next_i = self.next_block.get(i)
+        if next_i is not None and self.blocks[next_i].slot is None:
+            self._load(next_i, compute_stream, exclude_slot=block.slot)
+
+    def _load(self, i, compute_stream, exclude_slot=None):
+        block = self.blocks[i]
+
+        slot = self.next_slot
+        if slot == exclude_slot:
+            slot = (slot + 1) % len(self.slots)
+        self.next_slot = (slot + 1) % len(self.slots)
+
+        if self.slot_block[slot] is not None:
+            self._evict(self.slot_block[slot])
+
+        # wait for the kernels (already queued on the compute stream) that use the previous block in this slot
+        slot_free = torch.cuda.Event()
+        slot_free.record(compute_stream)
+        self.stream.wait_event(slot_free)
+
+        buffer = self.slots[slot]
+        with torch.cuda.stream(self.stream):
+            buffer[: block.nbytes].copy_(block.host_buffer, non_blocking=True)
+            ready = torch.cuda.Event()
+            ready.record(self.stream)
+
+        for ref in block.refs:
+            ref.device_view = _view(buffer, ref)
+            ref.point_to(ref.device_view)
+
+        block.slot = slot
+        self.slot_block[slot] = i
+        self.slot_ready[slot] = ready
+
+    def _evict(self, i):
+        block = self.blocks[i]
+        for ref in block.refs:
+            ref.point_to(ref.host)
+            ref.device_view = None
+
+        self.slot_block[block.slot] = None
+        block.slot = None
+
+    def _check_adopted(self, block):
+        "Adopts the tensors again if they were replaced, e.g. by `.half()`, `.to()` or `load_state_dict()`"
+        for ref in block.refs:
+            t = ref.get()
+            if t is None:
+                continue
+
+            expected = ref.host if block.slot is None else ref.device_view
+            if t.data_ptr() != expected.data_ptr() or t.dtype != ref.dtype or t.shape != ref.shape:
+                break
+        else:
+            return
+
+        log.debug("Re-adopting the weights of an offloaded block, since they were changed")
+        if block.slot is not None:
+            self.stream.synchronize()
+            # a resident tensor that wasn't replaced has the latest values in the device buffer
+            for ref in block.refs:
+                t = ref.get()
+                if t is not None and t.data_ptr() == ref.device_view.data_ptr():
+                    ref.point_to(ref.device_view.to("cpu"))
+            self.slot_block[block.slot] = None
+            block.slot = None
+
+        self._adopt(block)
+        if block.nbytes > self.slots[0].numel():  # e.g. converted to a larger dtype
+            self.evict_all()
+            self.slots = [torch.empty(block.nbytes, dtype=torch.uint8, device=self.device) for _ in self.slots]
+
+    def _adopt(self, block):
+        "Packs the parameters and buffers of the block into a pinned buffer, and points the tensors to it"
+        tensors = []
+        for m in block.module.modules():
+            tensors += [(m, name, True, p) for name, p in m._parameters.items() if p is not None]
+            tensors += [(m, name, False, b) for name, b in m._buffers.items() if b is not None]
+
+        block.refs = []
+        offset = 0
+        for module, name, is_param, tensor in tensors:
+            ref = _TensorRef(module, name, is_param, offset, tensor)
+            block.refs.append(ref)
+            offset += (ref.nbytes + ALIGNMENT - 1) // ALIGNMENT * ALIGNMENT
+
+        block.nbytes = offset
+        block.host_buffer = torch.empty(offset, dtype=torch.uint8, pin_memory=True)
+
+        for ref, (_, _, _, tensor) in zip(block.refs, tensors):
+            ref.host = _view(block.host_buffer, ref)
+            ref.host.copy_(tensor.data)
+            ref.point_to(ref.host)
+
+
+def _view(buffer, ref):
+    return buffer[ref.offset : ref.offset + ref.nbytes].view(ref.dtype).view(ref.shape)
+
+
+def get_unet_blocks(unet) -> list:
+    """
+    Splits a diffusers UNet into fine-grained blocks (the resnets, attentions, samplers and the smaller top-level
+    modules), to keep the size of the device buffers small. Returns the list of blocks.
+    """
+    blocks = []
+
+    def add_children(module):
+        for child in module.children():
+            if isinstance(child, torch.nn.ModuleList):
+                for c in child:
+                    if _has_tensors(c):
+                        blocks.append(c)
+            elif _has_tensors(child):
+                blocks.append(child)
+
+    for name, child in unet.named_children():
+        if name in ("down_blocks", "up_blocks"):
+            for b in child:
+                add_children(b)
+        elif name == "mid_block":
+            add_children(child)
+        elif _has_tensors(child):
+            blocks.append(child)
+
+    return blocks
+
+
+def _has_tensors(module):
+    return any(True for _ in module.parameters()) or any(True for _ in module.buffers())
+
+
+def offload_diffusers_pipeline(context, pipe):
+    """
+    Keeps the UNet in pinned RAM with a `PrefetchingBlockOffloader`, and the other components (text encoders, VAE)
+    in RAM with accelerate's cpu offload (same as `enable_sequential_cpu_offload()`).
+    """
+    from accelerate import cpu_offload
+
+    device = context.torch_device
+    unet = pipe.unet
+
+    blocks = get_unet_blocks(unet)
+    in_blocks = {id(t) for b in blocks for t in list(b.parameters()) + list(b.buffers())}
+    for m in unet.modules():  # keep the tensors that aren't part of any block on the device
+        for name, p in m._parameters.items():
+            if p is not None and id(p) not in in_blocks:
+                p.data = p.data.to(device)
+        for name, b in m._buffers.items():
+            if b is not None and id(b) not in in_blocks:
+                m._buffers[name] = b.to(device)
+
+    context.block_offloader = PrefetchingBlockOffloader(device, blocks)
+
+    for name, component in pipe.components.items():
+        if name == "unet" or not isinstance(component, torch.nn.Module):
+            continue
+        cpu_offload(component, device, offload_buffers=len(component._parameters) > 0)
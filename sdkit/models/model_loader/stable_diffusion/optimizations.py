@@ -6,7 +6,9 @@ from ldm.util import default
 from torch import einsum
 
 from sdkit import Context
-from sdkit.utils import log, is_cpu_device, memory_stats, mem_get_info
+from sdkit.utils import log, is_cpu_device, get_available_memory, memory_allocated
+
+STEPS_CACHE_TOLERANCE = 0.1  # recompute the attention steps if the allocated memory changed by 10% of the free memory
 
 
 def send_to_device(context: Context, model):
@@ -90,19 +92,33 @@ def send_to_device(context: Context, model):
         model.model.to(context.torch_device)
         d.input_blocks, d.middle_block, d.output_blocks, d.time_embed = tmp
 
-        d.time_embed.log_name = "model.model.diffusion_model.time_embed"
-        d.time_embed.register_forward_pre_hook(move_to_gpu)
+        if context.torch_device.type == "cuda":
+            # keep the blocks in pinned RAM, and prefetch the next block while the current one runs
+            from .offload import PrefetchingBlockOffloader
+
+            blocks = [d.time_embed, *d.input_blocks, d.middle_block, *d.output_blocks]
+            context.block_offloader = PrefetchingBlockOffloader(context.torch_device, blocks)
+
+            def move_fs_and_cs_to_cpu(module, _):
+                if context.module_in_gpu is not None:
+                    context.module_in_gpu.to("cpu")
+                    context.module_in_gpu = None
 
-        for i, block in enumerate(d.input_blocks):
-            block.log_name = f"model.model.diffusion_model.input_blocks[{i}]"
-            block.register_forward_pre_hook(move_to_gpu)
+            d.register_forward_pre_hook(move_fs_and_cs_to_cpu)
+        else:
+            d.time_embed.log_name = "model.model.diffusion_model.time_embed"
+            d.time_embed.register_forward_pre_hook(move_to_gpu)
 
-        d.middle_block.log_name = "model.model.diffusion_model.middle_block"
-        d.middle_block.register_forward_pre_hook(move_to_gpu)
+            for i, block in enumerate(d.input_blocks):
+                block.log_name = f"model.model.diffusion_model.input_blocks[{i}]"
+                block.register_forward_pre_hook(move_to_gpu)
 
-        for i, block in enumerate(d.output_blocks):
-            block.log_name = f"model.model.diffusion_model.output_blocks[{i}]"
-            block.register_forward_pre_hook(move_to_gpu)
+            d.middle_block.log_name = "model.model.diffusion_model.middle_block"
+            d.middle_block.register_forward_pre_hook(move_to_gpu)
+
+            for i, block in enumerate(d.output_blocks):
+                block.log_name = f"model.model.diffusion_model.output_blocks[{i}]"
+                block.register_forward_pre_hook(move_to_gpu)
     else:
         model.model.to(context.torch_device)
 
@@ -125,8 +141,24 @@ def get_context_kv(attention_context):
 # - using this code makes the sampler run at 5.6 to 5.9 it/sec, and consume ~3.6 GB of VRAM on lower-end PCs, and ~4.9 GB on higher-end PCs
 def make_attn_forward(context: Context, attn_precision="fp16"):
     app_context = context
+    steps_cache = {}  # bucket -> (steps, allocated memory when they were computed, free memory then)
 
     def get_steps(q, k):
+        steps = _get_fixed_steps()
+        if steps is not None:
+            return steps
+
+        # the same steps for (batch * heads) rounded up to a power of 2, computed for that size
+        batch = 1 << max(0, q.shape[0] - 1).bit_length()
+        key = (batch, q.shape[1], k.shape[1], q.element_size())
+        allocated = memory_allocated(q.device)  # cheap, unlike querying the free memory
+        entry = steps_cache.get(key)
+        if entry is None or abs(allocated - entry[1]) > entry[2] * STEPS_CACHE_TOLERANCE:
+            mem_free = get_available_memory(q.device)
+            entry = steps_cache[key] = (_get_steps(batch, q, k, mem_free), allocated, mem_free)
+        return entry[0]
+
+    def _get_fixed_steps():
         if context.torch_device.type in ("cpu", "mps") or "SET_ATTENTION_STEP_TO_2" in context.vram_optimizations:
             return 2
         elif "SET_ATTENTION_STEP_TO_4" in context.vram_optimizations:
@@ -139,18 +171,12 @@ def make_attn_forward(context: Context, attn_precision="fp16"):
             return 16
         elif "SET_ATTENTION_STEP_TO_24" in context.vram_optimizations:
             return 24  # use for low
+        return None
 
-        # figure out the available memory
-        stats = memory_stats(q.device)
-        mem_active = stats.get("active_bytes.all.current", 0)
-        mem_reserved = stats.get("reserved_bytes.all.current", 0)
-        mem_free_cuda, _ = mem_get_info(context.torch_device)
-        mem_free_torch = mem_reserved - mem_active
-        mem_free_total = mem_free_cuda + mem_free_torch
-
+    def _get_steps(batch, q, k, mem_free_total):
         # figure out the required memory
         gb = 1024**3
-        tensor_size = q.shape[0] * q.shape[1] * k.shape[1] * q.element_size()
+        tensor_size = batch * q.shape[1] * k.shape[1] * q.element_size()
         modifier = 3 if q.element_size() == 2 else 2.5
         mem_required = tensor_size * modifier
 
@@ -0,0 +1,25 @@
+"""
+TAESD is a tiny VAE decoder, used for cheap previews of the intermediate steps (see `sdkit.generate.progress`).
+
+`context.model_paths["taesd"]` can be a local directory (in the diffusers format), or a Hugging Face repo id, e.g.
+`"madebyollin/taesd"` for SD 1.x/2.x or `"madebyollin/taesdxl"` for SD XL.
+"""
+
+import torch
+
+from sdkit import Context
+
+
+def load_model(context: Context, **kwargs):
+    from diffusers import AutoencoderTiny
+
+    dtype = torch.float16 if context.half_precision else torch.float32
+    taesd = AutoencoderTiny.from_pretrained(context.model_paths["taesd"], torch_dtype=dtype)
+    taesd.encoder = None  # only the decoder is used for previews
+    taesd.eval()
+
+    return taesd.to(context.torch_device)
+
+
+def unload_model(context: Context, **kwargs):
+    pass
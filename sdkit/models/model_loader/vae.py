@@ -89,6 +89,10 @@ def _set_vae(context: Context, vae: dict):
                 mod._hf_hook.weights_map[v_type].data = v.to("cpu")
         else:
             m.vae.load_state_dict(vae, strict=False)
+
+        from sdkit.generate.vae_engine import refresh_vae_engine
+
+        refresh_vae_engine(m.vae)
     else:
         model.first_stage_model.load_state_dict(vae, strict=False)
 
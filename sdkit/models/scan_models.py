@@ -1,8 +1,43 @@
 import picklescan.scanner
 
+from sdkit.utils import get_file_metadata, list_model_files, trace, update_file_metadata
 
-def scan_model(file_path):
+
+def scan_model(file_path, use_index=True):
     """
     Uses `picklescan.scanner.scan_file_path()` to scan and return the results.
+
+    With `use_index`, the result is saved in the metadata index of the file's directory, and reused until the file
+    changes (its index key includes the ctime, which changes on every write, see `sdkit.utils.metadata_index`).
     """
-    return picklescan.scanner.scan_file_path(file_path)
+    if use_index:
+        scan = get_file_metadata(file_path).get("scan")
+        if scan:
+            return picklescan.scanner.ScanResult([], **scan)
+
+    with trace("model_scan"):
+        result = picklescan.scanner.scan_file_path(file_path)
+
+    if use_index and not result.scan_err:
+        scan = {
+            "scanned_files": result.scanned_files,
+            "issues_count": result.issues_count,
+            "infected_files": result.infected_files,
+        }
+        update_file_metadata(file_path, scan=scan)
+
+    return result
+
+
+def scan_models(paths, max_workers=4, use_index=True) -> dict:
+    """
+    Scans several model files in parallel, and returns the results as `{path: scan_result}`.
+
+    * paths: a list of file paths, or a directory (the model files in it are scanned, recursively).
+    """
+    from concurrent.futures import ThreadPoolExecutor
+
+    paths = list_model_files(paths)
+    with ThreadPoolExecutor(max_workers=max_workers, thread_name_prefix="sdkit-scan") as executor:
+        results = executor.map(lambda path: scan_model(path, use_index=use_index), paths)
+        return dict(zip(paths, results))
@@ -1 +1,6 @@
-from .merge_models import merge_models, merge_multiple_models
+from .merge_models import (
+    merge_models,
+    merge_models_add_difference,
+    merge_models_streaming,
+    merge_multiple_models,
+)
@@ -1,11 +1,18 @@
 # loosely inspired by https://github.com/lodimasq/batch-checkpoint-merger/blob/master/batch_checkpoint_merger/main.py#L71
 
+import json
+import math
+import os
+import struct
+
 from sdkit.utils import load_tensor_file, log, save_tensor_file
 
+MERGE_CHUNK_NUMEL = 16 * 1024 * 1024  # elements per chunk, per model
+
 
 def merge_models(model0_path: str, model1_path: str, ratio: float, out_path: str, use_fp16=True):
     """
-    Merges (using weighted sum) and writes to the `out_path`.
+    Merges (using weighted sum) and writes to the `out_path`. Streams the tensors, see `merge_models_streaming()`.
 
     * model0, model1 - the first and second model files to be merged
     * ratio - the ratio of the second model. 1 means only the second model will be used.
@@ -13,19 +20,195 @@ def merge_models(model0_path: str, model1_path: str, ratio: float, out_path: str
     """
 
     log.info(f"[cyan]Merge models:[/cyan] Merging {model0_path} and {model1_path}, ratio {ratio}")
-    merged = merge_two_models(model0_path, model1_path, ratio, use_fp16)
+    merge_models_streaming([model0_path, model1_path], [1 - ratio, ratio], out_path, use_fp16=use_fp16)
 
-    log.info(f"[cyan]Merge models:[/cyan] ... saving as {out_path}")
+
+def merge_models_add_difference(
+    model_a_path: str, model_b_path: str, model_c_path: str, alpha: float, out_path: str, **kwargs
+):
+    """
+    Writes `A + alpha * (B - C)` to `out_path`, in a single pass over the three files. E.g. to transplant a fine-tune
+    (B, trained from C) onto a different model (A). The keys missing in any of the models are taken from A.
+
+    The keyword arguments are passed to `merge_models_streaming()`.
+    """
+    log.info(f"[cyan]Merge models:[/cyan] {model_a_path} + {alpha} * ({model_b_path} - {model_c_path})")
+    models = [model_a_path, model_b_path, model_c_path]
+    merge_models_streaming(models, [1, alpha, -alpha], out_path, normalize=False, **kwargs)
+
+
+def merge_models_streaming(
+    model_paths: list,
+    weights: list,
+    out_path: str,
+    normalize=True,
+    use_fp16=True,
+    key_name_pattern="model",
+    device="cpu",
+    chunk_numel=MERGE_CHUNK_NUMEL,
+):
+    """
+    Writes `sum(weight_i * model_i)` to `out_path`, reading each tensor from the (memory-mapped) files only when it's
+    merged, in chunks of at most `chunk_numel` elements per model. Only a few chunks are in memory at a time, instead
+    of the full models. Safetensors outputs are written incrementally (other formats are collected in memory first).
+
+    * model_paths - the .safetensors or .ckpt files to merge (any number of them).
+    * weights - one weight per model. Can be negative, e.g. for add-difference merges.
+    * normalize - if True, the weights of each key are normalized among the models that contain the key (a weighted
+      sum). Keys whose weights add up to 0 are copied from the first model that contains them. If False, keys missing
+      in any of the models are copied from the first model that contains them.
+    * use_fp16 - save the merged floating-point tensors in fp16.
+    * key_name_pattern - only the keys containing this string are merged. The other keys are copied from the first
+      model that contains them. `None` merges all the keys.
+    * device - where the chunks are merged, e.g. "cuda:0". The accumulation is in fp32.
+    """
+    import torch
+
+    if len(model_paths) != len(weights):
+        raise RuntimeError("Incorrect number of weights provided while merging models! Needs one weight per model.")
+
+    readers = [_TensorReader(path) for path in model_paths]
+
+    plan = []
+    for key in _all_keys(readers):
+        sources = [(r, w) for r, w in zip(readers, weights) if key in r.infos]
+        shape, dtype = sources[0][0].infos[key]
+
+        mismatched = [r.path for r, _ in sources if r.infos[key][0] != shape]
+        if mismatched:
+            log.warn(f"Not merging {key}, since its shape in {mismatched} is different from {shape}")
+
+        mergeable = dtype.is_floating_point and (key_name_pattern is None or key_name_pattern in key)
+        mergeable = mergeable and not mismatched and (normalize or len(sources) == len(readers))
+        if mergeable:
+            total = sum(w for _, w in sources)
+            if normalize and total == 0:  # e.g. a key only in a model with a weight of 0. can't be normalized
+                sources = [(sources[0][0], 1.0)]
+            elif normalize:
+                sources = [(r, w / total) for r, w in sources]
+            out_dtype = torch.float16 if use_fp16 else dtype
+        else:
+            sources = sources[:1]
+            out_dtype = dtype
+
+        plan.append((key, shape, out_dtype, sources, mergeable))
+
+    log.info(f"[cyan]Merge models:[/cyan] Merging {len(plan)} tensors from {len(readers)} models into {out_path}")
+
+    def merged_chunks():
+        for key, shape, out_dtype, sources, mergeable in plan:
+            for start, end in _get_chunk_rows(shape, chunk_numel):
+                if not mergeable:
+                    yield key, sources[0][0].read(key, start, end).to(out_dtype)
+                    continue
+
+                acc = None
+                for reader, weight in sources:
+                    chunk = reader.read(key, start, end).to(device, torch.float32)
+                    acc = chunk * weight if acc is None else acc.add_(chunk, alpha=weight)  # never in-place on a file
+                yield key, acc.to(out_dtype).cpu()
 
     if out_path.lower().endswith(".safetensors"):
-        # elldrethSOg4060Mix_v10.ckpt contains a state_dict key among all the tensors, but safetensors
-        # assumes that all entries are tensors, not dicts => remove the key
-        if "state_dict" in merged:
-            del merged["state_dict"]
-        save_tensor_file(merged, out_path)
+        tensor_infos = [(key, shape, dtype) for key, shape, dtype, _, _ in plan]
+        _write_safetensors_streaming(out_path, tensor_infos, merged_chunks())
     else:
+        merged = {}
+        for key, chunk in merged_chunks():
+            merged.setdefault(key, []).append(chunk)
+        merged = {key: torch.cat(chunks) if len(chunks) > 1 else chunks[0] for key, chunks in merged.items()}
         save_tensor_file({"state_dict": merged}, out_path)
 
+    log.info(f"[cyan]Merge models:[/cyan] ... saved {out_path}")
+
+
+class _TensorReader:
+    "Reads ranges of rows of the tensors in a model file, without loading the entire file"
+
+    def __init__(self, path: str):
+        self.path = path
+        self.infos = {}  # key -> (shape, dtype)
+
+        if path.lower().endswith(".safetensors"):
+            import safetensors
+
+            self._file = safetensors.safe_open(path, framework="pt", device="cpu")
+            dtypes = _safetensors_dtypes()
+            for key in self._file.keys():
+                s = self._file.get_slice(key)
+                self.infos[key] = (tuple(s.get_shape()), dtypes[s.get_dtype()])
+        else:
+            data = load_tensor_file(path, lazy=True)
+            while "state_dict" in data:
+                data = data["state_dict"]
+
+            self._file = data
+            for key in data.keys():
+                value = data[key]
+                if hasattr(value, "shape") and hasattr(value, "dtype"):  # skip the non-tensor entries
+                    self.infos[key] = (tuple(value.shape), value.dtype)
+
+    def read(self, key, start, end):
+        "Rows `[start:end]` of the tensor, or the entire tensor if it's a scalar"
+        if isinstance(self._file, dict):
+            value = self._file[key]  # memory-mapped, if possible
+            return value if value.ndim == 0 else value[start:end]
+
+        if len(self.infos[key][0]) == 0:
+            return self._file.get_tensor(key)
+        return self._file.get_slice(key)[start:end]
+
+
+def _all_keys(readers) -> list:
+    "The keys of all the models, in the order of their first appearance"
+    keys = {}
+    for r in readers:
+        keys.update((k, None) for k in r.infos)
+    return list(keys)
+
+
+def _get_chunk_rows(shape, chunk_numel):
+    "Ranges of rows (of the first dimension) with at most `chunk_numel` elements (at least one row each)"
+    if len(shape) == 0:
+        return [(0, 1)]
+
+    row_numel = math.prod(shape[1:])
+    rows_per_chunk = max(1, chunk_numel // max(1, row_numel))
+    return [(i, min(i + rows_per_chunk, shape[0])) for i in range(0, shape[0], rows_per_chunk)] or [(0, 0)]
+
+
+def _write_safetensors_streaming(path, tensor_infos, chunks):
+    """
+    Writes a safetensors file from the `(key, tensor chunk)` pairs, in the order of `tensor_infos` (key, shape, dtype).
+    The header is computed from the shapes upfront, so each chunk is written (and freed) right away. Writes to a
+    temporary file first, so an interrupted merge doesn't leave a truncated model at `path`.
+    """
+    import torch
+
+    dtype_names = {dtype: name for name, dtype in _safetensors_dtypes().items()}
+
+    header = {"__metadata__": {"format": "pt"}}
+    offset = 0
+    for key, shape, dtype in tensor_infos:
+        nbytes = math.prod(shape) * torch.empty((), dtype=dtype).element_size()
+        header[key] = {"dtype": dtype_names[dtype], "shape": list(shape), "data_offsets": [offset, offset + nbytes]}
+        offset += nbytes
+
+    header_bytes = json.dumps(header, separators=(",", ":")).encode("utf-8")
+    header_bytes += b" " * (-len(header_bytes) % 8)  # the data starts 8-byte aligned
+
+    tmp_path = path + ".tmp"
+    try:
+        with open(tmp_path, "wb") as f:
+            f.write(struct.pack("<Q", len(header_bytes)))
+            f.write(header_bytes)
+            for _, chunk in chunks:
+                f.write(chunk.contiguous().view(-1).view(torch.uint8).numpy().tobytes())
+
+        os.replace(tmp_path, path)
+    finally:
+        if os.path.exists(tmp_path):
+            os.remove(tmp_path)
+
 
 # do this pair-wise, to avoid having to load all the models into memory
 def merge_two_models(model0, model1, alpha, use_fp16=True):
@@ -122,3 +305,20 @@ def merge_multiple_models(models: list, alphas: list, key_name_pattern: str = No
                 log.warning(f"Couldn't merge key {key}: {e}")
 
     return merged_model
+
+
+def _safetensors_dtypes():
+    import torch
+
+    return {
+        "F64": torch.float64,
+        "F32": torch.float32,
+        "F16": torch.float16,
+        "BF16": torch.bfloat16,
+        "I64": torch.int64,
+        "I32": torch.int32,
+        "I16": torch.int16,
+        "I8": torch.int8,
+        "U8": torch.uint8,
+        "BOOL": torch.bool,
+    }
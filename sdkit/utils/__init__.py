@@ -5,9 +5,18 @@ LOG_FORMAT = "%(asctime)s.%(msecs)03d %(levelname)s %(threadName)s %(message)s"
 logging.basicConfig(level=logging.INFO, format=LOG_FORMAT, datefmt="%X")
 
 
-from .file_utils import load_tensor_file, save_dicts, save_images, save_tensor_file
-from .hash_utils import hash_bytes, hash_file_quick, hash_url_quick
-from .http_utils import download_file
+from .file_utils import (
+    LazyTensorDict,
+    list_model_files,
+    load_tensor_file,
+    load_tensor_files,
+    save_dicts,
+    save_images,
+    save_tensor_file,
+)
+from .hash_utils import hash_bytes, hash_file_quick, hash_files_quick, hash_url_quick, get_quick_hash_ranges
+from .metadata_index import get_file_metadata, update_file_metadata
+from .http_utils import download_file, DownloadEngine, DownloadError
 from .image_utils import (
     apply_color_profile,
     base64_str_to_buffer,
@@ -18,10 +27,16 @@ from .image_utils import (
     resize_img,
     black_to_transparent,
     get_image,
+    save_img,
 )
+from .output_pipeline import OutputPipeline, get_output_pipeline
+from .tracing import TraceStats, disable_tracing, enable_tracing, is_tracing_enabled, trace, trace_module
 from .latent_utils import (
     get_image_latent_and_mask,
     img_to_tensor,
+    images_to_tensor,
+    latents_to_rgb_preview,
+    tensor_to_images,
     latent_samples_to_images,
     diffusers_latent_samples_to_images,
     to_tensor,
@@ -41,9 +56,13 @@ from .memory_utils import (
 from .convert_model_utils import (
     convert_pipeline_unet_to_onnx,
     convert_pipeline_to_tensorrt,
+    export_model_to_onnx,
+    get_onnx_state_dict,
+    build_tensorrt_engines,
 )
 from .device_utils import (
     has_amd_gpu,
+    get_available_memory,
     mem_get_info,
     memory_allocated,
     memory_stats,
@@ -91,7 +91,6 @@ def _convert_pipeline_model_to_onnx(
     fp16: bool = False,
 ):
     import torch
-    import onnx
     from torch.jit import TracerWarning
 
     warnings.filterwarnings(
@@ -112,6 +111,20 @@ def _convert_pipeline_model_to_onnx(
     _device = device if device else pipeline.device
     pipeline = pipeline.to(_device, torch_dtype=_dtype)
 
+    model_args = tuple(m.to(device=_device, dtype=_dtype) for m in model_args if isinstance(m, torch.Tensor))
+    output_names = ["out_sample"]
+    _export_to_onnx(
+        model, model_args, input_names, output_names, dynamic_axes, use_external_data_format, save_path, opset
+    )
+
+    pipeline = pipeline.to(orig_device, torch_dtype=orig_dtype)
+
+
+def _export_to_onnx(
+    model, model_args, input_names, output_names, dynamic_axes, use_external_data_format, save_path, opset=17
+):
+    import onnx
+
     if use_external_data_format:
         tmp_dir = save_path + "_"  # collect the individual weights here
         if os.path.exists(tmp_dir):
@@ -122,14 +135,12 @@ def _convert_pipeline_model_to_onnx(
     model_name, _ = os.path.splitext(save_path)
     model_name = os.path.basename(model_name)
 
-    model_args = tuple(m.to(device=_device, dtype=_dtype) for m in model_args if isinstance(m, torch.Tensor))
-
     onnx_export(
         model,
         model_args=model_args,
         output_path=model_path,
         ordered_input_names=input_names,
-        output_names=["out_sample"],  # has to be different from "sample" for correct tracing
+        output_names=output_names,  # have to be different from the input names for correct tracing
         dynamic_axes=dynamic_axes,
         opset=opset,
         use_external_data_format=use_external_data_format,
@@ -148,8 +159,6 @@ def _convert_pipeline_model_to_onnx(
             convert_attribute=False,
         )
 
-    pipeline = pipeline.to(orig_device, torch_dtype=orig_dtype)
-
 
 def onnx_export(
     model,
@@ -192,7 +201,7 @@ def convert_onnx_unet_to_tensorrt(pipeline, onnx_path, trt_out_dir, batch_size_r
 
     def get_shapes(min_size, max_size):
         opt_size = min_size + int((max_size - min_size) * 0.25)
-        opt_batch_size = batch_size_min + int((batch_size_min - batch_size_max) * 0.25)
+        opt_batch_size = batch_size_min + int((batch_size_max - batch_size_min) * 0.25)
         min_shape = {
             "sample": (batch_size_min * 2, unet_in_channels, min_size // 8, min_size // 8),
             "encoder_hidden_states": (batch_size_min * 2, num_tokens, text_hidden_size),
@@ -220,15 +229,15 @@ def convert_onnx_vae_to_tensorrt(pipeline, onnx_path, trt_out_dir, batch_size_ra
 
     def get_shapes(min_size, max_size):
         opt_size = min_size + int((max_size - min_size) * 0.25)
-        opt_batch_size = batch_size_min + int((batch_size_min - batch_size_max) * 0.25)
+        opt_batch_size = batch_size_min + int((batch_size_max - batch_size_min) * 0.25)
         min_shape = {
-            "sample": (batch_size_min * 2, unet_in_channels, min_size // 8, min_size // 8),
+            "sample": (batch_size_min, unet_in_channels, min_size // 8, min_size // 8),
         }
         opt_shape = {
-            "sample": (opt_batch_size * 2, unet_in_channels, opt_size // 8, opt_size // 8),
+            "sample": (opt_batch_size, unet_in_channels, opt_size // 8, opt_size // 8),
         }
         max_shape = {
-            "sample": (batch_size_max * 2, unet_in_channels, max_size // 8, max_size // 8),
+            "sample": (batch_size_max, unet_in_channels, max_size // 8, max_size // 8),
         }
         return min_shape, opt_shape, max_shape
 
@@ -334,3 +343,158 @@ def convert_pipeline_to_tensorrt(
 
     convert_onnx_unet_to_tensorrt(pipeline, unet_onnx, unet_path, batch_size_range, dimensions_range)
     # convert_onnx_vae_to_tensorrt(pipeline, vae_onnx, vae_path, batch_size_range, dimensions_range)
+
+
+def get_onnx_state_dict(model) -> dict:
+    """
+    Returns an fp32 copy (on the CPU) of the weights of the model, for exporting it to ONNX. Any fused LoRA is left
+    out, i.e. the weights from before the LoRA was fused are used. Raises a ValueError for quantized models.
+    """
+    import torch
+    from sdkit.models.model_loader.stable_diffusion.quantization import is_quantized
+
+    if any(is_quantized(m) for m in model.modules()):
+        raise ValueError("Quantized models can't be exported to ONNX")
+
+    state_dict = {k: v.to("cpu", torch.float32, copy=True) for k, v in model.state_dict().items()}
+    for name, module in model.named_modules():
+        base_weight = getattr(module, "_lora_base_weight", None)  # see lora._get_base_weight()
+        if base_weight is not None:
+            state_dict[f"{name}.weight" if name else "weight"] = base_weight.to(torch.float32)
+    return state_dict
+
+
+def export_model_to_onnx(
+    engine_type, model, save_path, num_tokens=77, text_hidden_size=768, opset=17, state_dict: dict = None
+):
+    """
+    Exports the UNet, the VAE decoder or a ControlNet model to ONNX, for building TensorRT engines. Exports a separate
+    fp32 copy on the CPU, so `model` can keep rendering on the GPU in the meantime.
+
+    * engine_type: `"unet"`, `"vae"` or `"controlnet"`.
+    * model: the UNet, the VAE (not just its decoder) or the ControlNet.
+    * state_dict: the weights to export, from `get_onnx_state_dict()`. Pass this when exporting from another thread,
+        so the weights don't change (e.g. by fusing a LoRA) while they're copied. `None` copies them now.
+    """
+    if os.path.exists(save_path) and os.stat(save_path).st_size > 0:
+        return
+
+    import torch
+    from diffusers.models.attention_processor import AttnProcessor
+
+    log.info(f"Making intermediate {engine_type} ONNX..")
+
+    copy = type(model).from_config(model.config)
+    copy.load_state_dict(state_dict if state_dict is not None else get_onnx_state_dict(model))
+    copy = copy.eval()
+    if hasattr(copy, "set_attn_processor"):
+        copy.set_attn_processor(AttnProcessor())  # exports as plain ops, unlike SDPA
+
+    in_channels = model.config.latent_channels if engine_type == "vae" else model.config.in_channels
+    size = 64
+    sample = torch.randn(2, in_channels, size, size)
+    timestep = torch.randn(2)
+    encoder_hidden_states = torch.randn(2, num_tokens, text_hidden_size)
+    batch_axes = {0: "batch", 2: "height", 3: "width"}
+
+    if engine_type == "unet":
+        args = (sample, timestep, encoder_hidden_states)
+        input_names = ["sample", "timestep", "encoder_hidden_states"]
+        dynamic_axes = {"sample": batch_axes, "timestep": {0: "batch"}, "encoder_hidden_states": {0: "batch"}}
+    elif engine_type == "vae":
+        args = (sample,)
+        input_names = ["sample"]
+        dynamic_axes = {"sample": batch_axes}
+    elif engine_type == "controlnet":
+        args = (sample, timestep, encoder_hidden_states, torch.randn(2, 3, size * 8, size * 8), torch.ones(1))
+        input_names = ["sample", "timestep", "encoder_hidden_states", "controlnet_cond", "conditioning_scale"]
+        dynamic_axes = {
+            "sample": batch_axes,
+            "timestep": {0: "batch"},
+            "encoder_hidden_states": {0: "batch"},
+            "controlnet_cond": {0: "batch", 2: "image_height", 3: "image_width"},
+        }
+    else:
+        raise ValueError(f"Unknown engine type: {engine_type}")
+
+    class OnnxWrapper(torch.nn.Module):
+        "Returns plain tensors (instead of diffusers' output classes), with a fixed list of inputs"
+
+        def __init__(self, model):
+            super().__init__()
+            self.model = model
+
+        def forward(self, *args):
+            if engine_type == "unet":
+                return (self.model(*args, return_dict=False)[0],)
+            if engine_type == "vae":
+                return (self.model.decoder(args[0]),)
+
+            sample, timestep, encoder_hidden_states, controlnet_cond, conditioning_scale = args
+            down, mid = self.model(
+                sample,
+                timestep,
+                encoder_hidden_states,
+                controlnet_cond=controlnet_cond,
+                conditioning_scale=conditioning_scale,
+                return_dict=False,
+            )
+            return (*down, mid)
+
+    wrapper = OnnxWrapper(copy)
+    with torch.no_grad():
+        num_outputs = len(wrapper(*args))
+
+    output_names = ["out_sample"] if num_outputs == 1 else [f"down_{i}" for i in range(num_outputs - 1)] + ["mid"]
+    for name in output_names:
+        dynamic_axes[name] = batch_axes
+
+    os.makedirs(os.path.dirname(save_path), exist_ok=True)
+    use_external_data_format = engine_type != "vae"  # over 2 GB
+    _export_to_onnx(wrapper, args, input_names, output_names, dynamic_axes, use_external_data_format, save_path, opset)
+
+    log.info(f"Made intermediate {engine_type} ONNX: {save_path}")
+
+
+def get_engine_shapes(engine_type, batch_size, size, in_channels=4, num_tokens=77, text_hidden_size=768) -> dict:
+    "The input shapes of an engine, for a batch of `batch_size` images of `size` pixels (an int, or `(width, height)`)"
+    width, height = (size, size) if isinstance(size, int) else size
+    latent = (in_channels, height // 8, width // 8)
+    if engine_type == "vae":
+        return {"sample": (batch_size, *latent)}
+
+    shapes = {
+        "sample": (batch_size * 2, *latent),
+        "encoder_hidden_states": (batch_size * 2, num_tokens, text_hidden_size),
+        "timestep": (batch_size * 2,),
+    }
+    if engine_type == "controlnet":
+        shapes["controlnet_cond"] = (batch_size * 2, 3, height, width)
+        shapes["conditioning_scale"] = (1,)
+    return shapes
+
+
+def build_tensorrt_engines(
+    engine_type,
+    onnx_path,
+    trt_out_dir,
+    batch_size_range,
+    dimensions_range,
+    in_channels=4,
+    num_tokens=77,
+    text_hidden_size=768,
+):
+    "Builds TensorRT engines (one per range in `dimensions_range`) from the ONNX file of the UNet, VAE or ControlNet"
+    batch_size_min, batch_size_max = batch_size_range
+
+    def get_shapes(min_size, max_size):
+        opt_size = min_size + int((max_size - min_size) * 0.25)
+        opt_batch_size = batch_size_min + int((batch_size_max - batch_size_min) * 0.25)
+        args = (in_channels, num_tokens, text_hidden_size)
+        return (
+            get_engine_shapes(engine_type, batch_size_min, min_size, *args),
+            get_engine_shapes(engine_type, opt_batch_size, opt_size, *args),
+            get_engine_shapes(engine_type, batch_size_max, max_size, *args),
+        )
+
+    _convert_onnx_to_tensorrt(onnx_path, trt_out_dir, get_shapes, engine_type, batch_size_range, dimensions_range)
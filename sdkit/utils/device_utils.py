@@ -61,6 +61,19 @@ def memory_stats(device) -> Dict:
     return {}  # none of the other platforms have working implementations of memory_stats
 
 
+def get_available_memory(device) -> int:
+    """
+    Expects a torch.device as the argument. Returns the bytes that can be allocated on the device: the free memory of
+    the device, plus the memory that torch has reserved but isn't using. Returns 0 if this isn't known (e.g. on CPU).
+    """
+    stats = memory_stats(device)
+    mem_active = stats.get("active_bytes.all.current", 0)
+    mem_reserved = stats.get("reserved_bytes.all.current", 0)
+    mem_free_device, _ = mem_get_info(device)
+
+    return mem_free_device + (mem_reserved - mem_active)
+
+
 def empty_cache():
     import torch
 
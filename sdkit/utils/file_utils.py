@@ -2,17 +2,141 @@ import json
 import os
 
 
-def load_tensor_file(path):
+def load_tensor_file(path, lazy=False, device="cpu", dtype=None):
+    """
+    * path: the path to a .safetensors, .ckpt or .pt file
+    * lazy: if True, returns a `LazyTensorDict`, which reads each tensor from the (memory-mapped) file only when it
+        is accessed. This avoids keeping the entire file in RAM, in addition to the model that is loaded from it.
+        Each access reads the tensor again, so `pop()` the tensors (or drop the references) after using them.
+        For .ckpt files, the file is memory-mapped if possible (requires torch 2.1 or newer).
+    * device: the device to load the tensors on
+    * dtype: the dtype to convert the floating-point tensors to. `None` keeps the dtype of the file.
+    """
     import torch
     import safetensors.torch
 
     if not isinstance(path, str):
         path = str(path)
 
+    if lazy:
+        if path.lower().endswith(".safetensors"):
+            f = safetensors.safe_open(path, framework="pt", device=str(device))
+            return LazyTensorDict(f.keys(), f.get_tensor, dtype=dtype)
+
+        try:
+            data = torch.load(path, map_location="cpu", mmap=True)
+        except (TypeError, RuntimeError):  # older torch, or a checkpoint in the legacy (non-zip) format
+            data = torch.load(path, map_location="cpu")
+
+        return LazyTensorDict(data.keys(), data.__getitem__, device=device, dtype=dtype)
+
     if path.lower().endswith(".safetensors"):
-        return safetensors.torch.load_file(path, device="cpu")
+        data = safetensors.torch.load_file(path, device=str(device))
     else:
-        return torch.load(path, map_location="cpu")
+        data = torch.load(path, map_location="cpu" if device == "cpu" else device)
+
+    if dtype is not None:
+        data = {k: _convert_tensor(v, None, dtype) for k, v in data.items()}
+
+    return data
+
+
+class LazyTensorDict(dict):
+    """
+    A dict of tensors, which are loaded only when they are accessed (and aren't kept in memory after that).
+
+    This is a subclass of `dict` (unlike `Mapping`), since the diffusers conversion code checks for `dict`.
+    Tensors that are assigned (e.g. with `d[key] = tensor`) are stored as usual.
+    """
+
+    def __init__(self, keys, get_tensor, device=None, dtype=None):
+        super().__init__((k, _NOT_LOADED) for k in keys)
+        self._get_tensor = get_tensor
+        self.device = device
+        self.dtype = dtype
+
+    def __getitem__(self, key):
+        value = super().__getitem__(key)
+        if value is _NOT_LOADED:
+            value = self._get_tensor(key)
+            if isinstance(value, dict):
+                value = LazyTensorDict(value.keys(), value.__getitem__, device=self.device, dtype=self.dtype)
+            else:
+                value = _convert_tensor(value, self.device, self.dtype)
+        return value
+
+    def __iter__(self):  # overriding this disables the C fast-path in dict(d) and {**d}, which skips __getitem__
+        return super().__iter__()
+
+    def get(self, key, default=None):
+        return self[key] if key in self else default
+
+    def pop(self, key, *default):
+        if key not in self:
+            if default:
+                return default[0]
+            raise KeyError(key)
+
+        value = self[key]
+        super().__delitem__(key)
+        return value
+
+    def popitem(self):
+        key = next(reversed(self.keys()))
+        return key, self.pop(key)
+
+    def setdefault(self, key, default=None):
+        if key not in self:
+            self[key] = default
+        return self[key]
+
+    def values(self):
+        return (self[k] for k in self.keys())
+
+    def items(self):
+        return ((k, self[k]) for k in self.keys())
+
+    def copy(self):
+        return {k: self[k] for k in self.keys()}
+
+    def __repr__(self):
+        return f"LazyTensorDict({list(self.keys())})"
+
+
+_NOT_LOADED = object()
+
+
+def _convert_tensor(value, device, dtype):
+    import torch
+
+    if not isinstance(value, torch.Tensor):
+        return value
+
+    if dtype is not None and value.is_floating_point() and value.dtype != dtype:
+        value = value.to(dtype)
+    if device is not None and value.device != torch.device(device):
+        value = value.to(device)
+
+    return value
+
+
+def load_tensor_files(paths: list, max_workers=4, **kwargs) -> list:
+    """
+    Loads several tensor files in parallel (on a thread pool, since reading the files and copying the tensors release
+    the GIL). Returns the loaded files in the same order as `paths`. The keyword arguments are passed to
+    `load_tensor_file()`.
+    """
+    from concurrent.futures import ThreadPoolExecutor
+
+    if len(paths) <= 1:
+        return [load_tensor_file(path, **kwargs) for path in paths]
+
+    def load(path):
+        data = load_tensor_file(path, **kwargs)
+        return dict(data.items()) if isinstance(data, LazyTensorDict) else data  # read the tensors on this thread
+
+    with ThreadPoolExecutor(max_workers=min(max_workers, len(paths)), thread_name_prefix="sdkit-load") as executor:
+        return list(executor.map(load, paths))
 
 
 def save_tensor_file(data, path):
@@ -25,6 +149,24 @@ def save_tensor_file(data, path):
         return torch.save(data, path)
 
 
+MODEL_FILE_EXTENSIONS = (".ckpt", ".safetensors", ".pt", ".pth", ".bin", ".sft")
+
+
+def list_model_files(paths) -> list:
+    "Returns the given list of file paths, or the model files in a directory (recursively), if `paths` is a directory"
+    if isinstance(paths, (list, tuple)):
+        return list(paths)
+
+    paths = str(paths)
+    if not os.path.isdir(paths):
+        return [paths]
+
+    files = []
+    for root, _, file_names in os.walk(paths):
+        files += [os.path.join(root, f) for f in sorted(file_names) if f.lower().endswith(MODEL_FILE_EXTENSIONS)]
+    return files
+
+
 def save_images(
     images: list,
     dir_path: str,
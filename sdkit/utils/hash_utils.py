@@ -25,27 +25,59 @@ def hash_url_quick(url):
     )
 
 
-def hash_file_quick(file_path):
+def hash_file_quick(file_path, use_index=True):
+    """
+    Returns the quick-hash of the file (see `compute_quick_hash()`). With `use_index`, the hash is saved in the metadata
+    index of the file's directory, and reused until the file changes.
+    """
     from sdkit.utils import log
+    from sdkit.utils.metadata_index import get_file_metadata, update_file_metadata
+
+    if use_index:
+        quick_hash = get_file_metadata(file_path).get("quick_hash")
+        if quick_hash:
+            log.debug(f"indexed hash of file: {file_path}")
+            return quick_hash
 
     log.debug(f"hashing file: {file_path}")
 
-    def get_size():
-        size = os.path.getsize(file_path)
-        log.debug(f"total size: {size}")
-        return size
+    with open(file_path, "rb") as f:
 
-    def read_bytes(offset: int, count: int):
-        with open(file_path, "rb") as f:
+        def get_size():
+            size = os.fstat(f.fileno()).st_size
+            log.debug(f"total size: {size}")
+            return size
+
+        def read_bytes(offset: int, count: int):
             f.seek(offset)
             bytes = f.read(count)
             log.debug(f"read byte range. offset: {offset}, count: {count}, actual count: {len(bytes)}")
             return bytes
 
-    return compute_quick_hash(
-        total_size_fn=get_size,
-        read_bytes_fn=read_bytes,
-    )
+        quick_hash = compute_quick_hash(
+            total_size_fn=get_size,
+            read_bytes_fn=read_bytes,
+        )
+
+    if use_index:
+        update_file_metadata(file_path, quick_hash=quick_hash)
+
+    return quick_hash
+
+
+def hash_files_quick(paths, max_workers=8, use_index=True) -> dict:
+    """
+    Returns the quick-hashes of several files in parallel, as `{path: quick_hash}`.
+
+    * paths: a list of file paths, or a directory (the model files in it are hashed, recursively).
+    """
+    from concurrent.futures import ThreadPoolExecutor
+    from sdkit.utils import list_model_files
+
+    paths = list_model_files(paths)
+    with ThreadPoolExecutor(max_workers=max_workers, thread_name_prefix="sdkit-hash") as executor:
+        hashes = executor.map(lambda path: hash_file_quick(path, use_index=use_index), paths)
+        return dict(zip(paths, hashes))
 
 
 def compute_quick_hash(total_size_fn, read_bytes_fn):
@@ -60,15 +92,16 @@ def compute_quick_hash(total_size_fn, read_bytes_fn):
     """
     total_size = total_size_fn()
 
+    ranges = get_quick_hash_ranges(total_size)
+    return hash_bytes(b"".join(read_bytes_fn(offset=offset, count=count) for offset, count in ranges))
+
+
+def get_quick_hash_ranges(total_size: int) -> list:
+    "The `(offset, count)` byte ranges that are hashed by `compute_quick_hash()`, for a file of this size"
     if total_size < 0x300000:
-        all_bytes = read_bytes_fn(offset=0, count=total_size)
-        return hash_bytes(all_bytes)
-    else:
-        start_bytes = read_bytes_fn(offset=0x100000, count=0x10000)
-        middle_bytes = read_bytes_fn(offset=int(total_size / 2), count=0x10000)
-        end_bytes = read_bytes_fn(offset=total_size - 0x100000, count=0x10000)
-
-        return hash_bytes(start_bytes + middle_bytes + end_bytes)
+        return [(0, total_size)]
+
+    return [(0x100000, 0x10000), (int(total_size / 2), 0x10000), (total_size - 0x100000, 0x10000)]
 
 
 def hash_bytes(bytes):
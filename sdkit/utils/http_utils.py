@@ -1,34 +1,360 @@
+import json
 import os
-from shutil import copyfileobj
+import threading
+import time
+from concurrent.futures import Future, ThreadPoolExecutor
 from tqdm import tqdm
 
+DOWNLOAD_CONNECTIONS = 8
+DOWNLOAD_PART_SIZE = 32 * 1024 * 1024
+DOWNLOAD_CHUNK_SIZE = 1024 * 1024
+DOWNLOAD_RETRIES = 3
+DOWNLOAD_TIMEOUT = 60  # seconds, without receiving any bytes
+STATE_SAVE_INTERVAL = 2  # seconds
 
-def download_file(url: str, out_path: str):
+
+class DownloadError(RuntimeError):
+    pass
+
+
+def download_file(url: str, out_path: str, quick_hash: str = None, num_connections=DOWNLOAD_CONNECTIONS):
     """
     Features:
     * Downloads large files (without storing them in memory)
-    * Resumes downloads from the bytes it has downloaded already
+    * Downloads several byte ranges of the file in parallel
+    * Resumes downloads from the bytes it has downloaded already (per range), if `quick_hash` is given. Files without
+      a hash are downloaded again, since a resumed file can't be verified
+    * Verifies the `quick_hash` of the file (if given) from the downloaded bytes, without reading the file again
     * Shows a progress bar
 
-    The remote server needs to support the `Range` header, for resume to work.
+    The remote server needs to support the `Range` header, for parallel downloads and resume to work. Otherwise the
+    file is downloaded in a single stream.
     """
-    import requests
-    from sdkit.utils import log
-
-    start_offset = 0 if not os.path.exists(out_path) else os.path.getsize(out_path)
-    res = requests.get(url, stream=True)
-    if not res.ok:
-        return
-    total_bytes = int(res.headers.get("Content-Length", "0"))
-
-    res = requests.get(url, stream=True, headers={"Range": f"bytes={start_offset}-", "Accept-Encoding": "identity"})
-    if not res.ok:
-        return
-
-    write_mode = "wb" if start_offset == 0 else "ab"
-
-    log.info(f"Downloading {url} to {out_path}")
-    with open(out_path, write_mode) as f, tqdm.wrapattr(
-        res.raw, "read", initial=start_offset, total=total_bytes, desc="Downloading", colour="green"
-    ) as res_stream:
-        copyfileobj(res_stream, f)
+    with DownloadEngine(max_connections=num_connections) as engine:
+        engine.submit(url, out_path, quick_hash).result()
+
+
+class DownloadEngine:
+    """
+    Downloads several files at once, each in several byte ranges, on a bounded pool of connections (shared by all
+    the files). The files are downloaded to `{out_path}.part`, along with the progress of each range in
+    `{out_path}.part.json`, and renamed to `out_path` after they're complete (and verified).
+
+    Usage:
+    ```
+    with DownloadEngine(max_connections=8) as engine:
+        futures = [engine.submit(url, out_path, quick_hash) for url, out_path, quick_hash in files]
+        for f in futures:
+            f.result()  # raises the error, if the file couldn't be downloaded
+    ```
+    """
+
+    def __init__(self, max_connections=DOWNLOAD_CONNECTIONS, part_size=DOWNLOAD_PART_SIZE):
+        import requests
+        from requests.adapters import HTTPAdapter
+
+        self.part_size = part_size
+        self.session = requests.Session()
+        adapter = HTTPAdapter(pool_connections=max_connections, pool_maxsize=max_connections)
+        self.session.mount("http://", adapter)
+        self.session.mount("https://", adapter)
+
+        self.executor = ThreadPoolExecutor(max_workers=max_connections, thread_name_prefix="sdkit-download")
+        self._futures = []
+
+    def submit(self, url: str, out_path: str, quick_hash: str = None) -> Future:
+        "Starts downloading the file. Returns a `Future`, with `out_path` as the result"
+        download = _FileDownload(self, url, out_path, quick_hash)
+        self._futures.append(download.future)
+        self.executor.submit(download.start)
+        return download.future
+
+    def close(self):
+        "Waits for the submitted downloads to finish (or fail), and closes the connections"
+        for f in self._futures:
+            f.exception()
+        self.executor.shutdown(wait=True)
+        self.session.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+
+class _FileDownload:
+    def __init__(self, engine: DownloadEngine, url, out_path, quick_hash):
+        self.engine = engine
+        self.url = url
+        self.out_path = out_path
+        self.part_path = out_path + ".part"
+        self.state_path = out_path + ".part.json"
+        self.quick_hash = quick_hash
+        self.future = Future()
+
+        self.total = None
+        self.ranged = False
+        self.parts = []  # (start, end) byte ranges, end exclusive
+        self.done = []  # bytes downloaded in each part
+        self.flushed = []  # bytes of each part that are on the disk, i.e. that can be resumed from
+        self.remaining = 0
+        self.pbar = None
+
+        self._hash_windows = []  # [offset, count, bytearray, bytes captured]
+        self._lock = threading.Lock()
+        self._last_save = 0
+
+    def start(self):
+        try:
+            self._start()
+        except BaseException as e:
+            self._fail(e)
+
+    def _start(self):
+        from sdkit.utils import hash_file_quick, log
+
+        if os.path.exists(self.out_path) and not os.path.exists(self.part_path):
+            if self.quick_hash and hash_file_quick(self.out_path) == self.quick_hash:  # no need to ask the server
+                log.info(f"Already downloaded {self.out_path}")
+                self.future.set_result(self.out_path)
+                return
+
+        self.total, self.ranged = self._probe()
+
+        if os.path.exists(self.out_path) and not os.path.exists(self.part_path):
+            size = os.path.getsize(self.out_path)
+            if size == self.total:
+                log.info(f"Already downloaded {self.out_path}")
+                self.future.set_result(self.out_path)
+                return
+            if self.ranged and size < self.total and self.quick_hash:  # a partial download by an older version
+                os.replace(self.out_path, self.part_path)
+                self._make_parts(downloaded=size)
+
+        if not self.parts:
+            self._make_parts(downloaded=0, state=self._load_state() if self.quick_hash else None)
+
+        if self.ranged:
+            with open(self.part_path, "ab") as f:
+                f.truncate(self.total)
+        else:
+            open(self.part_path, "wb").close()
+
+        if self.quick_hash and self.total is not None:
+            from sdkit.utils import get_quick_hash_ranges
+
+            self._hash_windows = [[o, c, bytearray(c), 0] for o, c in get_quick_hash_ranges(self.total)]
+
+        incomplete = [i for i, (start, end) in enumerate(self.parts) if end is None or self.done[i] < end - start]
+        self.remaining = len(incomplete)
+
+        log.info(f"Downloading {self.url} to {self.out_path} ({len(incomplete)} of {len(self.parts)} parts left)")
+        name = os.path.basename(self.out_path)
+        self.pbar = tqdm(total=self.total, initial=sum(self.done), unit="B", unit_scale=True, desc=name, colour="green")
+
+        if not incomplete:
+            self._finish()
+        for i in incomplete:
+            self.engine.executor.submit(self._download_part, i)
+
+    def _probe(self):
+        "Returns (total size, whether the server supports ranges)"
+        headers = {"Range": "bytes=0-0", "Accept-Encoding": "identity"}
+        with self.engine.session.get(self.url, headers=headers, stream=True, timeout=DOWNLOAD_TIMEOUT) as res:
+            res.raise_for_status()
+
+            content_range = res.headers.get("Content-Range", "")
+            if res.status_code == 206 and "/" in content_range and not content_range.endswith("/*"):
+                return int(content_range.rsplit("/", 1)[1]), True
+
+            length = res.headers.get("Content-Length")
+            return (int(length) if length else None), False
+
+    def _make_parts(self, downloaded: int, state: dict = None):
+        if not self.ranged:
+            self.parts, self.done, self.flushed = [(0, self.total)], [0], [0]
+            return
+
+        part_size = self.engine.part_size if state is None else state["part_size"]
+        self.parts = [(s, min(s + part_size, self.total)) for s in range(0, self.total, part_size)]
+        if state is not None:
+            self.done = state["done"]
+        else:
+            self.done = [min(end - start, max(0, downloaded - start)) for start, end in self.parts]
+        self.flushed = list(self.done)
+
+    def _load_state(self):
+        if not self.ranged or not os.path.exists(self.state_path) or not os.path.exists(self.part_path):
+            return None
+
+        try:
+            with open(self.state_path, "r") as f:
+                state = json.load(f)
+        except Exception:
+            return None
+
+        if state.get("url") != self.url or state.get("total") != self.total:
+            return None
+        return state if os.path.getsize(self.part_path) == self.total else None
+
+    def _save_state(self, force=False):
+        if not self.ranged or (not force and time.time() - self._last_save < STATE_SAVE_INTERVAL):
+            return
+
+        with self._lock:
+            self._last_save = time.time()
+            state = {"url": self.url, "total": self.total, "part_size": self.engine.part_size}
+            state["done"] = list(self.flushed)  # not `done`, which can include bytes that aren't written yet
+            if self.parts:
+                state["part_size"] = self.parts[0][1] - self.parts[0][0]
+
+            tmp_path = self.state_path + ".tmp"
+            with open(tmp_path, "w") as f:
+                json.dump(state, f)
+                f.flush()
+                os.fsync(f.fileno())
+            os.replace(tmp_path, self.state_path)
+
+    def _download_part(self, i):
+        from sdkit.utils import log
+
+        try:
+            for attempt in range(DOWNLOAD_RETRIES + 1):
+                try:
+                    self._fetch_part(i)
+                    break
+                except Exception as e:
+                    if attempt == DOWNLOAD_RETRIES or self.future.done():
+                        raise
+                    log.warn(f"Error downloading part {i} of {self.url}: {e}. Retrying..")
+                    time.sleep(1 + attempt)
+
+            with self._lock:
+                self.remaining -= 1
+                is_last = self.remaining == 0
+            if is_last:
+                self._finish()
+        except BaseException as e:
+            self._fail(e)
+
+    def _fetch_part(self, i):
+        start, end = self.parts[i]
+        if not self.ranged and self.done[i] > 0:  # a retry, which starts from the beginning of the file again
+            with self._lock:
+                self.pbar.update(-self.done[i])
+                self.done[i] = 0
+                for window in self._hash_windows:
+                    window[3] = 0
+        offset = start + self.done[i]  # resume from the bytes downloaded already
+
+        headers = {"Accept-Encoding": "identity"}
+        if self.ranged:
+            headers["Range"] = f"bytes={offset}-{end - 1}"
+
+        with self.engine.session.get(self.url, headers=headers, stream=True, timeout=DOWNLOAD_TIMEOUT) as res:
+            res.raise_for_status()
+            if self.ranged and res.status_code != 206:
+                raise DownloadError(f"The server ignored the byte range of {self.url}")
+
+            with open(self.part_path, "r+b") as f:
+                f.seek(offset)
+                last_flush = time.time()
+                for chunk in res.iter_content(DOWNLOAD_CHUNK_SIZE):
+                    if self.future.done():  # another part failed
+                        self._flush_part(f, i, offset - start)
+                        return
+
+                    f.write(chunk)
+                    self._capture_hash_bytes(offset, chunk)
+                    offset += len(chunk)
+                    with self._lock:
+                        self.done[i] = offset - start
+                        self.pbar.update(len(chunk))
+
+                    if time.time() - last_flush >= STATE_SAVE_INTERVAL:
+                        self._flush_part(f, i, offset - start)
+                        last_flush = time.time()
+
+                self._flush_part(f, i, offset - start)
+
+        if end is not None and offset < end:
+            raise DownloadError(f"Incomplete download of part {i} of {self.url}: {offset - start} of {end - start}")
+
+    def _flush_part(self, f, i, done):
+        "Writes the downloaded bytes of the part to the disk, before the state file says that they can be resumed"
+        if not self.ranged:
+            return
+
+        f.flush()
+        os.fsync(f.fileno())
+        with self._lock:
+            self.flushed[i] = done
+        self._save_state()
+
+    def _capture_hash_bytes(self, offset, chunk):
+        "Keeps the bytes of the quick-hash ranges while they're downloaded, so the file doesn't need to be read again"
+        for window in self._hash_windows:
+            w_offset, w_count, buf, _ = window
+            a, b = max(offset, w_offset), min(offset + len(chunk), w_offset + w_count)
+            if a < b:
+                buf[a - w_offset : b - w_offset] = chunk[a - offset : b - offset]
+                with self._lock:
+                    window[3] += b - a
+
+    def _get_quick_hash(self):
+        from sdkit.utils.hash_utils import compute_quick_hash
+
+        windows = {w[0]: w for w in self._hash_windows}
+
+        def read_bytes(offset, count):
+            w = windows.get(offset)
+            if w is not None and w[1] == count and w[3] >= count:
+                return bytes(w[2])
+
+            with open(self.part_path, "rb") as f:  # only for the ranges that were downloaded in an earlier session
+                f.seek(offset)
+                return f.read(count)
+
+        return compute_quick_hash(total_size_fn=lambda: os.path.getsize(self.part_path), read_bytes_fn=read_bytes)
+
+    def _finish(self):
+        from sdkit.utils import log
+
+        self.pbar.close()
+
+        if self.quick_hash:
+            actual_hash = self._get_quick_hash()
+            if actual_hash != self.quick_hash:
+                for path in (self.part_path, self.state_path):
+                    if os.path.exists(path):
+                        os.remove(path)
+                raise DownloadError(f"Downloaded {self.url}, but its hash is {actual_hash}, expected {self.quick_hash}")
+
+        os.replace(self.part_path, self.out_path)
+        if os.path.exists(self.state_path):
+            os.remove(self.state_path)
+
+        if self.quick_hash:  # verified, so loading this file doesn't need to hash it again
+            from sdkit.utils import update_file_metadata
+
+            update_file_metadata(self.out_path, quick_hash=self.quick_hash)
+
+        log.info(f"Downloaded {self.out_path}")
+        with self._lock:
+            if not self.future.done():
+                self.future.set_result(self.out_path)
+
+    def _fail(self, e):
+        with self._lock:
+            if self.future.done():
+                return
+            self.future.set_exception(e)
+
+        if self.pbar is not None:
+            self.pbar.close()
+        if self.parts and os.path.exists(self.part_path):
+            try:
+                self._save_state(force=True)  # to resume from here the next time
+            except Exception:
+                pass
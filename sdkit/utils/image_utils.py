@@ -9,16 +9,21 @@ def img_to_base64_str(img, output_format="PNG", output_quality=75, output_lossle
     return buffer_to_base64_str(buffered, output_format)
 
 
-def img_to_buffer(img, output_format="PNG", output_quality=75, output_lossless=False):
+def img_to_buffer(img, output_format="PNG", output_quality=75, output_lossless=False, **save_args):
     buffered = BytesIO()
+    save_img(img, buffered, output_format, output_quality, output_lossless, **save_args)
+    buffered.seek(0)
+    return buffered
+
+
+def save_img(img, f, output_format="PNG", output_quality=75, output_lossless=False, **save_args):
+    "Saves the image to a file path or file object. `save_args` are passed to PIL, e.g. `pnginfo` or `exif`"
     if output_format.upper() == "PNG":
-        img.save(buffered, format=output_format)
+        img.save(f, format=output_format, **save_args)
     elif output_format.upper() == "WEBP":
-        img.save(buffered, format=output_format, quality=output_quality, lossless=output_lossless)
+        img.save(f, format=output_format, quality=output_quality, lossless=output_lossless, **save_args)
     else:
-        img.save(buffered, format=output_format, quality=output_quality)
-    buffered.seek(0)
-    return buffered
+        img.save(f, format=output_format, quality=output_quality, **save_args)
 
 
 def buffer_to_base64_str(buffered, output_format="PNG"):
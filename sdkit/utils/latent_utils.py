@@ -93,42 +93,66 @@ def latent_samples_to_images(context: Context, samples):
 
     samples = model.decode_first_stage(samples)
     samples = torch.clamp((samples + 1.0) / 2.0, min=0.0, max=1.0)
+    samples = (255.0 * samples).to(torch.uint8)  # on the device, so only the uint8 pixels are copied
+    samples = rearrange(samples, "b c h w -> b h w c").cpu().numpy()
 
-    images = []
-    for sample in samples:
-        sample = 255.0 * rearrange(sample.cpu().numpy(), "c h w -> h w c")
-        sample = sample.astype(np.uint8)
-        images.append(Image.fromarray(sample))
-
-    return images
+    return [Image.fromarray(sample) for sample in samples]
 
 
 def diffusers_latent_samples_to_images(context: Context, latent_samples):
+    "Decodes `(latents, pipeline)` with the VAE of the pipeline, using `sdkit.generate.vae_engine`"
+    from sdkit.generate.vae_engine import get_vae_engine
+
+    samples, model = latent_samples
+    images = get_vae_engine(context, model.vae).decode(samples, output_type="pil")
+    return [img.convert("RGB") for img in images]
+
+
+# approximate linear maps from the latent channels to RGB, for cheap previews
+LATENT_RGB_FACTORS = {
+    "SD": (
+        [[0.3512, 0.2297, 0.3227], [0.3250, 0.4974, 0.2350], [-0.2829, 0.1762, 0.2721], [-0.2120, -0.2616, -0.7177]],
+        [0.0, 0.0, 0.0],
+    ),
+    "SDXL": (
+        [[0.3651, 0.4232, 0.4341], [-0.2533, -0.0042, 0.1068], [0.1076, 0.1111, -0.0362], [-0.3165, -0.2492, -0.2188]],
+        [0.1084, -0.0175, -0.0011],
+    ),
+}
+
+
+def latents_to_rgb_preview(latents, model_type="SD1"):
+    """
+    Converts a batch of latents (as passed to the step callbacks) of shape (B, 4, H/8, W/8) to an approximate image of
+    shape (B, 3, H/8, W/8) with values in [0, 1], without running the VAE. Good enough for previews and rough checks.
+    """
+    import torch
+
+    factors, bias = LATENT_RGB_FACTORS["SDXL" if model_type == "SDXL" else "SD"]
+    factors = torch.tensor(factors, device=latents.device, dtype=torch.float32)
+    bias = torch.tensor(bias, device=latents.device, dtype=torch.float32)
+
+    rgb = torch.einsum("bchw,cr->brhw", latents.float(), factors) + bias.view(1, 3, 1, 1)
+    return ((rgb + 1) / 2).clamp(0, 1)
+
+
+def images_to_tensor(images: list, device, dtype=None):
+    "Converts a list of PIL images (of the same size) to a (B, 3, H, W) tensor with values in [0, 1]"
+    import torch
+    import numpy as np
+
+    batch = np.stack([np.array(img.convert("RGB"), dtype=np.uint8) for img in images])
+    batch = torch.from_numpy(batch).to(device).permute(0, 3, 1, 2)  # copy the uint8 data, and convert on the device
+    return batch.to(dtype or torch.float32) / 255.0
+
+
+def tensor_to_images(tensor) -> list:
+    "Converts a (B, 3, H, W) tensor with values in [0, 1] to a list of PIL images, with one copy from the device"
     import torch
+    from PIL import Image
 
-    @torch.no_grad()
-    def apply():
-        samples, model = latent_samples
-
-        upcast_vae = "StableDiffusionXL" in str(type(model))  # need a better way than this
-        if upcast_vae:
-            # make sure the VAE is in float32 mode, as it overflows in float16
-            if model.vae.dtype == torch.float16 and model.vae.config.force_upcast:
-                model.upcast_vae()
-                samples = samples.to(next(iter(model.vae.post_quant_conv.parameters())).dtype)
-
-        try:
-            samples = model.vae.decode(samples / model.vae.config.scaling_factor, return_dict=False)[0]
-            do_denormalize = [True] * samples.shape[0]
-            images = model.image_processor.postprocess(samples, output_type="pil", do_denormalize=do_denormalize)
-        finally:
-            if upcast_vae and context.half_precision:
-                model.vae = model.vae.to(dtype=torch.float16)
-
-        images = [img.convert("RGB") for img in images]
-        return images
-
-    return apply()
+    tensor = (tensor.clamp(0, 1) * 255).round().to(torch.uint8).permute(0, 2, 3, 1).cpu().numpy()
+    return [Image.fromarray(t) for t in tensor]
 
 
 def tensor_to_bitmap(tensor):
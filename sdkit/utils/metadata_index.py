@@ -0,0 +1,96 @@
+"""
+A persistent index of the metadata of model files (quick hash, unsafe scan results), stored in a
+`.sdkit-index.json` file in the directory of the files. An entry is valid only while the file's size, mtime, ctime and
+inode are unchanged, so unchanged files skip the hashing and scanning on later loads. The ctime can't be set by the
+user (unlike the mtime), and changes on every write or rename of the file, so a modified file doesn't keep its key.
+
+This is a JSON file (instead of SQLite), since SQLite's file locking is unreliable on network file systems. Writes are
+atomic (to a temporary file, which is then renamed), and keep the entries written meanwhile by other processes. If the
+directory isn't writable, the index is kept in memory only.
+"""
+
+import json
+import os
+import threading
+
+INDEX_FILE_NAME = ".sdkit-index.json"
+
+_indexes = {}  # dir path -> MetadataIndex
+_indexes_lock = threading.Lock()
+
+
+def get_file_metadata(path) -> dict:
+    "Returns (a copy of) the indexed metadata of the file, or an empty dict if it isn't indexed, or has changed since"
+    path = os.path.abspath(path)
+    return _get_index(os.path.dirname(path)).get(os.path.basename(path), get_file_key(path))
+
+
+def update_file_metadata(path, **values):
+    "Adds these values to the indexed metadata of the file (and clears the metadata of an older version of the file)"
+    path = os.path.abspath(path)
+    _get_index(os.path.dirname(path)).update(os.path.basename(path), get_file_key(path), values)
+
+
+def get_file_key(path) -> list:
+    "Changes when the file is modified or replaced"
+    st = os.stat(path)
+    return [st.st_size, st.st_mtime_ns, st.st_ctime_ns, st.st_ino]
+
+
+def _get_index(dir_path):
+    with _indexes_lock:
+        if dir_path not in _indexes:
+            _indexes[dir_path] = MetadataIndex(dir_path)
+        return _indexes[dir_path]
+
+
+class MetadataIndex:
+    def __init__(self, dir_path):
+        self.path = os.path.join(dir_path, INDEX_FILE_NAME)
+        self.writable = True
+        self.entries = self._read()  # file name -> {"key": file key, "metadata": dict}
+        self._lock = threading.Lock()
+
+    def get(self, name, file_key) -> dict:
+        with self._lock:
+            entry = self.entries.get(name)
+            return dict(entry["metadata"]) if entry and entry["key"] == file_key else {}
+
+    def update(self, name, file_key, values: dict):
+        with self._lock:
+            entry = self.entries.get(name)
+            if entry is None or entry["key"] != file_key:
+                entry = {"key": file_key, "metadata": {}}
+            entry["metadata"].update(values)
+            self.entries[name] = entry
+
+            self._save(name)
+
+    def _read(self) -> dict:
+        try:
+            with open(self.path, "r", encoding="utf-8") as f:
+                entries = json.load(f)
+            return entries if isinstance(entries, dict) else {}
+        except (OSError, ValueError):
+            return {}
+
+    def _save(self, name):
+        from sdkit.utils import log
+
+        if not self.writable:
+            return
+
+        entries = self._read()  # including the entries saved by other processes
+        entries[name] = self.entries[name]
+        self.entries = entries
+
+        tmp_path = f"{self.path}.{os.getpid()}.{threading.get_ident()}.tmp"
+        try:
+            with open(tmp_path, "w", encoding="utf-8") as f:
+                json.dump(entries, f)
+            os.replace(tmp_path, self.path)
+        except OSError as e:
+            log.debug(f"Could not save the metadata index {self.path}, keeping it in memory: {e}")
+            self.writable = False
+            if os.path.exists(tmp_path):
+                os.remove(tmp_path)
@@ -0,0 +1,190 @@
+"""
+Encodes the generated images (PNG, JPEG or WEBP), and saves them or converts them to base64, on a pool of worker
+threads. This takes a few hundred milliseconds per large image, which would otherwise keep the GPU idle between two
+requests. With `OutputPipeline`, the caller gets a `Future` right away, and can start the next request while the
+images of the previous one are encoded. PIL releases the GIL while encoding, so the workers run in parallel.
+
+Usage:
+```
+pipeline = get_output_pipeline()
+images = generate_images(context, ...)
+futures = pipeline.save_images(images, dir_path="outputs", output_format="PNG")  # returns immediately
+images = generate_images(context, ...)  # the next request, while the previous images are saved
+```
+"""
+
+import base64
+import os
+import threading
+from concurrent.futures import Future, ThreadPoolExecutor
+from io import BytesIO
+
+OUTPUT_WORKERS = max(1, min(4, (os.cpu_count() or 2) // 2))
+
+_default_pipeline = None
+_default_pipeline_lock = threading.Lock()
+
+
+def get_output_pipeline() -> "OutputPipeline":
+    "Returns a shared `OutputPipeline`, created on first use"
+    global _default_pipeline
+
+    with _default_pipeline_lock:
+        if _default_pipeline is None:
+            _default_pipeline = OutputPipeline()
+        return _default_pipeline
+
+
+class OutputPipeline:
+    """
+    The images can be PIL images, uint8 numpy arrays (HWC) or torch tensors (HWC or CHW, uint8 or floats in [0, 1],
+    on any device). Arrays and tensors are converted to PIL images on the worker, so they shouldn't be modified until
+    the returned future is done.
+
+    `metadata` (a dict) is embedded in the image: as tEXt chunks in PNG files, and as EXIF UserComment (JSON) in JPEG
+    and WEBP files, like `save_dicts(..., output_format="embed")`.
+
+    Each worker encodes into its own reused buffer, so the memory for the encoded bytes isn't allocated again for
+    every image.
+    """
+
+    def __init__(self, max_workers=OUTPUT_WORKERS):
+        self.executor = ThreadPoolExecutor(max_workers=max_workers, thread_name_prefix="sdkit-output")
+        self._local = threading.local()
+
+    def encode(self, image, output_format="PNG", output_quality=75, output_lossless=False, metadata=None) -> Future:
+        "Returns a `Future`, with the encoded bytes as the result"
+
+        def run():
+            with self._encode(image, output_format, output_quality, output_lossless, metadata) as data:
+                return bytes(data)
+
+        return self.executor.submit(run)
+
+    def to_base64(self, image, output_format="PNG", output_quality=75, output_lossless=False, metadata=None) -> Future:
+        "Returns a `Future`, with the image as a base64 data url (like `img_to_base64_str()`) as the result"
+
+        def run():
+            with self._encode(image, output_format, output_quality, output_lossless, metadata) as data:
+                return f"data:image/{output_format.lower()};base64," + base64.b64encode(data).decode()
+
+        return self.executor.submit(run)
+
+    def save(
+        self, image, path: str, output_format="PNG", output_quality=75, output_lossless=False, metadata=None
+    ) -> Future:
+        "Writes the image to `path` (the full file path). Returns a `Future`, with `path` as the result"
+
+        def run():
+            with self._encode(image, output_format, output_quality, output_lossless, metadata) as data:
+                with open(path, "wb") as f:
+                    f.write(data)
+            return path
+
+        return self.executor.submit(run)
+
+    def save_images(
+        self,
+        images: list,
+        dir_path: str,
+        file_name="image",
+        output_format="JPEG",
+        output_quality=75,
+        output_lossless=False,
+        metadata: list = None,
+    ) -> list:
+        """
+        Like `save_images()`, but returns a list of `Future`s (one per image) right away, with the file paths as the
+        results.
+
+        * metadata: (optional) a list of dicts, one per image, to embed in the images.
+        """
+        if dir_path is None:
+            return []
+        os.makedirs(dir_path, exist_ok=True)
+
+        futures = []
+        for i, img in enumerate(images):
+            actual_file_name = file_name(i) if callable(file_name) else f"{file_name}_{i}"
+            path = os.path.join(dir_path, f"{actual_file_name}.{output_format.lower()}")
+            m = metadata[i] if metadata else None
+            futures.append(self.save(img, path, output_format, output_quality, output_lossless, m))
+        return futures
+
+    def close(self):
+        "Waits for the submitted images to finish, and stops the workers"
+        self.executor.shutdown(wait=True)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def _encode(self, image, output_format, output_quality, output_lossless, metadata) -> memoryview:
+        "Returns a view of the encoded bytes in this worker's buffer. Release it (`with`) before encoding again"
+        from sdkit.utils import save_img
+
+        buffered = getattr(self._local, "buffer", None)
+        if buffered is None:
+            buffered = self._local.buffer = BytesIO()
+
+        image = to_pil_image(image)
+        save_args = get_metadata_save_args(metadata, output_format)
+        output_lossless = output_lossless and output_format.upper() == "WEBP"
+
+        buffered.seek(0)  # overwrite the previous image, without shrinking the buffer
+        save_img(image, buffered, output_format, output_quality, output_lossless, **save_args)
+        size = buffered.tell()
+
+        view = buffered.getbuffer()
+        try:
+            return view[:size]
+        finally:
+            view.release()
+
+
+def to_pil_image(image):
+    "Converts a uint8 numpy array (HWC), or a torch tensor (HWC or CHW, uint8 or floats in [0, 1]) to a PIL image"
+    import numpy as np
+    from PIL import Image
+
+    if isinstance(image, Image.Image):
+        return image
+
+    if hasattr(image, "detach"):  # torch tensor
+        image = image.detach()
+        if image.ndim == 3 and image.shape[0] in (1, 3, 4) and image.shape[-1] not in (1, 3, 4):
+            image = image.permute(1, 2, 0)
+        if image.dtype.is_floating_point:
+            image = (image.clamp(0, 1) * 255).round()
+        image = image.cpu().byte().numpy()
+    elif image.dtype != np.uint8:
+        image = (np.clip(image, 0, 1) * 255).round().astype(np.uint8)
+
+    if image.ndim == 3 and image.shape[-1] == 1:
+        image = image[:, :, 0]
+    return Image.fromarray(np.ascontiguousarray(image))
+
+
+def get_metadata_save_args(metadata: dict, output_format: str) -> dict:
+    "Returns the arguments for `PIL.Image.save()` that embed the metadata in the image"
+    import json
+
+    if not metadata:
+        return {}
+
+    if output_format.upper() == "PNG":
+        from PIL.PngImagePlugin import PngInfo
+
+        embedded_metadata = PngInfo()
+        for key, val in metadata.items():
+            embedded_metadata.add_text(key, str(val))
+        return {"pnginfo": embedded_metadata}
+
+    import piexif
+    import piexif.helper
+
+    user_comment = json.dumps(metadata)
+    exif_dict = {"Exif": {piexif.ExifIFD.UserComment: piexif.helper.UserComment.dump(user_comment, encoding="unicode")}}
+    return {"exif": piexif.dump(exif_dict)}
@@ -0,0 +1,350 @@
+"""
+Span timing for the main stages of sdkit: loading, converting and scanning models, prompt encoding, applying LoRAs,
+building pipelines, each UNet step, VAE decoding and each filter. The top-level spans (e.g. `generate_images`, or a
+`load_model` outside a request) also record the peak VRAM and the host RSS during that span.
+
+Disabled by default. When disabled, `trace()` returns a shared no-op span, and the UNet step hooks aren't installed,
+so the instrumentation costs a function call per stage.
+
+Usage:
+```
+from sdkit.utils import enable_tracing, TraceStats
+
+stats = TraceStats()
+enable_tracing(exporters=[stats], cuda_events=True)
+
+generate_images(context, ...)
+
+print(stats.summary())  # {"generate_images": {"count": 1, "p50": 2.1, ..}, "generate_images/vae_decode": ..}
+```
+
+Exporters are functions, called with each finished top-level `Span` (on the thread that finished it). They can send
+the spans to OpenTelemetry, Prometheus etc. The span tree can be walked with `Span.walk()`, or converted with
+`Span.to_dict()`.
+"""
+
+import threading
+import time
+from contextlib import contextmanager
+
+_tracer = None  # the active Tracer, or None if tracing is disabled
+_local = threading.local()  # the stack of open spans, per thread
+
+
+def enable_tracing(exporters: list = [], cuda_events=False, track_memory=True) -> "Tracer":
+    """
+    * exporters: a list of functions, called with each finished top-level `Span`.
+    * cuda_events: also measure the GPU time of each span (`Span.gpu_time`) with CUDA events. The events are read once
+        the top-level span finishes, so this doesn't add a sync per span.
+    * track_memory: record the peak VRAM and the host RSS in the top-level spans (`Span.memory`). torch's peak memory
+        stats of the device aren't reset (other code may rely on them): if the peak rose during the span, that's the
+        span's peak. Otherwise it's the most VRAM allocated when the span or its children started or finished.
+    """
+    global _tracer
+
+    _tracer = Tracer(list(exporters), cuda_events, track_memory)
+    return _tracer
+
+
+def disable_tracing():
+    global _tracer
+
+    _tracer = None
+
+
+def is_tracing_enabled() -> bool:
+    return _tracer is not None
+
+
+def trace(name: str, device=None, **attributes):
+    """
+    Returns a span for the `with` statement. Spans opened inside it (on the same thread) become its children.
+
+    * device: the torch device, for recording the peak VRAM of this span (if it's a top-level span).
+    * attributes: any values to keep with the span, e.g. `width=512`.
+    """
+    tracer = _tracer
+    if tracer is None:
+        return _NOOP_SPAN
+    return Span(tracer, name, attributes, device)
+
+
+@contextmanager
+def trace_module(module, name: str):
+    "Records a span for each call of the module (e.g. each UNet step), while inside this `with` block"
+    tracer = _tracer
+    if tracer is None or module is None or not hasattr(module, "register_forward_pre_hook"):
+        yield
+        return
+
+    open_spans = []
+    calls = [0]
+
+    def on_start(m, args):
+        open_spans.append(Span(tracer, name, {"call": calls[0]}, None).__enter__())
+        calls[0] += 1
+
+    def on_end(m, args, output):
+        if open_spans:
+            open_spans.pop().__exit__(None, None, None)
+
+    handles = [module.register_forward_pre_hook(on_start), module.register_forward_hook(on_end)]
+    try:
+        yield
+    finally:
+        for h in handles:
+            h.remove()
+        while open_spans:  # the module raised an exception
+            open_spans.pop().__exit__(RuntimeError, None, None)
+
+
+class Tracer:
+    def __init__(self, exporters, cuda_events, track_memory):
+        self.exporters = exporters
+        self.track_memory = track_memory
+        self.cuda_events = cuda_events and _is_cuda_available()
+        self._process = None
+
+    def get_rss(self) -> int:
+        if self._process is None:
+            import psutil
+
+            self._process = psutil.Process()
+        return self._process.memory_info().rss
+
+    def export(self, span: "Span"):
+        from sdkit.utils import log
+
+        for exporter in self.exporters:
+            try:
+                exporter(span)
+            except Exception as e:
+                log.warn(f"Trace exporter {exporter} failed: {e}")
+
+
+class Span:
+    """
+    * duration: the wall-clock time of the span, in seconds.
+    * gpu_time: the GPU time of the span (in seconds), with `cuda_events`. Otherwise `None`.
+    * memory: (top-level spans only) `{"vram_peak", "rss_start", "rss_end", "rss_peak"}` in bytes, with `track_memory`.
+    * error: the name of the exception that ended the span, or `None`.
+    """
+
+    __slots__ = (
+        "name",
+        "attributes",
+        "parent",
+        "children",
+        "start",
+        "end",
+        "gpu_time",
+        "memory",
+        "error",
+        "_tracer",
+        "_device",
+        "_events",
+        "_vram_baseline",
+    )
+
+    def __init__(self, tracer: Tracer, name: str, attributes: dict, device):
+        self.name = name
+        self.attributes = attributes
+        self.parent = None
+        self.children = []
+        self.start = self.end = None
+        self.gpu_time = None
+        self.memory = None
+        self.error = None
+
+        self._tracer = tracer
+        self._device = device
+        self._events = None
+        self._vram_baseline = None  # torch's peak VRAM of the device, when this (top-level) span started
+
+    @property
+    def duration(self) -> float:
+        return (self.end or time.perf_counter()) - self.start
+
+    @property
+    def path(self) -> str:
+        "The names of this span and its parents, e.g. `generate_images/sampling/unet`"
+        return self.name if self.parent is None else f"{self.parent.path}/{self.name}"
+
+    def set(self, **attributes):
+        self.attributes.update(attributes)
+
+    def walk(self):
+        "Yields this span, and all the spans inside it"
+        yield self
+        for child in self.children:
+            yield from child.walk()
+
+    def to_dict(self) -> dict:
+        return {
+            "name": self.name,
+            "duration": self.duration,
+            "gpu_time": self.gpu_time,
+            "attributes": self.attributes,
+            "memory": self.memory,
+            "error": self.error,
+            "children": [c.to_dict() for c in self.children],
+        }
+
+    def __enter__(self):
+        stack = getattr(_local, "stack", None)
+        if stack is None:
+            stack = _local.stack = []
+
+        if stack:
+            self.parent = stack[-1]
+            self.parent.children.append(self)
+        elif self._tracer.track_memory:
+            self._start_memory_tracking()
+        stack.append(self)
+
+        if self._tracer.cuda_events:
+            self._events = (_record_cuda_event(), None)
+        self.start = time.perf_counter()
+        return self
+
+    def __exit__(self, exc_type, exc, tb):
+        self.end = time.perf_counter()
+        if self._events is not None:
+            self._events = (self._events[0], _record_cuda_event())
+        if exc_type is not None:
+            self.error = exc_type.__name__
+
+        stack = _local.stack
+        if self in stack:  # close any children left open (e.g. by an exception)
+            del stack[stack.index(self) :]
+
+        tracer = self._tracer
+        root = self
+        while root.parent is not None:
+            root = root.parent
+        if root.memory is not None:
+            root.memory["rss_peak"] = max(root.memory["rss_peak"], tracer.get_rss())
+            if root._vram_baseline is not None:
+                root.memory["vram_peak"] = max(root.memory["vram_peak"], _get_vram_allocated(root._device))
+
+        if self.parent is None:
+            self._finish()
+        return False
+
+    def _start_memory_tracking(self):
+        rss = self._tracer.get_rss()
+        self.memory = {"vram_peak": 0, "rss_start": rss, "rss_end": rss, "rss_peak": rss}
+
+        if self._device is not None and getattr(self._device, "type", None) == "cuda":
+            import torch
+
+            self._vram_baseline = torch.cuda.max_memory_allocated(self._device)
+            self.memory["vram_peak"] = _get_vram_allocated(self._device)
+
+    def _finish(self):
+        if self.memory is not None:
+            self.memory["rss_end"] = self._tracer.get_rss()
+            if self._vram_baseline is not None:
+                import torch
+
+                peak = torch.cuda.max_memory_allocated(self._device)
+                if peak > self._vram_baseline:  # a new peak, so it was reached during this span
+                    self.memory["vram_peak"] = max(self.memory["vram_peak"], peak)
+
+        if self._events is not None:
+            self._events[1].synchronize()  # the last event of this tree, so all the others are complete too
+            for span in self.walk():
+                if span._events is not None and span._events[1] is not None:
+                    span.gpu_time = span._events[0].elapsed_time(span._events[1]) / 1000
+                span._events = None
+
+        self._tracer.export(self)
+
+
+class _NoopSpan:
+    __slots__ = ()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc, tb):
+        return False
+
+    def set(self, **attributes):
+        pass
+
+
+_NOOP_SPAN = _NoopSpan()
+
+
+class TraceStats:
+    """
+    An exporter that keeps the durations (in seconds) of the last `max_samples` spans of each path (e.g.
+    `generate_images/vae_decode`), and summarizes them as percentiles. The peak VRAM and RSS of the top-level spans
+    are kept as the paths `{name}:vram_peak` and `{name}:rss_peak` (in bytes).
+    """
+
+    def __init__(self, max_samples=1000):
+        self.max_samples = max_samples
+        self.samples = {}  # path -> deque of values
+        self._lock = threading.Lock()
+
+    def __call__(self, root: Span):
+        from collections import deque
+
+        values = [(span.path, span.duration) for span in root.walk()]
+        if root.memory is not None:
+            values += [(f"{root.name}:vram_peak", root.memory["vram_peak"])]
+            values += [(f"{root.name}:rss_peak", root.memory["rss_peak"])]
+
+        with self._lock:
+            for path, value in values:
+                if path not in self.samples:
+                    self.samples[path] = deque(maxlen=self.max_samples)
+                self.samples[path].append(value)
+
+    def summary(self) -> dict:
+        "Returns `{path: {count, mean, p50, p95, max}}`"
+        with self._lock:
+            samples = {path: sorted(values) for path, values in self.samples.items()}
+
+        def percentile(values, q):
+            return values[int(round(q * (len(values) - 1)))]
+
+        return {
+            path: {
+                "count": len(values),
+                "mean": sum(values) / len(values),
+                "p50": percentile(values, 0.5),
+                "p95": percentile(values, 0.95),
+                "max": values[-1],
+            }
+            for path, values in samples.items()
+        }
+
+    def reset(self):
+        with self._lock:
+            self.samples.clear()
+
+
+def _is_cuda_available() -> bool:
+    try:
+        import torch
+
+        return torch.cuda.is_available()
+    except ImportError:
+        return False
+
+
+def _get_vram_allocated(device) -> int:
+    import torch
+
+    return torch.cuda.memory_allocated(device)
+
+
+def _record_cuda_event():
+    import torch
+
+    event = torch.cuda.Event(enable_timing=True)
+    event.record()
+    return event
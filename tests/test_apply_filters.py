@@ -0,0 +1,103 @@
+import importlib
+
+import torch
+from PIL import Image
+
+from sdkit import Context
+from sdkit.filter import apply_filters
+
+from common import GPU_DEVICE_NAME
+
+apply_filters_module = importlib.import_module("sdkit.filter.apply_filters")  # the name is shadowed by the function
+
+context = None
+
+
+class BatchFilter:
+    def __init__(self):
+        self.calls = []
+
+    def apply_batch(self, context, images, **kwargs):
+        self.calls.append(images.shape)
+        return 1 - images
+
+
+def setup_module():
+    global context
+
+    context = Context()
+    context.device = GPU_DEVICE_NAME
+
+
+def use_batch_filter(monkeypatch):
+    f = BatchFilter()
+    monkeypatch.setattr(apply_filters_module, "_get_module", lambda name: f if name == "invert" else None)
+    return f
+
+
+def test_1_0__images_of_the_same_size_are_filtered_together(monkeypatch):
+    f = use_batch_filter(monkeypatch)
+    images = [Image.new("RGB", (64, 32), (i * 50, 0, 255)) for i in range(4)]
+
+    out = apply_filters(context, ["invert", "invert"], images)
+
+    assert f.calls == [(4, 3, 32, 64)] * 2
+    assert [img.getpixel((0, 0)) for img in out] == [img.getpixel((0, 0)) for img in images]
+
+
+def test_1_1__images_of_different_sizes_are_filtered_separately(monkeypatch):
+    f = use_batch_filter(monkeypatch)
+    images = [Image.new("RGB", (64, 32)), Image.new("RGB", (32, 32))]
+
+    out = apply_filters(context, "invert", images)
+
+    assert len(f.calls) == 2
+    assert [img.size for img in out] == [(64, 32), (32, 32)]
+    assert out[0].getpixel((0, 0)) == (255, 255, 255)
+
+
+def test_1_2__tensor_input_and_output(monkeypatch):
+    use_batch_filter(monkeypatch)
+    images = torch.zeros((2, 3, 16, 16), device=GPU_DEVICE_NAME)
+
+    out = apply_filters(context, "invert", images, output_type="pt")
+
+    assert isinstance(out, torch.Tensor) and out.shape == (2, 3, 16, 16)
+    assert torch.all(out == 1)
+
+
+def test_1_3__images_are_grouped_by_size_and_keep_their_order(monkeypatch):
+    f = use_batch_filter(monkeypatch)
+    sizes = [(64, 32), (32, 32), (64, 32), (32, 32)]
+    images = [Image.new("RGB", size, (i * 50, 0, 0)) for i, size in enumerate(sizes)]
+
+    out = apply_filters(context, "invert", images)
+
+    assert sorted(f.calls) == [(2, 3, 32, 32), (2, 3, 32, 64)]
+    assert [img.size for img in out] == sizes
+    assert [img.getpixel((0, 0)) for img in out] == [(255 - i * 50, 255, 255) for i in range(4)]
+
+
+def test_1_4__the_alpha_channel_is_kept(monkeypatch):
+    use_batch_filter(monkeypatch)
+    context.models["upscale"] = lambda image: image.resize((image.width * 2, image.height * 2))
+    image = Image.new("RGBA", (16, 16), (0, 0, 0, 100))
+
+    out = apply_filters(context, ["invert", "upscale"], [image, Image.new("RGB", (16, 16))])
+
+    assert out[0].mode == "RGBA" and out[0].size == (32, 32)
+    assert out[0].getpixel((0, 0)) == (255, 255, 255, 100)
+    assert out[1].mode == "RGB"
+    del context.models["upscale"]
+
+
+def test_2_0__filters_without_batch_support_get_pil_images(monkeypatch):
+    use_batch_filter(monkeypatch)
+    context.models["rotate"] = lambda image: image.rotate(90, expand=True)
+    images = torch.zeros((2, 3, 16, 32), device=GPU_DEVICE_NAME)
+
+    out = apply_filters(context, ["invert", "rotate"], images)
+
+    assert [img.size for img in out] == [(16, 32), (16, 32)]
+    assert out[0].getpixel((0, 0)) == (255, 255, 255)
+    del context.models["rotate"]
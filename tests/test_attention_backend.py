@@ -0,0 +1,108 @@
+import torch
+
+from sdkit.models.model_loader.stable_diffusion.attention import (
+    AdaptiveAttnProcessor,
+    _get_chunks,
+    get_bucket,
+    get_calibrations,
+    run_attention,
+)
+
+from common import GPU_DEVICE_NAME
+
+
+def make_qkv(batch=2, heads=8, q_len=256, kv_len=77, head_dim=40):
+    torch.manual_seed(42)
+    q = torch.randn((batch, heads, q_len, head_dim), device=GPU_DEVICE_NAME)
+    k = torch.randn((batch, heads, kv_len, head_dim), device=GPU_DEVICE_NAME)
+    v = torch.randn((batch, heads, kv_len, head_dim), device=GPU_DEVICE_NAME)
+    return q, k, v
+
+
+def test_1_0__backends_match_sdpa():
+    q, k, v = make_qkv()
+    expected = run_attention("sdpa", 1, q, k, v)
+
+    for backend in ("chunked", "sliced"):
+        for chunks in (2, 3, 8):
+            actual = run_attention(backend, chunks, q, k, v)
+            assert torch.allclose(actual, expected, atol=1e-4), f"{backend} with {chunks} chunks"
+
+
+def test_1_1__backends_match_sdpa_with_a_mask():
+    q, k, v = make_qkv()
+    mask = torch.zeros((2, 1, 1, 77), device=GPU_DEVICE_NAME)
+    mask[:, :, :, 60:] = -10000
+    expected = run_attention("sdpa", 1, q, k, v, mask)
+
+    for backend in ("chunked", "sliced"):
+        assert torch.allclose(run_attention(backend, 4, q, k, v, mask), expected, atol=1e-4), backend
+
+
+def test_2_0__buckets_round_up_the_batch_size():
+    q3, k3, _ = make_qkv(batch=3)
+    q4, k4, _ = make_qkv(batch=4)
+    q5, k5, _ = make_qkv(batch=5)
+
+    assert get_bucket(q3, k3) == get_bucket(q4, k4)
+    assert get_bucket(q4, k4) != get_bucket(q5, k5)
+
+
+def test_2_1__chunks_are_computed_for_the_bucket_batch_size():
+    q3, k3, _ = make_qkv(batch=3)
+    q4, k4, _ = make_qkv(batch=4)
+    mem_free = 3 * 8 * 256 * 77 * 4 * 3  # fits the scores of a batch of 3, but not 4
+
+    assert _get_chunks(q3, k3, mem_free) == 1
+    batch = get_bucket(q3, k3)[2]
+    assert _get_chunks(q3, k3, mem_free, batch) == _get_chunks(q4, k4, mem_free) == 2
+
+
+def test_3_0__processor_matches_diffusers():
+    from diffusers.models.attention_processor import Attention, AttnProcessor2_0
+
+    attn = Attention(query_dim=320, cross_attention_dim=768, heads=8, dim_head=40).to(GPU_DEVICE_NAME)
+    hidden_states = torch.randn((2, 256, 320), device=GPU_DEVICE_NAME)
+    encoder_hidden_states = torch.randn((2, 77, 768), device=GPU_DEVICE_NAME)
+
+    with torch.no_grad():
+        attn.set_processor(AttnProcessor2_0())
+        expected = attn(hidden_states, encoder_hidden_states)
+
+        attn.set_processor(AdaptiveAttnProcessor(GPU_DEVICE_NAME, "auto"))
+        actual = attn(hidden_states, encoder_hidden_states)
+        assert torch.allclose(actual, expected, atol=1e-4)
+
+        actual = attn(hidden_states, encoder_hidden_states)  # uses the cached choice
+        assert torch.allclose(actual, expected, atol=1e-4)
+
+    assert any(key[0] == str(GPU_DEVICE_NAME) for key in get_calibrations())
+
+
+def test_3_1__upcast_attention_matches_diffusers_in_fp16():
+    from diffusers.models.attention_processor import Attention, AttnProcessor
+
+    torch.manual_seed(42)
+    attn = Attention(query_dim=320, cross_attention_dim=768, heads=8, dim_head=40, upcast_attention=True)
+    attn = attn.to(GPU_DEVICE_NAME, torch.float16)
+    hidden_states = torch.randn((2, 256, 320), device=GPU_DEVICE_NAME, dtype=torch.float16) * 30  # overflows in fp16
+    encoder_hidden_states = torch.randn((2, 77, 768), device=GPU_DEVICE_NAME, dtype=torch.float16) * 30
+
+    with torch.no_grad():
+        attn.set_processor(AttnProcessor())  # the legacy processor, which honours upcast_attention
+        expected = attn(hidden_states, encoder_hidden_states)
+        assert torch.isfinite(expected).all()
+
+        for backend in ("sdpa", "chunked", "sliced"):
+            attn.set_processor(AdaptiveAttnProcessor(GPU_DEVICE_NAME, backend))
+            actual = attn(hidden_states, encoder_hidden_states)
+            assert torch.allclose(actual.float(), expected.float(), atol=2e-2, rtol=1e-2), backend
+
+
+def test_3_2__sliced_attention_upcasts_the_scores():
+    q, k, v = (x.half() * 30 for x in make_qkv())
+    expected = run_attention("sdpa", 1, q.float(), k.float(), v.float()).half()
+
+    actual = run_attention("sliced", 4, q, k, v, upcast=True)
+    assert actual.dtype == torch.float16
+    assert torch.allclose(actual.float(), expected.float(), atol=1e-2)
@@ -0,0 +1,93 @@
+import threading
+
+from sdkit import Context
+from sdkit.generate import generate_images, BatchScheduler
+from sdkit.models import load_model
+
+from common import (
+    USE_DIFFUSERS,
+    assert_images_same,
+)
+
+context = None
+
+
+def setup_module():
+    global context
+
+    context = Context()
+    context.test_diffusers = USE_DIFFUSERS
+    context.model_paths["stable-diffusion"] = "models/stable-diffusion/1.x/sd-v1-4.ckpt"
+    load_model(context, "stable-diffusion")
+
+
+def test_1_0__batched_requests_match_solo_requests():
+    args = dict(width=64, height=64, num_inference_steps=3)
+    requests = [dict(prompt="Horse", seed=42), dict(prompt="Lighthouse", seed=43, guidance_scale=5)]
+    expected = [generate_images(context, **req, **args)[0] for req in requests]
+
+    scheduler = BatchScheduler(context, max_batch_size=4, batch_window=0)
+    futures = [scheduler.submit(**req, **args) for req in requests]
+    scheduler.run_pending()
+
+    for i, (future, expected_image) in enumerate(zip(futures, expected)):
+        images = future.result(timeout=0)
+        assert len(images) == 1
+        assert_images_same(images[0], expected_image, f"batch_scheduler_test1.0_{i}")
+
+
+def test_1_1__incompatible_requests_are_not_batched():
+    scheduler = BatchScheduler(context, max_batch_size=4, batch_window=0)
+    a = scheduler.submit(prompt="Horse", width=64, height=64, num_inference_steps=1)
+    b = scheduler.submit(prompt="Horse", width=128, height=64, num_inference_steps=1, num_outputs=2)
+
+    batch = scheduler._next_batch(block=False)
+    assert len(batch) == 1
+    scheduler._render(batch)
+    scheduler.run_pending()
+
+    assert a.result(timeout=0)[0].size == (64, 64)
+    assert [img.size for img in b.result(timeout=0)] == [(128, 64), (128, 64)]
+
+
+def test_1_2__requests_can_be_submitted_from_other_threads():
+    scheduler = BatchScheduler(context, max_batch_size=2, batch_window=0.5)
+    results = {}
+
+    def client(seed):
+        results[seed] = scheduler.generate_images(prompt="Horse", seed=seed, width=64, height=64, num_inference_steps=1)
+
+    clients = [threading.Thread(target=client, args=(seed,)) for seed in (1, 2, 3)]
+    for c in clients:
+        c.start()
+
+    def stop_when_done():
+        for c in clients:
+            c.join()
+        scheduler.stop()
+
+    threading.Thread(target=stop_when_done).start()
+    scheduler.run()  # the model was loaded on this thread
+
+    assert sorted(results.keys()) == [1, 2, 3]
+    assert all(len(images) == 1 for images in results.values())
+
+
+def test_1_3__requests_with_several_outputs_are_rendered_on_their_own():
+    args = dict(prompt="Horse", seed=42, width=64, height=64, num_inference_steps=3, num_outputs=2)
+    expected = generate_images(context, **args)
+
+    scheduler = BatchScheduler(context, max_batch_size=4, batch_window=0)
+    future = scheduler.submit(**args)
+    other = scheduler.submit(prompt="Lighthouse", seed=43, width=64, height=64, num_inference_steps=3)
+
+    batch = scheduler._next_batch(block=False)
+    assert len(batch) == 1
+    scheduler._render(batch)
+    scheduler.run_pending()
+
+    images = future.result(timeout=0)
+    assert len(images) == 2
+    for i, (image, expected_image) in enumerate(zip(images, expected)):
+        assert_images_same(image, expected_image, f"batch_scheduler_test1.3_{i}")
+    assert len(other.result(timeout=0)) == 1
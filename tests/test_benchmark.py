@@ -0,0 +1,32 @@
+import time
+
+from sdkit.benchmark import PeakRssSampler, get_new_failures
+
+MB = 1024**2
+
+
+def make_row(size, status="ok"):
+    return {"model_filename": "sd.safetensors", "image_size": size, "status": status, "error": None}
+
+
+def test_1_0__only_the_new_failures_are_reported():
+    stable = [make_row("512x512"), make_row("768x768", "failed"), make_row("1024x1024")]
+    beta = [make_row("512x512", "failed"), make_row("768x768", "failed"), make_row("1024x1024")]
+
+    new_failures = get_new_failures(stable, beta, keys=("model_filename", "image_size"))
+    assert [row["image_size"] for row in new_failures] == ["512x512"]
+
+
+def test_1_1__a_failure_at_a_point_missing_in_stable_is_new():
+    beta = [make_row("2048x2048", "load_failed")]
+    assert get_new_failures([], beta, keys=("model_filename", "image_size")) == beta
+
+
+def test_2_0__peak_rss_includes_memory_freed_inside_the_block():
+    with PeakRssSampler(interval=0.001) as rss:
+        start = rss.peak
+        buffer = b"x" * (300 * MB)  # written, so the pages are in the RSS
+        time.sleep(0.05)
+        del buffer
+
+    assert rss.peak - start > 200 * MB
@@ -0,0 +1,53 @@
+import torch
+
+from sdkit.models.model_loader.stable_diffusion.offload import PrefetchingBlockOffloader
+
+from common import GPU_DEVICE_NAME
+
+
+def make_model():
+    torch.manual_seed(42)
+    layers = [torch.nn.Sequential(torch.nn.Linear(256, 256), torch.nn.LayerNorm(256)) for _ in range(6)]
+    return torch.nn.Sequential(*layers)
+
+
+def test_1_0__offloaded_model_gives_the_same_output():
+    x = torch.randn((4, 256), device=GPU_DEVICE_NAME)
+
+    model = make_model().to(GPU_DEVICE_NAME)
+    expected = model(x)
+
+    model = make_model()
+    offloader = PrefetchingBlockOffloader(GPU_DEVICE_NAME, list(model))
+    for _ in range(3):  # the first run learns the order, and the next ones prefetch
+        actual = model(x)
+        assert torch.equal(actual, expected)
+
+    assert offloader.next_block == {i: i + 1 for i in range(5)}
+
+
+def test_1_1__only_two_blocks_are_on_the_device():
+    model = make_model()
+    offloader = PrefetchingBlockOffloader(GPU_DEVICE_NAME, list(model))
+    model(torch.randn((4, 256), device=GPU_DEVICE_NAME))
+
+    devices = [next(block.parameters()).device.type for block in model]
+    assert devices.count("cuda") <= 2
+    assert devices[-1] == "cuda"
+
+    offloader.evict_all()
+    assert all(next(block.parameters()).device.type == "cpu" for block in model)
+    assert all(next(block.parameters()).is_pinned() for block in model)
+
+
+def test_1_2__changed_weights_are_adopted():
+    x = torch.randn((4, 256), device=GPU_DEVICE_NAME)
+    model = make_model()
+    PrefetchingBlockOffloader(GPU_DEVICE_NAME, list(model))
+    model(x)
+
+    model.double()
+    actual = model(x.double())
+
+    expected = make_model().double().to(GPU_DEVICE_NAME)(x.double())
+    assert torch.allclose(actual, expected)
@@ -38,6 +38,16 @@ def test_codeformer_is_applied():
     assert_images_same(image_face_fixed, expected_image, "codeformer_test1")
 
 
+def test_codeformer_restores_a_batch_of_images():
+    image = Image.open(f"{TEST_DATA_FOLDER}/input_images/man-512x512.png")
+    images_face_fixed = apply_filters(context, "codeformer", [image, image, image], codeformer_fidelity=0.5)
+    expected_image = Image.open(f"{EXPECTED_DIR}/man-512x512-no_upscale-cuda.png")
+
+    assert len(images_face_fixed) == 3
+    for i, image_face_fixed in enumerate(images_face_fixed):
+        assert_images_same(image_face_fixed, expected_image, f"codeformer_test_batch_{i}")
+
+
 def test_codeformer_works_on_multiple_devices():
     def task(context):
         context.model_paths["codeformer"] = "models/codeformer/codeformer.pth"
@@ -0,0 +1,89 @@
+from types import SimpleNamespace
+
+import torch
+
+import sdkit.generate
+from sdkit import Context
+from sdkit.generate import warmup
+from sdkit.generate.vae_engine import get_vae_engine, release_vae_engine
+from sdkit.models.model_loader.stable_diffusion.compile import (
+    COMPILE_DEFAULTS,
+    get_compile_cache_dir,
+    get_compile_config,
+)
+
+
+def make_context(cache_dir):
+    context = Context()
+    context.device = "cpu"
+    context.compiled_model_cache_dir = cache_dir
+    return context
+
+
+def test_compile_config_defaults():
+    assert get_compile_config(None) is None
+    assert get_compile_config(False) is None
+    assert get_compile_config(True) == COMPILE_DEFAULTS
+    assert get_compile_config({"vae": False, "shapes": [(512, 512)]}) == {
+        **COMPILE_DEFAULTS,
+        "vae": False,
+        "shapes": [(512, 512)],
+    }
+
+
+def test_cache_dir_is_per_model_torch_version_and_device(tmp_path):
+    context = make_context(str(tmp_path))
+
+    cache_dir = get_compile_cache_dir(context, "abc123")
+    assert cache_dir.startswith(str(tmp_path))
+    assert "abc123" in cache_dir and "cpu" in cache_dir
+    assert torch.__version__.split("+")[0] in cache_dir
+    assert get_compile_cache_dir(context, "def456") != cache_dir
+
+    context.compiled_model_cache_dir = None
+    assert get_compile_cache_dir(context, "abc123") is None
+
+
+def test_compiled_vae_decoder_survives_a_new_vae_engine():
+    from diffusers import AutoencoderKL
+
+    vae = AutoencoderKL(block_out_channels=(32,), norm_num_groups=8, force_upcast=True).eval().half()
+    vae._compile_options = {"mode": "default", "dynamic": False}  # as set by compile_pipeline()
+    context = make_context(None)
+
+    engine = get_vae_engine(context, vae)
+    assert "forward" in vars(engine.fp32_vae.decoder)
+
+    release_vae_engine(vae)  # e.g. when the model is parked
+    assert "forward" in vars(get_vae_engine(context, vae).fp32_vae.decoder)
+
+    context.vae_precision = "fp16"  # decodes with the VAE itself now
+    assert get_vae_engine(context, vae).fp32_vae is None
+    assert "forward" in vars(vae.decoder)
+
+
+def test_warmup_renders_each_shape(monkeypatch):
+    calls = []
+    monkeypatch.setattr(sdkit.generate, "generate_images", lambda context, **kwargs: calls.append(kwargs))
+
+    context = make_context(None)
+    context.models["stable-diffusion"] = {"default": None, "params": {"compile_config": {"shapes": [(512, 512)]}}}
+
+    timings = warmup(context, runs=2)
+    assert list(timings) == [(512, 512, 1)]
+    assert [(c["width"], c["height"], c["num_outputs"]) for c in calls] == [(512, 512, 1)] * 2
+
+    calls.clear()
+    timings = warmup(context, shapes=[(768, 512, 2)], sampler_name="euler")
+    assert list(timings) == [(768, 512, 2)]
+    assert calls[0]["num_outputs"] == 2 and calls[0]["sampler_name"] == "euler" and calls[0]["num_inference_steps"] == 2
+
+
+def test_default_warmup_shape_is_the_native_size_of_the_model():
+    from sdkit.generate.warmup import get_default_warmup_shapes
+
+    context = make_context(None)
+    pipe = SimpleNamespace(unet=SimpleNamespace(config=SimpleNamespace(sample_size=128)), vae_scale_factor=8)
+    context.models["stable-diffusion"] = {"default": pipe, "params": {"compile_config": True}}
+
+    assert get_default_warmup_shapes(context) == [(1024, 1024)]
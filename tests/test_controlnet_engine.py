@@ -0,0 +1,155 @@
+import os
+
+import torch
+
+from diffusers.pipelines.controlnet.multicontrolnet import MultiControlNetModel
+
+from sdkit import Context
+from sdkit.generate.controlnet_engine import ControlNetEngine, clear_control_features
+from sdkit.models import unload_parked_controlnets
+from sdkit.models.model_loader import controlnet as controlnet_loader
+from sdkit.models.model_loader.stable_diffusion import attention
+
+
+def make_controlnet(seed):
+    from diffusers import ControlNetModel
+
+    torch.manual_seed(seed)
+    controlnet = ControlNetModel(
+        block_out_channels=(32, 64),
+        layers_per_block=1,
+        in_channels=4,
+        down_block_types=("CrossAttnDownBlock2D", "DownBlock2D"),
+        cross_attention_dim=32,
+        conditioning_embedding_out_channels=(16, 32),
+        norm_num_groups=8,
+    )
+    return controlnet.eval()
+
+
+def make_inputs():
+    torch.manual_seed(0)
+    sample, embeds = torch.randn(2, 4, 16, 16), torch.randn(2, 7, 32)
+    images = [torch.rand(2, 3, 32, 32) for _ in range(3)]
+    return sample, embeds, images
+
+
+def run(model, scales):
+    sample, embeds, images = make_inputs()
+    with torch.no_grad():
+        return model(sample, 10, embeds, controlnet_cond=images, conditioning_scale=scales, return_dict=False)
+
+
+def assert_residuals_same(a, b, atol=1e-4):
+    down_a, mid_a = a
+    down_b, mid_b = b
+    assert len(down_a) == len(down_b)
+    for x, y in zip(down_a, down_b):
+        assert torch.allclose(x, y, atol=atol)
+    assert torch.allclose(mid_a, mid_b, atol=atol)
+
+
+def test_1_0__engine_matches_multicontrolnet_one_at_a_time():
+    nets = [make_controlnet(i) for i in range(3)]
+    expected = run(MultiControlNetModel(nets), [1.0, 0.5, 0.8])
+
+    engine = ControlNetEngine(nets)
+    engine.use_batching = False
+    assert_residuals_same(run(engine, [1.0, 0.5, 0.8]), expected)
+
+
+def test_1_1__batched_controlnets_match_multicontrolnet():
+    nets = [make_controlnet(i) for i in range(3)]
+    expected = run(MultiControlNetModel(nets), [1.0, 0.5, 0.8])
+
+    engine = ControlNetEngine(nets)
+    assert_residuals_same(run(engine, [1.0, 0.5, 0.8]), expected)
+    assert not engine._unbatchable
+
+    # the weights are stacked in place, so the nets still compute the same thing on their own
+    assert_residuals_same(run(MultiControlNetModel(nets), [1.0, 0.5, 0.8]), expected)
+    ptrs = [next(net.parameters()).data_ptr() for net in nets]
+    size = next(nets[0].parameters()).numel() * next(nets[0].parameters()).element_size()
+    assert ptrs == [ptrs[0] + i * size for i in range(3)]
+
+
+def test_1_2__changing_the_active_controlnets_does_not_move_the_weights():
+    nets = [make_controlnet(i) for i in range(3)]
+    engine = ControlNetEngine(nets)
+    ptrs = [[t.data_ptr() for t in net.parameters()] for net in nets]
+
+    for scales in ([1.0, 0.5, 0.8], [1.0, 0.0, 0.8], [1.0, 0.5, 0.8]):  # e.g. net 1 has an earlier control_end
+        expected = run(MultiControlNetModel(nets), scales)
+        assert_residuals_same(run(engine, scales), expected)
+        assert [[t.data_ptr() for t in net.parameters()] for net in nets] == ptrs, scales
+
+
+def test_1_3__zero_weight_controlnets_are_skipped():
+    nets = [make_controlnet(i) for i in range(3)]
+    calls = []
+    for i, net in enumerate(nets):
+        net.register_forward_pre_hook(lambda m, args, i=i: calls.append(i))
+
+    engine = ControlNetEngine(nets)
+    engine.use_batching = False
+    expected = run(MultiControlNetModel(nets), [1.0, 0.0, 0.8])
+    calls.clear()
+
+    assert_residuals_same(run(engine, [1.0, 0.0, 0.8]), expected)
+    assert calls == [0, 2]
+
+    calls.clear()
+    assert run(engine, [0.0, 0.0, 0.0]) == (None, None)  # e.g. outside the control_start..control_end range
+    assert calls == []
+
+
+def test_1_4__control_image_features_are_reused():
+    nets = [make_controlnet(0)]
+    calls = []
+    nets[0].controlnet_cond_embedding.register_forward_pre_hook(lambda *args: calls.append(1))
+    clear_control_features()
+
+    engine = ControlNetEngine(nets)
+    sample, embeds, images = make_inputs()
+    with torch.no_grad():
+        for _ in range(3):  # steps of one request
+            engine(sample, 10, embeds, controlnet_cond=images[:1], conditioning_scale=[1.0])
+        assert len(calls) == 1
+
+        engine.set_control_keys(["image-a"])
+        for image in (images[0].clone(), images[0].clone()):  # later requests with the same control image
+            engine(sample, 10, embeds, controlnet_cond=[image], conditioning_scale=[1.0])
+        assert len(calls) == 2
+
+    assert "forward" not in vars(nets[0].controlnet_cond_embedding)
+
+
+def test_2_0__unloaded_controlnets_are_parked_only_with_controlnet_residency(monkeypatch):
+    calls = []
+    monkeypatch.setattr(attention, "set_attention_backend", lambda context, model: calls.append(model))
+    context = Context()
+    context.device = "cpu"
+    net = make_controlnet(0)
+    net._quick_hash = "abc"
+
+    context.models["controlnet"] = net
+    controlnet_loader.park_controlnets(context)
+    assert controlnet_loader.unpark_controlnet(context, "abc") is None  # disabled by default
+
+    context.controlnet_residency = 1
+    controlnet_loader.park_controlnets(context)
+    assert controlnet_loader.unpark_controlnet(context, "abc") is net
+    assert calls == [net]  # with the current attention backend
+
+    controlnet_loader.park_controlnets(context)
+    unload_parked_controlnets(context)
+    assert controlnet_loader.unpark_controlnet(context, "abc") is None
+
+
+def test_2_1__converted_controlnets_are_saved_in_the_cache(tmp_path):
+    cache_path = str(tmp_path / "controlnet-abc-fp32")
+    for seed in (0, 1):  # the second writer keeps the completed entry
+        controlnet_loader.save_converted_controlnet(make_controlnet(seed), torch.float32, cache_path)
+
+    assert os.listdir(tmp_path) == ["controlnet-abc-fp32"]
+    assert os.path.exists(os.path.join(cache_path, "config.json"))
@@ -0,0 +1,82 @@
+import os
+import shutil
+
+from sdkit import Context
+from sdkit.generate import generate_images
+from sdkit.models import load_model
+from sdkit.models.model_loader.stable_diffusion import model_cache
+from sdkit.utils import hash_file_quick
+
+from common import (
+    OUTPUT_FOLDER,
+    USE_DIFFUSERS,
+    assert_images_same,
+)
+
+MODEL_PATH = "models/stable-diffusion/1.x/sd-v1-4.ckpt"
+CACHE_DIR = f"{OUTPUT_FOLDER}/converted_models"
+
+context = None
+
+
+def setup_module():
+    global context
+
+    shutil.rmtree(CACHE_DIR, ignore_errors=True)
+
+    context = Context()
+    context.test_diffusers = USE_DIFFUSERS
+    context.converted_model_cache_dir = CACHE_DIR
+    context.model_paths["stable-diffusion"] = MODEL_PATH
+
+
+def get_cache_path():
+    return model_cache.get_cache_path(context, hash_file_quick(MODEL_PATH))
+
+
+def test_1_0__first_load_saves_the_converted_model():
+    load_model(context, "stable-diffusion")
+
+    meta = model_cache.get_cached_model_meta(get_cache_path())
+    assert meta is not None
+    assert meta["model_type"] == "SD1"
+    assert os.path.exists(os.path.join(get_cache_path(), "unet"))
+
+
+def test_1_1__second_load_uses_the_converted_model_and_renders_the_same():
+    expected_image = generate_images(context, "Horse", seed=42, width=64, height=64, num_inference_steps=3)[0]
+
+    calls = []
+    load_cached_pipeline = model_cache.load_cached_pipeline
+    model_cache.load_cached_pipeline = lambda *args: calls.append(args) or load_cached_pipeline(*args)
+    try:
+        load_model(context, "stable-diffusion", scan_model=False)
+    finally:
+        model_cache.load_cached_pipeline = load_cached_pipeline
+    assert len(calls) == 1
+
+    image = generate_images(context, "Horse", seed=42, width=64, height=64, num_inference_steps=3)[0]
+
+    assert_images_same(image, expected_image, "converted_model_cache_test1.1")
+
+
+def test_1_2__incomplete_entries_are_ignored():
+    os.remove(os.path.join(get_cache_path(), model_cache.META_FILE_NAME))
+    assert model_cache.get_cached_model_meta(get_cache_path()) is None
+
+    load_model(context, "stable-diffusion")
+    assert model_cache.get_cached_model_meta(get_cache_path()) is not None
+
+
+def test_1_3__a_completed_entry_is_kept_when_another_writer_finishes_later():
+    cache_path = get_cache_path()
+    meta = model_cache.get_cached_model_meta(cache_path)
+
+    tmp_path, other_tmp_path = model_cache.make_tmp_dir(cache_path), model_cache.make_tmp_dir(cache_path)
+    assert tmp_path != other_tmp_path  # unique per writer
+    shutil.rmtree(other_tmp_path)
+    model_cache.save_meta(tmp_path, cache_path, meta)
+
+    assert not os.path.exists(tmp_path)
+    assert os.path.exists(os.path.join(cache_path, "unet"))
+    assert model_cache.get_cached_model_meta(cache_path) is not None
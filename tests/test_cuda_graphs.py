@@ -0,0 +1,101 @@
+import torch
+
+from sdkit import Context
+from sdkit.generate.cuda_graphs import CUDA_GRAPH_CACHE_SIZE, _runners, cuda_graph_unet
+
+from common import GPU_DEVICE_NAME
+
+
+def make_unet():
+    from diffusers import UNet2DConditionModel
+
+    torch.manual_seed(0)
+    unet = UNet2DConditionModel(
+        block_out_channels=(32, 64),
+        layers_per_block=1,
+        sample_size=8,
+        in_channels=4,
+        out_channels=4,
+        down_block_types=("CrossAttnDownBlock2D", "DownBlock2D"),
+        up_block_types=("UpBlock2D", "CrossAttnUpBlock2D"),
+        cross_attention_dim=32,
+        norm_num_groups=8,
+    )
+    return unet.to(GPU_DEVICE_NAME).eval()
+
+
+def make_context(cuda_graphs=True):
+    context = Context()
+    context.device = GPU_DEVICE_NAME
+    context.cuda_graphs = cuda_graphs
+    return context
+
+
+def make_inputs(batch_size=2, size=8):
+    sample = torch.randn(batch_size, 4, size, size, device=GPU_DEVICE_NAME)
+    embeds = torch.randn(batch_size, 7, 32, device=GPU_DEVICE_NAME)
+    return sample, embeds
+
+
+def test_1_0__replayed_graph_gives_the_same_output():
+    unet = make_unet()
+    context = make_context()
+
+    with torch.no_grad():
+        for t in (999, 500, 1):  # the first call captures, the next ones replay
+            sample, embeds = make_inputs()
+            expected = unet(sample, t, encoder_hidden_states=embeds).sample
+            with cuda_graph_unet(context, unet):
+                actual = unet(sample, t, encoder_hidden_states=embeds).sample
+
+            assert torch.allclose(actual, expected, atol=1e-4)
+
+    assert len(_runners[unet].graphs) == 1
+    assert "forward" not in vars(unet)  # removed after the block
+
+
+def test_1_1__one_graph_per_shape_bucket_with_a_bounded_cache():
+    unet = make_unet()
+    context = make_context()
+
+    with torch.no_grad(), cuda_graph_unet(context, unet):
+        for batch_size in range(1, CUDA_GRAPH_CACHE_SIZE + 3):
+            sample, embeds = make_inputs(batch_size)
+            unet(sample, 10, encoder_hidden_states=embeds)
+
+    assert len(_runners[unet].graphs) == CUDA_GRAPH_CACHE_SIZE
+
+
+def test_2_0__graphs_are_captured_again_when_the_weights_or_state_change():
+    unet = make_unet()
+    context = make_context()
+    sample, embeds = make_inputs()
+
+    with torch.no_grad():
+        with cuda_graph_unet(context, unet, state_key="a"):
+            unet(sample, 10, encoder_hidden_states=embeds)
+        assert len(_runners[unet].graphs) == 1
+
+        with cuda_graph_unet(context, unet, state_key="b"):
+            assert len(_runners[unet].graphs) == 0
+
+        unet.conv_out.weight = torch.nn.Parameter(unet.conv_out.weight * 2)
+        expected = unet(sample, 10, encoder_hidden_states=embeds).sample
+        with cuda_graph_unet(context, unet, state_key="b"):
+            actual = unet(sample, 10, encoder_hidden_states=embeds).sample
+        assert torch.allclose(actual, expected, atol=1e-4)
+
+
+def test_2_1__runs_eagerly_for_controlnet_residuals_or_when_disabled():
+    unet = make_unet()
+    sample, embeds = make_inputs()
+
+    with torch.no_grad():
+        with cuda_graph_unet(make_context(cuda_graphs=False), unet):
+            assert "forward" not in vars(unet)
+
+        with cuda_graph_unet(make_context(), unet):
+            mid = torch.zeros(2, 64, 4, 4, device=GPU_DEVICE_NAME)
+            unet(sample, 10, encoder_hidden_states=embeds, mid_block_additional_residual=mid)
+
+    assert len(_runners[unet].graphs) == 0
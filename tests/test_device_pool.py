@@ -0,0 +1,83 @@
+import threading
+from types import SimpleNamespace
+
+import torch
+
+from sdkit import Context
+from sdkit.generate import DevicePool, generate_images
+from sdkit.models.model_loader.replica import make_replica
+
+from common import GPU_DEVICE_NAME, USE_DIFFUSERS, assert_images_same
+
+MODEL_PATH = "models/stable-diffusion/1.x/sd-v1-4.ckpt"
+
+
+def test_1_0__requests_go_to_the_device_with_the_fewest_pending_requests():
+    pool = DevicePool(["cpu", "cpu"])
+    release = threading.Event()
+    try:
+        pool.submit(lambda context: release.wait(10))  # keeps the first device busy
+        thread = pool.submit(lambda context: threading.current_thread()).result(timeout=10)
+
+        assert thread is pool._workers[1].thread
+    finally:
+        release.set()
+        pool.stop()
+
+
+def test_1_1__errors_are_raised_to_the_caller():
+    pool = DevicePool(["cpu", "cpu"])
+    try:
+        future = pool.submit(lambda context: 1 / 0)
+        assert isinstance(future.exception(timeout=10), ZeroDivisionError)
+
+        devices = pool.run_on_all(lambda context: context.device)
+        assert devices == ["cpu", "cpu"]
+    finally:
+        pool.stop()
+
+
+def make_model():
+    torch.manual_seed(42)
+    pipe = SimpleNamespace(unet=torch.nn.Linear(4, 4), vae=torch.nn.Linear(4, 4))
+    pipe.vae.register_buffer("scale", torch.ones(4))
+    return {"default": pipe, "params": {}}
+
+
+def test_2_0__replica_is_a_snapshot_of_the_model_when_it_was_made():
+    context = Context()
+    context.device = "cpu"
+    context.test_diffusers = True
+    context.models["stable-diffusion"] = model = make_model()
+    expected = model["default"].unet.weight.detach().clone()
+
+    replica = make_replica(context)
+    with torch.no_grad():
+        model["default"].unet.weight += 1  # e.g. a LoRA fused on the source device, while the others copy it
+    model["default"].extra = torch.nn.Linear(1, 1)
+
+    copies = [replica.to_device(context) for _ in range(2)]
+    for copy in copies:
+        unet = copy["default"].unet
+        assert torch.equal(unet.weight, expected)
+        assert isinstance(unet.weight, torch.nn.Parameter)
+        assert torch.equal(copy["default"].vae.scale, torch.ones(4))
+        assert not hasattr(copy["default"], "extra")
+
+    assert copies[0]["default"].unet.weight.data_ptr() != copies[1]["default"].unet.weight.data_ptr()
+
+
+def test_3_0__the_sd_model_is_copied_to_the_other_devices():
+    configure = lambda context: setattr(context, "test_diffusers", USE_DIFFUSERS)
+    pool = DevicePool([GPU_DEVICE_NAME, GPU_DEVICE_NAME], configure=configure)
+    try:
+        pool.load_model("stable-diffusion", MODEL_PATH)
+        args = dict(prompt="Horse", seed=42, width=64, height=64, num_inference_steps=3)
+        images = pool.run_on_all(render, **args)
+        assert_images_same(images[1], images[0], "device_pool_test3.0")
+    finally:
+        pool.stop()
+
+
+def render(context, **kwargs):
+    return generate_images(context, **kwargs)[0]
@@ -57,3 +57,35 @@ def test_1_1__tensorRT__stable_diffusion_1_4_txt2img_works__64x64():
 
     expected_image = Image.open(f"{EXPECTED_DIR}/1.4-txt-euler_a-42-64x64-cuda.png")
     assert_images_same(image, expected_image, "tensorRT_test1.1")
+
+
+def test_2_0__onnx_weights_leave_out_fused_loras():
+    import torch
+
+    from sdkit.utils import get_onnx_state_dict
+
+    model = torch.nn.Sequential(torch.nn.Linear(4, 4), torch.nn.Linear(4, 4)).half()
+    base_weight = model[0].weight.detach().to("cpu", copy=True)
+    model[0]._lora_base_weight = base_weight  # as if a LoRA was fused into it
+    with torch.no_grad():
+        model[0].weight += 1
+
+    state_dict = get_onnx_state_dict(model)
+
+    assert all(v.dtype == torch.float32 and v.device.type == "cpu" for v in state_dict.values())
+    assert torch.equal(state_dict["0.weight"], base_weight.float())
+    assert torch.equal(state_dict["1.weight"], model[1].weight.float())
+
+
+def test_2_1__quantized_models_cant_be_exported_to_onnx():
+    import pytest
+    import torch
+
+    from sdkit.models.model_loader.stable_diffusion.quantization import quantize_module
+    from sdkit.utils import get_onnx_state_dict
+
+    model = torch.nn.Sequential(torch.nn.Linear(4, 4))
+    quantize_module(model[0], "int8")
+
+    with pytest.raises(ValueError):
+        get_onnx_state_dict(model)
@@ -0,0 +1,176 @@
+import json
+import os
+import threading
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+import pytest
+
+from sdkit.utils import DownloadEngine, DownloadError, download_file, hash_bytes
+from sdkit.utils.hash_utils import get_quick_hash_ranges
+
+FILE_SIZE = 5 * 1024 * 1024 + 123  # larger than 3 MB, so the quick-hash uses byte ranges
+CONTENT = os.urandom(FILE_SIZE)
+
+server = None
+requests_seen = []
+
+
+class RangeHandler(BaseHTTPRequestHandler):
+    supports_ranges = True
+    fail_after = None  # bytes sent before the next full (not ranged) response breaks off, once
+
+    def do_GET(self):
+        requests_seen.append(self.headers.get("Range"))
+        data = CONTENT
+        range_header = self.headers.get("Range")
+
+        if range_header and RangeHandler.supports_ranges:
+            start, end = range_header.replace("bytes=", "").split("-")
+            start, end = int(start), min(int(end) if end else len(data) - 1, len(data) - 1)
+            self.send_response(206)
+            self.send_header("Content-Range", f"bytes {start}-{end}/{len(data)}")
+            data = data[start : end + 1]
+        else:
+            self.send_response(200)
+
+        self.send_header("Content-Length", str(len(data)))
+        self.end_headers()
+        if RangeHandler.fail_after is not None and range_header != "bytes=0-0" and len(data) == len(CONTENT):
+            data, RangeHandler.fail_after = data[: RangeHandler.fail_after], None
+            self.close_connection = True
+        try:
+            self.wfile.write(data)
+        except (BrokenPipeError, ConnectionResetError):  # the client closed the (probe) request early
+            pass
+
+    def log_message(self, *args):
+        pass
+
+
+def setup_module():
+    global server
+
+    server = ThreadingHTTPServer(("127.0.0.1", 0), RangeHandler)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+
+
+def teardown_module():
+    server.shutdown()
+
+
+def setup_function():
+    RangeHandler.supports_ranges = True
+    RangeHandler.fail_after = None
+    requests_seen.clear()
+
+
+def get_url():
+    return f"http://127.0.0.1:{server.server_address[1]}/model.safetensors"
+
+
+def get_quick_hash(data):
+    return hash_bytes(b"".join(data[o : o + c] for o, c in get_quick_hash_ranges(len(data))))
+
+
+def test_downloads_in_parallel_ranges(tmp_path):
+    out_path = str(tmp_path / "model.safetensors")
+
+    with DownloadEngine(max_connections=4, part_size=1024 * 1024) as engine:
+        engine.submit(get_url(), out_path, get_quick_hash(CONTENT)).result()
+
+    with open(out_path, "rb") as f:
+        assert f.read() == CONTENT
+    assert not os.path.exists(out_path + ".part")
+    assert not os.path.exists(out_path + ".part.json")
+    assert len([r for r in requests_seen if r and r != "bytes=0-0"]) == 6  # one request per part
+
+
+def test_downloads_several_files_at_once(tmp_path):
+    out_paths = [str(tmp_path / f"model_{i}.safetensors") for i in range(3)]
+
+    with DownloadEngine(max_connections=4, part_size=1024 * 1024) as engine:
+        futures = [engine.submit(get_url(), path) for path in out_paths]
+        assert [f.result() for f in futures] == out_paths
+
+    for path in out_paths:
+        assert os.path.getsize(path) == FILE_SIZE
+
+
+def test_hash_mismatch_raises_and_removes_the_file(tmp_path):
+    out_path = str(tmp_path / "model.safetensors")
+
+    with pytest.raises(DownloadError):
+        download_file(get_url(), out_path, quick_hash="not-the-hash")
+
+    assert not os.path.exists(out_path)
+    assert not os.path.exists(out_path + ".part")
+
+
+def test_resumes_only_the_incomplete_parts(tmp_path):
+    out_path = str(tmp_path / "model.safetensors")
+    part_size = 1024 * 1024
+
+    # the first two parts were downloaded earlier, and the third one partially
+    with open(out_path + ".part", "wb") as f:
+        f.write(CONTENT[: 2 * part_size + 100])
+        f.truncate(FILE_SIZE)
+    with open(out_path + ".part.json", "w") as f:
+        done = [part_size, part_size, 100, 0, 0, 0]
+        json.dump({"url": get_url(), "total": FILE_SIZE, "part_size": part_size, "done": done}, f)
+
+    with DownloadEngine(max_connections=4, part_size=part_size) as engine:
+        engine.submit(get_url(), out_path, get_quick_hash(CONTENT)).result()
+
+    with open(out_path, "rb") as f:
+        assert f.read() == CONTENT
+    assert f"bytes={2 * part_size + 100}-{3 * part_size - 1}" in requests_seen
+    assert f"bytes=0-{part_size - 1}" not in requests_seen
+
+
+def test_single_stream_if_the_server_does_not_support_ranges(tmp_path):
+    RangeHandler.supports_ranges = False
+    out_path = str(tmp_path / "model.safetensors")
+
+    download_file(get_url(), out_path, quick_hash=get_quick_hash(CONTENT))
+
+    with open(out_path, "rb") as f:
+        assert f.read() == CONTENT
+
+
+def test_a_failed_single_stream_is_retried_from_the_start(tmp_path):
+    RangeHandler.supports_ranges = False
+    RangeHandler.fail_after = 1024 * 1024 + 7
+    out_path = str(tmp_path / "model.safetensors")
+
+    download_file(get_url(), out_path, quick_hash=get_quick_hash(CONTENT))
+
+    with open(out_path, "rb") as f:
+        assert f.read() == CONTENT
+
+
+def test_files_without_a_hash_are_not_resumed(tmp_path):
+    out_path = str(tmp_path / "config.yaml")
+    part_size = 1024 * 1024
+
+    with open(out_path + ".part", "wb") as f:  # e.g. left behind with the wrong bytes
+        f.write(os.urandom(part_size))
+        f.truncate(FILE_SIZE)
+    with open(out_path + ".part.json", "w") as f:
+        json.dump({"url": get_url(), "total": FILE_SIZE, "part_size": part_size, "done": [part_size] + [0] * 5}, f)
+
+    with DownloadEngine(max_connections=4, part_size=part_size) as engine:
+        engine.submit(get_url(), out_path).result()
+
+    with open(out_path, "rb") as f:
+        assert f.read() == CONTENT
+    assert f"bytes=0-{part_size - 1}" in requests_seen
+
+
+def test_skips_already_downloaded_files_with_the_same_hash(tmp_path):
+    out_path = str(tmp_path / "model.safetensors")
+    with open(out_path, "wb") as f:
+        f.write(CONTENT)
+
+    download_file(get_url(), out_path, quick_hash=get_quick_hash(CONTENT))
+
+    assert requests_seen == []
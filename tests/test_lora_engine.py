@@ -0,0 +1,123 @@
+import torch
+
+from sdkit import Context
+from sdkit.models.model_loader.lora import LoraBlock, apply_lora_model, move_blocks_to_device, unload_model
+
+from common import GPU_DEVICE_NAME
+
+context = None
+
+
+class TinyModel(torch.nn.Module):
+    def __init__(self):
+        super().__init__()
+        self.conv = torch.nn.Conv2d(8, 8, 3, padding=1)
+        self.proj = torch.nn.Linear(8, 8)
+
+    def forward(self, x):
+        x = self.conv(x)
+        return self.proj(x.permute(0, 2, 3, 1)).permute(0, 3, 1, 2)
+
+
+def setup_module():
+    global context
+
+    context = Context()
+    context.device = GPU_DEVICE_NAME
+    context.test_diffusers = True
+
+
+def make_model_and_loras(count=2):
+    torch.manual_seed(42)
+    model = TinyModel().to(GPU_DEVICE_NAME)
+
+    loras = []
+    for _ in range(count):
+        conv = LoraBlock("conv", model.conv, up=torch.randn(8, 4, 1, 1), down=torch.randn(4, 8, 3, 3), alpha=2.0)
+        proj = LoraBlock("proj", model.proj, up=torch.randn(8, 4), down=torch.randn(4, 8), alpha=4.0)
+        loras.append({"conv": conv, "proj": proj})
+
+    context.models["lora"] = loras
+    return model
+
+
+def teardown_function():
+    unload_model(context)
+    context.models.pop("lora", None)
+    context.lora_mode = "fused"
+
+
+def test_1_0__fused_weights_do_not_drift():
+    model = make_model_and_loras()
+    base = model.proj.weight.detach().clone()
+
+    for alphas in ([0.5, 1.0], [1.0, 0.2], [0.3, 0.7], [0.0, 0.0]):
+        apply_lora_model(context, alphas)
+
+    assert torch.equal(model.proj.weight, base)
+
+
+def test_1_1__same_alphas_are_not_applied_again():
+    model = make_model_and_loras()
+    apply_lora_model(context, [0.5, 1.0])
+    weight = model.proj.weight.detach().clone()
+
+    model.proj.weight.data += 1  # would be overwritten if the weights were recomputed
+    apply_lora_model(context, [0.5, 1.0])
+
+    assert torch.equal(model.proj.weight, weight + 1)
+
+
+def test_1_2__unload_restores_the_original_weights():
+    model = make_model_and_loras()
+    base = model.conv.weight.detach().clone()
+
+    apply_lora_model(context, [0.5, 1.0])
+    assert not torch.equal(model.conv.weight, base)
+
+    unload_model(context)
+    assert torch.equal(model.conv.weight, base)
+    assert not hasattr(model.conv, "_lora_base_weight")
+
+
+def test_2_0__runtime_mode_matches_fused_mode():
+    x = torch.randn((1, 8, 16, 16), device=GPU_DEVICE_NAME)
+    model = make_model_and_loras()
+
+    apply_lora_model(context, [0.5, 1.0])
+    expected = model(x)
+
+    context.lora_mode = "runtime"
+    apply_lora_model(context, [0.5, 1.0])
+    assert hasattr(model.proj, "_lora_runtime_hook")
+    actual = model(x)
+
+    assert torch.allclose(actual, expected, atol=1e-3, rtol=1e-3)
+
+
+def test_2_1__runtime_mode_does_not_modify_the_weights():
+    model = make_model_and_loras()
+    base = model.proj.weight.detach().clone()
+
+    context.lora_mode = "runtime"
+    apply_lora_model(context, [0.5, 1.0])
+    apply_lora_model(context, [1.0, 0.0])
+
+    assert torch.equal(model.proj.weight, base)
+
+    unload_model(context)
+    assert not hasattr(model.proj, "_lora_runtime_hook")
+
+
+def test_3_0__blocks_are_moved_to_the_device_together():
+    torch.manual_seed(42)
+    model = TinyModel()
+    up, down = torch.randn(8, 4), torch.randn(4, 8).half()
+    loras = [{"proj": LoraBlock("proj", model.proj, up=up.clone(), down=down.clone())}]
+
+    move_blocks_to_device(loras, GPU_DEVICE_NAME)
+
+    block = loras[0]["proj"]
+    assert block.up.device == torch.device(GPU_DEVICE_NAME)
+    assert block.down.dtype == torch.float16
+    assert torch.equal(block.up.cpu(), up) and torch.equal(block.down.cpu(), down)
@@ -0,0 +1,127 @@
+import json
+import os
+
+from sdkit.utils import get_file_metadata, hash_file_quick, hash_files_quick, update_file_metadata
+from sdkit.utils import metadata_index
+from sdkit.utils.hash_utils import compute_quick_hash
+from sdkit.utils.metadata_index import INDEX_FILE_NAME
+
+
+def make_file(path, size, seed=0):
+    data = bytes((i * 31 + seed) % 251 for i in range(size))
+    with open(path, "wb") as f:
+        f.write(data)
+    return data
+
+
+def reference_quick_hash(data):
+    return compute_quick_hash(lambda: len(data), lambda offset, count: data[offset : offset + count])
+
+
+def setup_function():
+    metadata_index._indexes.clear()
+
+
+def test_quick_hash_is_the_same_as_the_reference(tmp_path):
+    for size in (1000, 4 * 1024 * 1024 + 7):
+        path = str(tmp_path / f"model_{size}.safetensors")
+        data = make_file(path, size)
+
+        assert hash_file_quick(path, use_index=False) == reference_quick_hash(data)
+        assert hash_file_quick(path) == reference_quick_hash(data)
+
+
+def test_quick_hash_is_saved_in_the_index(tmp_path):
+    path = str(tmp_path / "model.ckpt")
+    data = make_file(path, 1000)
+
+    quick_hash = hash_file_quick(path)
+
+    with open(tmp_path / INDEX_FILE_NAME) as f:
+        index = json.load(f)
+    assert index["model.ckpt"]["metadata"]["quick_hash"] == quick_hash == reference_quick_hash(data)
+
+    # a new process would read the index from the disk
+    metadata_index._indexes.clear()
+    assert get_file_metadata(path)["quick_hash"] == quick_hash
+
+
+def test_index_entry_is_ignored_after_the_file_changes(tmp_path):
+    path = str(tmp_path / "model.ckpt")
+    make_file(path, 1000)
+    update_file_metadata(path, quick_hash="old-hash", model_type="SD1")
+
+    data = make_file(path, 2000, seed=1)
+    os.utime(path, ns=(0, 12345))  # in case the file system's mtime resolution is coarse
+
+    assert get_file_metadata(path) == {}
+    assert hash_file_quick(path) == reference_quick_hash(data)
+    assert "model_type" not in get_file_metadata(path)
+
+
+def test_keeps_the_entries_saved_by_other_processes(tmp_path):
+    path_a, path_b = str(tmp_path / "a.ckpt"), str(tmp_path / "b.ckpt")
+    make_file(path_a, 100)
+    make_file(path_b, 200)
+
+    update_file_metadata(path_a, quick_hash="hash-a")
+
+    # another process loaded the index before "a" was added, and then saves "b"
+    other_index = metadata_index.MetadataIndex(str(tmp_path))
+    other_index.entries.pop("a.ckpt")
+    other_index.update("b.ckpt", metadata_index.get_file_key(path_b), {"quick_hash": "hash-b"})
+
+    metadata_index._indexes.clear()
+    assert get_file_metadata(path_a)["quick_hash"] == "hash-a"
+    assert get_file_metadata(path_b)["quick_hash"] == "hash-b"
+
+
+def test_hash_files_quick_in_a_directory(tmp_path):
+    os.makedirs(tmp_path / "sub")
+    paths = [str(tmp_path / "a.safetensors"), str(tmp_path / "sub" / "b.ckpt")]
+    data = [make_file(path, 500 + i, seed=i) for i, path in enumerate(paths)]
+    make_file(str(tmp_path / "notes.txt"), 10)
+
+    actual = hash_files_quick(str(tmp_path))
+
+    assert actual == {path: reference_quick_hash(d) for path, d in zip(paths, data)}
+
+
+def test_scan_results_are_saved_in_the_index(tmp_path, monkeypatch):
+    import picklescan.scanner
+
+    from sdkit.models import scan_model
+
+    safe_path, unsafe_path = str(tmp_path / "safe.ckpt"), str(tmp_path / "unsafe.ckpt")
+    make_file(safe_path, 1000)
+    make_file(unsafe_path, 1000, seed=1)
+
+    scanned = []
+
+    def scan_file_path(path):
+        scanned.append(path)
+        infected = 1 if path == unsafe_path else 0
+        return picklescan.scanner.ScanResult([], scanned_files=1, issues_count=infected, infected_files=infected)
+
+    monkeypatch.setattr(picklescan.scanner, "scan_file_path", scan_file_path)
+
+    for _ in range(2):
+        assert scan_model(safe_path).infected_files == 0
+        assert scan_model(unsafe_path).infected_files == 1
+
+    assert scanned == [safe_path, unsafe_path]  # unchanged files aren't scanned again
+    assert get_file_metadata(safe_path)["scan"]["infected_files"] == 0
+    assert get_file_metadata(unsafe_path)["scan"]["infected_files"] == 1
+
+
+def test_a_modified_file_does_not_keep_its_index_key(tmp_path):
+    path = str(tmp_path / "model.ckpt")
+    make_file(path, 1000)
+    update_file_metadata(path, scan={"scanned_files": 1, "issues_count": 0, "infected_files": 0})
+    st = os.stat(path)
+
+    make_file(path, 1000, seed=1)  # the same size, inode and mtime
+    os.utime(path, ns=(st.st_atime_ns, st.st_mtime_ns))
+
+    assert os.stat(path).st_ino == st.st_ino
+    assert get_file_metadata(path) == {}
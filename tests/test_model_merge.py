@@ -1,4 +1,5 @@
-from sdkit.train import merge_multiple_models
+from sdkit.train import merge_models_add_difference, merge_models_streaming, merge_multiple_models
+from sdkit.utils import load_tensor_file, save_tensor_file
 
 
 # section 1 - two models
@@ -121,3 +122,93 @@ def test_3_0__misc__merges_only_if_key_pattern_matches():
     )
     expected = {"model_a": (1 * 0.5 + 10 * 0.5), "model_b": (2 * 0.5 + 20 * 0.5), "model_c": 3}
     assert actual == expected
+
+
+# section 4 - streaming merges (of files)
+def make_model_files(tmp_path, models: list) -> list:
+    paths = []
+    for i, m in enumerate(models):
+        path = str(tmp_path / f"model_{i}.safetensors")
+        save_tensor_file(m, path)
+        paths.append(path)
+    return paths
+
+
+def test_4_0__streaming__three_way_weighted_sum(tmp_path):
+    import torch
+
+    models = [{"model.a": torch.randn(10, 3), "model.b": torch.randn(4)} for _ in range(3)]
+    paths = make_model_files(tmp_path, models)
+    out_path = str(tmp_path / "out.safetensors")
+
+    merge_models_streaming(paths, [0.2, 0.3, 0.5], out_path, use_fp16=False)
+
+    actual = load_tensor_file(out_path)
+    for key in ("model.a", "model.b"):
+        expected = 0.2 * models[0][key] + 0.3 * models[1][key] + 0.5 * models[2][key]
+        assert torch.allclose(actual[key], expected, atol=1e-6)
+
+
+def test_4_1__streaming__small_chunks_give_the_same_result(tmp_path):
+    import torch
+
+    models = [{"model.a": torch.randn(37, 5, 3), "model.scalar": torch.tensor(float(i))} for i in range(2)]
+    paths = make_model_files(tmp_path, models)
+
+    merge_models_streaming(paths, [0.4, 0.6], str(tmp_path / "big.safetensors"), use_fp16=False)
+    merge_models_streaming(paths, [0.4, 0.6], str(tmp_path / "small.safetensors"), use_fp16=False, chunk_numel=16)
+
+    big = load_tensor_file(str(tmp_path / "big.safetensors"))
+    small = load_tensor_file(str(tmp_path / "small.safetensors"))
+    assert torch.equal(big["model.a"], small["model.a"])
+    assert torch.allclose(small["model.scalar"], torch.tensor(0.6))
+
+
+def test_4_2__streaming__missing_keys_and_unmerged_keys(tmp_path):
+    import torch
+
+    models = [
+        {"model.a": torch.ones(2), "ids": torch.arange(3), "model.c": torch.full((2,), 3.0)},
+        {"model.a": torch.full((2,), 3.0), "ids": torch.arange(3) + 10, "model.d": torch.full((2,), 5.0)},
+    ]
+    paths = make_model_files(tmp_path, models)
+    out_path = str(tmp_path / "out.safetensors")
+
+    merge_models_streaming(paths, [0.5, 0.5], out_path)
+
+    actual = load_tensor_file(out_path)
+    assert actual["model.a"].dtype == torch.float16
+    assert torch.equal(actual["model.a"], torch.full((2,), 2.0, dtype=torch.float16))
+    assert torch.equal(actual["ids"], torch.arange(3))  # not a float tensor, so copied from the first model
+    assert torch.equal(actual["model.c"], torch.full((2,), 3.0, dtype=torch.float16))
+    assert torch.equal(actual["model.d"], torch.full((2,), 5.0, dtype=torch.float16))
+
+
+def test_4_3__streaming__add_difference(tmp_path):
+    import torch
+
+    models = [{"model.a": torch.randn(8, 2)} for _ in range(3)]
+    models[0]["model.only_in_a"] = torch.ones(2)
+    paths = make_model_files(tmp_path, models)
+    out_path = str(tmp_path / "out.safetensors")
+
+    merge_models_add_difference(*paths, alpha=0.7, out_path=out_path, use_fp16=False)
+
+    actual = load_tensor_file(out_path)
+    expected = models[0]["model.a"] + 0.7 * (models[1]["model.a"] - models[2]["model.a"])
+    assert torch.allclose(actual["model.a"], expected, atol=1e-6)
+    assert torch.equal(actual["model.only_in_a"], torch.ones(2))
+
+
+def test_4_4__streaming__keys_with_a_total_weight_of_0_are_copied(tmp_path):
+    import torch
+
+    models = [{"model.a": torch.ones(2)}, {"model.a": torch.full((2,), 3.0), "model.only_in_b": torch.full((2,), 5.0)}]
+    paths = make_model_files(tmp_path, models)
+    out_path = str(tmp_path / "out.safetensors")
+
+    merge_models_streaming(paths, [1, 0], out_path, use_fp16=False)
+
+    actual = load_tensor_file(out_path)
+    assert torch.equal(actual["model.a"], torch.ones(2))
+    assert torch.equal(actual["model.only_in_b"], torch.full((2,), 5.0))  # not zeros
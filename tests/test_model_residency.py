@@ -0,0 +1,77 @@
+import time
+
+from sdkit import Context
+from sdkit.generate import generate_images
+from sdkit.models import load_model, prefetch_model, unload_parked_models
+
+from common import (
+    USE_DIFFUSERS,
+    assert_images_same,
+)
+
+MODEL_A = "models/stable-diffusion/1.x/sd-v1-4.ckpt"
+MODEL_B = "models/stable-diffusion/1.x/realisticVisionV51_v51VAE.safetensors"
+
+context = None
+
+
+def setup_module():
+    global context
+
+    context = Context()
+    context.test_diffusers = USE_DIFFUSERS
+    context.model_residency_budget = {"vram": 3, "ram": 6}
+
+
+def teardown_module():
+    unload_parked_models(context)
+
+
+def render():
+    return generate_images(context, "Horse", seed=42, width=64, height=64, num_inference_steps=3)[0]
+
+
+def load(model_path):
+    context.model_paths["stable-diffusion"] = model_path
+    t = time.time()
+    load_model(context, "stable-diffusion")
+    return time.time() - t
+
+
+def test_1_0__switching_back_uses_the_parked_model():
+    load(MODEL_A)
+    expected_image = render()
+    model_a = context.models["stable-diffusion"]
+
+    load(MODEL_B)
+    assert context.models["stable-diffusion"] is not model_a
+    assert len(context._parked_models) == 1
+
+    load(MODEL_A)
+    assert context.models["stable-diffusion"] is model_a
+    assert_images_same(render(), expected_image, "model_residency_test1.0")
+
+
+def test_1_1__models_over_the_vram_budget_are_moved_to_ram():
+    context.model_residency_budget = {"vram": 0.1, "ram": 6}
+
+    load(MODEL_B)  # parks A, and moves it to RAM
+    entry = next(iter(context._parked_models.values()))
+    assert entry.tier == "ram"
+    assert next(entry.model["default"].unet.parameters()).device.type == "cpu"
+
+    context.model_residency_budget = {"vram": 3, "ram": 6}
+    context.model_paths["stable-diffusion"] = MODEL_A
+    prefetch_model(context)
+    assert entry.tier == "vram"
+
+    load(MODEL_A)
+    assert next(context.models["stable-diffusion"]["default"].unet.parameters()).device.type == "cuda"
+    assert render().getbbox()
+
+
+def test_1_2__models_over_both_budgets_are_discarded():
+    context.model_residency_budget = {"vram": 0.1, "ram": 0.1}
+
+    load(MODEL_B)
+    assert len(context._parked_models) == 0
@@ -0,0 +1,56 @@
+import torch
+
+from sdkit.generate.noise import make_noise, philox4x32, philox_randn
+
+from common import GPU_DEVICE_NAME
+
+SHAPE = (4, 64, 64)
+
+
+def test_1_0__philox_known_answer():
+    # Random123 known-answer test for philox4x32-10, with counter = 0 and key = 0
+    zero = torch.zeros((1,), dtype=torch.int64)
+    out = philox4x32(zero, zero, zero, zero, zero, zero)
+    assert [int(c) for c in out] == [0x6627E8D5, 0xE169C58D, 0xBC57AC4C, 0x9B00DBD8]
+
+    mask = torch.full((1,), 0xFFFFFFFF, dtype=torch.int64)
+    out = philox4x32(mask, mask, mask, mask, mask, mask)
+    assert [int(c) for c in out] == [0x408F276D, 0x41C83B0E, 0xA20BC7C6, 0x6D5451FD]
+
+
+def test_1_1__philox_is_a_standard_normal():
+    noise = philox_randn([42, 43], SHAPE, "cpu")
+    assert noise.shape == (2, *SHAPE)
+    assert abs(noise.mean()) < 0.02
+    assert abs(noise.std() - 1) < 0.02
+    assert not torch.equal(noise[0], noise[1])
+
+
+def test_1_2__philox_noise_doesnt_depend_on_the_batch():
+    batch = make_noise([42, 43, 44], SHAPE, GPU_DEVICE_NAME, "philox")
+    solo = make_noise([43], SHAPE, GPU_DEVICE_NAME, "philox")
+    assert torch.equal(batch[1:2], solo)
+
+
+def test_1_3__philox_matches_across_devices():
+    cpu = make_noise([42, 2**40 + 7], SHAPE, "cpu", "philox")
+    device = make_noise([42, 2**40 + 7], SHAPE, GPU_DEVICE_NAME, "philox")
+    assert torch.allclose(cpu, device.cpu(), atol=1e-5)
+
+
+def test_2_0__device_mode_is_unchanged():
+    seed = 42
+    expected = []
+    for _ in range(3):
+        torch.manual_seed(seed)
+        expected.append(torch.randn((1, *SHAPE), device=GPU_DEVICE_NAME))
+        seed += 1
+    expected = torch.cat(expected)
+
+    assert torch.equal(make_noise([42, 43, 44], SHAPE, GPU_DEVICE_NAME, "device"), expected)
+
+
+def test_2_1__cpu_mode_is_identical_across_devices():
+    cpu = make_noise([42, 43], SHAPE, "cpu", "cpu")
+    device = make_noise([42, 43], SHAPE, GPU_DEVICE_NAME, "cpu")
+    assert torch.equal(cpu, device.cpu())
@@ -0,0 +1,30 @@
+import torch
+from PIL import Image
+from transformers import CLIPImageProcessor
+
+from sdkit.filter.nsfw_checker import _preprocess_on_device
+from sdkit.utils import images_to_tensor, latents_to_rgb_preview
+
+from common import GPU_DEVICE_NAME
+
+
+def test_1_0__device_preprocessing_matches_the_feature_extractor():
+    feature_extractor = CLIPImageProcessor()  # same settings as the safety checker's
+    torch.manual_seed(42)
+    image = Image.fromarray((torch.rand(320, 512, 3) * 255).to(torch.uint8).numpy())
+
+    expected = feature_extractor(image, return_tensors="pt").pixel_values
+    images = images_to_tensor([image], GPU_DEVICE_NAME)
+    actual = _preprocess_on_device(images, feature_extractor, GPU_DEVICE_NAME, torch.float32)
+
+    assert actual.shape == expected.shape == (1, 3, 224, 224)
+    assert (actual.cpu() - expected).abs().mean() < 0.05  # PIL and torch resize slightly differently
+
+
+def test_2_0__latent_preview_shape_and_range():
+    latents = torch.randn((2, 4, 64, 64), device=GPU_DEVICE_NAME) * 3
+
+    for model_type in ("SD1", "SDXL"):
+        preview = latents_to_rgb_preview(latents, model_type)
+        assert preview.shape == (2, 3, 64, 64)
+        assert preview.min() >= 0 and preview.max() <= 1
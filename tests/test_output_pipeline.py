@@ -0,0 +1,67 @@
+import base64
+from io import BytesIO
+
+import numpy as np
+import torch
+from PIL import Image
+
+from sdkit.utils import OutputPipeline
+
+
+def make_image(width=64, height=48, seed=0):
+    rng = np.random.default_rng(seed)
+    return rng.integers(0, 256, (height, width, 3), dtype=np.uint8)
+
+
+def decode(data):
+    return np.array(Image.open(BytesIO(data)))
+
+
+def test_encodes_pil_images_arrays_and_tensors():
+    arr = make_image()
+
+    with OutputPipeline(max_workers=2) as pipeline:
+        futures = [
+            pipeline.encode(Image.fromarray(arr)),
+            pipeline.encode(arr),
+            pipeline.encode(torch.from_numpy(arr)),  # HWC
+            pipeline.encode(torch.from_numpy(arr).permute(2, 0, 1)),  # CHW
+            pipeline.encode(torch.from_numpy(arr).permute(2, 0, 1) / 255.0),  # floats in [0, 1]
+        ]
+
+        for f in futures:
+            assert np.array_equal(decode(f.result()), arr)
+
+
+def test_reused_buffer_returns_only_the_current_image():
+    with OutputPipeline(max_workers=1) as pipeline:
+        large = pipeline.encode(make_image(512, 512, seed=1)).result()
+        small = pipeline.encode(make_image(16, 16, seed=2)).result()
+
+    assert len(small) < len(large)
+    assert np.array_equal(decode(small), make_image(16, 16, seed=2))
+
+
+def test_base64_is_a_data_url():
+    arr = make_image()
+
+    with OutputPipeline() as pipeline:
+        img_str = pipeline.to_base64(arr, output_format="JPEG").result()
+
+    assert img_str.startswith("data:image/jpeg;base64,")
+    assert decode(base64.b64decode(img_str.split(",", 1)[1])).shape == arr.shape
+
+
+def test_saves_images_with_embedded_metadata(tmp_path):
+    images = [make_image(seed=i) for i in range(3)]
+    metadata = [{"prompt": f"photo {i}", "seed": i} for i in range(3)]
+
+    with OutputPipeline() as pipeline:
+        futures = pipeline.save_images(images, str(tmp_path), file_name="img", output_format="PNG", metadata=metadata)
+        paths = [f.result() for f in futures]
+
+    assert paths == [str(tmp_path / f"img_{i}.png") for i in range(3)]
+    for i, path in enumerate(paths):
+        img = Image.open(path)
+        assert np.array_equal(np.array(img), images[i])
+        assert img.text == {"prompt": f"photo {i}", "seed": str(i)}
@@ -0,0 +1,51 @@
+from sdkit import Context
+from sdkit.generate.pipeline_cache import clear_controlnet_pipelines, get_controlnet_pipeline, get_scheduler
+
+
+class FakePipeline:
+    def __init__(self, controlnet=None, **components):
+        self.controlnet = controlnet
+        self.components = components
+        self.watermark = "watermark"
+
+
+class FakeControlNet:
+    pass
+
+
+def test_1_0__controlnet_pipelines_are_reused():
+    default_pipe = FakePipeline(unet="unet", vae="vae")
+    cn1, cn2 = FakeControlNet(), FakeControlNet()
+
+    pipe = get_controlnet_pipeline(default_pipe, FakePipeline, cn1)
+    assert pipe.controlnet is cn1
+    assert pipe.components == default_pipe.components
+    assert pipe.watermark is None
+
+    assert get_controlnet_pipeline(default_pipe, FakePipeline, cn1) is pipe
+    assert get_controlnet_pipeline(default_pipe, FakePipeline, cn2) is not pipe
+    assert get_controlnet_pipeline(default_pipe, FakePipeline, [cn1, cn2]) is not pipe
+
+
+def test_1_1__clearing_the_controlnet_pipelines():
+    context = Context()
+    default_pipe = FakePipeline()
+    context.models["stable-diffusion"] = {"default": default_pipe}
+    cn = FakeControlNet()
+
+    pipe = get_controlnet_pipeline(default_pipe, FakePipeline, cn)
+    clear_controlnet_pipelines(context)
+    assert get_controlnet_pipeline(default_pipe, FakePipeline, cn) is not pipe
+
+
+def test_2_0__schedulers_are_reused():
+    from diffusers import EulerAncestralDiscreteScheduler
+
+    default_pipe = FakePipeline()
+    config = EulerAncestralDiscreteScheduler().config
+
+    scheduler = get_scheduler(default_pipe, "euler_a", config)
+    assert isinstance(scheduler, EulerAncestralDiscreteScheduler)
+    assert get_scheduler(default_pipe, "euler_a", config) is scheduler
+    assert get_scheduler(default_pipe, "euler", config) is not scheduler
+    assert get_scheduler(FakePipeline(), "euler_a", config) is not scheduler
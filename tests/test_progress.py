@@ -0,0 +1,71 @@
+import pytest
+import torch
+
+from sdkit import Context
+from sdkit.generate import CancelToken, GenerationCancelled
+from sdkit.generate.progress import make_progress_callback
+
+from common import GPU_DEVICE_NAME
+
+context = None
+
+
+def setup_module():
+    global context
+
+    context = Context()
+    context.device = GPU_DEVICE_NAME
+
+
+def test_1_0__progress_events_with_previews():
+    events = []
+    callback = make_progress_callback(context, events.append, preview_every=4, total_steps=10)
+
+    latents = torch.randn((2, 4, 64, 64), device=GPU_DEVICE_NAME)
+    for i in range(10):
+        callback(latents, i)
+
+    assert [e.step for e in events] == list(range(1, 11))
+    assert all(e.total_steps == 10 for e in events)
+    assert [e.step for e in events if e.preview is not None] == [4, 8, 10]  # and always on the last step
+
+    preview = events[3].preview
+    assert len(preview) == 2
+    assert preview[0].size == (64, 64)
+
+
+def test_1_1__legacy_callback_is_still_called():
+    calls = []
+    callback = make_progress_callback(context, lambda e: None, callback=lambda x, i, *args: calls.append(i))
+
+    for i in range(3):
+        callback(torch.zeros((1, 4, 8, 8)), i, "pipe")
+
+    assert calls == [0, 1, 2]
+
+
+def test_1_2__nothing_to_wrap():
+    fn = lambda x, i: None
+    assert make_progress_callback(context, callback=fn) is fn
+
+
+def test_2_0__cancel_stops_at_the_next_step():
+    token = CancelToken()
+    callback = make_progress_callback(context, cancel_token=token)
+
+    callback(torch.zeros((1, 4, 8, 8)), 0)
+    token.cancel()
+    with pytest.raises(GenerationCancelled):
+        callback(torch.zeros((1, 4, 8, 8)), 1)
+
+
+def test_2_1__batch_is_cancelled_only_when_all_requests_are():
+    a, b = CancelToken(), CancelToken()
+    batch_token = CancelToken.all_of([a, b])
+
+    a.cancel()
+    assert not batch_token.is_cancelled
+    b.cancel()
+    assert batch_token.is_cancelled
+
+    assert CancelToken.all_of([a, None]) is None
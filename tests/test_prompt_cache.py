@@ -0,0 +1,44 @@
+import torch
+
+from sdkit.generate.prompt_cache import PromptEmbeddingsCache
+
+from common import GPU_DEVICE_NAME
+
+ENTRY_SIZE = 77 * 768 * 2  # bytes, for a fp16 SD 1.x conditioning tensor
+
+
+def make_entry(val):
+    return (torch.full((1, 77, 768), float(val), dtype=torch.float16, device=GPU_DEVICE_NAME),)
+
+
+def test_1_0__cache_returns_stored_embeddings():
+    cache = PromptEmbeddingsCache(device_budget=4 * ENTRY_SIZE, cpu_budget=4 * ENTRY_SIZE)
+    cache.put("a", make_entry(1))
+
+    embeds = cache.get("a", GPU_DEVICE_NAME)
+    assert embeds is not None and embeds[0].device == torch.device(GPU_DEVICE_NAME)
+    assert torch.all(embeds[0] == 1)
+    assert cache.get("b", GPU_DEVICE_NAME) is None
+
+
+def test_1_1__old_entries_move_to_cpu_and_come_back():
+    cache = PromptEmbeddingsCache(device_budget=2 * ENTRY_SIZE, cpu_budget=2 * ENTRY_SIZE)
+    for key in ("a", "b", "c"):
+        cache.put(key, make_entry(ord(key)))
+
+    assert cache._entries["a"][0][0].device.type == "cpu"
+
+    embeds = cache.get("a", GPU_DEVICE_NAME)
+    assert embeds[0].device == torch.device(GPU_DEVICE_NAME)
+    assert torch.all(embeds[0] == ord("a"))
+    assert cache._entries["b"][0][0].device.type == "cpu"  # "b" is now the least-recently used
+
+
+def test_1_2__entries_beyond_both_budgets_are_discarded():
+    cache = PromptEmbeddingsCache(device_budget=ENTRY_SIZE, cpu_budget=ENTRY_SIZE)
+    for key in ("a", "b", "c"):
+        cache.put(key, make_entry(ord(key)))
+
+    assert len(cache) == 2
+    assert cache.get("a", GPU_DEVICE_NAME) is None
+    assert cache.get("c", GPU_DEVICE_NAME) is not None
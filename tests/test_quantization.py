@@ -0,0 +1,55 @@
+import pytest
+import torch
+
+from sdkit.models.model_loader.lora import LoraBlock
+from sdkit.models.model_loader.stable_diffusion.quantization import quantize_unet, is_quantized, dequantize_weight
+
+from common import GPU_DEVICE_NAME
+
+
+class TinyUNet(torch.nn.Module):
+    def __init__(self):
+        super().__init__()
+        self.conv_in = torch.nn.Conv2d(4, 32, 3, padding=1)
+        self.conv = torch.nn.Conv2d(32, 32, 3, padding=1)
+        self.proj = torch.nn.Linear(32, 32)
+        self.conv_out = torch.nn.Conv2d(32, 4, 3, padding=1)
+
+    def forward(self, x):
+        x = self.conv(self.conv_in(x))
+        x = self.proj(x.permute(0, 2, 3, 1)).permute(0, 3, 1, 2)
+        return self.conv_out(x)
+
+
+def make_unet():
+    torch.manual_seed(42)
+    return TinyUNet().to(GPU_DEVICE_NAME, torch.float16)
+
+
+@pytest.mark.parametrize("quantization_type", ["int8", "fp8"])
+def test_1_0__quantized_unet_output_is_close(quantization_type):
+    x = torch.randn((1, 4, 16, 16), device=GPU_DEVICE_NAME, dtype=torch.float16)
+    unet = make_unet()
+    expected = unet(x)
+
+    quantize_unet(unet, quantization_type)
+    assert is_quantized(unet.conv) and is_quantized(unet.proj)
+    assert not is_quantized(unet.conv_in) and not is_quantized(unet.conv_out)
+    assert "weight" not in dict(unet.named_parameters())
+
+    actual = unet(x)
+    assert unet.conv.weight is None  # released after the forward
+    assert torch.allclose(actual, expected, atol=0.05, rtol=0.05)
+
+
+def test_1_1__lora_is_applied_to_the_quantized_weights():
+    unet = make_unet()
+    quantize_unet(unet, "int8")
+    before = dequantize_weight(unet.proj).float()
+
+    torch.manual_seed(1)
+    block = LoraBlock("proj", unet.proj, up=torch.randn((32, 4)), down=torch.randn((4, 32)), alpha=4)
+    y = block.apply(0.5)
+
+    after = dequantize_weight(unet.proj).float()
+    assert torch.allclose(after - before, y.to(after.device), atol=0.05)
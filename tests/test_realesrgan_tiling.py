@@ -0,0 +1,79 @@
+import pytest
+import torch
+
+from sdkit import Context
+from sdkit.filter import realesrgan
+
+from common import GPU_DEVICE_NAME
+
+context = None
+
+
+class FakeUpsampler:
+    "Stands in for RealESRGANer, with a nearest-neighbour 'model' (so the tiled output must match exactly)"
+
+    def __init__(self):
+        self.model = torch.nn.Upsample(scale_factor=4, mode="nearest")
+        self.model.dummy = torch.nn.Parameter(torch.zeros(1))  # for next(model.parameters())
+        self.model.to(GPU_DEVICE_NAME)
+        self.device = torch.device(GPU_DEVICE_NAME)
+        self.scale = 4
+        self.pre_pad = 0
+        self.tile = 0
+        self.tile_pad = 10
+
+
+def setup_module():
+    global context
+
+    context = Context()
+    context.device = GPU_DEVICE_NAME
+    context.models["realesrgan"] = FakeUpsampler()
+
+
+@pytest.mark.parametrize("tile_size,tile_overlap", [(32, 8), (48, 16), (100, 32), (64, 0)])
+def test_1_0__tiled_output_matches_the_untiled_output(tile_size, tile_overlap):
+    torch.manual_seed(42)
+    images = torch.rand((3, 3, 80, 96), device=GPU_DEVICE_NAME)
+
+    expected = torch.nn.functional.interpolate(images, scale_factor=4, mode="nearest")
+    actual = realesrgan.apply_batch(context, images, tile_size=tile_size, tile_overlap=tile_overlap)
+
+    assert actual.shape == (3, 3, 320, 384)
+    assert torch.allclose(actual, expected, atol=1e-5)
+
+
+def test_1_1__output_scale():
+    images = torch.rand((1, 3, 32, 32), device=GPU_DEVICE_NAME)
+
+    actual = realesrgan.apply_batch(context, images, scale=2, tile_size=16)
+
+    assert actual.shape == (1, 3, 64, 64)
+
+
+def test_2_0__tile_starts_cover_the_image():
+    assert realesrgan._get_tile_starts(100, 100, 16) == [0]
+    assert realesrgan._get_tile_starts(100, 40, 8) == [0, 32, 60]
+
+
+def test_1_2__the_tile_size_of_the_loaded_model_is_used():
+    upsampler = context.models["realesrgan"]
+    calls = []
+    hook = upsampler.model.register_forward_pre_hook(lambda m, args: calls.append(args[0].shape))
+    upsampler.tile = 32
+    try:
+        realesrgan.apply_batch(context, torch.rand((1, 3, 64, 64), device=GPU_DEVICE_NAME))
+    finally:
+        upsampler.tile = 0
+        hook.remove()
+
+    assert all(shape[-2:] == (32, 32) for shape in calls)
+    assert sum(shape[0] for shape in calls) == 9  # overlapping by 2 * tile_pad, at most half a tile
+
+
+def test_2_1__memory_per_pixel_of_rrdbnet():
+    model = torch.nn.Module()
+    model.conv_first = torch.nn.Conv2d(3, 64, 3)
+
+    assert realesrgan.get_mem_per_pixel(model, 4, 2) == 3072 * 2
+    assert realesrgan.get_mem_per_pixel(model, 2, 4) < realesrgan.get_mem_per_pixel(model, 4, 4)
@@ -0,0 +1,82 @@
+import pytest
+import torch
+
+from sdkit.generate.step_cache import cache_unet_steps, get_step_cache_config
+
+
+def make_unet():
+    from diffusers import UNet2DConditionModel
+
+    torch.manual_seed(0)
+    unet = UNet2DConditionModel(
+        block_out_channels=(32, 32, 64),
+        layers_per_block=1,
+        sample_size=16,
+        in_channels=4,
+        out_channels=4,
+        down_block_types=("CrossAttnDownBlock2D", "CrossAttnDownBlock2D", "DownBlock2D"),
+        up_block_types=("UpBlock2D", "CrossAttnUpBlock2D", "CrossAttnUpBlock2D"),
+        cross_attention_dim=32,
+        norm_num_groups=8,
+    )
+    return unet.eval()
+
+
+def make_inputs(seed):
+    torch.manual_seed(seed)
+    return torch.randn(2, 4, 16, 16), torch.randn(2, 7, 32)
+
+
+@pytest.mark.parametrize("depth", [0, 1])
+def test_1_0__cached_step_with_the_same_inputs_gives_the_same_output(depth):
+    unet = make_unet()
+    sample, embeds = make_inputs(0)
+
+    with torch.no_grad():
+        expected = unet(sample, 10, encoder_hidden_states=embeds).sample
+        with cache_unet_steps(unet, {"interval": 2, "depth": depth}):
+            full = unet(sample, 10, encoder_hidden_states=embeds).sample
+            cached = unet(sample, 10, encoder_hidden_states=embeds).sample  # reuses the deep features of `full`
+
+    assert torch.allclose(full, expected, atol=1e-5)
+    assert torch.allclose(cached, expected, atol=1e-5)
+
+
+def test_1_1__cached_steps_skip_the_deep_blocks():
+    unet = make_unet()
+    calls = []
+    unet.mid_block.resnets[0].register_forward_pre_hook(lambda *args: calls.append("mid"))
+
+    with torch.no_grad(), cache_unet_steps(unet, {"interval": 3, "depth": 0}) as cache:
+        for seed in range(6):
+            sample, embeds = make_inputs(seed)
+            unet(sample, 10, encoder_hidden_states=embeds)
+
+    assert cache.calls == 6
+    assert len(calls) == 2  # only the full steps (0 and 3) compute the mid block
+    assert all("forward" not in vars(m) for m in unet.modules())  # removed after the block
+
+
+def test_1_2__cached_steps_differ_only_slightly_from_full_steps():
+    unet = make_unet()
+    sample, embeds = make_inputs(0)
+
+    with torch.no_grad():
+        expected = unet(sample * 1.01, 9, encoder_hidden_states=embeds).sample
+        with cache_unet_steps(unet, "fast"):
+            unet(sample, 10, encoder_hidden_states=embeds)
+            cached = unet(sample * 1.01, 9, encoder_hidden_states=embeds).sample
+
+    assert not torch.equal(cached, expected)
+    assert (cached - expected).abs().mean() < 0.1 * expected.abs().mean()
+
+
+def test_2_0__config():
+    assert get_step_cache_config(None) is None
+    assert get_step_cache_config("draft") == {"interval": 3, "depth": 0}
+    assert get_step_cache_config({"interval": 4}) == {"interval": 4, "depth": 0}
+
+    with pytest.raises(ValueError):
+        get_step_cache_config("unknown")
+    with pytest.raises(ValueError):
+        get_step_cache_config({"interval": 0})
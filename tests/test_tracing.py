@@ -0,0 +1,100 @@
+import pytest
+import torch
+
+from sdkit.utils import TraceStats, disable_tracing, enable_tracing, trace, trace_module
+
+
+def teardown_function():
+    disable_tracing()
+
+
+def test_disabled_tracing_returns_a_shared_noop_span():
+    assert trace("a") is trace("b")
+
+    with trace("a") as span:
+        span.set(x=1)
+
+
+def test_nested_spans_are_exported_as_a_tree():
+    roots = []
+    enable_tracing(exporters=[roots.append])
+
+    with trace("request", width=512):
+        with trace("prompt_encode"):
+            pass
+        with trace("vae_decode"):
+            pass
+
+    assert len(roots) == 1
+    root = roots[0]
+    assert root.attributes == {"width": 512}
+    assert [s.path for s in root.walk()] == ["request", "request/prompt_encode", "request/vae_decode"]
+    assert root.duration >= sum(c.duration for c in root.children)
+    assert root.memory["rss_peak"] >= root.memory["rss_start"] > 0
+
+
+def test_records_the_exception_and_closes_the_span():
+    roots = []
+    enable_tracing(exporters=[roots.append])
+
+    with pytest.raises(ValueError):
+        with trace("request"):
+            with trace("sampling"):
+                raise ValueError("oops")
+
+    assert roots[0].error == "ValueError"
+    assert roots[0].children[0].error == "ValueError"
+
+    with trace("next_request"):
+        pass
+    assert roots[1].parent is None  # the earlier spans aren't left open
+
+
+def test_trace_module_records_each_call():
+    roots = []
+    enable_tracing(exporters=[roots.append])
+    unet = torch.nn.Linear(4, 4)
+
+    with trace("sampling"), trace_module(unet, "unet"):
+        for _ in range(3):
+            unet(torch.randn(1, 4))
+    unet(torch.randn(1, 4))  # the hooks are removed after the block
+
+    assert [c.name for c in roots[0].children] == ["unet"] * 3
+    assert [c.attributes["call"] for c in roots[0].children] == [0, 1, 2]
+    assert len(roots) == 1
+
+
+def test_trace_stats_summarizes_the_durations():
+    stats = TraceStats()
+    enable_tracing(exporters=[stats])
+
+    for _ in range(5):
+        with trace("request"):
+            with trace("step"):
+                pass
+
+    summary = stats.summary()
+    assert summary["request"]["count"] == 5
+    assert summary["request/step"]["count"] == 5
+    assert summary["request/step"]["p95"] <= summary["request/step"]["max"]
+    assert "request:vram_peak" in summary
+
+
+@pytest.mark.skipif(not torch.cuda.is_available(), reason="needs CUDA")
+def test_peak_vram_stats_are_not_reset():
+    roots = []
+    enable_tracing(exporters=[roots.append])
+    device = torch.device("cuda")
+
+    big = torch.empty(64 * 1024 * 1024, dtype=torch.uint8, device=device)
+    del big
+    peak = torch.cuda.max_memory_allocated(device)
+
+    with trace("request", device=device):
+        with trace("step"):
+            x = torch.empty(1024 * 1024, dtype=torch.uint8, device=device)
+    del x
+
+    assert torch.cuda.max_memory_allocated(device) == peak  # e.g. for a benchmark that measures around a request
+    assert 1024 * 1024 <= roots[0].memory["vram_peak"] < peak
@@ -0,0 +1,109 @@
+import numpy as np
+import torch
+
+from sdkit import Context
+from sdkit.generate.vae_engine import get_vae_engine, refresh_vae_engine, release_vae_engine
+
+
+def make_vae(force_upcast=True):
+    from diffusers import AutoencoderKL
+
+    torch.manual_seed(0)
+    vae = AutoencoderKL(
+        block_out_channels=(32, 32),
+        down_block_types=("DownEncoderBlock2D", "DownEncoderBlock2D"),
+        up_block_types=("UpDecoderBlock2D", "UpDecoderBlock2D"),
+        latent_channels=4,
+        norm_num_groups=8,
+        force_upcast=force_upcast,
+    )
+    return vae.eval()
+
+
+def reference_decode(vae, latents):
+    with torch.no_grad():
+        x = vae.decode(latents / vae.config.scaling_factor, return_dict=False)[0]
+    x = (x / 2 + 0.5).clamp(0, 1)
+    return (x * 255).round().to(torch.uint8).permute(0, 2, 3, 1).numpy()
+
+
+def make_context(vae_precision="auto"):
+    context = Context()
+    context.device = "cpu"
+    context.vae_precision = vae_precision
+    return context
+
+
+def test_1_0__decodes_the_same_as_the_vae():
+    vae = make_vae()
+    latents = torch.randn(3, 4, 8, 8)
+
+    images = get_vae_engine(make_context(), vae).decode(latents)
+
+    assert len(images) == 3
+    assert np.array_equal(np.stack([np.array(img) for img in images]), reference_decode(vae, latents))
+
+
+def test_1_1__returns_a_tensor_for_pt():
+    vae = make_vae()
+    latents = torch.randn(2, 4, 8, 8)
+
+    images = get_vae_engine(make_context(), vae).decode(latents, output_type="pt")
+
+    assert images.shape == (2, 3, 16, 16)
+    assert images.min() >= 0 and images.max() <= 1
+
+
+def test_1_2__calls_on_image_for_each_image():
+    vae = make_vae()
+    seen = {}
+
+    images = get_vae_engine(make_context(), vae).decode(torch.randn(3, 4, 8, 8), on_image=seen.__setitem__)
+
+    assert sorted(seen) == [0, 1, 2]
+    assert all(seen[i] is images[i] for i in range(3))
+
+
+def test_2_0__fp16_vae_is_decoded_with_a_permanent_fp32_copy():
+    vae = make_vae(force_upcast=True).half()
+    engine = get_vae_engine(make_context(), vae)
+
+    assert engine.fp32_vae is not None
+    assert engine.fp32_vae.dtype == torch.float32
+    assert vae.dtype == torch.float16  # not converted back and forth
+    assert get_vae_engine(make_context(), vae) is engine
+
+
+def test_2_1__no_copy_for_fp16_vaes_without_force_upcast_or_with_vae_precision_fp16():
+    assert get_vae_engine(make_context(), make_vae(force_upcast=False).half()).fp32_vae is None
+    assert get_vae_engine(make_context("fp16"), make_vae(force_upcast=True).half()).fp32_vae is None
+    assert get_vae_engine(make_context("fp32"), make_vae(force_upcast=False).half()).fp32_vae is not None
+
+
+def test_2_2__refresh_copies_the_new_weights():
+    vae = make_vae().half()
+    engine = get_vae_engine(make_context(), vae)
+
+    with torch.no_grad():
+        vae.decoder.conv_out.bias.fill_(0.5)
+    refresh_vae_engine(vae)
+
+    assert torch.all(engine.fp32_vae.decoder.conv_out.bias == 0.5)
+
+    release_vae_engine(vae)
+    assert get_vae_engine(make_context(), vae) is not engine
+
+
+def test_3_0__cpu_offloaded_vae_is_decoded_on_its_execution_device():
+    from accelerate import cpu_offload
+
+    vae = make_vae(force_upcast=False)
+    latents = torch.randn(2, 4, 8, 8)
+    expected = reference_decode(vae, latents)
+
+    cpu_offload(vae, "cpu", offload_buffers=True)
+    assert vae.device.type == "meta"
+
+    images = get_vae_engine(make_context(), vae).decode(latents)
+
+    assert np.array_equal(np.stack([np.array(img) for img in images]), expected)